@@ -41,6 +41,7 @@ static void *no_unused_sql_h_warn[]={rcsid_sql_h, no_unused_sql_h_warn};
 
 struct _henv {
 	MdbSQL *sql;	
+	struct _hstmt *plan_stmt;	/* statement prepared in sql, if any */
 };
 struct _hdbc {
 	struct _henv *henv;
@@ -53,6 +54,9 @@ struct _hstmt {
 	char query[4096];
 	struct _sql_bind_info *bind_head;
 	int rows_affected;
+	SQLUINTEGER max_rows;	/* SQL_ATTR_MAX_ROWS, 0 for all */
+	int prepared;		/* query came from SQLPrepare */
+	struct _sql_param_info *param_head;
 };
 
 struct _sql_bind_info {
@@ -64,6 +68,15 @@ struct _sql_bind_info {
 	struct _sql_bind_info *next;
 };
 
+struct _sql_param_info {
+	int param_number;
+	int param_ctype;
+	char *varaddr;
+	int param_buflen;
+	SQLINTEGER *param_lenbind;
+	struct _sql_param_info *next;
+};
+
 #ifdef __cplusplus
 }
 #endif
@@ -20,12 +20,35 @@ typedef struct {
 	MdbTableDef *cur_table;
 	MdbSargNode *sarg_tree;
 	GList *sarg_stack;
+	MdbSargSet *in_set;
 	/* FIX ME */
 	void *bound_values[256];
 	unsigned char *kludge_ttable_pg;
 	long max_rows;
+	long limit;		/* LIMIT or TOP, -1 for none */
+	unsigned long offset;
+	GPtrArray *joins;
+	size_t mem_budget;
+	GPtrArray *group_by;
+	GPtrArray *order_by;
+	unsigned int num_params;	/* ? placeholders in the query */
+	GArray *param_values;	/* MdbSQLParam for each placeholder */
+	char *prepared;		/* query text kept by mdb_sql_prepare() */
+	int replan;		/* prepared query is parsed again to run */
+	int preparing;		/* mdb_sql_prepare() is parsing the query */
 } MdbSQL;
 
+/* value bound to a ? placeholder */
+#define MDB_SQL_PARAM_UNBOUND 0
+#define MDB_SQL_PARAM_INT 1
+#define MDB_SQL_PARAM_STRING 2
+
+typedef struct {
+	int type;
+	int i;
+	char s[256];
+} MdbSQLParam;
+
 typedef struct {
 	char *name;
 	int  disp_size;
@@ -33,8 +56,19 @@ typedef struct {
 	int  bind_type;
 	int  *bind_len;
 	int  bind_max;
+	int  func;	/* aggregate function, MDB_SQL_NOAGG for a column */
+	char *arg;	/* column the aggregate reads, NULL for COUNT(*) */
 } MdbSQLColumn;
 
+enum {
+	MDB_SQL_NOAGG = 0,
+	MDB_SQL_COUNT,
+	MDB_SQL_SUM,
+	MDB_SQL_MIN,
+	MDB_SQL_MAX,
+	MDB_SQL_AVG
+};
+
 typedef struct {
 	char *name;
 	char *alias;
@@ -45,6 +79,60 @@ typedef struct {
 	MdbSarg *sarg;
 } MdbSQLSarg;
 
+typedef struct {
+	char *name;
+	int desc;
+} MdbSQLOrder;
+
+/* an equi-join condition, from ON or from col = col in the WHERE clause */
+typedef struct {
+	char *left;
+	char *right;
+	int op;
+	MdbSargNode *node;	/* placeholder in the sarg tree, or NULL for ON */
+} MdbSQLJoin;
+
+/*
+ * Operators hand each other rows in batches, each row in the flat format
+ * of MdbRowSource.  A batch holds about MDB_SQL_BATCH_ROWS rows, though an
+ * operator may add more when one input row yields many.
+ */
+#define MDB_SQL_BATCH_ROWS 256
+
+typedef struct {
+	unsigned int num_rows;
+	unsigned int max_rows;
+	size_t *offsets;
+	size_t *lens;
+	unsigned char *buf;
+	size_t used;
+	size_t size;
+} MdbSQLBatch;
+
+#define MDB_SQL_BATCH_ROW(b, i) ((b)->buf + (b)->offsets[i])
+
+/* rows an operator has to hold on to, kept back to back in blocks */
+typedef struct {
+	GPtrArray *blocks;
+	GArray *used;		/* bytes used in each block */
+	size_t block_size;
+	unsigned int num_rows;
+	/* read position */
+	unsigned int read_block;
+	size_t read_pos;
+} MdbSQLRows;
+
+typedef struct mdbsqlop MdbSQLOp;
+struct mdbsqlop {
+	/* fills batch and returns the number of rows, 0 at the end */
+	int (*next)(MdbSQLOp *op, MdbSQLBatch *batch);
+	void (*close)(MdbSQLOp *op);
+	void *data;
+};
+
+/* default memory budget for hash join build sides, aggregation and sorts */
+#define MDB_SQL_MEM_BUDGET (16 * 1024 * 1024)
+
 extern char *g_input_ptr;
 
 #undef YY_INPUT
@@ -55,9 +143,20 @@ extern MdbSQL *mdb_sql_init();
 extern MdbSQLSarg *mdb_sql_alloc_sarg();
 extern MdbHandle *mdb_sql_open(MdbSQL *sql, char *db_name);
 extern int mdb_sql_add_sarg(MdbSQL *sql, char *col_name, int op, char *constant);
+extern void mdb_sql_add_in_value(MdbSQL *sql, char *constant);
+extern int mdb_sql_add_in_sarg(MdbSQL *sql, char *col_name);
+extern int mdb_sql_add_param_sarg(MdbSQL *sql, char *col_name, int op);
+extern int mdb_sql_set_param(MdbSargNode *node, gpointer data);
 extern void mdb_sql_all_columns(MdbSQL *sql);
 extern int mdb_sql_add_column(MdbSQL *sql, char *column_name);
 extern int mdb_sql_add_table(MdbSQL *sql, char *table_name);
+extern void mdb_sql_set_table_alias(MdbSQL *sql, char *alias);
+extern int mdb_sql_add_join(MdbSQL *sql, char *left, int op, char *right, int in_where);
+extern int mdb_sql_add_aggregate(MdbSQL *sql, int func, char *arg);
+extern void mdb_sql_set_column_alias(MdbSQL *sql, char *alias);
+extern int mdb_sql_add_group_by(MdbSQL *sql, char *column_name);
+extern int mdb_sql_add_order_by(MdbSQL *sql, char *column_name, int desc);
+extern void mdb_sql_set_mem_budget(MdbSQL *sql, size_t bytes);
 extern void mdb_sql_dump(MdbSQL *sql);
 extern void mdb_sql_exit(MdbSQL *sql);
 extern void mdb_sql_reset(MdbSQL *sql);
@@ -71,12 +170,54 @@ extern void mdb_sql_add_and(MdbSQL *sql);
 extern void mdb_sql_add_not(MdbSQL *sql);
 extern void mdb_sql_describe_table(MdbSQL *sql);
 extern MdbSQL* mdb_sql_run_query (MdbSQL*, const gchar*);
+extern int mdb_sql_prepare(MdbSQL *sql, const gchar *querystr);
+extern void mdb_sql_bind_param_int(MdbSQL *sql, unsigned int num, int value);
+extern void mdb_sql_bind_param_string(MdbSQL *sql, unsigned int num, char *value);
+extern int mdb_sql_execute(MdbSQL *sql);
 extern void mdb_sql_set_maxrow(MdbSQL *sql, int maxrow);
+extern int mdb_sql_set_limit(MdbSQL *sql, char *limit, char *offset);
 extern int mdb_sql_eval_expr(MdbSQL *sql, char *const1, int op, char *const2);
 extern void mdb_sql_bind_all(MdbSQL *sql);
 extern int mdb_sql_fetch_row(MdbSQL *sql, MdbTableDef *table);
 extern int mdb_sql_add_temp_col(MdbSQL *sql, MdbTableDef *ttable, int col_num, char *name, int col_type, int col_size, int is_fixed);
 extern void mdb_sql_bind_column(MdbSQL *sql, int colnum, void *varaddr, int *len_ptr);
+extern void mdb_sql_error(char *fmt, ...);
+extern MdbSargNode *mdb_sql_alloc_node();
+extern void mdb_sql_free_tree(MdbSargNode *tree);
+extern void mdb_sql_free_columns(GPtrArray *columns);
+extern void mdb_sql_free_order_by(GPtrArray *order_by);
+extern char *mdb_sql_unqualify(MdbSQLTable *sql_tab, char *name);
+extern MdbSargNode *mdb_sql_fold_or_chains(MdbSargNode *node);
+
+/* join.c */
+extern void mdb_sql_join_select(MdbSQL *sql);
+
+/* aggregate.c */
+extern int mdb_sql_is_aggregate(MdbSQL *sql);
+extern void mdb_sql_aggregate(MdbSQL *sql);
+
+/* operator.c */
+extern MdbSQLOp *mdb_sql_op_new(int (*next)(MdbSQLOp *, MdbSQLBatch *), void (*close)(MdbSQLOp *), void *data);
+extern int mdb_sql_op_next(MdbSQLOp *op, MdbSQLBatch *batch);
+extern void mdb_sql_op_close(MdbSQLOp *op);
+extern MdbSQLOp *mdb_sql_scan_op(MdbTableDef *table, MdbColumn **cols, int num_cols);
+extern void mdb_sql_set_op(MdbTableDef *ttable, MdbSQLOp *op);
+extern void mdb_sql_batch_init(MdbSQLBatch *batch);
+extern void mdb_sql_batch_free(MdbSQLBatch *batch);
+extern unsigned char *mdb_sql_batch_row(MdbSQLBatch *batch, size_t max_len);
+extern void mdb_sql_batch_end_row(MdbSQLBatch *batch, size_t len);
+extern void mdb_sql_batch_add(MdbSQLBatch *batch, const unsigned char *row, size_t len);
+extern void mdb_sql_batch_pack(MdbSQLBatch *batch, MdbHandle *mdb, MdbColumn **cols, int num_cols);
+extern size_t mdb_sql_flat_value(unsigned char *buf, const void *val, int len);
+extern size_t mdb_sql_flat_size(const unsigned char *row, int num_vals);
+extern void mdb_sql_flat_decode(const unsigned char *row, int num_vals, const unsigned char **vals, int *lens);
+extern MdbSQLRows *mdb_sql_rows_new(void);
+extern void mdb_sql_rows_add(MdbSQLRows *rows, const unsigned char *row, size_t len);
+extern void mdb_sql_rows_free(MdbSQLRows *rows);
+extern MdbSQLOp *mdb_sql_rows_op(MdbSQLRows *rows);
+
+/* sort.c */
+extern void mdb_sql_sort(MdbSQL *sql, unsigned long limit);
 
 #ifdef __cplusplus
   }
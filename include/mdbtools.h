@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <string.h>
+#include <time.h>
 #include <glib.h>
 
 #ifdef HAVE_ICONV
@@ -43,9 +44,17 @@
 #define MDB_MAX_OBJ_NAME 256
 #define MDB_MAX_COLS 256
 #define MDB_MAX_IDX_COLS 10
+/* flag and value of every column of a writable index key */
+#define MDB_MAX_KEY_LEN 128
+/* rows on a page are numbered with one byte in index entries */
+#define MDB_MAX_PG_ROWS 255
 #define MDB_CATALOG_PG 18
 #define MDB_MEMO_OVERHEAD 12
 #define MDB_BIND_SIZE 16384
+/* longest MONEY or NUMERIC string, sign, point and NUL included */
+#define MDB_NUMERIC_BUFSZ 42
+/* longest float or double string, they are printed without exponent */
+#define MDB_DOUBLE_BUFSZ 350
 
 enum {
 	MDB_PAGE_DB = 0,
@@ -102,7 +111,8 @@ enum {
 	MDB_LTEQ,
 	MDB_LIKE,
 	MDB_ISNULL,
-	MDB_NOTNULL
+	MDB_NOTNULL,
+	MDB_IN
 };
 
 typedef enum {
@@ -113,9 +123,15 @@ typedef enum {
 
 typedef enum {
 	MDB_NOFLAGS = 0x00,
-	MDB_WRITABLE = 0x01
+	MDB_WRITABLE = 0x01,
+	MDB_JOURNAL = 0x02	/* journal writes to <file>-journal */
 } MdbFileFlags;
 
+typedef enum {
+	MDB_SYNC_NONE,	/* flushed pages are left to the OS */
+	MDB_SYNC_FLUSH	/* mdb_flush() waits for the disk */
+} MdbSyncPolicy;
+
 enum {
 	MDB_DEBUG_LIKE = 0x0001,
 	MDB_DEBUG_WRITE = 0x0002,
@@ -123,7 +139,8 @@ enum {
 	MDB_DEBUG_OLE = 0x0008,
 	MDB_DEBUG_ROW = 0x0010,
 	MDB_USE_INDEX = 0x0020,
-	MDB_NO_MEMO = 0x0040 /* don't follow memo fields */
+	MDB_NO_MEMO = 0x0040, /* don't follow memo fields */
+	MDB_NO_SIMD = 0x0080 /* decode rows with the scalar kernels only */
 };
 
 #define mdb_is_logical_op(x) (x == MDB_OR || \
@@ -137,7 +154,8 @@ enum {
 				x == MDB_LTEQ || \
 				x == MDB_LIKE || \
 				x == MDB_ISNULL || \
-				x == MDB_NOTNULL )
+				x == MDB_NOTNULL || \
+				x == MDB_IN )
 
 enum {
 	MDB_ASC,
@@ -183,9 +201,14 @@ typedef struct {
 	MdbBackend	*default_backend;
 	char			*backend_name;
 	MdbStatistics	*stats;
-	/* free map */
+	/* global usage map, marks the pages free for reuse */
 	int  map_sz;
 	unsigned char *free_map;
+	guint32	reserved_pgs;	/* pages reserved on disk by fallocate() */
+	GHashTable	*dirty_pgs;	/* pg -> page waiting for mdb_flush() */
+	unsigned long	pg_writes;	/* calls to mdb_write_pg() */
+	MdbSyncPolicy	sync;
+	int		journal_fd;	/* -1 without MDB_JOURNAL */
 	/* reference count */
 	int refs;
 } MdbFile; 
@@ -221,6 +244,11 @@ typedef struct {
 	unsigned char alt_pg_buf[MDB_PGSIZE];
 	unsigned int  num_catalog;
 	GPtrArray	*catalog;
+	GPtrArray	*catalog_cache;	/* every MSysObjects entry */
+	GHashTable	*catalog_names;	/* lower case name -> entries */
+	int		catalog_stale;	/* MSysObjects was written to */
+	GHashTable	*tdefs;		/* table_pg -> MdbTdef */
+	GHashTable	*space_dirs;	/* table_pg -> free space directory */
 	MdbBackend	*default_backend;
 	char		*backend_name;
 	MdbFormatConstants *fmt;
@@ -229,15 +257,24 @@ typedef struct {
 	iconv_t	iconv_in;
 	iconv_t	iconv_out;
 #endif
+	/* UCS-2LE to UTF-8 is done by mdb_ucs2_to_utf8() */
+	int		utf8_in;
+	char		date_fmt[64];
+	unsigned char	date_ops[256];	/* date_fmt compiled by mdb_set_date_fmt() */
+	int		date_fast;	/* date_ops is usable */
 } MdbHandle; 
 
 typedef struct {
 	MdbHandle	*mdb;
 	char           object_name[MDB_MAX_OBJ_NAME+1];
 	int            object_type;
+	int            raw_type;	/* Type as stored in MSysObjects */
 	unsigned long  table_pg; /* misnomer since object may not be a table */
 	unsigned long  kkd_pg;
 	unsigned int   kkd_rowid;
+	/* the entry's row in MSysObjects, where its properties are kept */
+	unsigned long  row_pg;
+	unsigned int   row_num;
 	int			num_props;
 	GArray		*props;
 	GArray		*columns;
@@ -275,6 +312,10 @@ typedef struct {
 	/* MEMO/OLE readers */
 	guint32		cur_blob_pg_row;
 	int		chunk_size;
+	/* lazy memo binding, header of the current value */
+	int		lazy_memo;
+	int		memo_pending;
+	unsigned char	memo_hdr[MDB_MEMO_OVERHEAD];
 	/* numerics only */
 	int		col_prec;
 	int		col_scale;
@@ -287,15 +328,57 @@ typedef struct {
 	int		row_col_num;
 } MdbColumn;
 
+/*
+ * streaming reader for MEMO/OLE values, see blob.c.  Holds one LVAL row
+ * worth of raw data and, for MEMO fields, the partially converted text.
+ */
+typedef struct {
+	MdbHandle	*mdb;
+	int		is_text;
+	int		multi_page;
+	guint32		length;
+	guint32		raw_total;
+	guint32		next_pg_row;
+	unsigned char	raw[MDB_PGSIZE];
+	size_t		raw_len;
+	size_t		raw_pos;
+	/* compressed unicode state (Jet4 text only) */
+	int		compressed;
+	int		compress;
+	int		have_odd;
+	unsigned char	odd_byte;
+	unsigned char	text[MDB_PGSIZE*2];
+	size_t		text_len;
+	size_t		text_pos;
+} MdbBlob;
+
+/*
+ * constant list for the IN operator.  Numeric and string constants are kept
+ * in separate sorted arrays so a value can be tested with a binary search.
+ */
+typedef struct {
+	GArray		*ints;
+	GPtrArray	*strs;
+	gboolean	sorted;
+} MdbSargSet;
+
 struct mdbsargtree {
 	int       op;
 	MdbColumn *col;
 	MdbAny    value;
+	MdbSargSet *set;
 	void      *parent;
+	int       param;	/* number of the ? it takes its value from, or 0 */
 	MdbSargNode *left;
 	MdbSargNode *right;
 };
 
+typedef struct {
+	int	op;
+	MdbAny	value;
+	MdbSargSet *set;
+} MdbSarg;
+
 typedef struct {
 	guint32 pg;
 	int start_pos;
@@ -313,11 +396,81 @@ typedef struct {
 	int cur_depth;
 	guint32 last_leaf_found;
 	int clean_up_mode;
+	int in_seek;	/* IN list: 1 once seeking, -1 to walk the index */
+	guint in_pos;	/* the constant sought last, and its key */
+	unsigned char in_key[4];
 	MdbIndexPage pages[MDB_MAX_INDEX_DEPTH];
 } MdbIndexChain;
 
+/*
+ * Rows handed to a temp table by a callback instead of being packed into
+ * pages.  A flat row holds, for each column, a 2 byte length (MDB_FLAT_NULL
+ * for null) and the value as stored on a data page.  A Boolean is null when
+ * false.  next() returns 0 after the last row; the row stays valid until
+ * the following call.
+ */
+#define MDB_FLAT_NULL 0xffff
+
+typedef struct {
+	int (*next)(void *data, const unsigned char **row, size_t *len);
+	void (*free)(void *data);
+	void *data;
+} MdbRowSource;
+
+/*
+ * A table definition as read from its TDEF pages, shared by every
+ * MdbTableDef opened on the table and never changed once read.  Columns,
+ * indices and properties are read the first time a table asks for them;
+ * tables get their own copies to bind and search with.  Writing to the
+ * table drops it from the handle's cache, see mdb_tdef_drop().
+ */
+typedef struct {
+	guint32		table_pg;
+	int		refs;
+	unsigned int	num_rows;
+	unsigned int	num_cols;
+	unsigned int	num_var_cols;
+	unsigned int	num_idxs;
+	unsigned int	num_real_idxs;
+	guint32		first_data_pg;
+	size_t		map_sz;
+	unsigned char	*usage_map;
+	size_t		freemap_sz;
+	unsigned char	*free_usage_map;
+	GPtrArray	*columns;
+	/* where the index entries start, after the column names */
+	guint32		index_pg;
+	int		index_start;
+	GPtrArray	*indices;
+	unsigned int	num_used_idxs;	/* real indices that have an entry */
+	GPtrArray	*props;		/* MdbProperties from LvProp */
+	int		props_read;
+} MdbTdef;
+
+/* a row of the page decoded by mdb_crack_page() */
+typedef struct {
+	int	start;		/* -1 if left to mdb_crack_row() */
+	int	end;
+	unsigned int	cols;
+	unsigned int	var_cols;
+	unsigned int	var_pos;	/* its offset table in var_offsets */
+} MdbPageRow;
+
+typedef struct {
+	guint32	pg;		/* page decoded, 0 for none */
+	unsigned long	pg_writes;	/* MdbFile pg_writes at the time */
+	unsigned int	num_rows;
+	MdbPageRow	*rows;
+	unsigned int	mask_sz;	/* null mask bytes kept per row */
+	unsigned char	*masks;		/* num_rows * mask_sz */
+	unsigned int	stride;		/* bytes per column in valid */
+	unsigned char	*valid;		/* bit per row per null mask bit */
+	unsigned int	*var_offsets;
+} MdbPageCrack;
+
 typedef struct {
 	MdbCatalogEntry *entry;
+	MdbTdef	*tdef;		/* NULL for temp tables */
 	char	name[MDB_MAX_OBJ_NAME+1];
 	unsigned int    num_cols;
 	GPtrArray	*columns;
@@ -330,7 +483,14 @@ typedef struct {
 	guint32	cur_pg_num;
 	guint32	cur_phys_pg;
 	unsigned int    cur_row;
+	guint32	fwd_pg_row;	/* row the current one was reached through, if it moved */
 	int  noskip_del;  /* don't skip deleted rows */
+	/* rows mdb_fetch_row() skips first and returns at most */
+	int  fetch_limited;
+	unsigned long fetch_offset;
+	unsigned long fetch_limit;
+	unsigned long fetch_skipped;
+	unsigned long fetch_count;
 	/* object allocation map */
 	guint32  map_base_pg;
 	size_t map_sz;
@@ -345,11 +505,14 @@ typedef struct {
 	MdbIndex *scan_idx;
 	MdbHandle *mdbidx;
 	MdbIndexChain *chain;
+	MdbSarg *seek_sarg;	/* equality sarg moved by mdb_index_scan_seek() */
 	MdbProperties	*props;
 	unsigned int num_var_cols;  /* to know if row has variable columns */
+	MdbPageCrack *page_crack;	/* the page being scanned, decoded */
 	/* temp table */
 	unsigned int  is_temp_table;
 	GPtrArray     *temp_table_pages;
+	MdbRowSource  *row_source;
 } MdbTableDef;
 
 struct mdbindex {
@@ -379,10 +542,23 @@ typedef struct {
 	int offset;
 } MdbField;
 
+/*
+ * State of a bulk load, see mdb_bulk_insert_begin().  Rows are packed into
+ * a page in memory which is appended to the file once full.
+ */
 typedef struct {
-	int	op;
-	MdbAny	value;
-} MdbSarg;
+	MdbTableDef	*table;
+	unsigned char	*pg;		/* data page being filled */
+	guint32		pg_num;		/* where it will be written */
+	unsigned int	pg_rows;
+	int		pg_free_end;	/* start of the lowest row on it */
+	guint32		next_pg;	/* next free page of the current run */
+	guint32		run_end;	/* and the page after the run */
+	GArray		*data_pgs;	/* first page and count of each run */
+	unsigned long	num_rows;	/* rows added so far */
+	GPtrArray	*indices;	/* keys of the indexes to rebuild */
+	unsigned int	stale_idxs;	/* indexes that can't be rebuilt */
+} MdbBulkInsert;
 
 /* mem.c */
 extern void mdb_init();
@@ -391,6 +567,7 @@ extern void mdb_exit();
 /* file.c */
 extern ssize_t mdb_read_pg(MdbHandle *mdb, unsigned long pg);
 extern ssize_t mdb_read_alt_pg(MdbHandle *mdb, unsigned long pg);
+extern void mdb_prefetch_pg(MdbHandle *mdb, unsigned long pg);
 extern unsigned char mdb_get_byte(void *buf, int offset);
 extern int    mdb_get_int16(void *buf, int offset);
 extern long   mdb_get_int32(void *buf, int offset);
@@ -410,6 +587,7 @@ extern void mdb_swap_pgbuf(MdbHandle *mdb);
 /* catalog.c */
 extern void mdb_free_catalog(MdbHandle *mdb);
 extern GPtrArray *mdb_read_catalog(MdbHandle *mdb, int obj_type);
+extern MdbCatalogEntry *mdb_get_catalogentry_by_name(MdbHandle *mdb, const gchar *name, int obj_type);
 extern void mdb_dump_catalog(MdbHandle *mdb, int obj_type);
 extern char *mdb_get_objtype_string(int obj_type);
 
@@ -418,6 +596,9 @@ extern MdbTableDef *mdb_alloc_tabledef(MdbCatalogEntry *entry);
 extern void mdb_free_tabledef(MdbTableDef *table);
 extern MdbTableDef *mdb_read_table(MdbCatalogEntry *entry);
 extern MdbTableDef *mdb_read_table_by_name(MdbHandle *mdb, gchar *table_name, int obj_type);
+extern void mdb_tdef_unref(MdbTdef *tdef);
+extern void mdb_tdef_drop(MdbHandle *mdb, guint32 table_pg);
+extern void mdb_free_tdefs(MdbHandle *mdb);
 extern void mdb_append_column(GPtrArray *columns, MdbColumn *in_col);
 extern void mdb_free_columns(GPtrArray *columns);
 extern GPtrArray *mdb_read_columns(MdbTableDef *table);
@@ -435,6 +616,7 @@ extern void mdb_data_dump(MdbTableDef *table);
 extern void mdb_bind_column(MdbTableDef *table, int col_num, void *bind_ptr, int *len_ptr);
 extern int mdb_rewind_table(MdbTableDef *table);
 extern int mdb_fetch_row(MdbTableDef *table);
+extern void mdb_set_fetch_limit(MdbTableDef *table, unsigned long offset, long limit);
 extern int mdb_is_fixed_col(MdbColumn *col);
 extern char *mdb_col_to_string(MdbHandle *mdb, void *buf, int start, int datatype, int size);
 extern int mdb_find_pg_row(MdbHandle *mdb, int pg_row, void **buf, int *off, size_t *len);
@@ -444,9 +626,28 @@ extern int mdb_col_fixed_size(MdbColumn *col);
 extern int mdb_col_disp_size(MdbColumn *col);
 extern size_t mdb_ole_read_next(MdbHandle *mdb, MdbColumn *col, void *ole_ptr);
 extern size_t mdb_ole_read(MdbHandle *mdb, MdbColumn *col, void *ole_ptr, int chunk_size);
-extern void mdb_set_date_fmt(const char *);
+extern void mdb_set_date_fmt(MdbHandle *mdb, const char *);
+extern void mdb_date_to_tm(double td, struct tm *t);
+extern size_t mdb_date_to_buf(MdbHandle *mdb, double td, char *buf, size_t len);
 extern int mdb_read_row(MdbTableDef *table, unsigned int row);
 
+/* blob.c */
+extern MdbBlob *mdb_blob_open(MdbHandle *mdb, MdbColumn *col);
+extern size_t mdb_blob_read(MdbBlob *blob, void *buf, size_t n);
+extern void mdb_blob_close(MdbBlob *blob);
+extern void mdb_set_lazy_memo(MdbTableDef *table, int col_num, int lazy);
+extern guint32 mdb_memo_length(MdbColumn *col);
+extern int mdb_memo_fetch(MdbHandle *mdb, MdbColumn *col);
+
+/* money.c */
+extern int mdb_money_to_buf(const unsigned char *src, char *buf);
+extern int mdb_numeric_to_buf(const unsigned char *src, int scale, char *buf);
+extern char *mdb_money_to_string(MdbHandle *mdb, int start);
+
+/* dtoa.c */
+extern int mdb_double_to_buf(double d, char *buf);
+extern int mdb_float_to_buf(float fl, char *buf);
+
 /* dump.c */
 extern void buffer_dump(const void *buf, int start, size_t len);
 
@@ -468,6 +669,14 @@ extern int mdb_add_sarg_by_name(MdbTableDef *table, char *colname, MdbSarg *in_s
 extern int mdb_test_string(MdbSargNode *node, char *s);
 extern int mdb_test_int(MdbSargNode *node, gint32 i);
 extern int mdb_add_sarg(MdbColumn *col, MdbSarg *in_sarg);
+extern void mdb_clear_sargs(MdbColumn *col);
+extern MdbSargSet *mdb_alloc_sarg_set();
+extern void mdb_free_sarg_set(MdbSargSet *set);
+extern void mdb_sarg_set_add_int(MdbSargSet *set, gint32 i);
+extern void mdb_sarg_set_add_string(MdbSargSet *set, char *s);
+extern void mdb_sarg_set_sort(MdbSargSet *set);
+extern int mdb_sarg_set_find_int(MdbSargSet *set, gint32 i);
+extern int mdb_sarg_set_find_string(MdbSargSet *set, char *s);
 
 
 
@@ -479,10 +688,16 @@ extern int mdb_index_find_next_on_page(MdbHandle *mdb, MdbIndexPage *ipg);
 extern int mdb_index_find_next(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32 *pg, guint16 *row);
 extern void mdb_index_hash_text(char *text, char *hash);
 extern void mdb_index_scan_init(MdbHandle *mdb, MdbTableDef *table);
+extern void mdb_index_scan_use(MdbHandle *mdb, MdbTableDef *table, MdbIndex *idx);
+extern int mdb_index_scan_seek(MdbTableDef *table, gint32 value);
+extern int mdb_index_seek(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, unsigned char *key, int key_len);
+extern int mdb_index_compute_cost(MdbTableDef *table, MdbIndex *idx);
+extern MdbStrategy mdb_choose_index(MdbTableDef *table, int *choice);
 extern int mdb_index_find_row(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32 pg, guint16 row);
 extern void mdb_index_swap_n(unsigned char *src, int sz, unsigned char *dest);
 extern void mdb_free_indices(GPtrArray *indices);
 void mdb_index_page_reset(MdbIndexPage *ipg);
+void mdb_index_page_init(MdbIndexPage *ipg);
 extern int mdb_index_pack_bitmap(MdbHandle *mdb, MdbIndexPage *ipg);
 
 /* stats.c */
@@ -494,23 +709,65 @@ extern void mdb_dump_stats(MdbHandle *mdb);
 extern int mdb_like_cmp(char *s, char *r);
 
 /* write.c */
+extern void mdb_init_row_kernels(void);
 extern int mdb_crack_row(MdbTableDef *table, int row_start, int row_end, MdbField *fields);
+extern int mdb_crack_page(MdbTableDef *table);
+extern int mdb_crack_page_row(MdbTableDef *table, unsigned int row, int row_start, int row_end, MdbField *fields);
+extern void mdb_free_page_crack(MdbPageCrack *pc);
 extern guint16 mdb_add_row_to_pg(MdbTableDef *table, unsigned char *row_buffer, int new_row_size);
 extern int mdb_update_index(MdbTableDef *table, MdbIndex *idx, unsigned int num_fields, MdbField *fields, guint32 pgnum, guint16 rownum);
 extern int mdb_pack_row(MdbTableDef *table, unsigned char *row_buffer, unsigned int num_fields, MdbField *fields);
+extern int mdb_packed_row_size(MdbTableDef *table, unsigned int num_fields, MdbField *fields);
 extern int mdb_replace_row(MdbTableDef *table, int row, void *new_row, int new_row_size);
 extern int mdb_pg_get_freespace(MdbHandle *mdb);
+extern int mdb_pg_free_end(MdbHandle *mdb, unsigned char *pg_buf);
 extern int mdb_update_row(MdbTableDef *table);
 extern void *mdb_new_data_pg(MdbCatalogEntry *entry);
+extern ssize_t mdb_write_pg(MdbHandle *mdb, unsigned long pg);
+extern int mdb_flush(MdbHandle *mdb);
+extern int mdb_maybe_flush(MdbHandle *mdb);
+extern void mdb_set_sync(MdbHandle *mdb, MdbSyncPolicy sync);
+extern void mdb_drop_dirty_pgs(MdbHandle *mdb, guint32 start_pg, guint32 num_pgs);
+extern void _mdb_put_int16(void *buf, guint32 offset, guint32 value);
+extern void _mdb_put_int32(void *buf, guint32 offset, guint32 value);
+extern void _mdb_put_int32_msb(void *buf, guint32 offset, guint32 value);
+
+/* bulk.c */
+extern MdbBulkInsert *mdb_bulk_insert_begin(MdbTableDef *table);
+extern int mdb_bulk_insert_add(MdbBulkInsert *bulk, int num_fields, MdbField *fields);
+extern int mdb_bulk_insert_end(MdbBulkInsert *bulk);
 
 /* map.c */
 extern guint32 mdb_map_find_next_freepage(MdbTableDef *table, int row_size);
 extern guint32 mdb_map_find_next(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint32 start_pg);
+extern guint32 mdb_map_set_range(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint32 start_pg, guint32 num_pgs, int set);
+extern int mdb_map_write(MdbTableDef *table, int map_offset, unsigned char *map, size_t map_sz);
+extern int mdb_map_add_pages(MdbTableDef *table, int map_offset, unsigned char *map, size_t map_sz, guint32 start_pg, guint32 num_pgs);
+extern guint32 mdb_alloc_pages(MdbHandle *mdb, guint32 num_pgs);
+extern void mdb_free_pages(MdbHandle *mdb, guint32 start_pg, guint32 num_pgs);
+extern guint32 mdb_alloc_page(MdbTableDef *table);
+extern void mdb_space_dir_update(MdbTableDef *table, guint32 pg, unsigned char *pg_buf);
+extern void mdb_free_space_dirs(MdbHandle *mdb);
+
+/* idxwrite.c */
+extern int mdb_index_writable(MdbTableDef *table, MdbIndex *idx);
+extern int mdb_index_make_key(MdbTableDef *table, MdbIndex *idx, unsigned int num_fields, MdbField *fields, unsigned char *key);
+extern int mdb_index_del_entry(MdbTableDef *table, MdbIndex *idx, unsigned char *key, int key_len, guint32 pg_row);
+extern int mdb_index_add_entry(MdbTableDef *table, MdbIndex *idx, unsigned char *key, int key_len, guint32 pg_row);
+
+/* journal.c */
+extern int mdb_sync_fd(int fd);
+extern int mdb_journal_open(MdbHandle *mdb, int keep);
+extern int mdb_journal_commit(MdbHandle *mdb, guint32 *pgs, guint num_pgs);
+extern void mdb_journal_done(MdbHandle *mdb);
+extern void mdb_journal_close(MdbFile *f);
 
 /* props.c */
 extern GPtrArray *mdb_read_props_list(gchar *kkd, int len);
 extern void mdb_free_props(MdbProperties *props);
 extern MdbProperties *mdb_read_props(MdbHandle *mdb, GPtrArray *names, gchar *kkd, int len);
+extern MdbProperties *mdb_get_props(MdbTableDef *table, const gchar *name);
+extern void mdb_free_props_list(GPtrArray *props);
 
 /* worktable.c */
 extern MdbTableDef *mdb_create_temp_table(MdbHandle *mdb, char *name);
@@ -518,6 +775,7 @@ extern void mdb_temp_table_add_col(MdbTableDef *table, MdbColumn *col);
 extern void mdb_fill_temp_col(MdbColumn *tcol, char *col_name, int col_size, int col_type, int is_fixed);
 extern void mdb_fill_temp_field(MdbField *field, void *value, int siz, int is_fixed, int is_null, int start, int column);
 extern void mdb_temp_columns_end(MdbTableDef *table);
+extern void mdb_temp_table_set_source(MdbTableDef *table, MdbRowSource *source);
 
 /* options.c */
 extern int mdb_get_option(unsigned long optnum);
@@ -526,6 +784,7 @@ extern void mdb_debug(int klass, char *fmt, ...);
 /* iconv.c */
 extern int mdb_unicode2ascii(MdbHandle *mdb, char *src, size_t slen, char *dest, size_t dlen);
 extern int mdb_ascii2unicode(MdbHandle *mdb, char *src, size_t slen, char *dest, size_t dlen);
+extern size_t mdb_ucs2_to_utf8(const unsigned char *src, size_t slen, int compressed, char *dest, size_t dlen, size_t *used);
 extern void mdb_iconv_init(MdbHandle *mdb);
 extern void mdb_iconv_close(MdbHandle *mdb);
 
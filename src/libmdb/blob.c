@@ -0,0 +1,376 @@
+/* MDB Tools - A library for reading MS Access database files
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "mdbtools.h"
+#include "errno.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+/*
+ * Streaming access to MEMO and OLE values.  Unlike mdb_memo_to_string()
+ * the value is never materialized in one piece, so there is no limit on
+ * its size: the LVAL chain is walked one row at a time, the next page in
+ * the chain is prefetched while the current one is consumed, and MEMO
+ * text is converted to the client charset as it is read.
+ */
+
+/*
+ * set up a stream from a memo header followed by any inline data
+ */
+static MdbBlob *
+mdb_blob_new(MdbHandle *mdb, int is_text, unsigned char *ptr, int size)
+{
+	MdbBlob *blob;
+	guint32 memo_len;
+
+	blob = (MdbBlob *) g_malloc0(sizeof(MdbBlob));
+	blob->mdb = mdb;
+	blob->is_text = is_text;
+
+	if (size < MDB_MEMO_OVERHEAD)
+		return blob;
+
+	/* The 32 bit integer at offset 0 is the length of the field
+	 *   with some flags in the high bits.
+	 * The 32 bit integer at offset 4 contains page and row information.
+	 */
+	memo_len = mdb_get_int32(ptr, 0);
+
+	if (memo_len & 0x80000000) {
+		/* inline, the whole value is on the data page already */
+		blob->length = size - MDB_MEMO_OVERHEAD;
+		memcpy(blob->raw, ptr + MDB_MEMO_OVERHEAD, blob->length);
+		blob->raw_len = blob->length;
+		blob->raw_total = blob->length;
+	} else if (memo_len & 0x40000000) {
+		blob->length = memo_len & 0x00ffffff;
+		blob->next_pg_row = mdb_get_int32(ptr, 4);
+	} else if ((memo_len & 0xff000000) == 0) {
+		blob->length = memo_len;
+		blob->multi_page = 1;
+		blob->next_pg_row = mdb_get_int32(ptr, 4);
+	} else {
+		fprintf(stderr, "Unhandled memo field flags = %02x\n",
+			memo_len >> 24);
+	}
+	if (blob->next_pg_row >> 8)
+		mdb_prefetch_pg(mdb, blob->next_pg_row >> 8);
+
+	return blob;
+}
+/**
+ * mdb_blob_open:
+ * @mdb: Database file handle
+ * @col: MEMO or OLE column, positioned on the current row by mdb_fetch_row()
+ *
+ * Returns: a new stream, which must be freed with mdb_blob_close().
+ */
+MdbBlob *
+mdb_blob_open(MdbHandle *mdb, MdbColumn *col)
+{
+	return mdb_blob_new(mdb, col->col_type == MDB_MEMO,
+		mdb->pg_buf + col->cur_value_start, col->cur_value_len);
+}
+void
+mdb_blob_close(MdbBlob *blob)
+{
+	g_free(blob);
+}
+/*
+ * load the next LVAL row of the chain into blob->raw, returns the number
+ * of bytes loaded or 0 at the end of the value.
+ */
+static size_t
+mdb_blob_next_chunk(MdbBlob *blob)
+{
+	MdbHandle *mdb = blob->mdb;
+	unsigned char *buf;
+	int row_start;
+	size_t len;
+
+	if (!(blob->next_pg_row >> 8))
+		return 0;
+
+	mdb_debug(MDB_DEBUG_OLE,"Reading LVAL page %06x",
+		blob->next_pg_row >> 8);
+	if (mdb_find_pg_row(mdb, blob->next_pg_row, (void **)&buf,
+		&row_start, &len)) {
+		blob->next_pg_row = 0;
+		return 0;
+	}
+	buf += row_start;
+
+	if (blob->multi_page) {
+		if (len < 4) {
+			blob->next_pg_row = 0;
+			return 0;
+		}
+		blob->next_pg_row = mdb_get_int32(buf, 0);
+		buf += 4;
+		len -= 4;
+		if (blob->raw_total + len >= blob->length) {
+			/* never run past the declared length */
+			len = blob->length - blob->raw_total;
+			blob->next_pg_row = 0;
+		}
+		/* start reading the next page while this one is consumed */
+		if (blob->next_pg_row >> 8)
+			mdb_prefetch_pg(mdb, blob->next_pg_row >> 8);
+	} else {
+		blob->next_pg_row = 0;
+	}
+	memcpy(blob->raw, buf, len);
+	blob->raw_len = len;
+	blob->raw_pos = 0;
+	blob->raw_total += len;
+
+	return len;
+}
+static size_t
+mdb_blob_read_raw(MdbBlob *blob, unsigned char *buf, size_t n)
+{
+	size_t got = 0, len;
+
+	while (got < n) {
+		if (blob->raw_pos >= blob->raw_len
+		 && !mdb_blob_next_chunk(blob))
+			break;
+		len = MIN(n - got, blob->raw_len - blob->raw_pos);
+		memcpy(buf + got, blob->raw + blob->raw_pos, len);
+		blob->raw_pos += len;
+		got += len;
+	}
+	return got;
+}
+/*
+ * expand the next piece of raw text into blob->text.  For Jet4 this
+ * undoes unicode compression and keeps track of characters which are
+ * split between two LVAL rows.
+ */
+static size_t
+mdb_blob_fill_text(MdbBlob *blob)
+{
+	unsigned char c;
+
+	blob->text_len = blob->text_pos = 0;
+	if (blob->raw_pos >= blob->raw_len && !mdb_blob_next_chunk(blob))
+		return 0;
+
+	if (IS_JET3(blob->mdb)) {
+		memcpy(blob->text, blob->raw + blob->raw_pos,
+			blob->raw_len - blob->raw_pos);
+		blob->text_len = blob->raw_len - blob->raw_pos;
+		blob->raw_pos = blob->raw_len;
+		return blob->text_len;
+	}
+
+	/* 'Unicode Compressed' marker, only valid at the start of the value */
+	if (blob->raw_total == blob->raw_len && blob->raw_pos == 0
+	 && blob->raw_len >= 2
+	 && blob->raw[0] == 0xff && blob->raw[1] == 0xfe) {
+		blob->compressed = 1;
+		blob->compress = 1;
+		blob->raw_pos = 2;
+	}
+	while (blob->raw_pos < blob->raw_len) {
+		c = blob->raw[blob->raw_pos++];
+		if (blob->compressed && !blob->have_odd) {
+			if (c == 0) {
+				blob->compress = !blob->compress;
+				continue;
+			}
+			if (blob->compress) {
+				blob->text[blob->text_len++] = c;
+				blob->text[blob->text_len++] = 0;
+				continue;
+			}
+		}
+		if (blob->have_odd) {
+			blob->text[blob->text_len++] = blob->odd_byte;
+			blob->text[blob->text_len++] = c;
+			blob->have_odd = 0;
+		} else {
+			blob->odd_byte = c;
+			blob->have_odd = 1;
+		}
+	}
+	return blob->text_len;
+}
+static size_t
+mdb_blob_read_text(MdbBlob *blob, char *buf, size_t n)
+{
+	MdbHandle *mdb = blob->mdb;
+	size_t got = 0;
+	size_t len_in, len_out;
+	char *in_ptr, *out_ptr;
+	int unit = IS_JET4(mdb) ? 2 : 1;
+
+	while (got < n) {
+		/* a chunk may end on an odd byte, so keep going until
+		 * there is something to convert or the value is exhausted */
+		while (blob->text_pos >= blob->text_len) {
+			if (!mdb_blob_fill_text(blob)
+			 && blob->raw_pos >= blob->raw_len
+			 && !(blob->next_pg_row >> 8))
+				return got;
+		}
+		in_ptr = (char *) blob->text + blob->text_pos;
+		len_in = blob->text_len - blob->text_pos;
+		out_ptr = buf + got;
+		len_out = n - got;
+		if (mdb->utf8_in) {
+			size_t used;
+
+			out_ptr += mdb_ucs2_to_utf8((unsigned char *)in_ptr,
+				len_in, 0, out_ptr, len_out, &used);
+			len_in -= used;
+		} else
+#ifdef HAVE_ICONV
+		if (iconv(mdb->iconv_in, &in_ptr, &len_in, &out_ptr, &len_out)
+			== (size_t)-1 && errno != E2BIG && len_out) {
+			/* Don't bail if impossible conversion is encountered */
+			in_ptr += unit;
+			len_in -= unit;
+			*out_ptr++ = '?';
+			len_out--;
+		}
+#else
+		if (unit == 1) {
+			size_t len = MIN(len_in, len_out);
+			memcpy(out_ptr, in_ptr, len);
+			in_ptr += len;
+			out_ptr += len;
+			len_in -= len;
+			len_out -= len;
+		} else {
+			/* rough UCS-2LE to ISO-8859-1 conversion */
+			while (len_in && len_out) {
+				*out_ptr++ = (in_ptr[1] == 0) ? in_ptr[0] : '?';
+				in_ptr += 2;
+				len_in -= 2;
+				len_out--;
+			}
+		}
+#endif
+		blob->text_pos = blob->text_len - len_in;
+		/* no room left for the next character */
+		if (out_ptr == buf + got)
+			break;
+		got = out_ptr - buf;
+	}
+	return got;
+}
+/**
+ * mdb_blob_read:
+ * @blob: stream returned by mdb_blob_open()
+ * @buf: destination buffer
+ * @n: size of @buf
+ *
+ * Reads the next piece of the value.  OLE data is returned as is, MEMO
+ * text is converted to the client charset and never split in the middle
+ * of a character, so @n should be at least a few bytes.  The result is
+ * not NUL terminated.
+ *
+ * Returns: number of bytes stored in @buf, 0 at the end of the value.
+ */
+size_t
+mdb_blob_read(MdbBlob *blob, void *buf, size_t n)
+{
+	if (!blob || !buf || !n)
+		return 0;
+	if (blob->is_text)
+		return mdb_blob_read_text(blob, buf, n);
+	return mdb_blob_read_raw(blob, buf, n);
+}
+
+/**
+ * mdb_set_lazy_memo:
+ * @table: Table definition
+ * @col_num: 1 based column number, as for mdb_bind_column()
+ * @lazy: non-zero to defer resolution of the LVAL chain
+ *
+ * In lazy mode fetching a row only records the memo header; the bound
+ * buffer is left empty until mdb_memo_fetch() is called and the length
+ * pointer receives the stored length of the value.  Inline values are
+ * still converted immediately since they cost no extra I/O.
+ */
+void
+mdb_set_lazy_memo(MdbTableDef *table, int col_num, int lazy)
+{
+	MdbColumn *col;
+
+	col = g_ptr_array_index(table->columns, col_num - 1);
+	col->lazy_memo = lazy;
+}
+/**
+ * mdb_memo_length:
+ * @col: MEMO or OLE column
+ *
+ * Returns: the stored length in bytes of the current value, taken from
+ * its header without reading any LVAL page.
+ */
+guint32
+mdb_memo_length(MdbColumn *col)
+{
+	guint32 memo_len;
+
+	if (col->cur_value_len < MDB_MEMO_OVERHEAD)
+		return 0;
+	memo_len = mdb_get_int32(col->memo_hdr, 0);
+	if (memo_len & 0x80000000)
+		return col->cur_value_len - MDB_MEMO_OVERHEAD;
+	return memo_len & 0x00ffffff;
+}
+/**
+ * mdb_memo_fetch:
+ * @mdb: Database file handle
+ * @col: MEMO column bound in lazy mode
+ *
+ * Resolves a deferred memo value into the bound buffer.  This remains
+ * valid after the table has moved on to other pages, as long as no other
+ * row has been fetched.
+ *
+ * Returns: length of the text in the bound buffer.
+ */
+int
+mdb_memo_fetch(MdbHandle *mdb, MdbColumn *col)
+{
+	MdbBlob *blob;
+	size_t len = 0, got;
+
+	if (!col->bind_ptr)
+		return 0;
+	if (!col->memo_pending)
+		return strlen(col->bind_ptr);
+
+	blob = mdb_blob_new(mdb, 1, col->memo_hdr, MDB_MEMO_OVERHEAD);
+	while (len < MDB_BIND_SIZE - 1 && (got = mdb_blob_read(blob,
+		(char *)col->bind_ptr + len, MDB_BIND_SIZE - 1 - len)))
+		len += got;
+	mdb_blob_close(blob);
+	((char *)col->bind_ptr)[len] = '\0';
+
+	col->memo_pending = 0;
+	if (col->len_ptr) {
+		*col->len_ptr = len;
+	}
+	return len;
+}
@@ -0,0 +1,547 @@
+/* MDB Tools - A library for reading MS Access database files
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "mdbtools.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+/*
+ * Bulk loading.  mdb_insert_row() looks for a page with room, rebuilds it
+ * and walks the index for every row.  A bulk load instead fills fresh pages
+ * in memory and appends each one once it is full.  The usage maps and the
+ * row count are written once at the end, and the indexes are rebuilt from
+ * their sorted keys.
+ */
+
+/* pages taken from the file at a time */
+#define MDB_BULK_RUN 64
+
+/* index entries start after the header and bitmap (Jet3 layout) */
+#define MDB_IDX_BITMAP_START 0x16
+#define MDB_IDX_ENTRY_START 0xf8
+
+/*
+ * The keys of an index are kept as its leaf entries are stored: the key
+ * from mdb_index_make_key() followed by the big endian row pointer, so
+ * they sort on their bytes.  All keys of an index have the same length.
+ */
+typedef struct {
+	MdbIndex *idx;
+	int key_len;
+	int entry_sz;		/* key_len plus the row pointer */
+	GArray *keys;
+} MdbBulkIndex;
+
+static void
+mdb_bulk_add_key(MdbTableDef *table, MdbBulkIndex *bidx, unsigned int num_fields, MdbField *fields, guint32 pg_row)
+{
+	unsigned char entry[MDB_MAX_KEY_LEN + 4];
+
+	mdb_index_make_key(table, bidx->idx, num_fields, fields, entry);
+	_mdb_put_int32_msb(entry, bidx->key_len, pg_row);
+	g_array_append_vals(bidx->keys, entry, 1);
+}
+static gint
+mdb_bulk_key_cmp(gconstpointer a, gconstpointer b, gpointer entry_sz)
+{
+	return memcmp(a, b, *(int *) entry_sz);
+}
+/*
+ * Take the next page of the current run, pages are allocated in runs so
+ * the table stays in order on disk.
+ */
+static guint32
+mdb_bulk_alloc_pg(MdbBulkInsert *bulk)
+{
+	MdbHandle *mdb = bulk->table->entry->mdb;
+	guint32 pg;
+
+	if (bulk->next_pg == bulk->run_end) {
+		if (!(pg = mdb_alloc_pages(mdb, MDB_BULK_RUN)))
+			return 0;
+		bulk->next_pg = pg;
+		bulk->run_end = pg + MDB_BULK_RUN;
+	}
+	return bulk->next_pg++;
+}
+/* write a page built somewhere other than mdb->pg_buf */
+static void
+mdb_bulk_write_pg(MdbHandle *mdb, guint32 pg, unsigned char *buf)
+{
+	memcpy(mdb->pg_buf, buf, mdb->fmt->pg_size);
+	if (!mdb_write_pg(mdb, pg)) {
+		fprintf(stderr, "write failed! exiting...\n");
+		exit(1);
+	}
+	mdb->cur_pg = pg;
+}
+static int
+mdb_bulk_start_pg(MdbBulkInsert *bulk)
+{
+	MdbCatalogEntry *entry = bulk->table->entry;
+	MdbFormatConstants *fmt = entry->mdb->fmt;
+
+	GArray *runs = bulk->data_pgs;
+
+	if (!(bulk->pg_num = mdb_bulk_alloc_pg(bulk)))
+		return 0;
+	if (runs->len && g_array_index(runs, guint32, runs->len - 2)
+			+ g_array_index(runs, guint32, runs->len - 1) == bulk->pg_num) {
+		g_array_index(runs, guint32, runs->len - 1)++;
+	} else {
+		guint32 run[2];
+		run[0] = bulk->pg_num;
+		run[1] = 1;
+		g_array_append_vals(runs, run, 2);
+	}
+	memset(bulk->pg, 0, fmt->pg_size);
+	bulk->pg[0] = MDB_PAGE_DATA;
+	bulk->pg[1] = 0x01;
+	_mdb_put_int32(bulk->pg, 4, entry->table_pg);
+	bulk->pg_rows = 0;
+	bulk->pg_free_end = fmt->pg_size;
+	return 1;
+}
+static void
+mdb_bulk_flush_pg(MdbBulkInsert *bulk)
+{
+	MdbHandle *mdb = bulk->table->entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+
+	_mdb_put_int16(bulk->pg, fmt->row_count_offset, bulk->pg_rows);
+	_mdb_put_int16(bulk->pg, 2, bulk->pg_free_end - fmt->row_count_offset
+		- 2 - bulk->pg_rows * 2);
+	mdb_debug(MDB_DEBUG_WRITE, "writing page %d", bulk->pg_num);
+	mdb_bulk_write_pg(mdb, bulk->pg_num, bulk->pg);
+}
+/**
+ * mdb_bulk_insert_begin:
+ * @table: table to load, opened with mdb_read_table()
+ *
+ * Starts loading rows into @table with mdb_bulk_insert_add().  Nothing is
+ * visible to readers of the table until mdb_bulk_insert_end() is called.
+ * Indexes are rebuilt at the end; those that can't be written, the ones
+ * mdb_insert_row() can't update either, are left as they were and a
+ * warning is printed.  Their number is in the stale_idxs of the result.
+ *
+ * Returns: the load state, or NULL if the table can't be written to.
+ */
+MdbBulkInsert *
+mdb_bulk_insert_begin(MdbTableDef *table)
+{
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbBulkInsert *bulk;
+	MdbBulkIndex *bidx;
+	MdbIndex *idx;
+	unsigned char key[MDB_MAX_KEY_LEN];
+	unsigned int i, j;
+
+	if (!mdb->f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
+		return NULL;
+	}
+	if (table->is_temp_table) {
+		fprintf(stderr, "Temporary tables can't be bulk loaded\n");
+		return NULL;
+	}
+	if (!table->columns)
+		mdb_read_columns(table);
+	if (!table->indices)
+		mdb_read_indices(table);
+
+	bulk = (MdbBulkInsert *) g_malloc0(sizeof(MdbBulkInsert));
+	bulk->table = table;
+	bulk->pg = g_malloc0(mdb->fmt->pg_size);
+	bulk->data_pgs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	bulk->indices = g_ptr_array_new();
+
+	for (i=0;i<table->num_idxs;i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		/* foreign keys share the index of the table they refer to */
+		if (idx->index_type == 2)
+			continue;
+		/* several logical indexes may use the same real one */
+		for (j=0;j<bulk->indices->len;j++) {
+			bidx = g_ptr_array_index(bulk->indices, j);
+			if (bidx->idx->first_pg == idx->first_pg)
+				break;
+		}
+		if (j < bulk->indices->len)
+			continue;
+		/* mdb_insert_row() can't keep these up to date either */
+		if (!mdb_index_writable(table, idx)) {
+			fprintf(stderr, "Warning: index %s can't be rebuilt and will be out of date\n", idx->name);
+			bulk->stale_idxs++;
+			continue;
+		}
+		bidx = (MdbBulkIndex *) g_malloc0(sizeof(MdbBulkIndex));
+		bidx->idx = idx;
+		/* a key of nulls, for its length */
+		bidx->key_len = mdb_index_make_key(table, idx, 0, NULL, key);
+		bidx->entry_sz = bidx->key_len + 4;
+		bidx->keys = g_array_new(FALSE, FALSE, bidx->entry_sz);
+		g_ptr_array_add(bulk->indices, bidx);
+	}
+
+	return bulk;
+}
+/**
+ * mdb_bulk_insert_add:
+ * @bulk: load started by mdb_bulk_insert_begin()
+ * @num_fields: number of fields
+ * @fields: the row, as for mdb_insert_row()
+ *
+ * Returns: 1 on success, 0 if the row could not be added.
+ */
+int
+mdb_bulk_insert_add(MdbBulkInsert *bulk, int num_fields, MdbField *fields)
+{
+	MdbTableDef *table = bulk->table;
+	MdbFormatConstants *fmt = table->entry->mdb->fmt;
+	MdbBulkIndex *bidx;
+	int row_size, room;
+	unsigned int i;
+
+	row_size = mdb_packed_row_size(table, num_fields, fields);
+	if (row_size > fmt->pg_size - fmt->row_count_offset - 4) {
+		fprintf(stderr, "Row of %d bytes does not fit on a page\n", row_size);
+		return 0;
+	}
+	if (bulk->pg_num) {
+		room = bulk->pg_free_end - fmt->row_count_offset - 2
+			- (bulk->pg_rows + 1) * 2;
+		if (room < row_size || bulk->pg_rows == MDB_MAX_PG_ROWS) {
+			mdb_bulk_flush_pg(bulk);
+			bulk->pg_num = 0;
+			/* no table refers to the new pages yet */
+			if (!mdb_maybe_flush(table->entry->mdb))
+				return 0;
+		}
+	}
+	if (!bulk->pg_num && !mdb_bulk_start_pg(bulk)) {
+		fprintf(stderr, "Unable to allocate new page.\n");
+		return 0;
+	}
+
+	bulk->pg_free_end -= row_size;
+	mdb_pack_row(table, bulk->pg + bulk->pg_free_end, num_fields, fields);
+	_mdb_put_int16(bulk->pg, fmt->row_count_offset + 2 + bulk->pg_rows * 2,
+		bulk->pg_free_end);
+
+	for (i=0;i<bulk->indices->len;i++) {
+		bidx = g_ptr_array_index(bulk->indices, i);
+		mdb_bulk_add_key(table, bidx, num_fields, fields,
+			(bulk->pg_num << 8) | bulk->pg_rows);
+	}
+	bulk->pg_rows++;
+	bulk->num_rows++;
+
+	return 1;
+}
+/*
+ * add the keys of the rows already in the table, read before the new pages
+ * are put in its usage map
+ */
+static void
+mdb_bulk_read_keys(MdbBulkInsert *bulk)
+{
+	MdbCatalogEntry *entry = bulk->table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbTableDef *table;
+	MdbBulkIndex *bidx;
+	MdbField fields[MDB_MAX_COLS];
+	unsigned int i, row;
+	int start;
+	size_t len;
+
+	table = mdb_read_table(entry);
+	if (!table)
+		return;
+	mdb_read_columns(table);
+	mdb_rewind_table(table);
+	while (mdb_fetch_row(table)) {
+		/* the row again, as fields for mdb_index_make_key() */
+		row = table->cur_row - 1;
+		mdb_find_row(mdb, row, &start, &len);
+		start &= 0x1fff;
+		mdb_crack_row(table, start, start + len - 1, fields);
+		for (i=0;i<bulk->indices->len;i++) {
+			bidx = g_ptr_array_index(bulk->indices, i);
+			mdb_bulk_add_key(bulk->table, bidx, table->num_cols,
+				fields, (table->cur_phys_pg << 8) | row);
+		}
+	}
+	mdb_free_tabledef(table);
+}
+/*
+ * collect the pages of an index so they can be used again, the root page
+ * is kept where it is
+ */
+static void
+mdb_bulk_index_pages(MdbHandle *mdb, guint32 pg, GHashTable *seen, GArray *pgs, int depth)
+{
+	MdbIndexPage ipg;
+	GArray *children;
+	guint32 child;
+	unsigned int i;
+
+	while (pg && !g_hash_table_lookup(seen, GUINT_TO_POINTER(pg))) {
+		if (mdb_read_pg(mdb, pg) != mdb->fmt->pg_size)
+			return;
+		if (mdb->pg_buf[0] != MDB_PAGE_INDEX
+		 && mdb->pg_buf[0] != MDB_PAGE_LEAF)
+			return;
+		g_hash_table_insert(seen, GUINT_TO_POINTER(pg), GUINT_TO_POINTER(1));
+		if (depth)
+			g_array_append_val(pgs, pg);
+		if (mdb->pg_buf[0] == MDB_PAGE_LEAF) {
+			/* leaves are chained, some are only found that way */
+			pg = mdb_get_int32(mdb->pg_buf, 0x0c);
+			depth = 1;
+			continue;
+		}
+		if (depth >= MDB_MAX_INDEX_DEPTH)
+			return;
+		children = g_array_new(FALSE, FALSE, sizeof(guint32));
+		mdb_index_page_init(&ipg);
+		ipg.pg = pg;
+		while (mdb_index_find_next_on_page(mdb, &ipg)) {
+			child = mdb_get_int32_msb(mdb->pg_buf, ipg.offset + ipg.len - 3) >> 8;
+			g_array_append_val(children, child);
+			ipg.offset += ipg.len;
+		}
+		for (i=0;i<children->len;i++)
+			mdb_bulk_index_pages(mdb, g_array_index(children, guint32, i),
+				seen, pgs, depth + 1);
+		g_array_free(children, TRUE);
+		return;
+	}
+}
+static gint
+mdb_bulk_pg_cmp(gconstpointer a, gconstpointer b)
+{
+	guint32 pa = *(const guint32 *) a, pb = *(const guint32 *) b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+/*
+ * Write one level of an index.  Each entry of keys becomes a leaf entry,
+ * or a node entry pointing at childs[i].  The last entry of every page
+ * written is added to parent for the level above, unless the level fits
+ * on one page, which then becomes the root.
+ */
+static int
+mdb_bulk_write_level(MdbBulkInsert *bulk, MdbBulkIndex *bidx, GArray *keys, GArray *childs, GArray *free_pgs, unsigned int *next_free, GArray *parent, GArray *parent_childs)
+{
+	MdbHandle *mdb = bulk->table->entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	unsigned char *pg_buf = mdb->pg_buf;
+	int entry_sz, per_pg, pos, bit;
+	unsigned int num_pgs, p, i, n, first;
+	guint32 *pgs;
+
+	entry_sz = bidx->entry_sz + (childs ? 4 : 0);
+	per_pg = (fmt->pg_size - MDB_IDX_ENTRY_START) / entry_sz;
+	num_pgs = (keys->len + per_pg - 1) / per_pg;
+	if (!num_pgs) num_pgs = 1;
+
+	/* number the pages first, each one points to the next */
+	pgs = g_malloc(num_pgs * sizeof(guint32));
+	if (num_pgs == 1) {
+		pgs[0] = bidx->idx->first_pg;
+	} else for (p=0;p<num_pgs;p++) {
+		if (*next_free < free_pgs->len) {
+			pgs[p] = g_array_index(free_pgs, guint32, (*next_free)++);
+		} else if (!(pgs[p] = mdb_bulk_alloc_pg(bulk))) {
+			g_free(pgs);
+			return 0;
+		}
+	}
+
+	for (p=0;p<num_pgs;p++) {
+		first = p * per_pg;
+		n = MIN((unsigned int) per_pg, keys->len - first);
+
+		memset(pg_buf, 0, fmt->pg_size);
+		pg_buf[0] = childs ? MDB_PAGE_INDEX : MDB_PAGE_LEAF;
+		pg_buf[1] = 0x01;
+		_mdb_put_int32(pg_buf, 4, bulk->table->entry->table_pg);
+		_mdb_put_int32(pg_buf, 0x08, p ? pgs[p-1] : 0);
+		_mdb_put_int32(pg_buf, 0x0c, p + 1 < num_pgs ? pgs[p+1] : 0);
+
+		pos = MDB_IDX_ENTRY_START;
+		for (i=first;i<first+n;i++) {
+			memcpy(pg_buf + pos, keys->data + i * bidx->entry_sz,
+				bidx->entry_sz);
+			if (childs)
+				_mdb_put_int32_msb(pg_buf, pos + bidx->entry_sz,
+					g_array_index(childs, guint32, i));
+			pos += entry_sz;
+			/* the bitmap marks where each entry ends */
+			bit = pos - MDB_IDX_ENTRY_START;
+			pg_buf[MDB_IDX_BITMAP_START + bit/8] |= 1 << (bit%8);
+		}
+		_mdb_put_int16(pg_buf, 2, fmt->pg_size - pos);
+		if (!mdb_write_pg(mdb, pgs[p])) {
+			fprintf(stderr, "write failed! exiting...\n");
+			exit(1);
+		}
+		mdb->cur_pg = pgs[p];
+
+		if (num_pgs > 1) {
+			g_array_append_vals(parent,
+				keys->data + (first + n - 1) * bidx->entry_sz, 1);
+			g_array_append_val(parent_childs, pgs[p]);
+		}
+	}
+	g_free(pgs);
+	return num_pgs;
+}
+static int
+mdb_bulk_build_index(MdbBulkInsert *bulk, MdbBulkIndex *bidx)
+{
+	MdbHandle *mdb = bulk->table->entry->mdb;
+	GHashTable *seen;
+	GArray *free_pgs, *keys, *childs = NULL, *parent, *parent_childs;
+	unsigned int next_free = 0;
+	int num_pgs, ret = 1;
+
+	g_array_sort_with_data(bidx->keys, mdb_bulk_key_cmp, &bidx->entry_sz);
+
+	seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+	free_pgs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	mdb_bulk_index_pages(mdb, bidx->idx->first_pg, seen, free_pgs, 0);
+	g_hash_table_destroy(seen);
+	g_array_sort(free_pgs, mdb_bulk_pg_cmp);
+
+	/* leaves first, then the nodes above them until one page is left */
+	keys = bidx->keys;
+	bidx->keys = NULL;
+	do {
+		parent = g_array_new(FALSE, FALSE, bidx->entry_sz);
+		parent_childs = g_array_new(FALSE, FALSE, sizeof(guint32));
+		num_pgs = mdb_bulk_write_level(bulk, bidx, keys, childs,
+			free_pgs, &next_free, parent, parent_childs);
+		g_array_free(keys, TRUE);
+		if (childs) g_array_free(childs, TRUE);
+		keys = parent;
+		childs = parent_childs;
+		if (!num_pgs) ret = 0;
+	} while (num_pgs > 1);
+	g_array_free(keys, TRUE);
+	g_array_free(childs, TRUE);
+
+	g_array_free(free_pgs, TRUE);
+	return ret;
+}
+static void
+mdb_bulk_free(MdbBulkInsert *bulk)
+{
+	MdbBulkIndex *bidx;
+	unsigned int i;
+
+	for (i=0;i<bulk->indices->len;i++) {
+		bidx = g_ptr_array_index(bulk->indices, i);
+		if (bidx->keys) g_array_free(bidx->keys, TRUE);
+		g_free(bidx);
+	}
+	g_ptr_array_free(bulk->indices, TRUE);
+	g_array_free(bulk->data_pgs, TRUE);
+	/* the rest of the last run */
+	mdb_free_pages(bulk->table->entry->mdb, bulk->next_pg,
+		bulk->run_end - bulk->next_pg);
+	g_free(bulk->pg);
+	g_free(bulk);
+}
+/**
+ * mdb_bulk_insert_end:
+ * @bulk: load started by mdb_bulk_insert_begin(), freed by this call
+ *
+ * Writes the last page, adds the new pages to the table's usage maps,
+ * updates its row count and rebuilds its indexes.
+ *
+ * Returns: 1 on success, 0 if the loaded rows could not be made part of
+ * the table.
+ */
+int
+mdb_bulk_insert_end(MdbBulkInsert *bulk)
+{
+	MdbTableDef *table = bulk->table;
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	MdbBulkIndex *bidx;
+	GArray *runs = bulk->data_pgs;
+	guint32 start_pg, num_pgs;
+	unsigned int i;
+	int ret = 1;
+
+	if (!bulk->num_rows) {
+		mdb_bulk_free(bulk);
+		return 1;
+	}
+	mdb_bulk_flush_pg(bulk);
+
+	if (bulk->indices->len)
+		mdb_bulk_read_keys(bulk);
+
+	/* make the new pages part of the table */
+	for (i=0;i<runs->len;i+=2) {
+		start_pg = g_array_index(runs, guint32, i);
+		num_pgs = g_array_index(runs, guint32, i + 1);
+		if (!mdb_map_add_pages(table, fmt->tab_usage_map_offset,
+				table->usage_map, table->map_sz, start_pg, num_pgs)) {
+			fprintf(stderr, "The usage map of table %s has no room for pages %lu to %lu\n",
+				table->name, (unsigned long) start_pg,
+				(unsigned long) (start_pg + num_pgs - 1));
+			mdb_bulk_free(bulk);
+			return 0;
+		}
+	}
+	/* only the last page has room left */
+	mdb_map_add_pages(table, fmt->tab_free_map_offset,
+		table->free_usage_map, table->freemap_sz, bulk->pg_num, 1);
+	mdb_space_dir_update(table, bulk->pg_num, bulk->pg);
+
+	table->num_rows += bulk->num_rows;
+	mdb_read_pg(mdb, entry->table_pg);
+	_mdb_put_int32(mdb->pg_buf, fmt->tab_num_rows_offset, table->num_rows);
+	if (!mdb_write_pg(mdb, entry->table_pg)) {
+		fprintf(stderr, "write failed! exiting...\n");
+		exit(1);
+	}
+
+	for (i=0;i<bulk->indices->len;i++) {
+		bidx = g_ptr_array_index(bulk->indices, i);
+		mdb_debug(MDB_DEBUG_WRITE, "Rebuilding %s.", bidx->idx->name);
+		if (!mdb_bulk_build_index(bulk, bidx))
+			ret = 0;
+	}
+
+	mdb_tdef_drop(mdb, entry->table_pg);
+	if (entry->table_pg == 2)
+		mdb->catalog_stale = 1;
+	mdb_bulk_free(bulk);
+	if (!mdb_maybe_flush(mdb))
+		ret = 0;
+	return ret;
+}
@@ -47,31 +47,96 @@ static char *type_name[] = {"Form",
 	}
 }
 
-void mdb_free_catalog(MdbHandle *mdb)
+/*
+ * Table names may be given with anything but letters and digits replaced
+ * by '_', as mdb-export and friends print them.
+ */
+static char *mdb_sanitize_name(char *str)
 {
-	unsigned int i;
+	static char namebuf[256];
+	char *p = namebuf;
+
+	while (*str) {
+		*p = isalnum(*str) ? *str : '_';
+		p++;
+		str++;
+	}
+	*p = 0;
 
-	if ((!mdb) || (!mdb->catalog)) return;
-	for (i=0; i<mdb->catalog->len; i++)
-		g_free (g_ptr_array_index(mdb->catalog, i));
-	g_ptr_array_free(mdb->catalog, TRUE);
-	mdb->catalog = NULL;
+	return namebuf;
 }
+static void mdb_free_name_list(gpointer data)
+{
+	g_ptr_array_free((GPtrArray *)data, TRUE);
+}
+static void mdb_free_dropped_entry(gpointer key, gpointer value, gpointer data)
+{
+	g_free(value);
+}
+/* index entry under name, in lower case; each name keeps catalog order */
+static void mdb_catalog_add_name(MdbHandle *mdb, char *name, MdbCatalogEntry *entry)
+{
+	GPtrArray *entries;
+	char *key;
 
-GPtrArray *mdb_read_catalog (MdbHandle *mdb, int objtype)
+	key = g_ascii_strdown(name, -1);
+	entries = g_hash_table_lookup(mdb->catalog_names, key);
+	if (!entries) {
+		entries = g_ptr_array_new();
+		g_hash_table_insert(mdb->catalog_names, key, entries);
+	} else {
+		g_free(key);
+		/* the sanitized name is often the name itself */
+		if (g_ptr_array_index(entries, entries->len-1) == entry)
+			return;
+	}
+	g_ptr_array_add(entries, entry);
+}
+/* integer value of a column in the row just fetched */
+static long mdb_catalog_int(MdbHandle *mdb, MdbColumn *col)
+{
+	if (!col || !col->cur_value_len) return 0;
+
+	switch (col->col_type) {
+		case MDB_BYTE:
+			return mdb->pg_buf[col->cur_value_start];
+		case MDB_INT:
+			return (gint16) mdb_get_int16(mdb->pg_buf, col->cur_value_start);
+		default:
+			return mdb_get_int32(mdb->pg_buf, col->cur_value_start);
+	}
+}
+static MdbColumn *mdb_catalog_column(MdbTableDef *table, char *name)
+{
+	MdbColumn *col;
+	unsigned int i;
+
+	for (i=0;i<table->num_cols;i++) {
+		col = g_ptr_array_index(table->columns, i);
+		if (!strcasecmp(col->name, name))
+			return col;
+	}
+	return NULL;
+}
+/*
+ * Read MSysObjects into mdb->catalog_cache, unless it is there already.
+ * The cache lives until the handle is closed or MSysObjects is written
+ * to.  Reading it again keeps the entries of objects still there, since
+ * open tables point at them.
+ */
+static int mdb_load_catalog(MdbHandle *mdb)
 {
 	MdbCatalogEntry *entry, msysobj;
 	MdbTableDef *table;
-	char obj_id[256];
+	MdbColumn *id_col, *type_col, *flags_col;
+	GHashTable *old_ids = NULL;
 	char obj_name[256];
-	char obj_type[256];
-	char obj_flags[256];
+	unsigned long id;
+	unsigned int i;
 	int type;
 
-	if (!mdb) return NULL;
-	if (mdb->catalog) mdb_free_catalog(mdb);
-	mdb->catalog = g_ptr_array_new();
-	mdb->num_catalog = 0;
+	if (mdb->catalog_cache && !mdb->catalog_stale)
+		return 1;
 
 	/* dummy up a catalog entry so we may read the table def */
 	memset(&msysobj, 0, sizeof(MdbCatalogEntry));
@@ -83,39 +148,146 @@ GPtrArray *mdb_read_catalog (MdbHandle *mdb, int objtype)
 	/* mdb_table_dump(&msysobj); */
 
 	table = mdb_read_table(&msysobj);
-	if (!table) return NULL;
+	if (!table) return 0;
 
 	mdb_read_columns(table);
 
-	mdb_bind_column_by_name(table, "Id", obj_id, NULL);
+	/* only the name needs converting, the rest is read as stored */
 	mdb_bind_column_by_name(table, "Name", obj_name, NULL);
-	mdb_bind_column_by_name(table, "Type", obj_type, NULL);
-	mdb_bind_column_by_name(table, "Flags", obj_flags, NULL);
+	id_col = mdb_catalog_column(table, "Id");
+	type_col = mdb_catalog_column(table, "Type");
+	flags_col = mdb_catalog_column(table, "Flags");
 
 	mdb_rewind_table(table);
 
+	if (mdb->catalog_cache) {
+		old_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+		for (i=0; i<mdb->catalog_cache->len; i++) {
+			entry = g_ptr_array_index(mdb->catalog_cache, i);
+			g_hash_table_insert(old_ids, 
+				GUINT_TO_POINTER(entry->table_pg), entry);
+		}
+		g_ptr_array_free(mdb->catalog_cache, TRUE);
+		g_hash_table_destroy(mdb->catalog_names);
+	}
+	mdb->catalog_cache = g_ptr_array_new();
+	mdb->catalog_names = g_hash_table_new_full(g_str_hash, g_str_equal,
+		g_free, mdb_free_name_list);
+	mdb->catalog_stale = 0;
+
 	while (mdb_fetch_row(table)) {
-		type = atoi(obj_type);
-		if (objtype==MDB_ANY || type == objtype) {
-			// fprintf(stdout, "obj_id: %10ld objtype: %-3d obj_name: %s\n", 
-			// (atol(obj_id) & 0x00FFFFFF), type, obj_name); 
+		id = mdb_catalog_int(mdb, id_col) & 0x00FFFFFF;
+		type = mdb_catalog_int(mdb, type_col);
+		entry = NULL;
+		if (old_ids) {
+			entry = g_hash_table_lookup(old_ids, GUINT_TO_POINTER(id));
+			if (entry)
+				g_hash_table_remove(old_ids, GUINT_TO_POINTER(id));
+		}
+		if (!entry)
 			entry = (MdbCatalogEntry *) g_malloc0(sizeof(MdbCatalogEntry));
-			entry->mdb = mdb;
-			strcpy(entry->object_name, obj_name);
-			entry->object_type = (type & 0x7F);
-			entry->table_pg = atol(obj_id) & 0x00FFFFFF;
-			entry->flags = atol(obj_flags);
+		entry->mdb = mdb;
+		strcpy(entry->object_name, obj_name);
+		entry->object_type = (type & 0x7F);
+		entry->raw_type = type;
+		entry->table_pg = id;
+		entry->flags = mdb_catalog_int(mdb, flags_col);
+		entry->row_pg = table->cur_phys_pg;
+		entry->row_num = table->cur_row - 1;
+		g_ptr_array_add(mdb->catalog_cache, entry); 
+
+		mdb_catalog_add_name(mdb, entry->object_name, entry);
+		mdb_catalog_add_name(mdb, mdb_sanitize_name(entry->object_name), entry);
+	}
+	if (old_ids) {
+		/* objects no longer in MSysObjects */
+		g_hash_table_foreach(old_ids, mdb_free_dropped_entry, NULL);
+		g_hash_table_destroy(old_ids);
+	}
+ 
+	mdb_free_tabledef(table);
+
+	return 1;
+}
+
+void mdb_free_catalog(MdbHandle *mdb)
+{
+	unsigned int i;
+
+	if (!mdb) return;
+	if (mdb->catalog) {
+		g_ptr_array_free(mdb->catalog, TRUE);
+		mdb->catalog = NULL;
+	}
+	mdb->num_catalog = 0;
+	if (mdb->catalog_cache) {
+		for (i=0; i<mdb->catalog_cache->len; i++)
+			g_free (g_ptr_array_index(mdb->catalog_cache, i));
+		g_ptr_array_free(mdb->catalog_cache, TRUE);
+		mdb->catalog_cache = NULL;
+	}
+	if (mdb->catalog_names) {
+		g_hash_table_destroy(mdb->catalog_names);
+		mdb->catalog_names = NULL;
+	}
+	mdb->catalog_stale = 0;
+}
+
+/*
+ * Fill mdb->catalog with the objects of type objtype (or MDB_ANY).  The
+ * entries belong to the handle and stay valid after the next call; only
+ * the mdb->catalog array itself is replaced.
+ */
+GPtrArray *mdb_read_catalog (MdbHandle *mdb, int objtype)
+{
+	MdbCatalogEntry *entry;
+	unsigned int i;
+
+	if (!mdb) return NULL;
+	if (mdb->catalog) g_ptr_array_free(mdb->catalog, TRUE);
+	mdb->catalog = g_ptr_array_new();
+	mdb->num_catalog = 0;
+
+	if (!mdb_load_catalog(mdb)) return NULL;
+
+	for (i=0; i<mdb->catalog_cache->len; i++) {
+		entry = g_ptr_array_index(mdb->catalog_cache, i);
+		if (objtype==MDB_ANY || entry->raw_type == objtype) {
 			mdb->num_catalog++;
 			g_ptr_array_add(mdb->catalog, entry); 
 		}
 	}
 	//mdb_dump_catalog(mdb, MDB_TABLE);
- 
-	mdb_free_tabledef(table);
 
 	return mdb->catalog;
 }
 
+/*
+ * Find an object by name, or by the name with anything but letters and
+ * digits replaced by '_'.  Case is not significant.
+ */
+MdbCatalogEntry *mdb_get_catalogentry_by_name(MdbHandle *mdb, const gchar *name, int objtype)
+{
+	MdbCatalogEntry *entry;
+	GPtrArray *entries;
+	unsigned int i;
+	char *key;
+
+	if (!mdb_load_catalog(mdb)) return NULL;
+
+	key = g_ascii_strdown(name, -1);
+	entries = g_hash_table_lookup(mdb->catalog_names, key);
+	g_free(key);
+	if (!entries) return NULL;
+
+	for (i=0; i<entries->len; i++) {
+		entry = g_ptr_array_index(entries, i);
+		if (objtype==MDB_ANY || entry->raw_type == objtype)
+			return entry;
+	}
+	return NULL;
+}
+
 void 
 mdb_dump_catalog(MdbHandle *mdb, int obj_type)
 {
@@ -27,21 +27,77 @@
 
 #define OFFSET_MASK 0x1fff
 
-char *mdb_money_to_string(MdbHandle *mdb, int start);
 static int _mdb_attempt_bind(MdbHandle *mdb, 
 	MdbColumn *col, unsigned char isnull, int offset, int len);
-static char *mdb_num_to_string(MdbHandle *mdb, int start, int datatype, int prec, int scale);
 static char *mdb_date_to_string(MdbHandle *mdb, int start);
 #ifdef MDB_COPY_OLE
 static size_t mdb_copy_ole(MdbHandle *mdb, void *dest, int start, int size);
 #endif
 
-static char date_fmt[64] = "%x %X";
-
-void mdb_set_date_fmt(const char *fmt)
+/*
+ * Date formats made only of numeric fields are compiled once into a list
+ * of ops and formatted by hand, anything else is left to strftime().
+ */
+enum {
+	MDB_DF_END = 0,
+	MDB_DF_CHAR,	/* followed by the literal character */
+	MDB_DF_YEAR,
+	MDB_DF_YEAR2,
+	MDB_DF_MONTH,
+	MDB_DF_DAY,
+	MDB_DF_DAY_SP,
+	MDB_DF_YDAY,
+	MDB_DF_HOUR,
+	MDB_DF_MIN,
+	MDB_DF_SEC
+};
+
+static int mdb_compile_date_fmt(const char *fmt, unsigned char *ops)
 {
-		date_fmt[63] = 0; 
-		strncpy(date_fmt, fmt, 63);
+	const char *expand;
+	int j = 0;
+
+	for (; *fmt; fmt++) {
+		if (*fmt != '%') {
+			ops[j++] = MDB_DF_CHAR;
+			ops[j++] = *fmt;
+			continue;
+		}
+		switch (*++fmt) {
+			case 'Y': ops[j++] = MDB_DF_YEAR; break;
+			case 'y': ops[j++] = MDB_DF_YEAR2; break;
+			case 'm': ops[j++] = MDB_DF_MONTH; break;
+			case 'd': ops[j++] = MDB_DF_DAY; break;
+			case 'e': ops[j++] = MDB_DF_DAY_SP; break;
+			case 'j': ops[j++] = MDB_DF_YDAY; break;
+			case 'H': ops[j++] = MDB_DF_HOUR; break;
+			case 'M': ops[j++] = MDB_DF_MIN; break;
+			case 'S': ops[j++] = MDB_DF_SEC; break;
+			case '%':
+				ops[j++] = MDB_DF_CHAR;
+				ops[j++] = '%';
+			break;
+			case 'F':
+			case 'T':
+				expand = (*fmt == 'F') ?
+					"\x02\x01-\x04\x01-\x05" :
+					"\x08\x01:\x09\x01:\x0a";
+				strcpy((char *)ops + j, expand);
+				j += strlen(expand);
+			break;
+			default:
+				/* locale dependent or unknown */
+				return 0;
+		}
+	}
+	ops[j] = MDB_DF_END;
+	return 1;
+}
+void mdb_set_date_fmt(MdbHandle *mdb, const char *fmt)
+{
+		mdb->date_fmt[63] = 0; 
+		strncpy(mdb->date_fmt, fmt, 63);
+		mdb->date_fast = mdb_compile_date_fmt(mdb->date_fmt, mdb->date_ops);
 }
 
 void mdb_bind_column(MdbTableDef *table, int col_num, void *bind_ptr, int *len_ptr)
@@ -216,6 +272,24 @@ int ret;
 		col->cur_value_start = 0;
 		col->cur_value_len = 0;
 	}
+	if (col->col_type == MDB_MEMO) {
+		col->memo_pending = 0;
+		if (len >= MDB_MEMO_OVERHEAD)
+			memcpy(col->memo_hdr, mdb->pg_buf + start,
+				MDB_MEMO_OVERHEAD);
+		/* leave the LVAL chain for mdb_memo_fetch() */
+		if (col->bind_ptr && len >= MDB_MEMO_OVERHEAD
+		 && (col->lazy_memo || mdb_get_option(MDB_NO_MEMO))
+		 && !(mdb_get_int32(col->memo_hdr, 0) & 0x80000000)) {
+			strcpy(col->bind_ptr, "");
+			col->memo_pending = 1;
+			ret = mdb_memo_length(col);
+			if (col->len_ptr) {
+				*col->len_ptr = ret;
+			}
+			return ret;
+		}
+	}
 	if (col->bind_ptr) {
 		if (!len) {
 			strcpy(col->bind_ptr, "");
@@ -223,15 +297,26 @@ int ret;
 			//fprintf(stdout,"len %d size %d\n",len, col->col_size);
 			char *str;
 			if (col->col_type == MDB_NUMERIC) {
-				str = mdb_num_to_string(mdb, start,
-					col->col_type, col->col_prec,
-					col->col_scale);
+				mdb_numeric_to_buf(mdb->pg_buf + start,
+					col->col_scale, col->bind_ptr);
+			} else if (col->col_type == MDB_MONEY) {
+				mdb_money_to_buf(mdb->pg_buf + start,
+					col->bind_ptr);
+			} else if (col->col_type == MDB_FLOAT) {
+				mdb_float_to_buf(mdb_get_single(mdb->pg_buf,
+					start), col->bind_ptr);
+			} else if (col->col_type == MDB_DOUBLE) {
+				mdb_double_to_buf(mdb_get_double(mdb->pg_buf,
+					start), col->bind_ptr);
+			} else if (col->col_type == MDB_SDATETIME) {
+				mdb_date_to_buf(mdb, mdb_get_double(mdb->pg_buf,
+					start), col->bind_ptr, MDB_BIND_SIZE);
 			} else {
 				str = mdb_col_to_string(mdb, mdb->pg_buf, start,
 					col->col_type, len);
+				strcpy(col->bind_ptr, str);
+				g_free(str);
 			}
-			strcpy(col->bind_ptr, str);
-			g_free(str);
 		}
 		ret = strlen(col->bind_ptr);
 		if (col->len_ptr) {
@@ -258,6 +343,20 @@ int mdb_read_row(MdbTableDef *table, unsigned int row)
 
 	mdb_find_row(mdb, row, &row_start, &row_size);
 
+	/* a row reached through an index may have moved, leaving a pointer */
+	table->fwd_pg_row = 0;
+	if ((row_start & 0x4000) && row_size == 4
+	 && table->strategy == MDB_INDEX_SCAN) {
+		guint32 fwd = mdb_get_int32(mdb->pg_buf, row_start & OFFSET_MASK);
+
+		table->fwd_pg_row = (table->cur_phys_pg << 8) | row;
+		table->cur_phys_pg = fwd >> 8;
+		table->cur_row = row = fwd & 0xff;
+		if (!mdb_read_pg(mdb, table->cur_phys_pg))
+			return 0;
+		mdb_find_row(mdb, row, &row_start, &row_size);
+	}
+
 	delflag = lookupflag = 0;
 	if (row_start & 0x8000) lookupflag++;
 	if (row_start & 0x4000) delflag++;
@@ -273,8 +372,13 @@ int mdb_read_row(MdbTableDef *table, unsigned int row)
 		return 0;
 	}
 
-	num_fields = mdb_crack_row(table, row_start, row_start + row_size - 1,
-		fields);
+	/* a table scan reads every row of the page, decode them together */
+	if (table->strategy == MDB_TABLE_SCAN && !table->is_temp_table)
+		num_fields = mdb_crack_page_row(table, row, row_start,
+			row_start + row_size - 1, fields);
+	else
+		num_fields = mdb_crack_row(table, row_start,
+			row_start + row_size - 1, fields);
 	if (!mdb_test_sargs(table, fields, num_fields)) return 0;
 	
 #if MDB_DEBUG
@@ -348,11 +452,54 @@ int mdb_rewind_table(MdbTableDef *table)
 	table->cur_pg_num=0;
 	table->cur_phys_pg=0;
 	table->cur_row=0;
+	table->fetch_skipped=0;
+	table->fetch_count=0;
+	/* an index scan starts over from the root */
+	if (table->chain)
+		memset(table->chain, 0, sizeof(MdbIndexChain));
 
 	return 0;
 }
-int 
-mdb_fetch_row(MdbTableDef *table)
+/*
+ * Bind the next row of a temp table that gets its rows from a callback.
+ * The row is copied to the page buffer so values can be found the usual way.
+ */
+static int
+mdb_fetch_source_row(MdbTableDef *table)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbRowSource *source = table->row_source;
+	MdbColumn *col;
+	const unsigned char *row;
+	size_t len, pos = 0;
+	unsigned int i, siz;
+
+	if (!source->next(source->data, &row, &len))
+		return 0;
+	if (len > mdb->fmt->pg_size) {
+		fprintf(stderr, "Temp table row too large (%lu bytes)\n",
+			(unsigned long)len);
+		return 0;
+	}
+	memcpy(mdb->pg_buf, row, len);
+	/* pg_buf no longer holds a page of the file */
+	mdb->cur_pg = 0;
+	for (i=0; i<table->num_cols && pos + 2 <= len; i++) {
+		col = g_ptr_array_index(table->columns, i);
+		siz = mdb_get_int16(mdb->pg_buf, pos);
+		pos += 2;
+		if (siz == MDB_FLAT_NULL) {
+			_mdb_attempt_bind(mdb, col, 1, 0, 0);
+		} else {
+			_mdb_attempt_bind(mdb, col, 0, pos, siz);
+			pos += siz;
+		}
+	}
+	table->cur_row++;
+	return 1;
+}
+static int 
+mdb_fetch_next_row(MdbTableDef *table)
 {
 	MdbHandle *mdb = table->entry->mdb;
 	MdbFormatConstants *fmt = mdb->fmt;
@@ -360,6 +507,8 @@ mdb_fetch_row(MdbTableDef *table)
 	int rc;
 	guint32 pg;
 
+	if (table->row_source)
+		return mdb_fetch_source_row(table);
 	if (table->num_rows==0)
 		return 0;
 
@@ -388,11 +537,10 @@ mdb_fetch_row(MdbTableDef *table)
 				fmt->pg_size);
 		} else if (table->strategy==MDB_INDEX_SCAN) {
 		
-			if (!mdb_index_find_next(table->mdbidx, table->scan_idx, table->chain, &pg, (guint16 *) &(table->cur_row))) {
-				mdb_index_scan_free(table);
+			if (!mdb_index_find_next(table->mdbidx, table->scan_idx, table->chain, &pg, (guint16 *) &(table->cur_row)))
 				return 0;
-			}
 			mdb_read_pg(mdb, pg);
+			table->cur_phys_pg = pg;
 		} else {
 			rows = mdb_get_int16(mdb->pg_buf,fmt->row_count_offset);
 
@@ -413,6 +561,97 @@ mdb_fetch_row(MdbTableDef *table)
 
 	return 1;
 }
+/*
+ * Skip the rows before the fetch offset.  A plain table scan with nothing to
+ * test counts the live rows in each page's row offset table instead of
+ * cracking them, other tables fetch and drop them.
+ */
+static int
+mdb_skip_rows(MdbTableDef *table)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	const unsigned char *row;
+	unsigned int rows;
+	size_t len;
+	int start;
+
+	if (table->row_source) {
+		MdbRowSource *source = table->row_source;
+		for (; table->fetch_skipped < table->fetch_offset;
+		  table->fetch_skipped++)
+			if (!source->next(source->data, &row, &len))
+				return 0;
+		return 1;
+	}
+	if (table->is_temp_table || table->strategy == MDB_INDEX_SCAN
+	 || table->sarg_tree) {
+		for (; table->fetch_skipped < table->fetch_offset;
+		  table->fetch_skipped++)
+			if (!mdb_fetch_next_row(table))
+				return 0;
+		return 1;
+	}
+	if (table->num_rows == 0)
+		return 0;
+	if (!table->cur_pg_num) {
+		table->cur_pg_num = 1;
+		table->cur_row = 0;
+		if (!mdb_read_next_dpg(table)) return 0;
+	}
+	while (table->fetch_skipped < table->fetch_offset) {
+		rows = mdb_get_int16(mdb->pg_buf, mdb->fmt->row_count_offset);
+		if (table->cur_row >= rows) {
+			table->cur_row = 0;
+			if (!mdb_read_next_dpg(table)) return 0;
+			continue;
+		}
+		if (table->fetch_skipped + (rows - table->cur_row)
+		 > table->fetch_offset) {
+			/* the offset may end on this page, go row by row */
+			mdb_find_row(mdb, table->cur_row, &start, &len);
+			if (table->noskip_del || !(start & 0x4000))
+				table->fetch_skipped++;
+			table->cur_row++;
+			continue;
+		}
+		/* pass over the rest of the page, deleted rows don't count */
+		for (; table->cur_row < rows; table->cur_row++) {
+			mdb_find_row(mdb, table->cur_row, &start, &len);
+			if (table->noskip_del || !(start & 0x4000))
+				table->fetch_skipped++;
+		}
+	}
+	return 1;
+}
+int 
+mdb_fetch_row(MdbTableDef *table)
+{
+	if (table->fetch_limited && table->fetch_count >= table->fetch_limit)
+		return 0;
+	if (table->fetch_skipped < table->fetch_offset && !mdb_skip_rows(table))
+		return 0;
+	if (!mdb_fetch_next_row(table))
+		return 0;
+	table->fetch_count++;
+	return 1;
+}
+/**
+ * mdb_set_fetch_limit:
+ * @table: table to be read
+ * @offset: rows to skip
+ * @limit: rows to return at most, -1 for all
+ *
+ * Makes mdb_fetch_row() skip the first @offset rows and stop after @limit,
+ * without reading further pages.  The count starts over at each
+ * mdb_rewind_table().
+ **/
+void
+mdb_set_fetch_limit(MdbTableDef *table, unsigned long offset, long limit)
+{
+	table->fetch_offset = offset;
+	table->fetch_limited = limit >= 0;
+	table->fetch_limit = limit >= 0 ? limit : 0;
+}
 void mdb_data_dump(MdbTableDef *table)
 {
 	unsigned int i;
@@ -687,137 +926,119 @@ static char *mdb_memo_to_string(MdbHandle *mdb, int start, int size)
 		return text;
 	}
 }
-static char *
-mdb_num_to_string(MdbHandle *mdb, int start, int datatype, int prec, int scale)
-{
-	char *text;
-	gint32 l;
-
-	memcpy(&l, mdb->pg_buf+start+13, 4);
-
-	text = (char *) g_malloc(prec+2);
-	sprintf(text, "%0*" G_GINT32_FORMAT, prec, GINT32_FROM_LE(l));
-	if (scale) {
-		memmove(text+prec-scale, text+prec-scale+1, scale+1);
-		text[prec-scale] = '.';
-	}
-	return text;
-}
-
-static int trim_trailing_zeros(char * buff)
-{
-	char *p;
-	int n = strlen(buff);
-
-	/* Don't need to trim strings with no decimal portion */
-	if(!strchr(buff,'.'))
-		return 0;
-
-	/* Trim the zeros */
-	p = buff + n - 1;
-	while (p >= buff && *p == '0')
-		*p-- = '\0';
 
-	/* If a decimal sign is left at the end, remove it too */
-	if (*p == '.')
-		*p = '\0';
-
-	return 0;
-}
+static const int noleap_cal[] = {0,31,59,90,120,151,181,212,243,273,304,334,365};
+static const int leap_cal[]   = {0,31,60,91,121,152,182,213,244,274,305,335,366};
 
 /* Date/Time is stored as a double, where the whole
    part is the days from 12/30/1899 and the fractional
    part is the fractional part of one day. */
-static char *
-mdb_date_to_string(MdbHandle *mdb, int start)
+void
+mdb_date_to_tm(double td, struct tm *t)
 {
-	struct tm t;
-	long int day, time;
-	int yr, q;
-	int *cal;
-	int noleap_cal[] = {0,31,59,90,120,151,181,212,243,273,304,334,365};
-	int leap_cal[]   = {0,31,60,91,121,152,182,213,244,274,305,335,366};
-
-	char *text = (char *) g_malloc(MDB_BIND_SIZE);
-	double td = mdb_get_double(mdb->pg_buf, start);
+	long int day, time, era, doe, yoe, doy, mp;
+	int yr;
 
 	day = (long int)(td);
 	time = (long int)(fabs(td - day) * 86400.0 + 0.5);
-	t.tm_hour = time / 3600;
-	t.tm_min = (time / 60) % 60;
-	t.tm_sec = time % 60; 
-	t.tm_year = 1 - 1900;
-
-	day += 693593; /* Days from 1/1/1 to 12/31/1899 */
-	t.tm_wday = (day+1) % 7;
-
-	q = day / 146097;  /* 146097 days in 400 years */
-	t.tm_year += 400 * q;
-	day -= q * 146097;
-
-	q = day / 36524;  /* 36524 days in 100 years */
-	if (q > 3) q = 3;
-	t.tm_year += 100 * q;
-	day -= q * 36524;
-
-	q = day / 1461;  /* 1461 days in 4 years */
-	t.tm_year += 4 * q;
-	day -= q * 1461;
-
-	q = day / 365;  /* 365 days in 1 year */
-	if (q > 3) q = 3;
-	t.tm_year += q;
-	day -= q * 365;
-
-	yr = t.tm_year + 1900;
-	cal = ((yr)%4==0 && ((yr)%100!=0 || (yr)%400==0)) ?
-		leap_cal : noleap_cal;
-	for (t.tm_mon=0; t.tm_mon<12; t.tm_mon++) {
-		if (day < cal[t.tm_mon+1]) break;
+	if (time >= 86400) {
+		time -= 86400;
+		day++;
 	}
-	t.tm_mday = day - cal[t.tm_mon] + 1;
-	t.tm_yday = day;
-	t.tm_isdst = -1;
-
-	strftime(text, MDB_BIND_SIZE, date_fmt, &t);
-
-	return text;
+	t->tm_hour = time / 3600;
+	t->tm_min = (time / 60) % 60;
+	t->tm_sec = time % 60; 
+	/* 12/30/1899 was a Saturday */
+	t->tm_wday = ((day % 7) + 13) % 7;
+
+	/* civil date from a day count, with years starting on March 1st
+	 * so the leap day falls at the end */
+	day += 693899; /* Days from 3/1/0000 to 12/30/1899 */
+	era = (day >= 0 ? day : day - 146096) / 146097;
+	doe = day - era * 146097;
+	yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+	doy = doe - (365*yoe + yoe/4 - yoe/100);
+	mp = (5*doy + 2) / 153;
+	t->tm_mday = doy - (153*mp + 2)/5 + 1;
+	t->tm_mon = (mp < 10) ? mp + 2 : mp - 10;
+	yr = yoe + era * 400 + (t->tm_mon < 2);
+	t->tm_year = yr - 1900;
+
+	t->tm_yday = (((yr)%4==0 && ((yr)%100!=0 || (yr)%400==0)) ?
+		leap_cal : noleap_cal)[t->tm_mon] + t->tm_mday - 1;
+	t->tm_isdst = -1;
 }
+static char *
+mdb_put_num(char *p, int val, int width, char pad)
+{
+	char tmp[12];
+	int n = 0;
 
-int floor_log10(double f, int is_single)
+	do {
+		tmp[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	for (; n < width; width--)
+		*p++ = pad;
+	while (n)
+		*p++ = tmp[--n];
+	return p;
+}
+/**
+ * mdb_date_to_buf
+ * @mdb: Database handle, whose date format is used
+ * @td: Jet date/time value
+ * @buf: destination buffer
+ * @len: size of @buf
+ *
+ * Formats a date with the format given to mdb_set_date_fmt() on @mdb.
+ *
+ * Returns: the length of the string written to @buf.
+ */
+size_t
+mdb_date_to_buf(MdbHandle *mdb, double td, char *buf, size_t len)
 {
-	unsigned int i;
-	double y = 10.0;
+	struct tm t;
+	unsigned char *op;
+	char *p = buf;
 
-	if (f < 0.0)
-		f = -f;
-	
-	if ((f == 0.0) || (f == 1.0)) {
-		return 0;
-	} else if (f < 1.0) {
-		if (is_single) {
-			/* The intermediate value p is necessary to prevent
-			 * promotion of the comparison to type double */
-			float p;
-			for (i=1; (p = f * y) < 1.0; i++)
-				y *= 10.0;
-		} else {
-			for (i=1; f * y < 1.0; i++)
-				y *= 10.0;
+	mdb_date_to_tm(td, &t);
+	if (!mdb->date_fast)
+		return strftime(buf, len, mdb->date_fmt, &t);
+
+	for (op = mdb->date_ops; *op; op++) {
+		/* room for the widest field and the terminator */
+		if (p - buf + 12 > len)
+			break;
+		switch (*op) {
+			case MDB_DF_CHAR: *p++ = *++op; break;
+			case MDB_DF_YEAR: p = mdb_put_num(p, t.tm_year + 1900, 1, '0'); break;
+			case MDB_DF_YEAR2: p = mdb_put_num(p, (t.tm_year + 1900) % 100, 2, '0'); break;
+			case MDB_DF_MONTH: p = mdb_put_num(p, t.tm_mon + 1, 2, '0'); break;
+			case MDB_DF_DAY: p = mdb_put_num(p, t.tm_mday, 2, '0'); break;
+			case MDB_DF_DAY_SP: p = mdb_put_num(p, t.tm_mday, 2, ' '); break;
+			case MDB_DF_YDAY: p = mdb_put_num(p, t.tm_yday + 1, 3, '0'); break;
+			case MDB_DF_HOUR: p = mdb_put_num(p, t.tm_hour, 2, '0'); break;
+			case MDB_DF_MIN: p = mdb_put_num(p, t.tm_min, 2, '0'); break;
+			case MDB_DF_SEC: p = mdb_put_num(p, t.tm_sec, 2, '0'); break;
 		}
-		return -(int)i;
-	} else {  /* (x > 1.0) */
-		for (i=0; f >= y; i++)
-			y *= 10.0;
-		return (int)i;
 	}
+	*p = '\0';
+	return p - buf;
+}
+static char *
+mdb_date_to_string(MdbHandle *mdb, int start)
+{
+	char *text = (char *) g_malloc(MDB_BIND_SIZE);
+
+	mdb_date_to_buf(mdb, mdb_get_double(mdb->pg_buf, start),
+		text, MDB_BIND_SIZE);
+	return text;
 }
 
 char *mdb_col_to_string(MdbHandle *mdb, void *buf, int start, int datatype, int size)
 {
 	char *text = NULL;
-	float tf;
-	double td;
 
 	switch (datatype) {
 		case MDB_BOOL:
@@ -836,16 +1057,12 @@ char *mdb_col_to_string(MdbHandle *mdb, void *buf, int start, int datatype, int
 				mdb_get_int32(buf, start));
 		break;
 		case MDB_FLOAT:
-			tf = mdb_get_single(buf, start);
-			text = g_strdup_printf("%.*f",
-				FLT_DIG - floor_log10(tf,1) - 1, tf);
-			trim_trailing_zeros(text);
+			text = (char *) g_malloc(MDB_DOUBLE_BUFSZ);
+			mdb_float_to_buf(mdb_get_single(buf, start), text);
 		break;
 		case MDB_DOUBLE:
-			td = mdb_get_double(buf, start);
-			text = g_strdup_printf("%.*f",
-				DBL_DIG - floor_log10(td,0) - 1, td);
-			trim_trailing_zeros(text);
+			text = (char *) g_malloc(MDB_DOUBLE_BUFSZ);
+			mdb_double_to_buf(mdb_get_double(buf, start), text);
 		break;
 		case MDB_TEXT:
 			if (size<0) {
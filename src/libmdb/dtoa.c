@@ -0,0 +1,346 @@
+/* MDB Tools - A library for reading MS Access database files
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "mdbtools.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+/*
+ * Shortest round-trip formatting of floating point values, using the
+ * Grisu2 algorithm of Florian Loitsch, "Printing Floating-Point Numbers
+ * Quickly and Accurately with Integers" (PLDI 2010).  The digits produced
+ * always read back as the same float or double, and are the shortest such
+ * string for nearly all values.
+ */
+
+typedef struct {
+	guint64 f;
+	int e;
+} MdbDiyFp;
+
+/* normalized 10^k for k = -348, -340, ..., 340 */
+static const guint64 cached_pow_f[] = {
+	G_GUINT64_CONSTANT(0xfa8fd5a0081c0288), G_GUINT64_CONSTANT(0xbaaee17fa23ebf76), G_GUINT64_CONSTANT(0x8b16fb203055ac76),
+	G_GUINT64_CONSTANT(0xcf42894a5dce35ea), G_GUINT64_CONSTANT(0x9a6bb0aa55653b2d), G_GUINT64_CONSTANT(0xe61acf033d1a45df),
+	G_GUINT64_CONSTANT(0xab70fe17c79ac6ca), G_GUINT64_CONSTANT(0xff77b1fcbebcdc4f), G_GUINT64_CONSTANT(0xbe5691ef416bd60c),
+	G_GUINT64_CONSTANT(0x8dd01fad907ffc3c), G_GUINT64_CONSTANT(0xd3515c2831559a83), G_GUINT64_CONSTANT(0x9d71ac8fada6c9b5),
+	G_GUINT64_CONSTANT(0xea9c227723ee8bcb), G_GUINT64_CONSTANT(0xaecc49914078536d), G_GUINT64_CONSTANT(0x823c12795db6ce57),
+	G_GUINT64_CONSTANT(0xc21094364dfb5637), G_GUINT64_CONSTANT(0x9096ea6f3848984f), G_GUINT64_CONSTANT(0xd77485cb25823ac7),
+	G_GUINT64_CONSTANT(0xa086cfcd97bf97f4), G_GUINT64_CONSTANT(0xef340a98172aace5), G_GUINT64_CONSTANT(0xb23867fb2a35b28e),
+	G_GUINT64_CONSTANT(0x84c8d4dfd2c63f3b), G_GUINT64_CONSTANT(0xc5dd44271ad3cdba), G_GUINT64_CONSTANT(0x936b9fcebb25c996),
+	G_GUINT64_CONSTANT(0xdbac6c247d62a584), G_GUINT64_CONSTANT(0xa3ab66580d5fdaf6), G_GUINT64_CONSTANT(0xf3e2f893dec3f126),
+	G_GUINT64_CONSTANT(0xb5b5ada8aaff80b8), G_GUINT64_CONSTANT(0x87625f056c7c4a8b), G_GUINT64_CONSTANT(0xc9bcff6034c13053),
+	G_GUINT64_CONSTANT(0x964e858c91ba2655), G_GUINT64_CONSTANT(0xdff9772470297ebd), G_GUINT64_CONSTANT(0xa6dfbd9fb8e5b88f),
+	G_GUINT64_CONSTANT(0xf8a95fcf88747d94), G_GUINT64_CONSTANT(0xb94470938fa89bcf), G_GUINT64_CONSTANT(0x8a08f0f8bf0f156b),
+	G_GUINT64_CONSTANT(0xcdb02555653131b6), G_GUINT64_CONSTANT(0x993fe2c6d07b7fac), G_GUINT64_CONSTANT(0xe45c10c42a2b3b06),
+	G_GUINT64_CONSTANT(0xaa242499697392d3), G_GUINT64_CONSTANT(0xfd87b5f28300ca0e), G_GUINT64_CONSTANT(0xbce5086492111aeb),
+	G_GUINT64_CONSTANT(0x8cbccc096f5088cc), G_GUINT64_CONSTANT(0xd1b71758e219652c), G_GUINT64_CONSTANT(0x9c40000000000000),
+	G_GUINT64_CONSTANT(0xe8d4a51000000000), G_GUINT64_CONSTANT(0xad78ebc5ac620000), G_GUINT64_CONSTANT(0x813f3978f8940984),
+	G_GUINT64_CONSTANT(0xc097ce7bc90715b3), G_GUINT64_CONSTANT(0x8f7e32ce7bea5c70), G_GUINT64_CONSTANT(0xd5d238a4abe98068),
+	G_GUINT64_CONSTANT(0x9f4f2726179a2245), G_GUINT64_CONSTANT(0xed63a231d4c4fb27), G_GUINT64_CONSTANT(0xb0de65388cc8ada8),
+	G_GUINT64_CONSTANT(0x83c7088e1aab65db), G_GUINT64_CONSTANT(0xc45d1df942711d9a), G_GUINT64_CONSTANT(0x924d692ca61be758),
+	G_GUINT64_CONSTANT(0xda01ee641a708dea), G_GUINT64_CONSTANT(0xa26da3999aef774a), G_GUINT64_CONSTANT(0xf209787bb47d6b85),
+	G_GUINT64_CONSTANT(0xb454e4a179dd1877), G_GUINT64_CONSTANT(0x865b86925b9bc5c2), G_GUINT64_CONSTANT(0xc83553c5c8965d3d),
+	G_GUINT64_CONSTANT(0x952ab45cfa97a0b3), G_GUINT64_CONSTANT(0xde469fbd99a05fe3), G_GUINT64_CONSTANT(0xa59bc234db398c25),
+	G_GUINT64_CONSTANT(0xf6c69a72a3989f5c), G_GUINT64_CONSTANT(0xb7dcbf5354e9bece), G_GUINT64_CONSTANT(0x88fcf317f22241e2),
+	G_GUINT64_CONSTANT(0xcc20ce9bd35c78a5), G_GUINT64_CONSTANT(0x98165af37b2153df), G_GUINT64_CONSTANT(0xe2a0b5dc971f303a),
+	G_GUINT64_CONSTANT(0xa8d9d1535ce3b396), G_GUINT64_CONSTANT(0xfb9b7cd9a4a7443c), G_GUINT64_CONSTANT(0xbb764c4ca7a44410),
+	G_GUINT64_CONSTANT(0x8bab8eefb6409c1a), G_GUINT64_CONSTANT(0xd01fef10a657842c), G_GUINT64_CONSTANT(0x9b10a4e5e9913129),
+	G_GUINT64_CONSTANT(0xe7109bfba19c0c9d), G_GUINT64_CONSTANT(0xac2820d9623bf429), G_GUINT64_CONSTANT(0x80444b5e7aa7cf85),
+	G_GUINT64_CONSTANT(0xbf21e44003acdd2d), G_GUINT64_CONSTANT(0x8e679c2f5e44ff8f), G_GUINT64_CONSTANT(0xd433179d9c8cb841),
+	G_GUINT64_CONSTANT(0x9e19db92b4e31ba9), G_GUINT64_CONSTANT(0xeb96bf6ebadf77d9), G_GUINT64_CONSTANT(0xaf87023b9bf0ee6b),
+};
+static const gint16 cached_pow_e[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+	-954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+	-688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+	-422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+	-157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+	109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+	641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+	907, 933, 960, 986, 1013, 1039, 1066,
+};
+static const guint64 mdb_pow10[] = {
+	G_GUINT64_CONSTANT(1), G_GUINT64_CONSTANT(10),
+	G_GUINT64_CONSTANT(100), G_GUINT64_CONSTANT(1000),
+	G_GUINT64_CONSTANT(10000), G_GUINT64_CONSTANT(100000),
+	G_GUINT64_CONSTANT(1000000), G_GUINT64_CONSTANT(10000000),
+	G_GUINT64_CONSTANT(100000000), G_GUINT64_CONSTANT(1000000000),
+	G_GUINT64_CONSTANT(10000000000), G_GUINT64_CONSTANT(100000000000),
+	G_GUINT64_CONSTANT(1000000000000), G_GUINT64_CONSTANT(10000000000000),
+	G_GUINT64_CONSTANT(100000000000000), G_GUINT64_CONSTANT(1000000000000000),
+	G_GUINT64_CONSTANT(10000000000000000), G_GUINT64_CONSTANT(100000000000000000),
+	G_GUINT64_CONSTANT(1000000000000000000), G_GUINT64_CONSTANT(10000000000000000000)
+};
+
+static MdbDiyFp
+diy_mul(MdbDiyFp x, MdbDiyFp y)
+{
+	const guint64 M32 = 0xffffffff;
+	guint64 a = x.f >> 32, b = x.f & M32, c = y.f >> 32, d = y.f & M32;
+	guint64 ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	guint64 tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+	MdbDiyFp r;
+
+	tmp += 1U << 31; /* round */
+	r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+	r.e = x.e + y.e + 64;
+	return r;
+}
+static MdbDiyFp
+diy_normalize(MdbDiyFp x)
+{
+	while (!(x.f & (G_GUINT64_CONSTANT(1) << 63))) {
+		x.f <<= 1;
+		x.e--;
+	}
+	return x;
+}
+static void
+grisu_round(char *buf, int len, guint64 delta, guint64 rest, guint64 ten_kappa, guint64 wp_w)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa
+	 && (rest + ten_kappa < wp_w
+	  || wp_w - rest > rest + ten_kappa - wp_w)) {
+		buf[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+static int
+count_digits(guint32 n)
+{
+	int i;
+
+	for (i=1; i<10; i++)
+		if (n < mdb_pow10[i])
+			return i;
+	return 10;
+}
+static void
+grisu_digits(MdbDiyFp w, MdbDiyFp mp, guint64 delta, char *buf, int *len, int *K)
+{
+	MdbDiyFp one;
+	guint64 wp_w = mp.f - w.f;
+	guint64 p2, tmp;
+	guint32 p1, d;
+	int kappa;
+
+	one.f = G_GUINT64_CONSTANT(1) << -mp.e;
+	one.e = mp.e;
+	p1 = (guint32)(mp.f >> -one.e);
+	p2 = mp.f & (one.f - 1);
+	kappa = count_digits(p1);
+	*len = 0;
+
+	/* integer part */
+	while (kappa > 0) {
+		d = p1 / mdb_pow10[kappa - 1];
+		p1 %= mdb_pow10[kappa - 1];
+		if (d || *len)
+			buf[(*len)++] = '0' + d;
+		kappa--;
+		tmp = ((guint64)p1 << -one.e) + p2;
+		if (tmp <= delta) {
+			*K += kappa;
+			grisu_round(buf, *len, delta, tmp,
+				mdb_pow10[kappa] << -one.e, wp_w);
+			return;
+		}
+	}
+	/* fractional part */
+	for (;;) {
+		p2 *= 10;
+		delta *= 10;
+		d = (guint32)(p2 >> -one.e);
+		if (d || *len)
+			buf[(*len)++] = '0' + d;
+		p2 &= one.f - 1;
+		kappa--;
+		if (p2 < delta) {
+			*K += kappa;
+			grisu_round(buf, *len, delta, p2, one.f,
+				(-kappa < 20) ? wp_w * mdb_pow10[-kappa] : 0);
+			return;
+		}
+	}
+}
+/*
+ * f * 2^e is the value, with hidden the implicit leading bit of the
+ * source format so the distance to the lower neighbour is known.
+ */
+static void
+grisu2(guint64 f, int e, guint64 hidden, char *buf, int *len, int *K)
+{
+	MdbDiyFp v, pl, mi, c, w, wp, wm;
+	double dk;
+	int k, idx;
+
+	v.f = f;
+	v.e = e;
+	/* boundaries halfway to the neighbouring values */
+	pl.f = (f << 1) + 1;
+	pl.e = e - 1;
+	pl = diy_normalize(pl);
+	if (f == hidden) {
+		mi.f = (f << 2) - 1;
+		mi.e = e - 2;
+	} else {
+		mi.f = (f << 1) - 1;
+		mi.e = e - 1;
+	}
+	mi.f <<= mi.e - pl.e;
+	mi.e = pl.e;
+
+	/* pick a cached power of ten bringing the exponent into range */
+	dk = (-61 - pl.e) * 0.30102999566398114 + 347;
+	k = (int)dk;
+	if (dk - k > 0.0)
+		k++;
+	idx = (k >> 3) + 1;
+	*K = -(-348 + idx * 8);
+	c.f = cached_pow_f[idx];
+	c.e = cached_pow_e[idx];
+
+	w = diy_mul(diy_normalize(v), c);
+	wp = diy_mul(pl, c);
+	wm = diy_mul(mi, c);
+	wm.f++;
+	wp.f--;
+	grisu_digits(w, wp, wp.f - wm.f, buf, len, K);
+}
+/*
+ * write digits * 10^K in plain positional notation, as the previous
+ * printf based code did
+ */
+static int
+mdb_format_digits(char *digits, int len, int K, int neg, char *buf)
+{
+	int pt, i, j = 0;
+
+	/* drop trailing zeros */
+	while (len > 1 && digits[len - 1] == '0') {
+		len--;
+		K++;
+	}
+	if (neg)
+		buf[j++] = '-';
+	pt = len + K;
+	if (pt <= 0) {
+		buf[j++] = '0';
+		buf[j++] = '.';
+		for (i=pt; i<0; i++)
+			buf[j++] = '0';
+		memcpy(buf + j, digits, len);
+		j += len;
+	} else if (pt >= len) {
+		memcpy(buf + j, digits, len);
+		j += len;
+		for (i=len; i<pt; i++)
+			buf[j++] = '0';
+	} else {
+		memcpy(buf + j, digits, pt);
+		j += pt;
+		buf[j++] = '.';
+		memcpy(buf + j, digits + pt, len - pt);
+		j += len - pt;
+	}
+	buf[j] = '\0';
+
+	return j;
+}
+static int
+mdb_special_to_buf(guint64 f, int neg, int is_nan, char *buf)
+{
+	if (is_nan)
+		strcpy(buf, "nan");
+	else if (f)
+		strcpy(buf, neg ? "-inf" : "inf");
+	else
+		strcpy(buf, neg ? "-0" : "0");
+	return strlen(buf);
+}
+/**
+ * mdb_double_to_buf
+ * @d: value to format
+ * @buf: buffer of at least MDB_DOUBLE_BUFSZ bytes
+ *
+ * Returns: the length of the string written to @buf.
+ */
+int
+mdb_double_to_buf(double d, char *buf)
+{
+	guint64 bits, f;
+	int be, neg, len, K;
+	char digits[20];
+
+	memcpy(&bits, &d, sizeof(bits));
+	neg = (bits >> 63) != 0;
+	be = (int)((bits >> 52) & 0x7ff);
+	f = bits & ((G_GUINT64_CONSTANT(1) << 52) - 1);
+
+	if (be == 0x7ff)
+		return mdb_special_to_buf(1, neg, f != 0, buf);
+	if (be == 0 && f == 0)
+		return mdb_special_to_buf(0, neg, 0, buf);
+
+	if (be)
+		grisu2(f + (G_GUINT64_CONSTANT(1) << 52), be - 1075,
+			G_GUINT64_CONSTANT(1) << 52, digits, &len, &K);
+	else
+		grisu2(f, -1074, G_GUINT64_CONSTANT(1) << 52, digits, &len, &K);
+
+	return mdb_format_digits(digits, len, K, neg, buf);
+}
+/**
+ * mdb_float_to_buf
+ * @fl: value to format
+ * @buf: buffer of at least MDB_DOUBLE_BUFSZ bytes
+ *
+ * Like mdb_double_to_buf(), but the digits only need to read back as
+ * the same single precision value.
+ *
+ * Returns: the length of the string written to @buf.
+ */
+int
+mdb_float_to_buf(float fl, char *buf)
+{
+	guint32 bits, f;
+	int be, neg, len, K;
+	char digits[20];
+
+	memcpy(&bits, &fl, sizeof(bits));
+	neg = (bits >> 31) != 0;
+	be = (int)((bits >> 23) & 0xff);
+	f = bits & ((1 << 23) - 1);
+
+	if (be == 0xff)
+		return mdb_special_to_buf(1, neg, f != 0, buf);
+	if (be == 0 && f == 0)
+		return mdb_special_to_buf(0, neg, 0, buf);
+
+	if (be)
+		grisu2(f + (1 << 23), be - 150, 1 << 23, digits, &len, &K);
+	else
+		grisu2(f, -149, 1 << 23, digits, &len, &K);
+
+	return mdb_format_digits(digits, len, K, neg, buf);
+}
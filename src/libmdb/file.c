@@ -17,6 +17,10 @@
  * Boston, MA 02111-1307, USA.
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include "mdbtools.h"
 
 #ifdef DMALLOC
@@ -97,7 +101,8 @@ static char *mdb_find_file(const char *file_name)
 /**
  * mdb_open:
  * @filename: path to MDB (database) file
- * @flags: MDB_NOFLAGS for read-only, MDB_WRITABLE for read/write
+ * @flags: MDB_NOFLAGS for read-only, MDB_WRITABLE for read/write, with
+ * MDB_JOURNAL to make each mdb_flush() crash safe through a journal file
  *
  * Opens an MDB file and returns an MdbHandle to it.  MDB File may be relative
  * to the current directory, a full path to the file, or relative to a 
@@ -112,6 +117,7 @@ MdbHandle *mdb_open(const char *filename, MdbFileFlags flags)
 
 	mdb = (MdbHandle *) g_malloc0(sizeof(MdbHandle));
 	mdb_set_default_backend(mdb, "access");
+	mdb_set_date_fmt(mdb, "%x %X");
 #ifdef HAVE_ICONV
 	mdb->iconv_in = (iconv_t)-1;
 	mdb->iconv_out = (iconv_t)-1;
@@ -121,6 +127,7 @@ MdbHandle *mdb_open(const char *filename, MdbFileFlags flags)
 	mdb->f = (MdbFile *) g_malloc0(sizeof(MdbFile));
 	mdb->f->refs = 1;
 	mdb->f->fd = -1;
+	mdb->f->journal_fd = -1;
 	mdb->f->filename = mdb_find_file(filename);
 	if (!mdb->f->filename) { 
 		fprintf(stderr, "Can't alloc filename\n");
@@ -145,6 +152,11 @@ MdbHandle *mdb_open(const char *filename, MdbFileFlags flags)
 		mdb_close(mdb);
 		return NULL;
 	}
+	/* before anything is read, a crash may have left pages to recover */
+	if (!mdb_journal_open(mdb, flags & MDB_JOURNAL)) {
+		mdb_close(mdb);
+		return NULL;
+	}
 	if (!mdb_read_pg(mdb, 0)) {
 		fprintf(stderr,"Couldn't read first page.\n");
 		mdb_close(mdb);
@@ -180,6 +192,9 @@ void
 mdb_close(MdbHandle *mdb)
 {
 	if (!mdb) return;	
+	mdb_flush(mdb);
+	mdb_free_tdefs(mdb);
+	mdb_free_space_dirs(mdb);
 	mdb_free_catalog(mdb);
 	g_free(mdb->stats);
 	g_free(mdb->backend_name);
@@ -188,8 +203,12 @@ mdb_close(MdbHandle *mdb)
 		if (mdb->f->refs > 1) {
 			mdb->f->refs--;
 		} else {
+			mdb_journal_close(mdb->f);
 			if (mdb->f->fd != -1) close(mdb->f->fd);
 			g_free(mdb->f->filename);
+			g_free(mdb->f->free_map);
+			if (mdb->f->dirty_pgs)
+				g_hash_table_destroy(mdb->f->dirty_pgs);
 			g_free(mdb->f);
 		}
 	}
@@ -210,17 +229,17 @@ mdb_close(MdbHandle *mdb)
 MdbHandle *mdb_clone_handle(MdbHandle *mdb)
 {
 	MdbHandle *newmdb;
-	MdbCatalogEntry *entry, *data;
-	unsigned int i;
 
 	newmdb = (MdbHandle *) g_memdup(mdb, sizeof(MdbHandle));
 	newmdb->stats = NULL;
+	/* clones read pages for their owner; they read a catalog if asked */
 	newmdb->catalog = g_ptr_array_new();
-	for (i=0;i<mdb->num_catalog;i++) {
-		entry = g_ptr_array_index(mdb->catalog,i);
-		data = g_memdup(entry,sizeof(MdbCatalogEntry));
-		g_ptr_array_add(newmdb->catalog, data);
-	}
+	newmdb->num_catalog = 0;
+	newmdb->catalog_cache = NULL;
+	newmdb->catalog_names = NULL;
+	newmdb->catalog_stale = 0;
+	newmdb->tdefs = NULL;
+	newmdb->space_dirs = NULL;
 	mdb->backend_name = NULL;
 	if (mdb->f) {
 		mdb->f->refs++;
@@ -253,12 +272,30 @@ ssize_t mdb_read_alt_pg(MdbHandle *mdb, unsigned long pg)
 	len = _mdb_read_pg(mdb, mdb->alt_pg_buf, pg);
 	return len;
 }
+/*
+** mdb_prefetch_pg hints the kernel that a page will be read soon, used to
+** overlap the I/O on LVAL chains with processing of the current page
+*/
+void mdb_prefetch_pg(MdbHandle *mdb, unsigned long pg)
+{
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(mdb->f->fd, (off_t) pg * mdb->fmt->pg_size,
+		mdb->fmt->pg_size, POSIX_FADV_WILLNEED);
+#endif
+}
 static ssize_t _mdb_read_pg(MdbHandle *mdb, void *pg_buf, unsigned long pg)
 {
 	ssize_t len;
 	struct stat status;
 	off_t offset = pg * mdb->fmt->pg_size;
+	void *dirty;
 
+	/* written but not flushed yet */
+	if (mdb->f->dirty_pgs && (dirty = g_hash_table_lookup(mdb->f->dirty_pgs,
+			GUINT_TO_POINTER(pg)))) {
+		memcpy(pg_buf, dirty, mdb->fmt->pg_size);
+		return mdb->fmt->pg_size;
+	}
         fstat(mdb->f->fd, &status);
         if (status.st_size < offset) { 
                 fprintf(stderr,"offset %lu is beyond EOF\n",offset);
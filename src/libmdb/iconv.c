@@ -20,10 +20,123 @@
 #include "mdbtools.h"
 #include "errno.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef DMALLOC
 #include "dmalloc.h"
 #endif
 
+/*
+ * Converts UCS-2LE text, or Jet4 'Unicode Compressed' text with the
+ * 0xff 0xfe marker already removed, straight to UTF-8.  Stops before a
+ * character which would not fit in dlen bytes.  If used is not NULL it
+ * receives the number of source bytes consumed.
+ *
+ * Returns: number of bytes written to dest, which is not NUL terminated.
+ */
+size_t
+mdb_ucs2_to_utf8(const unsigned char *src, size_t slen, int compressed,
+	char *dest, size_t dlen, size_t *used)
+{
+	const unsigned char *s = src, *end = src + slen;
+	unsigned char *d = (unsigned char *) dest, *dend = d + dlen;
+	int compress = compressed;
+	unsigned int c, c2, n;
+
+	while (s < end) {
+		if (compress) {
+#ifdef __SSE2__
+			/* copy runs of ASCII, 16 characters at a time */
+			while (end - s >= 16 && dend - d >= 16) {
+				__m128i v = _mm_loadu_si128((const __m128i *)s);
+				__m128i z = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+				if (_mm_movemask_epi8(v) | _mm_movemask_epi8(z))
+					break;
+				_mm_storeu_si128((__m128i *)d, v);
+				s += 16;
+				d += 16;
+			}
+			if (s == end) break;
+#endif
+			c = *s;
+			if (c == 0) {
+				compress = 0;
+				s++;
+				continue;
+			}
+			if (c < 0x80) {
+				if (d == dend) break;
+				*d++ = c;
+			} else {
+				if (dend - d < 2) break;
+				*d++ = 0xc0 | (c >> 6);
+				*d++ = 0x80 | (c & 0x3f);
+			}
+			s++;
+			continue;
+		}
+		if (compressed && *s == 0) {
+			compress = 1;
+			s++;
+			continue;
+		}
+#ifdef __SSE2__
+		/* 8 ASCII characters at a time */
+		while (end - s >= 16 && dend - d >= 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *)s);
+			__m128i z = _mm_setzero_si128();
+			__m128i hi = _mm_and_si128(v, _mm_set1_epi16((short)0xff80));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(hi, z)) != 0xffff
+			 || _mm_movemask_epi8(_mm_cmpeq_epi16(v, z)))
+				break;
+			_mm_storel_epi64((__m128i *)d, _mm_packus_epi16(v, v));
+			s += 16;
+			d += 8;
+		}
+		if (s == end) break;
+#endif
+		if (end - s < 2) break;
+		c = s[0] | (s[1] << 8);
+		n = 2;
+		if (c >= 0xd800 && c < 0xdc00 && end - s >= 4) {
+			/* surrogate pair */
+			c2 = s[2] | (s[3] << 8);
+			if (c2 >= 0xdc00 && c2 < 0xe000) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+				n = 4;
+			}
+		}
+		if (c < 0x80) {
+			if (d == dend) break;
+			*d++ = c;
+		} else if (c < 0x800) {
+			if (dend - d < 2) break;
+			*d++ = 0xc0 | (c >> 6);
+			*d++ = 0x80 | (c & 0x3f);
+		} else if (c >= 0xd800 && c < 0xe000) {
+			/* unpaired surrogate */
+			if (d == dend) break;
+			*d++ = '?';
+		} else if (c < 0x10000) {
+			if (dend - d < 3) break;
+			*d++ = 0xe0 | (c >> 12);
+			*d++ = 0x80 | ((c >> 6) & 0x3f);
+			*d++ = 0x80 | (c & 0x3f);
+		} else {
+			if (dend - d < 4) break;
+			*d++ = 0xf0 | (c >> 18);
+			*d++ = 0x80 | ((c >> 12) & 0x3f);
+			*d++ = 0x80 | ((c >> 6) & 0x3f);
+			*d++ = 0x80 | (c & 0x3f);
+		}
+		s += n;
+	}
+	if (used) *used = s - src;
+	return (char *) d - dest;
+}
+
 /*
  * This function is used in reading text data from an MDB table.
  */
@@ -38,6 +151,21 @@ mdb_unicode2ascii(MdbHandle *mdb, char *src, size_t slen, char *dest, size_t dle
 	if ((!src) || (!dest) || (!dlen))
 		return 0;
 
+	if (mdb->utf8_in) {
+		int compressed = 0;
+
+		if ((slen>=2)
+		 && ((src[0]&0xff)==0xff) && ((src[1]&0xff)==0xfe)) {
+			compressed = 1;
+			src += 2;
+			slen -= 2;
+		}
+		dlen = mdb_ucs2_to_utf8((unsigned char *)src, slen, compressed,
+			dest, dlen - 1, NULL);
+		dest[dlen]='\0';
+		return dlen;
+	}
+
 	/* Uncompress 'Unicode Compressed' string into tmp */
 	if (IS_JET4(mdb) && (slen>=2)
 	 && ((src[0]&0xff)==0xff) && ((src[1]&0xff)==0xfe)) {
@@ -186,6 +314,9 @@ void mdb_iconv_init(MdbHandle *mdb)
 	if (!(iconv_code=getenv("MDBICONV"))) {
 		iconv_code="UTF-8";
 	}
+	/* the common case doesn't need iconv at all */
+	mdb->utf8_in = IS_JET4(mdb) && (!strcasecmp(iconv_code, "UTF-8")
+		|| !strcasecmp(iconv_code, "UTF8"));
 
 #ifdef HAVE_ICONV
         if (IS_JET4(mdb)) {
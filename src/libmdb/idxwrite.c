@@ -0,0 +1,546 @@
+/* MDB Tools - A library for reading MS Access database files
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "mdbtools.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+/*
+ * Adding and removing single index entries.  Only Jet3 indexes on fixed
+ * size columns can be written.  Pages are decoded into a list of entries,
+ * changed and encoded again; the leaf is found by walking down from the
+ * root, each node entry holding the last key of its child.  A page that
+ * overflows is split in two and the parent gets an entry for the new half,
+ * splitting in turn if needed; the root keeps its page and moves its
+ * entries down instead.
+ */
+
+/* Jet3 index page layout */
+#define MDB_IDX_PREFIX_OFFSET 0x14
+#define MDB_IDX_BITMAP_START 0x16
+#define MDB_IDX_ENTRY_START 0xf8
+
+typedef struct {
+	unsigned char key[MDB_MAX_KEY_LEN];
+	int key_len;
+	guint32 pg_row;
+	guint32 child;		/* node entries only */
+} MdbIdxEntry;
+
+/* pages from the root down to a leaf, and the node entry followed on each */
+typedef struct {
+	guint32 pgs[MDB_MAX_INDEX_DEPTH];
+	unsigned int pos[MDB_MAX_INDEX_DEPTH];
+	int depth;
+} MdbIdxPath;
+
+/* bytes of a key column's value in an index entry, 0 if it can't be written */
+static int
+mdb_idx_col_size(MdbColumn *col)
+{
+	switch (col->col_type) {
+		case MDB_BYTE:
+			return 1;
+		case MDB_INT:
+			return 2;
+		case MDB_LONGINT:
+		case MDB_FLOAT:
+			return 4;
+		case MDB_MONEY:
+		case MDB_DOUBLE:
+		case MDB_SDATETIME:
+			return 8;
+	}
+	return 0;
+}
+/**
+ * mdb_index_writable:
+ * @table: table the index belongs to
+ * @idx: index
+ *
+ * Returns: 1 if entries can be added to and removed from @idx.
+ */
+int
+mdb_index_writable(MdbTableDef *table, MdbIndex *idx)
+{
+	unsigned int i;
+	int key_len = 0, sz;
+
+	if (IS_JET4(table->entry->mdb) || !idx->first_pg || !idx->num_keys)
+		return 0;
+	for (i=0;i<idx->num_keys;i++) {
+		sz = mdb_idx_col_size(g_ptr_array_index(table->columns,
+			idx->key_col_num[i] - 1));
+		if (!sz)
+			return 0;
+		key_len += 1 + sz;
+	}
+	return key_len <= MDB_MAX_KEY_LEN;
+}
+/**
+ * mdb_index_make_key:
+ * @table: table the index belongs to
+ * @idx: index, see mdb_index_writable()
+ * @num_fields: number of fields
+ * @fields: the row
+ * @key: buffer for the key
+ *
+ * Encodes the key columns of a row the way they sort in @idx: for each
+ * column a flag byte and the value, big endian, with the sign bit flipped
+ * (all bits of negative floating point values, none of unsigned bytes).
+ * Descending columns are inverted.  A null column is its flag and zeros.
+ *
+ * Returns: the length of the key.
+ */
+int
+mdb_index_make_key(MdbTableDef *table, MdbIndex *idx, unsigned int num_fields, MdbField *fields, unsigned char *key)
+{
+	MdbColumn *col;
+	MdbField *field;
+	unsigned int i, j;
+	int pos = 0, sz, k, desc;
+
+	for (i=0;i<idx->num_keys;i++) {
+		col = g_ptr_array_index(table->columns, idx->key_col_num[i] - 1);
+		sz = mdb_idx_col_size(col);
+		desc = idx->key_col_order[i] == MDB_DESC;
+		field = NULL;
+		for (j=0;j<num_fields;j++) {
+			if (fields[j].colnum == idx->key_col_num[i] - 1) {
+				field = &fields[j];
+				break;
+			}
+		}
+		memset(key + pos + 1, 0, sz);
+		if (!field || field->is_null || !field->value || field->siz < sz) {
+			key[pos] = desc ? 0xff : 0x00;
+			pos += 1 + sz;
+			continue;
+		}
+		key[pos] = desc ? 0x80 : 0x7f;
+		mdb_index_swap_n(field->value, sz, key + pos + 1);
+		if ((col->col_type == MDB_FLOAT || col->col_type == MDB_DOUBLE
+		  || col->col_type == MDB_SDATETIME) && (key[pos + 1] & 0x80)) {
+			for (k=1;k<=sz;k++)
+				key[pos + k] ^= 0xff;
+		} else if (col->col_type != MDB_BYTE) {
+			key[pos + 1] ^= 0x80;
+		}
+		if (desc) {
+			for (k=1;k<=sz;k++)
+				key[pos + k] ^= 0xff;
+		}
+		pos += 1 + sz;
+	}
+	return pos;
+}
+static gint
+mdb_idx_entry_cmp(const MdbIdxEntry *a, const MdbIdxEntry *b)
+{
+	int ret;
+
+	ret = memcmp(a->key, b->key, MIN(a->key_len, b->key_len));
+	if (ret)
+		return ret;
+	if (a->key_len != b->key_len)
+		return a->key_len < b->key_len ? -1 : 1;
+	if (a->pg_row == b->pg_row)
+		return 0;
+	return a->pg_row < b->pg_row ? -1 : 1;
+}
+/*
+ * Decode the entries of the leaf or node page in mdb->pg_buf.  Entries
+ * after the first leave out the prefix all keys on the page share.
+ */
+static int
+mdb_idx_read_entries(MdbHandle *mdb, GArray *entries)
+{
+	unsigned char *buf = mdb->pg_buf;
+	int tail = buf[0] == MDB_PAGE_INDEX ? 8 : 4;
+	int prefix_len = mdb_get_int16(buf, MDB_IDX_PREFIX_OFFSET);
+	unsigned char first[MDB_MAX_KEY_LEN + 8];
+	unsigned char full[MDB_MAX_KEY_LEN + 8];
+	int start = MDB_IDX_ENTRY_START, pos, bit, len, full_len;
+	MdbIdxEntry e;
+
+	g_array_set_size(entries, 0);
+	for (pos=start+1;pos<=mdb->fmt->pg_size;pos++) {
+		bit = pos - MDB_IDX_ENTRY_START;
+		if (MDB_IDX_BITMAP_START + bit/8 >= MDB_IDX_ENTRY_START)
+			break;
+		if (!(buf[MDB_IDX_BITMAP_START + bit/8] & (1 << (bit%8))))
+			continue;
+		len = pos - start;
+		if (!entries->len) {
+			full_len = len;
+			if (full_len > (int) sizeof(first))
+				return 0;
+			memcpy(first, buf + start, len);
+			memcpy(full, buf + start, len);
+		} else {
+			full_len = prefix_len + len;
+			if (full_len > (int) sizeof(full))
+				return 0;
+			memcpy(full, first, prefix_len);
+			memcpy(full + prefix_len, buf + start, len);
+		}
+		if (full_len < tail)
+			return 0;
+		memset(&e, 0, sizeof(e));
+		e.key_len = full_len - tail;
+		memcpy(e.key, full, e.key_len);
+		e.pg_row = mdb_get_int32_msb(full, e.key_len);
+		if (tail == 8)
+			e.child = mdb_get_int32_msb(full, e.key_len + 4) & 0xffffff;
+		g_array_append_val(entries, e);
+		start = pos;
+	}
+	return 1;
+}
+/*
+ * Encode entries into the page in mdb->pg_buf, keeping its header.  The
+ * entries after the first leave out the prefix all keys share.  Returns 0,
+ * leaving the page as it was, if they don't fit.
+ */
+static int
+mdb_idx_store_entries(MdbHandle *mdb, GArray *entries)
+{
+	unsigned char *buf = mdb->pg_buf;
+	int tail = buf[0] == MDB_PAGE_INDEX ? 8 : 4;
+	int pos = MDB_IDX_ENTRY_START, bit, prefix_len = 0, skip, n;
+	MdbIdxEntry *first, *e;
+	unsigned int i;
+
+	if (entries->len > 1) {
+		first = &g_array_index(entries, MdbIdxEntry, 0);
+		prefix_len = first->key_len;
+		for (i=1;i<entries->len && prefix_len;i++) {
+			e = &g_array_index(entries, MdbIdxEntry, i);
+			for (n=0;n<prefix_len && n<e->key_len
+				&& e->key[n] == first->key[n];n++);
+			prefix_len = n;
+		}
+	}
+	for (i=0;i<entries->len;i++)
+		pos += g_array_index(entries, MdbIdxEntry, i).key_len + tail
+			- (i ? prefix_len : 0);
+	if (pos > mdb->fmt->pg_size)
+		return 0;
+
+	memset(buf + MDB_IDX_PREFIX_OFFSET, 0,
+		mdb->fmt->pg_size - MDB_IDX_PREFIX_OFFSET);
+	_mdb_put_int16(buf, MDB_IDX_PREFIX_OFFSET, prefix_len);
+	pos = MDB_IDX_ENTRY_START;
+	for (i=0;i<entries->len;i++) {
+		e = &g_array_index(entries, MdbIdxEntry, i);
+		skip = i ? prefix_len : 0;
+		memcpy(buf + pos, e->key + skip, e->key_len - skip);
+		pos += e->key_len - skip;
+		_mdb_put_int32_msb(buf, pos, e->pg_row);
+		if (tail == 8)
+			_mdb_put_int32_msb(buf, pos + 4, e->child);
+		pos += tail;
+		/* the bitmap marks where each entry ends */
+		bit = pos - MDB_IDX_ENTRY_START;
+		buf[MDB_IDX_BITMAP_START + bit/8] |= 1 << (bit%8);
+	}
+	_mdb_put_int16(buf, 2, mdb->fmt->pg_size - pos);
+	return 1;
+}
+/*
+ * Walk down from the root to the leaf that target belongs on, following
+ * the first node entry not below it (or the last one), and note the way
+ * in path.  The leaf is left in mdb->pg_buf.
+ */
+static guint32
+mdb_idx_find_leaf(MdbHandle *mdb, MdbIndex *idx, MdbIdxEntry *target, MdbIdxPath *path)
+{
+	GArray *entries = g_array_new(FALSE, FALSE, sizeof(MdbIdxEntry));
+	guint32 pg = idx->first_pg;
+	unsigned int i;
+	int depth;
+
+	for (depth=0;depth<MDB_MAX_INDEX_DEPTH;depth++) {
+		if (!mdb_read_pg(mdb, pg))
+			break;
+		path->pgs[depth] = pg;
+		path->depth = depth + 1;
+		if (mdb->pg_buf[0] == MDB_PAGE_LEAF) {
+			g_array_free(entries, TRUE);
+			return pg;
+		}
+		if (mdb->pg_buf[0] != MDB_PAGE_INDEX
+		 || !mdb_idx_read_entries(mdb, entries) || !entries->len)
+			break;
+		for (i=0;i+1<entries->len;i++) {
+			if (mdb_idx_entry_cmp(&g_array_index(entries, MdbIdxEntry, i),
+					target) >= 0)
+				break;
+		}
+		path->pos[depth] = i;
+		pg = g_array_index(entries, MdbIdxEntry, i).child;
+	}
+	g_array_free(entries, TRUE);
+	return 0;
+}
+static void
+mdb_idx_write_pg(MdbHandle *mdb, guint32 pg)
+{
+	if (!mdb_write_pg(mdb, pg)) {
+		fprintf(stderr, "write failed! exiting...\n");
+		exit(1);
+	}
+	mdb->cur_pg = pg;
+}
+static void
+mdb_idx_set_target(MdbIdxEntry *target, unsigned char *key, int key_len, guint32 pg_row)
+{
+	memset(target, 0, sizeof(MdbIdxEntry));
+	memcpy(target->key, key, key_len);
+	target->key_len = key_len;
+	target->pg_row = pg_row;
+}
+/* the parent's entry for a page ends with the page's last entry */
+static void
+mdb_idx_set_node(MdbIdxEntry *node, GArray *entries, guint32 child)
+{
+	MdbIdxEntry *last = &g_array_index(entries, MdbIdxEntry, entries->len - 1);
+
+	memcpy(node, last, sizeof(MdbIdxEntry));
+	node->child = child;
+}
+/* start a page in mdb->pg_buf with the header of another of its level */
+static void
+mdb_idx_new_pg(MdbHandle *mdb, unsigned char *hdr, guint32 prev, guint32 next)
+{
+	memset(mdb->pg_buf, 0, mdb->fmt->pg_size);
+	memcpy(mdb->pg_buf, hdr, MDB_IDX_PREFIX_OFFSET);
+	_mdb_put_int32(mdb->pg_buf, 0x08, prev);
+	_mdb_put_int32(mdb->pg_buf, 0x0c, next);
+}
+static int mdb_idx_put_level(MdbTableDef *table, MdbIdxPath *path, int level, GArray *entries, int append);
+/*
+ * Split the page at level of path, which can't hold entries.  The first
+ * part goes to a new page in front of it; when appending to the end of the
+ * index, that is all but the new entry, so pages filled in key order stay
+ * full.  The root moves both parts to new pages and points to them.
+ */
+static int
+mdb_idx_split(MdbTableDef *table, MdbIdxPath *path, int level, GArray *entries, int append)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	unsigned char hdr[MDB_IDX_PREFIX_OFFSET];
+	guint32 pg = path->pgs[level], left_pg, right_pg, prev = 0, next = 0;
+	GArray *left, *right, *parent;
+	MdbIdxEntry node;
+	unsigned int n;
+	int ret = 0;
+
+	if (entries->len < 2)
+		return 0;
+	if (!level) {
+		if (path->depth >= MDB_MAX_INDEX_DEPTH
+		 || !(left_pg = mdb_alloc_pages(mdb, 2)))
+			return 0;
+		right_pg = left_pg + 1;
+	} else {
+		if (!(left_pg = mdb_alloc_pages(mdb, 1)))
+			return 0;
+		right_pg = pg;
+	}
+	mdb_read_pg(mdb, pg);
+	memcpy(hdr, mdb->pg_buf, MDB_IDX_PREFIX_OFFSET);
+	if (level) {
+		prev = mdb_get_int32(hdr, 0x08);
+		next = mdb_get_int32(hdr, 0x0c);
+	}
+
+	n = append ? entries->len - 1 : entries->len / 2;
+	left = g_array_new(FALSE, FALSE, sizeof(MdbIdxEntry));
+	right = g_array_new(FALSE, FALSE, sizeof(MdbIdxEntry));
+	g_array_append_vals(left, entries->data, n);
+	g_array_append_vals(right, &g_array_index(entries, MdbIdxEntry, n),
+		entries->len - n);
+
+	mdb_idx_new_pg(mdb, hdr, prev, right_pg);
+	mdb_idx_store_entries(mdb, left);
+	mdb_idx_write_pg(mdb, left_pg);
+	mdb_idx_new_pg(mdb, hdr, left_pg, next);
+	mdb_idx_store_entries(mdb, right);
+	mdb_idx_write_pg(mdb, right_pg);
+	if (prev && mdb_read_pg(mdb, prev)) {
+		_mdb_put_int32(mdb->pg_buf, 0x0c, left_pg);
+		mdb_idx_write_pg(mdb, prev);
+	}
+
+	parent = g_array_new(FALSE, FALSE, sizeof(MdbIdxEntry));
+	if (!level) {
+		hdr[0] = MDB_PAGE_INDEX;
+		mdb_idx_new_pg(mdb, hdr, 0, 0);
+		mdb_idx_set_node(&node, left, left_pg);
+		g_array_append_val(parent, node);
+		mdb_idx_set_node(&node, right, right_pg);
+		g_array_append_val(parent, node);
+		ret = mdb_idx_store_entries(mdb, parent);
+		mdb_idx_write_pg(mdb, pg);
+	} else if (mdb_read_pg(mdb, path->pgs[level-1])
+	 && mdb_idx_read_entries(mdb, parent)
+	 && path->pos[level-1] < parent->len) {
+		mdb_idx_set_node(&g_array_index(parent, MdbIdxEntry,
+			path->pos[level-1]), right, right_pg);
+		mdb_idx_set_node(&node, left, left_pg);
+		g_array_insert_val(parent, path->pos[level-1], node);
+		ret = mdb_idx_put_level(table, path, level-1, parent, append);
+	}
+	g_array_free(parent, TRUE);
+	g_array_free(left, TRUE);
+	g_array_free(right, TRUE);
+	return ret;
+}
+/*
+ * Write entries to the page at level of path, splitting it if they don't
+ * fit, and raise its parent's entry if the last one went past it.
+ */
+static int
+mdb_idx_put_level(MdbTableDef *table, MdbIdxPath *path, int level, GArray *entries, int append)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	guint32 pg = path->pgs[level];
+	GArray *parent;
+	MdbIdxEntry node, *up;
+	int ret = 1;
+
+	mdb_read_pg(mdb, pg);
+	if (!mdb_idx_store_entries(mdb, entries))
+		return mdb_idx_split(table, path, level, entries, append);
+	mdb_idx_write_pg(mdb, pg);
+	if (!level || !entries->len)
+		return 1;
+
+	mdb_idx_set_node(&node, entries, pg);
+	parent = g_array_new(FALSE, FALSE, sizeof(MdbIdxEntry));
+	if (!mdb_read_pg(mdb, path->pgs[level-1])
+	 || !mdb_idx_read_entries(mdb, parent)
+	 || path->pos[level-1] >= parent->len) {
+		ret = 0;
+	} else {
+		up = &g_array_index(parent, MdbIdxEntry, path->pos[level-1]);
+		if (mdb_idx_entry_cmp(up, &node) < 0) {
+			memcpy(up, &node, sizeof(MdbIdxEntry));
+			ret = mdb_idx_put_level(table, path, level-1, parent, append);
+		}
+	}
+	g_array_free(parent, TRUE);
+	return ret;
+}
+/**
+ * mdb_index_del_entry:
+ * @table: table the index belongs to
+ * @idx: index, see mdb_index_writable()
+ * @key: key made by mdb_index_make_key()
+ * @key_len: length of @key
+ * @pg_row: page and row of the entry
+ *
+ * Removes an entry from the leaf it is on.  Uses mdb->pg_buf.
+ *
+ * Returns: 1 on success, 0 if the entry was not found.
+ */
+int
+mdb_index_del_entry(MdbTableDef *table, MdbIndex *idx, unsigned char *key, int key_len, guint32 pg_row)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	GArray *entries;
+	MdbIdxEntry target;
+	MdbIdxPath path;
+	guint32 pgs[3];
+	unsigned int i, p;
+
+	mdb_idx_set_target(&target, key, key_len, pg_row);
+	if (!(pgs[0] = mdb_idx_find_leaf(mdb, idx, &target, &path)))
+		return 0;
+	/* a tree that keeps first keys in its nodes leads one leaf too far */
+	pgs[1] = mdb_get_int32(mdb->pg_buf, 0x08);
+	pgs[2] = mdb_get_int32(mdb->pg_buf, 0x0c);
+
+	entries = g_array_new(FALSE, FALSE, sizeof(MdbIdxEntry));
+	for (p=0;p<3;p++) {
+		if (!pgs[p] || !mdb_read_pg(mdb, pgs[p])
+		 || mdb->pg_buf[0] != MDB_PAGE_LEAF
+		 || !mdb_idx_read_entries(mdb, entries))
+			continue;
+		for (i=0;i<entries->len;i++) {
+			if (!mdb_idx_entry_cmp(&g_array_index(entries, MdbIdxEntry, i),
+					&target))
+				break;
+		}
+		if (i == entries->len)
+			continue;
+		g_array_remove_index(entries, i);
+		mdb_idx_store_entries(mdb, entries);
+		mdb_idx_write_pg(mdb, pgs[p]);
+		g_array_free(entries, TRUE);
+		return 1;
+	}
+	g_array_free(entries, TRUE);
+	return 0;
+}
+/**
+ * mdb_index_add_entry:
+ * @table: table the index belongs to
+ * @idx: index, see mdb_index_writable()
+ * @key: key made by mdb_index_make_key()
+ * @key_len: length of @key
+ * @pg_row: page and row the entry points to
+ *
+ * Adds an entry to the leaf it sorts on, splitting pages on the way up
+ * as needed.  Reads one page per level, plus a neighbour for each split.
+ * Uses mdb->pg_buf.
+ *
+ * Returns: 1 on success, 0 if the index could not be changed.
+ */
+int
+mdb_index_add_entry(MdbTableDef *table, MdbIndex *idx, unsigned char *key, int key_len, guint32 pg_row)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	GArray *entries;
+	MdbIdxEntry target;
+	MdbIdxPath path;
+	unsigned int i;
+	int ret = 0, append;
+
+	mdb_idx_set_target(&target, key, key_len, pg_row);
+	if (!mdb_idx_find_leaf(mdb, idx, &target, &path))
+		return 0;
+	entries = g_array_new(FALSE, FALSE, sizeof(MdbIdxEntry));
+	if (mdb_idx_read_entries(mdb, entries)) {
+		for (i=0;i<entries->len;i++) {
+			if (mdb_idx_entry_cmp(&g_array_index(entries, MdbIdxEntry, i),
+					&target) > 0)
+				break;
+		}
+		append = i == entries->len && !mdb_get_int32(mdb->pg_buf, 0x0c);
+		g_array_insert_val(entries, i, target);
+		ret = mdb_idx_put_level(table, &path, path.depth - 1,
+			entries, append);
+	}
+	g_array_free(entries, TRUE);
+	return ret;
+}
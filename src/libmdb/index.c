@@ -25,6 +25,7 @@
 
 MdbIndexPage *mdb_index_read_bottom_pg(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain);
 MdbIndexPage *mdb_chain_add_page(MdbHandle *mdb, MdbIndexChain *chain, guint32 pg);
+void mdb_index_cache_sarg(MdbColumn *col, MdbSarg *sarg, MdbSarg *idx_sarg);
 
 char idx_to_text[] = {
 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* 0-7     0x00-0x07 */
@@ -62,44 +63,42 @@ char idx_to_text[] = {
 };
 
 
-GPtrArray *
-mdb_read_indices(MdbTableDef *table)
+/* read the index definitions following the columns */
+static void
+mdb_tdef_read_indices(MdbHandle *mdb, MdbTdef *tdef)
 {
-	MdbCatalogEntry *entry = table->entry;
-	MdbHandle *mdb = entry->mdb;
 	MdbFormatConstants *fmt = mdb->fmt;
 	MdbIndex *pidx;
 	unsigned int i, j;
 	int idx_num, key_num, col_num;
 	int cur_pos, name_sz, idx2_sz, type_offset;
-	int index_start_pg = mdb->cur_pg;
 	gchar *tmpbuf;
 
-        table->indices = g_ptr_array_new();
+        tdef->indices = g_ptr_array_new();
 
+	mdb_read_pg(mdb, tdef->index_pg);
         if (IS_JET4(mdb)) {
-		cur_pos = table->index_start + 52 * table->num_real_idxs;
+		cur_pos = tdef->index_start + 52 * tdef->num_real_idxs;
 		idx2_sz = 28;
 		type_offset = 23;
 	} else {
-		cur_pos = table->index_start + 39 * table->num_real_idxs;
+		cur_pos = tdef->index_start + 39 * tdef->num_real_idxs;
 		idx2_sz = 20;
 		type_offset = 19;
 	}
 
 	tmpbuf = (gchar *) g_malloc(idx2_sz);
-	for (i=0;i<table->num_idxs;i++) {
+	for (i=0;i<tdef->num_idxs;i++) {
 		read_pg_if_n(mdb, tmpbuf, &cur_pos, idx2_sz);
 		pidx = (MdbIndex *) g_malloc0(sizeof(MdbIndex));
-		pidx->table = table;
 		pidx->index_num = mdb_get_int16(tmpbuf, 4);
 		pidx->index_type = tmpbuf[type_offset]; 
-		g_ptr_array_add(table->indices, pidx);
+		g_ptr_array_add(tdef->indices, pidx);
 	}
 	g_free(tmpbuf);
 
-	for (i=0;i<table->num_idxs;i++) {
-		pidx = g_ptr_array_index (table->indices, i);
+	for (i=0;i<tdef->num_idxs;i++) {
+		pidx = g_ptr_array_index (tdef->indices, i);
 		if (IS_JET4(mdb)) {
 			name_sz=read_pg_if_16(mdb, &cur_pos);
 		} else {
@@ -112,14 +111,14 @@ mdb_read_indices(MdbTableDef *table)
 		//fprintf(stderr, "index name %s\n", pidx->name);
 	}
 
-	mdb_read_alt_pg(mdb, entry->table_pg);
-	mdb_read_pg(mdb, index_start_pg);
-	cur_pos = table->index_start;
+	mdb_read_alt_pg(mdb, tdef->table_pg);
+	mdb_read_pg(mdb, tdef->index_pg);
+	cur_pos = tdef->index_start;
 	idx_num=0;
-	for (i=0;i<table->num_real_idxs;i++) {
+	for (i=0;i<tdef->num_real_idxs;i++) {
 		if (IS_JET4(mdb)) cur_pos += 4;
 		do {
-			pidx = g_ptr_array_index (table->indices, idx_num++);
+			pidx = g_ptr_array_index (tdef->indices, idx_num++);
 		} while (pidx && pidx->index_type==2);
 
 		/* if there are more real indexes than index entries left after
@@ -127,7 +126,7 @@ mdb_read_indices(MdbTableDef *table)
 		   on Northwind Orders table.
 		*/
 		if (!pidx) {
-			table->num_real_idxs--;
+			tdef->num_used_idxs--;
 			continue;
 		}
 
@@ -155,7 +154,29 @@ mdb_read_indices(MdbTableDef *table)
 		pidx->flags = read_pg_if_8(mdb, &cur_pos);
 		if (IS_JET4(mdb)) cur_pos += 9;
 	}
-	return NULL;
+}
+GPtrArray *
+mdb_read_indices(MdbTableDef *table)
+{
+	MdbTdef *tdef = table->tdef;
+	MdbIndex *pidx;
+	unsigned int i;
+
+	/* the index definitions start where the columns end */
+	if (!table->columns)
+		mdb_read_columns(table);
+	if (!tdef->indices)
+		mdb_tdef_read_indices(table->entry->mdb, tdef);
+
+	table->indices = g_ptr_array_sized_new(tdef->indices->len);
+	for (i=0;i<tdef->indices->len;i++) {
+		pidx = g_memdup(g_ptr_array_index(tdef->indices, i),
+			sizeof(MdbIndex));
+		pidx->table = table;
+		g_ptr_array_add(table->indices, pidx);
+	}
+	table->num_real_idxs = tdef->num_used_idxs;
+	return table->indices;
 }
 void
 mdb_index_hash_text(char *text, char *hash)
@@ -182,12 +203,54 @@ mdb_index_swap_n(unsigned char *src, int sz, unsigned char *dest)
 		dest[j++] = src[i];
 	}
 }
+/*
+ * IN lists are cached by converting every constant to its index form.  The
+ * encoded values no longer sort the same way, so the new set is resorted.
+ */
+static MdbSargSet *
+mdb_index_cache_sarg_set(MdbColumn *col, MdbSargSet *set)
+{
+	MdbSargSet *idx_set;
+	MdbSarg sarg, idx_sarg;
+	unsigned int i;
+
+	idx_set = mdb_alloc_sarg_set();
+	sarg.op = idx_sarg.op = MDB_EQUAL;
+	sarg.set = idx_sarg.set = NULL;
+	switch (col->col_type) {
+		case MDB_TEXT:
+		for (i=0; i<set->strs->len; i++) {
+			strncpy(sarg.value.s, g_ptr_array_index(set->strs, i), 255);
+			sarg.value.s[255] = '\0';
+			mdb_index_cache_sarg(col, &sarg, &idx_sarg);
+			mdb_sarg_set_add_string(idx_set, idx_sarg.value.s);
+		}
+		break;
+
+		default:
+		for (i=0; i<set->ints->len; i++) {
+			sarg.value.i = idx_sarg.value.i =
+				g_array_index(set->ints, gint32, i);
+			mdb_index_cache_sarg(col, &sarg, &idx_sarg);
+			mdb_sarg_set_add_int(idx_set, idx_sarg.value.i);
+		}
+		break;
+	}
+	mdb_sarg_set_sort(idx_set);
+
+	return idx_set;
+}
 void 
 mdb_index_cache_sarg(MdbColumn *col, MdbSarg *sarg, MdbSarg *idx_sarg)
 {
 	//guint32 cache_int;
 	unsigned char *c;
 
+	if (sarg->op == MDB_IN) {
+		idx_sarg->set = mdb_index_cache_sarg_set(col, sarg->set);
+		return;
+	}
+
 	switch (col->col_type) {
 		case MDB_TEXT:
 		mdb_index_hash_text(sarg->value.s, idx_sarg->value.s);
@@ -197,7 +260,7 @@ mdb_index_cache_sarg(MdbColumn *col, MdbSarg *sarg, MdbSarg *idx_sarg)
 		idx_sarg->value.i = GUINT32_SWAP_LE_BE(sarg->value.i);
 		//cache_int = sarg->value.i * -1;
 		c = (unsigned char *) &(idx_sarg->value.i);
-		c[0] |= 0x80;
+		c[0] ^= 0x80;
 		//printf("int %08x %02x %02x %02x %02x\n", sarg->value.i, c[0], c[1], c[2], c[3]);
 		break;	
 
@@ -287,6 +350,7 @@ mdb_index_test_sargs(MdbHandle *mdb, MdbIndex *idx, char *buf, int len)
 			/* XXX - kludge */
 			node.op = sarg->op;
 			node.value = sarg->value;
+			node.set = sarg->set;
 			//field.value = &mdb->pg_buf[offset + c_offset];
 			field.value = buf;
 		       	field.siz = c_len;
@@ -299,6 +363,97 @@ mdb_index_test_sargs(MdbHandle *mdb, MdbIndex *idx, char *buf, int len)
 	}
 	return 1;
 }
+/*
+ * Leaf entries come in key order, so once an ascending long integer key is
+ * beyond an equality sarg no later entry can match it.
+ */
+static int
+mdb_index_past_sargs(MdbIndex *idx, unsigned char *key)
+{
+	MdbColumn *col;
+	MdbSarg *idx_sarg;
+	unsigned int i;
+
+	if (idx->num_keys != 1 || idx->key_col_order[0] != MDB_ASC)
+		return 0;
+	col=g_ptr_array_index(idx->table->columns,idx->key_col_num[0]-1);
+	if (col->col_type != MDB_LONGINT || !col->idx_sarg_cache)
+		return 0;
+	for (i=0;i<col->idx_sarg_cache->len;i++) {
+		idx_sarg = g_ptr_array_index(col->idx_sarg_cache, i);
+		if (idx_sarg->op == MDB_EQUAL &&
+		    memcmp(key, &idx_sarg->value.i, 4) > 0)
+			return 1;
+	}
+	return 0;
+}
+/*
+ * An IN list on an ascending long integer key is run as one seek per
+ * constant instead of a walk over every leaf.  The constants are sorted by
+ * value, which is also the order of their keys.  Returns the list, or NULL
+ * if the index has to be walked.
+ */
+static MdbSargSet *
+mdb_index_in_set(MdbIndex *idx)
+{
+	MdbColumn *col;
+	MdbSarg *sarg;
+	unsigned int i;
+
+	if (idx->num_keys != 1 || idx->key_col_order[0] != MDB_ASC)
+		return NULL;
+	col=g_ptr_array_index(idx->table->columns,idx->key_col_num[0]-1);
+	if (col->col_type != MDB_LONGINT)
+		return NULL;
+	for (i=0;i<col->num_sargs;i++) {
+		sarg = g_ptr_array_index(col->sargs, i);
+		if (sarg->op == MDB_IN && sarg->set && sarg->set->ints->len) {
+			mdb_sarg_set_sort(sarg->set);
+			return sarg->set;
+		}
+	}
+	return NULL;
+}
+/*
+ * Make the first constant from pos on whose key is not below key (any
+ * constant, if key is NULL) the one sought.  Returns 0 if no constant is
+ * left.
+ */
+static int
+mdb_index_in_next(MdbIndex *idx, MdbIndexChain *chain, MdbSargSet *set, guint pos, unsigned char *key)
+{
+	MdbColumn *col;
+	MdbSarg sarg, idx_sarg;
+
+	col=g_ptr_array_index(idx->table->columns,idx->key_col_num[0]-1);
+	sarg.op = MDB_EQUAL;
+	sarg.set = NULL;
+	for (;pos<set->ints->len;pos++) {
+		sarg.value.i = g_array_index(set->ints, gint32, pos);
+		mdb_index_cache_sarg(col, &sarg, &idx_sarg);
+		if (!key || memcmp(&idx_sarg.value.i, key, 4) >= 0) {
+			chain->in_pos = pos;
+			memcpy(chain->in_key, &idx_sarg.value.i, 4);
+			return 1;
+		}
+	}
+	return 0;
+}
+/* restart the chain at the leaf that may hold the constant sought */
+static int
+mdb_index_in_seek(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain)
+{
+	guint pos = chain->in_pos;
+	unsigned char key[4];
+
+	memcpy(key, chain->in_key, 4);
+	if (!mdb_index_seek(mdb, idx, chain, key, 4))
+		return 0;
+	chain->in_seek = 1;
+	chain->in_pos = pos;
+	memcpy(chain->in_key, key, 4);
+	return 1;
+}
 /*
  * pack the pages bitmap
  */
@@ -559,8 +714,20 @@ mdb_index_find_next(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32
 	int idx_sz;
 	int idx_start = 0;
 	MdbColumn *col;
-	guint32 pg_row;
-
+	MdbSargSet *in_set = NULL;
+	int in_cmp;
+	guint32 pg_row, done_pg;
+
+	if (chain->in_seek != -1 && (in_set = mdb_index_in_set(idx))
+	 && !chain->in_seek) {
+		mdb_index_in_next(idx, chain, in_set, 0, NULL);
+		if (!mdb_index_in_seek(mdb, idx, chain)) {
+			/* walk the whole index after all */
+			memset(chain, 0, sizeof(MdbIndexChain));
+			chain->in_seek = -1;
+			in_set = NULL;
+		}
+	}
 	ipg = mdb_index_read_bottom_pg(mdb, idx, chain);
 
 	/*
@@ -572,6 +739,26 @@ mdb_index_find_next(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32
 		 * if no more rows on this leaf, try to find a new leaf
 		 */
 		if (!mdb_index_find_next_on_page(mdb, ipg)) {
+			/*
+			 * with an IN list, go to the leaf of the next constant
+			 * rather than to the next leaf, unless the leaf ends
+			 * on a constant that may go on there.  The first seek
+			 * worked, so a failed one can't happen.
+			 */
+			if (in_set && !chain->clean_up_mode) {
+				if (!mdb_index_in_next(idx, chain, in_set,
+						chain->in_pos, ipg->cache_value))
+					return 0;
+				done_pg = ipg->pg;
+				if (memcmp(chain->in_key, ipg->cache_value, 4)) {
+					if (!mdb_index_in_seek(mdb, idx, chain))
+						return 0;
+					ipg = mdb_index_read_bottom_pg(mdb, idx, chain);
+					if (ipg->pg != done_pg)
+						continue;
+					/* it's on a later leaf, the unwind finds it */
+				}
+			}
 			if (!chain->clean_up_mode) {
 				if (!(ipg = mdb_index_unwind(mdb, idx, chain)))
 					chain->clean_up_mode = 1;
@@ -613,7 +800,23 @@ mdb_index_find_next(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32
 		}
 
 		//idx_start = ipg->offset + (ipg->len - 4 - idx_sz);
-		passed = mdb_index_test_sargs(mdb, idx, (char *)(ipg->cache_value), idx_sz);
+		/*
+		 * a seek may land before the constant sought, on keys that
+		 * were returned already
+		 */
+		in_cmp = in_set ? memcmp(ipg->cache_value, chain->in_key, 4) : 0;
+		passed = in_cmp >= 0
+			&& mdb_index_test_sargs(mdb, idx, (char *)(ipg->cache_value), idx_sz);
+		if (!passed && mdb_index_past_sargs(idx, ipg->cache_value))
+			return 0;
+		/*
+		 * once past the constant sought, every key up to this one has
+		 * been seen: look for the next constant from here on
+		 */
+		if (!passed && in_cmp > 0
+		 && !mdb_index_in_next(idx, chain, in_set, chain->in_pos + 1,
+				ipg->cache_value))
+			return 0;
 
 		ipg->offset += ipg->len;
 	} while (!passed);
@@ -623,6 +826,66 @@ mdb_index_find_next(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32
 
 	return ipg->len;
 }
+/*
+ * Descend from the root to the leaf that may hold the first entry equal to
+ * key (in index byte order), leaving the chain set up so mdb_index_find_next()
+ * carries on from there.  Node entries are compared the same way leaf
+ * entries are cached, so only single column fixed size keys can be sought.
+ * Returns 0 if the tree can't be searched; the caller should then clear the
+ * chain and scan from the start.
+ */
+int
+mdb_index_seek(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, unsigned char *key, int key_len)
+{
+	MdbIndexPage *ipg;
+	MdbColumn *col;
+	unsigned char node_key[256];
+	guint32 pg, child;
+	int idx_sz, key_sz;
+
+	if (idx->num_keys != 1) return 0;
+	col=g_ptr_array_index(idx->table->columns,idx->key_col_num[0]-1);
+	idx_sz = mdb_col_fixed_size(col);
+	if (idx_sz != key_len) return 0;
+
+	memset(chain, 0, sizeof(MdbIndexChain));
+	pg = idx->first_pg;
+	while (chain->cur_depth < MDB_MAX_INDEX_DEPTH) {
+		ipg = mdb_chain_add_page(mdb, chain, pg);
+		if (!mdb_read_pg(mdb, pg)) return 0;
+		if (mdb->pg_buf[0]==MDB_PAGE_LEAF) {
+			chain->last_leaf_found = pg;
+			return 1;
+		}
+		if (mdb->pg_buf[0]!=MDB_PAGE_INDEX) return 0;
+		/*
+		 * follow the last entry below the key (or the first entry),
+		 * the leaf scan skips whatever is still smaller
+		 */
+		child = 0;
+		memset(node_key, 0, sizeof(node_key));
+		while (mdb_index_find_next_on_page(mdb, ipg)) {
+			key_sz = ipg->len - 8;
+			if (key_sz < 0) return 0;
+			if (key_sz < idx_sz) {
+				/* compressed, only the tail of the key is stored */
+				memcpy(&node_key[idx_sz - key_sz], &mdb->pg_buf[ipg->offset], key_sz);
+			} else {
+				memcpy(node_key, &mdb->pg_buf[ipg->offset + key_sz - idx_sz], idx_sz);
+			}
+			if (child && memcmp(node_key, key, key_len) >= 0) {
+				/* leave this entry for the unwind to pick up */
+				ipg->start_pos--;
+				break;
+			}
+			child = mdb_get_int32_msb(mdb->pg_buf, ipg->offset + ipg->len - 3) >> 8;
+			ipg->offset += ipg->len;
+		}
+		if (!child) return 0;
+		pg = child;
+	}
+	return 0;
+}
 /*
  * XXX - FIX ME
  * This function is grossly inefficient.  It scans the entire index building 
@@ -722,7 +985,7 @@ mdb_index_dump(MdbTableDef *table, MdbIndex *idx)
  *
  * Indexes with no matching sargs are assigned 0
  * Unique indexes are preferred over non-uniques
- * Operator preference is equal, like, isnull, others 
+ * Operator preference is equal, in, like, isnull, others 
  */
 int mdb_index_compute_cost(MdbTableDef *table, MdbIndex *idx)
 {
@@ -763,6 +1026,8 @@ int mdb_index_compute_cost(MdbTableDef *table, MdbIndex *idx)
 			switch (sarg->op) {
 				case MDB_EQUAL:
 					return 1; break;
+				case MDB_IN:
+					return 2; break;
 				case MDB_LIKE:
 					return 4; break;
 				case MDB_ISNULL:
@@ -776,6 +1041,8 @@ int mdb_index_compute_cost(MdbTableDef *table, MdbIndex *idx)
 					if (not_all_equal) return 2; 
 					else return 1;
 					break;
+				case MDB_IN:
+					return 3; break;
 				case MDB_LIKE:
 					return 6; break;
 				case MDB_ISNULL:
@@ -789,6 +1056,8 @@ int mdb_index_compute_cost(MdbTableDef *table, MdbIndex *idx)
 			switch (sarg->op) {
 				case MDB_EQUAL:
 					return 2; break;
+				case MDB_IN:
+					return 3; break;
 				case MDB_LIKE:
 					return 5; break;
 				case MDB_ISNULL:
@@ -802,6 +1071,8 @@ int mdb_index_compute_cost(MdbTableDef *table, MdbIndex *idx)
 					if (not_all_equal) return 3; 
 					else return 2;
 					break;
+				case MDB_IN:
+					return 4; break;
 				case MDB_LIKE:
 					return 7; break;
 				case MDB_ISNULL:
@@ -847,15 +1118,67 @@ mdb_index_scan_init(MdbHandle *mdb, MdbTableDef *table)
 	int i;
 
 	if (mdb_get_option(MDB_USE_INDEX) && mdb_choose_index(table, &i) == MDB_INDEX_SCAN) {
-		table->strategy = MDB_INDEX_SCAN;
-		table->scan_idx = g_ptr_array_index (table->indices, i);
-		table->chain = g_malloc0(sizeof(MdbIndexChain));
-		table->mdbidx = mdb_clone_handle(mdb);
-		mdb_read_pg(table->mdbidx, table->scan_idx->first_pg);
+		mdb_index_scan_use(mdb, table, g_ptr_array_index (table->indices, i));
 		//printf("best index is %s\n",table->scan_idx->name);
 	}
 	//printf("TABLE SCAN? %d\n", table->strategy);
 }
+/*
+ * read table in the order of idx from now on
+ */
+void
+mdb_index_scan_use(MdbHandle *mdb, MdbTableDef *table, MdbIndex *idx)
+{
+	table->strategy = MDB_INDEX_SCAN;
+	table->scan_idx = idx;
+	if (!table->chain)
+		table->chain = g_malloc0(sizeof(MdbIndexChain));
+	else
+		memset(table->chain, 0, sizeof(MdbIndexChain));
+	if (!table->mdbidx)
+		table->mdbidx = mdb_clone_handle(mdb);
+	mdb_read_pg(table->mdbidx, idx->first_pg);
+}
+/*
+ * Restart an index scan at the rows whose key equals value.  The value is
+ * kept as an extra equality sarg on the key column, so the leaf scan stops
+ * as soon as it is past the key.  Only long integer keys can be sought.
+ */
+int
+mdb_index_scan_seek(MdbTableDef *table, gint32 value)
+{
+	MdbIndex *idx = table->scan_idx;
+	MdbColumn *col;
+	MdbSarg sarg, key;
+
+	if (!idx || !table->chain || idx->num_keys != 1)
+		return 0;
+	col=g_ptr_array_index(table->columns,idx->key_col_num[0]-1);
+	if (col->col_type != MDB_LONGINT)
+		return 0;
+
+	if (!table->seek_sarg) {
+		memset(&sarg, 0, sizeof(MdbSarg));
+		sarg.op = MDB_EQUAL;
+		mdb_add_sarg(col, &sarg);
+		table->seek_sarg = g_ptr_array_index(col->sargs, col->num_sargs-1);
+		if (col->idx_sarg_cache)
+			g_ptr_array_add(col->idx_sarg_cache,
+				g_memdup(table->seek_sarg, sizeof(MdbSarg)));
+	}
+	table->seek_sarg->value.i = value;
+	if (col->idx_sarg_cache)
+		mdb_index_cache_sarg(col, table->seek_sarg,
+			g_ptr_array_index(col->idx_sarg_cache, col->num_sargs-1));
+
+	mdb_rewind_table(table);
+	memcpy(&key, table->seek_sarg, sizeof(MdbSarg));
+	mdb_index_cache_sarg(col, table->seek_sarg, &key);
+	if (!mdb_index_seek(table->mdbidx, idx, table->chain,
+	    (unsigned char *)&key.value.i, 4))
+		memset(table->chain, 0, sizeof(MdbIndexChain));
+	return 1;
+}
 void 
 mdb_index_scan_free(MdbTableDef *table)
 {
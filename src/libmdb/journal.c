@@ -0,0 +1,303 @@
+/* MDB Tools - A library for reading MS Access database files
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "mdbtools.h"
+#include <errno.h>
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+/*
+ * Write journal.  With MDB_JOURNAL, every mdb_flush() first writes the new
+ * images of the pages it is about to change to <file>-journal and syncs
+ * it; only then are the pages written in place.  Once they are on disk the
+ * journal is emptied again.  A journal left behind by a crash is either
+ * complete, and its pages are written again when the file is next opened
+ * for writing, or torn, and the file was never touched.
+ *
+ * Layout (little endian):
+ *	"MDBJ", version, page size, page count
+ *	page count times: page number, page image
+ *	checksum of all of the above, "MDBC"
+ */
+
+#define MDB_JOURNAL_VERSION 1
+#define MDB_JOURNAL_HDR 16
+#define MDB_JOURNAL_TRAILER 8
+
+static char *
+mdb_journal_name(MdbFile *f)
+{
+	return g_strconcat(f->filename, "-journal", NULL);
+}
+/* FNV-1a */
+static guint32
+mdb_journal_sum(unsigned char *buf, size_t len)
+{
+	guint32 sum = 2166136261U;
+	size_t i;
+
+	for (i=0;i<len;i++) {
+		sum ^= buf[i];
+		sum *= 16777619U;
+	}
+	return sum;
+}
+/**
+ * mdb_sync_fd:
+ * @fd: file descriptor
+ *
+ * Waits for the data written to @fd to reach the disk.
+ *
+ * Returns: 1 on success, 0 on failure.
+ */
+int
+mdb_sync_fd(int fd)
+{
+#ifdef HAVE_FDATASYNC
+	if (fdatasync(fd)) {
+		perror("fdatasync");
+		return 0;
+	}
+#else
+	if (fsync(fd)) {
+		perror("fsync");
+		return 0;
+	}
+#endif
+	return 1;
+}
+/* makes a newly created journal's directory entry durable */
+static int
+mdb_sync_dir(MdbFile *f)
+{
+	char *dir = g_path_get_dirname(f->filename);
+	int fd, ret = 1;
+
+	fd = open(dir, O_RDONLY);
+	if (fd == -1 || fsync(fd)) {
+		perror("fsync");
+		ret = 0;
+	}
+	if (fd != -1) close(fd);
+	g_free(dir);
+	return ret;
+}
+static int
+mdb_write_all(int fd, unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror("write");
+			return 0;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+/*
+ * Writes the pages of a complete journal back to the database file.
+ * Returns 0 if the journal is torn, -1 if the pages can't be written.
+ */
+static int
+mdb_journal_replay(MdbFile *f, unsigned char *buf, size_t len)
+{
+	guint32 pg_size, num_pgs, i, pg;
+	unsigned char *rec;
+
+	if (len < MDB_JOURNAL_HDR + MDB_JOURNAL_TRAILER
+	 || memcmp(buf, "MDBJ", 4)
+	 || mdb_get_int32(buf, 4) != MDB_JOURNAL_VERSION)
+		return 0;
+	pg_size = mdb_get_int32(buf, 8);
+	num_pgs = mdb_get_int32(buf, 12);
+	if ((pg_size != 2048 && pg_size != 4096)
+	 || len != MDB_JOURNAL_HDR + (size_t) num_pgs * (4 + pg_size)
+		+ MDB_JOURNAL_TRAILER
+	 || memcmp(buf + len - 4, "MDBC", 4)
+	 || mdb_get_int32(buf, len - 8) != (gint32) mdb_journal_sum(buf, len - 8))
+		return 0;
+
+	rec = buf + MDB_JOURNAL_HDR;
+	for (i=0;i<num_pgs;i++) {
+		pg = mdb_get_int32(rec, 0);
+		if (lseek(f->fd, (off_t) pg * pg_size, SEEK_SET) == -1
+		 || !mdb_write_all(f->fd, rec + 4, pg_size))
+			return -1;
+		rec += 4 + pg_size;
+	}
+	if (!mdb_sync_fd(f->fd))
+		return -1;
+	fprintf(stderr, "Recovered %lu pages of %s from its journal\n",
+		(unsigned long) num_pgs, f->filename);
+	return 1;
+}
+/**
+ * mdb_journal_open:
+ * @mdb: Database file handle
+ * @keep: journal the writes made through @mdb
+ *
+ * Called by mdb_open().  A journal left behind by a crash is replayed if
+ * the file is writable; a read only handle only warns about it.  With
+ * @keep, the journal file is then kept open for mdb_flush().
+ *
+ * Returns: 1 on success, 0 if the journal could not be replayed or
+ * created.
+ */
+int
+mdb_journal_open(MdbHandle *mdb, int keep)
+{
+	MdbFile *f = mdb->f;
+	char *name = mdb_journal_name(f);
+	struct stat status;
+	unsigned char *buf;
+	int fd, ret = 1;
+
+	fd = open(name, f->writable ? O_RDWR : O_RDONLY);
+	if (fd != -1 && !fstat(fd, &status) && status.st_size) {
+		if (!f->writable) {
+			fprintf(stderr, "%s has a journal; open it for writing to recover it\n",
+				f->filename);
+		} else {
+			buf = g_malloc(status.st_size);
+			if (read(fd, buf, status.st_size) != status.st_size
+			 || mdb_journal_replay(f, buf, status.st_size) == -1) {
+				fprintf(stderr, "Couldn't recover %s from its journal\n",
+					f->filename);
+				ret = 0;
+			}
+			g_free(buf);
+			/* a torn journal is dropped, the file was never written */
+			if (ret && (ftruncate(fd, 0) || !mdb_sync_fd(fd)))
+				ret = 0;
+		}
+	}
+	if (ret && keep && f->writable) {
+		if (fd == -1) {
+			fd = open(name, O_RDWR | O_CREAT, 0644);
+			if (fd != -1 && !mdb_sync_dir(f)) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		if (fd == -1) {
+			fprintf(stderr, "Couldn't create journal %s\n", name);
+			ret = 0;
+		}
+		f->journal_fd = fd;
+	} else {
+		if (fd != -1) close(fd);
+		if (ret && f->writable)
+			unlink(name);
+	}
+	g_free(name);
+	return ret;
+}
+/**
+ * mdb_journal_commit:
+ * @mdb: Database file handle
+ * @pgs: sorted page numbers
+ * @num_pgs: number of pages
+ *
+ * Writes the dirty images of @pgs to the journal as one group and waits
+ * for them to reach the disk.  The pages may be written in place once this
+ * returns.
+ *
+ * Returns: 1 on success, 0 on failure.
+ */
+int
+mdb_journal_commit(MdbHandle *mdb, guint32 *pgs, guint num_pgs)
+{
+	MdbFile *f = mdb->f;
+	int pg_size = mdb->fmt->pg_size;
+	size_t len = MDB_JOURNAL_HDR + (size_t) num_pgs * (4 + pg_size)
+		+ MDB_JOURNAL_TRAILER;
+	unsigned char *buf, *rec;
+	guint i;
+	int ret;
+
+	buf = g_malloc(len);
+	memcpy(buf, "MDBJ", 4);
+	_mdb_put_int32(buf, 4, MDB_JOURNAL_VERSION);
+	_mdb_put_int32(buf, 8, pg_size);
+	_mdb_put_int32(buf, 12, num_pgs);
+	rec = buf + MDB_JOURNAL_HDR;
+	for (i=0;i<num_pgs;i++) {
+		_mdb_put_int32(rec, 0, pgs[i]);
+		memcpy(rec + 4, g_hash_table_lookup(f->dirty_pgs,
+			GUINT_TO_POINTER(pgs[i])), pg_size);
+		rec += 4 + pg_size;
+	}
+	_mdb_put_int32(buf, len - 8, mdb_journal_sum(buf, len - 8));
+	memcpy(buf + len - 4, "MDBC", 4);
+
+	/* cut off whatever a longer, failed group left after this one */
+	ret = lseek(f->journal_fd, 0, SEEK_SET) != -1
+		&& mdb_write_all(f->journal_fd, buf, len)
+		&& !ftruncate(f->journal_fd, len)
+		&& mdb_sync_fd(f->journal_fd);
+	g_free(buf);
+	return ret;
+}
+/**
+ * mdb_journal_done:
+ * @mdb: Database file handle
+ *
+ * Empties the journal once the pages of the last group are on disk.
+ */
+void
+mdb_journal_done(MdbHandle *mdb)
+{
+	if (ftruncate(mdb->f->journal_fd, 0))
+		perror("ftruncate");
+}
+/**
+ * mdb_journal_close:
+ * @f: Database file
+ *
+ * Closes the journal, and removes it unless it still holds a group that
+ * was not written in place.
+ */
+void
+mdb_journal_close(MdbFile *f)
+{
+	struct stat status;
+	char *name;
+
+	if (f->journal_fd == -1)
+		return;
+	if (!fstat(f->journal_fd, &status) && !status.st_size) {
+		name = mdb_journal_name(f);
+		unlink(name);
+		g_free(name);
+	}
+	close(f->journal_fd);
+	f->journal_fd = -1;
+}
@@ -17,12 +17,29 @@
  * Boston, MA 02111-1307, USA.
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef HAVE_FALLOCATE
+#define _GNU_SOURCE
+#include <fcntl.h>
+#endif
+
 #include "mdbtools.h"
 
 #ifdef DMALLOC
 #include "dmalloc.h"
 #endif
 
+/* pages reserved on disk ahead of the end of the file */
+#define MDB_ALLOC_CHUNK 256
+
+/* the global usage map is row 0 of page 1 */
+#define MDB_GLOBAL_MAP_PG_ROW 0x100
+
+/* width in bytes of a free space directory bucket */
+#define MDB_SPACE_GRANULE 64
+
 static guint32 
 mdb_map_find_next0(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint32 start_pg)
 {
@@ -95,39 +112,570 @@ mdb_map_find_next(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint
 	fprintf(stderr, "Warning: unrecognized usage map type: %d\n", map[0]);
 	return -1;
 }
+/*
+ * Set (or clear) the bits of pages start_pg .. start_pg+num_pgs-1 in a
+ * usage map.  A type 0 map is changed in memory and must be written back
+ * with mdb_map_write(); the 0x05 pages of a type 1 map are read and written
+ * here, once each.  Uses mdb->pg_buf.
+ *
+ * Returns the number of pages the map has no bit for.
+ */
+guint32
+mdb_map_set_range(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint32 start_pg, guint32 num_pgs, int set)
+{
+	guint32 pg, end_pg = start_pg + num_pgs;
+	guint32 missed = 0;
+
+	if (map[0] == 0) {
+		guint32 first = mdb_get_int32(map, 1);
+		guint32 usage_bitlen = (map_sz - 5) * 8;
+		unsigned char *usage_bitmap = map + 5;
+
+		for (pg=start_pg; pg<end_pg; pg++) {
+			guint32 i = pg - first;
+			if (pg < first || i >= usage_bitlen) {
+				missed++;
+			} else if (set) {
+				usage_bitmap[i/8] |= 1 << (i%8);
+			} else {
+				usage_bitmap[i/8] &= ~(1 << (i%8));
+			}
+		}
+	} else if (map[0] == 1) {
+		guint32 usage_bitlen = (mdb->fmt->pg_size - 4) * 8;
+		guint32 max_map_pgs = (map_sz - 1) / 4;
+		guint32 map_ind, map_pg, i;
+
+		for (pg=start_pg; pg<end_pg; ) {
+			/* pages covered by the same map page */
+			map_ind = pg / usage_bitlen;
+			i = pg % usage_bitlen;
+			if (map_ind >= max_map_pgs
+			 || !(map_pg = mdb_get_int32(map, (map_ind*4)+1))
+			 || mdb_read_pg(mdb, map_pg) != mdb->fmt->pg_size) {
+				missed += MIN(end_pg - pg, usage_bitlen - i);
+				pg += MIN(end_pg - pg, usage_bitlen - i);
+				continue;
+			}
+			for (; pg<end_pg && i<usage_bitlen; pg++, i++) {
+				if (set)
+					mdb->pg_buf[4 + i/8] |= 1 << (i%8);
+				else
+					mdb->pg_buf[4 + i/8] &= ~(1 << (i%8));
+			}
+			if (!mdb_write_pg(mdb, map_pg)) {
+				fprintf(stderr, "write failed! exiting...\n");
+				exit(1);
+			}
+		}
+	} else {
+		fprintf(stderr, "Warning: unrecognized usage map type: %d\n", map[0]);
+		return num_pgs;
+	}
+	return missed;
+}
+/*
+ * Write a table's usage map (map_offset is fmt->tab_usage_map_offset) or
+ * free space map (fmt->tab_free_map_offset) back to the row it was read
+ * from.  Only needed for type 0 maps, the size of the row does not change.
+ */
+static int
+mdb_map_write_row(MdbHandle *mdb, guint32 pg_row, unsigned char *map, size_t map_sz)
+{
+	int row_start;
+	size_t row_size;
+
+	if (mdb_read_pg(mdb, pg_row >> 8) != mdb->fmt->pg_size)
+		return 0;
+	mdb_find_row(mdb, pg_row & 0xff, &row_start, &row_size);
+	row_start &= 0x1fff; /* remove flags */
+	if (row_size != map_sz) {
+		fprintf(stderr, "usage map on page %lu has changed size\n",
+			(unsigned long) (pg_row >> 8));
+		return 0;
+	}
+	memcpy(mdb->pg_buf + row_start, map, map_sz);
+	if (!mdb_write_pg(mdb, pg_row >> 8)) {
+		fprintf(stderr, "write failed! exiting...\n");
+		exit(1);
+	}
+	return 1;
+}
+int
+mdb_map_write(MdbTableDef *table, int map_offset, unsigned char *map, size_t map_sz)
+{
+	MdbHandle *mdb = table->entry->mdb;
+
+	if (mdb_read_pg(mdb, table->entry->table_pg) != mdb->fmt->pg_size)
+		return 0;
+	return mdb_map_write_row(mdb, mdb_get_int32(mdb->pg_buf, map_offset),
+		map, map_sz);
+}
+/*
+ * The global usage map has a bit set for every page that is free to be
+ * reused.  Pages it doesn't reach are in use.  It is read once per file.
+ */
+static unsigned char *
+mdb_global_map(MdbHandle *mdb)
+{
+	MdbFile *f = mdb->f;
+	void *buf;
+	int row_start;
+	size_t len;
+
+	if (!f->free_map) {
+		if (mdb_find_pg_row(mdb, MDB_GLOBAL_MAP_PG_ROW, &buf, &row_start, &len)
+		 || len < 5)
+			return NULL;
+		f->free_map = g_memdup(buf + row_start, len);
+		f->map_sz = len;
+	}
+	return f->free_map;
+}
+static void
+mdb_global_map_set(MdbHandle *mdb, guint32 start_pg, guint32 num_pgs, int free)
+{
+	MdbFile *f = mdb->f;
+	unsigned char *map;
+
+	if (!(map = mdb_global_map(mdb)))
+		return;
+	if (mdb_map_set_range(mdb, map, f->map_sz, start_pg, num_pgs, free) < num_pgs
+	 && map[0] == 0)
+		mdb_map_write_row(mdb, MDB_GLOBAL_MAP_PG_ROW, map, f->map_sz);
+}
+/**
+ * mdb_alloc_pages:
+ * @mdb: Database file handle
+ * @num_pgs: number of pages wanted
+ *
+ * Adds a run of pages to the end of the file.  Disk space is reserved in
+ * chunks ahead of need where fallocate() is available, so runs allocated
+ * one after the other stay contiguous on disk too.  The new pages are
+ * zeroed and belong to no table.
+ *
+ * Returns: the first page of the run, or 0 on failure.
+ */
+guint32
+mdb_alloc_pages(MdbHandle *mdb, guint32 num_pgs)
+{
+	MdbFile *f = mdb->f;
+	int pg_size = mdb->fmt->pg_size;
+	struct stat status;
+	guint32 first_pg;
+
+	if (!f->writable || !num_pgs)
+		return 0;
+	if (fstat(f->fd, &status)) {
+		perror("fstat");
+		return 0;
+	}
+	first_pg = (status.st_size + pg_size - 1) / pg_size;
+#ifdef HAVE_FALLOCATE
+	if (first_pg + num_pgs > f->reserved_pgs) {
+		guint32 reserve = first_pg + num_pgs + MDB_ALLOC_CHUNK;
+
+		/* the file size is set below, one run at a time */
+		if (!fallocate(f->fd, FALLOC_FL_KEEP_SIZE,
+				(off_t) first_pg * pg_size,
+				(off_t) (reserve - first_pg) * pg_size))
+			f->reserved_pgs = reserve;
+	}
+#endif
+	if (ftruncate(f->fd, (off_t) (first_pg + num_pgs) * pg_size)) {
+		perror("ftruncate");
+		return 0;
+	}
+	mdb_debug(MDB_DEBUG_WRITE, "allocated pages %d to %d",
+		first_pg, first_pg + num_pgs - 1);
+	mdb_global_map_set(mdb, first_pg, num_pgs, 0);
+
+	return first_pg;
+}
+/**
+ * mdb_free_pages:
+ * @mdb: Database file handle
+ * @start_pg: first page
+ * @num_pgs: number of pages
+ *
+ * Gives back pages that are no longer used.  A run at the end of the file
+ * is cut off, other pages are marked free in the global usage map.
+ */
+void
+mdb_free_pages(MdbHandle *mdb, guint32 start_pg, guint32 num_pgs)
+{
+	int pg_size = mdb->fmt->pg_size;
+	struct stat status;
+
+	if (!num_pgs)
+		return;
+	if (!fstat(mdb->f->fd, &status)
+	 && (off_t) (start_pg + num_pgs) * pg_size == status.st_size
+	 && !ftruncate(mdb->f->fd, (off_t) start_pg * pg_size)) {
+		mdb_drop_dirty_pgs(mdb, start_pg, num_pgs);
+		return;
+	}
+	mdb_global_map_set(mdb, start_pg, num_pgs, 1);
+}
+static int
+mdb_map_is_empty(unsigned char *map, size_t map_sz)
+{
+	unsigned int i;
+
+	for (i=5; i<map_sz; i++) {
+		if (map[i]) return 0;
+	}
+	return 1;
+}
+/*
+ * make sure a type 1 map has the 0x05 pages holding the bits for
+ * start_pg .. start_pg+num_pgs-1
+ */
+static int
+mdb_map_need_pgs(MdbHandle *mdb, unsigned char *map, size_t map_sz, guint32 start_pg, guint32 num_pgs)
+{
+	guint32 usage_bitlen = (mdb->fmt->pg_size - 4) * 8;
+	guint32 map_ind, map_pg;
+
+	for (map_ind = start_pg / usage_bitlen;
+	     map_ind <= (start_pg + num_pgs - 1) / usage_bitlen; map_ind++) {
+		if (map_ind >= (map_sz - 1) / 4)
+			return 0;
+		if (mdb_get_int32(map, (map_ind*4)+1))
+			continue;
+		if (!(map_pg = mdb_alloc_pages(mdb, 1)))
+			return 0;
+		memset(mdb->pg_buf, 0, mdb->fmt->pg_size);
+		mdb->pg_buf[0] = MDB_PAGE_MAP;
+		mdb->pg_buf[1] = 0x01;
+		if (!mdb_write_pg(mdb, map_pg)) {
+			fprintf(stderr, "write failed! exiting...\n");
+			exit(1);
+		}
+		mdb->cur_pg = map_pg;
+		_mdb_put_int32(map, (map_ind*4)+1, map_pg);
+	}
+	return 1;
+}
+/*
+ * Type 0 maps only reach so far from their start page.  An empty one is
+ * moved to start at start_pg, one in use becomes a type 1 map over 0x05
+ * pages.
+ */
+static int
+mdb_map_make_room(MdbHandle *mdb, unsigned char *map, size_t map_sz, guint32 start_pg, guint32 num_pgs)
+{
+	unsigned char *old;
+	guint32 start, run, i, bitlen;
+	int ret;
+
+	if (map[0] == 1)
+		return mdb_map_need_pgs(mdb, map, map_sz, start_pg, num_pgs);
+	if (map[0] != 0)
+		return 0;
+	bitlen = (map_sz - 5) * 8;
+	if (mdb_map_is_empty(map, map_sz) && num_pgs <= bitlen) {
+		_mdb_put_int32(map, 1, start_pg);
+		return 1;
+	}
+
+	old = g_memdup(map, map_sz);
+	start = mdb_get_int32(old, 1);
+	memset(map, 0, map_sz);
+	map[0] = 1;
+	ret = mdb_map_need_pgs(mdb, map, map_sz, start_pg, num_pgs);
+	for (i=0; ret && i<bitlen; i++) {
+		if (!(old[5 + i/8] & (1 << (i%8))))
+			continue;
+		/* copy runs of set bits */
+		for (run=1; i+run<bitlen && (old[5 + (i+run)/8] & (1 << ((i+run)%8))); run++)
+			;
+		if (!mdb_map_need_pgs(mdb, map, map_sz, start + i, run)
+		 || mdb_map_set_range(mdb, map, map_sz, start + i, run, 1))
+			ret = 0;
+		i += run;
+	}
+	if (!ret) {
+		/* leave the map as it was */
+		memcpy(map, old, map_sz);
+	}
+	g_free(old);
+	return ret;
+}
+/**
+ * mdb_map_add_pages:
+ * @table: table the map belongs to
+ * @map_offset: fmt->tab_usage_map_offset or fmt->tab_free_map_offset
+ * @map: the table's copy of that map
+ * @map_sz: its size
+ * @start_pg: first page
+ * @num_pgs: number of pages
+ *
+ * Sets the pages in one of a table's maps, making room for them if the map
+ * doesn't reach them yet, and writes the map back.
+ *
+ * Returns: 1 on success, 0 if the map can't hold the pages.
+ */
+int
+mdb_map_add_pages(MdbTableDef *table, int map_offset, unsigned char *map, size_t map_sz, guint32 start_pg, guint32 num_pgs)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	unsigned char *old = g_memdup(map, map_sz);
+	int changed, ret = 1;
+
+	if (mdb_map_set_range(mdb, map, map_sz, start_pg, num_pgs, 1)
+	 && (!mdb_map_make_room(mdb, map, map_sz, start_pg, num_pgs)
+	  || mdb_map_set_range(mdb, map, map_sz, start_pg, num_pgs, 1)))
+		ret = 0;
+	/* a type 1 row only changes when it gets another map page */
+	changed = memcmp(old, map, map_sz);
+	g_free(old);
+	if (changed && !mdb_map_write(table, map_offset, map, map_sz))
+		ret = 0;
+	return ret;
+}
+/**
+ * mdb_alloc_page:
+ * @table: table the page is for
+ *
+ * Adds an empty data page to the end of the file and to the table's usage
+ * and free space maps.
+ *
+ * Returns: the page number, or 0 if no page could be added.
+ */
 guint32
 mdb_alloc_page(MdbTableDef *table)
 {
-	printf("Allocating new page\n");
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	void *new_pg;
+	guint32 pg;
+
+	if (!(pg = mdb_alloc_pages(mdb, 1)))
+		return 0;
+	new_pg = mdb_new_data_pg(entry);
+	memcpy(mdb->pg_buf, new_pg, fmt->pg_size);
+	g_free(new_pg);
+	if (!mdb_write_pg(mdb, pg)) {
+		fprintf(stderr, "write failed! exiting...\n");
+		exit(1);
+	}
+	mdb->cur_pg = pg;
+
+	if (!mdb_map_add_pages(table, fmt->tab_usage_map_offset, 
+			table->usage_map, table->map_sz, pg, 1)) {
+		fprintf(stderr, "The usage map of table %s has no room for page %lu\n",
+			table->name, (unsigned long) pg);
+		mdb_free_pages(mdb, pg, 1);
+		return 0;
+	}
+	mdb_map_add_pages(table, fmt->tab_free_map_offset,
+		table->free_usage_map, table->freemap_sz, pg, 1);
+	mdb_tdef_drop(mdb, entry->table_pg);
+
+	return pg;
+}
+/*
+ * Free space directory: the data pages of a table that still have room,
+ * bucketed by their free bytes so an insert finds a page without reading
+ * any.  Built on the first insert from the free map and kept up to date
+ * by every write to the table's data pages.
+ */
+typedef struct {
+	guint32	pg;
+	int	room;		/* bytes for a row and its offset */
+	guint	pos;		/* index in its bucket */
+} MdbSpacePage;
+
+typedef struct {
+	GHashTable	*pages;		/* pg -> MdbSpacePage */
+	guint		num_buckets;
+	GPtrArray	**buckets;	/* room / MDB_SPACE_GRANULE */
+} MdbSpaceDir;
+
+static void
+mdb_space_dir_destroy(gpointer data)
+{
+	MdbSpaceDir *dir = data;
+	guint i;
+
+	for (i=0;i<dir->num_buckets;i++)
+		g_ptr_array_free(dir->buckets[i], TRUE);
+	g_free(dir->buckets);
+	g_hash_table_destroy(dir->pages);
+	g_free(dir);
+}
+void
+mdb_free_space_dirs(MdbHandle *mdb)
+{
+	if (!mdb->space_dirs) return;
+	g_hash_table_destroy(mdb->space_dirs);
+	mdb->space_dirs = NULL;
+}
+static int
+mdb_space_dir_room(MdbTableDef *table, unsigned char *pg_buf)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	int rco = mdb->fmt->row_count_offset;
+	int rows, free_end;
+
+	/* the free map may be stale */
+	if (pg_buf[0] != MDB_PAGE_DATA
+	 || mdb_get_int32(pg_buf, 4) != table->entry->table_pg)
+		return 0;
+	rows = mdb_get_int16(pg_buf, rco);
+	if (rows >= MDB_MAX_PG_ROWS)
+		return 0;
+	free_end = mdb_pg_free_end(mdb, pg_buf);
+	return free_end - (rco + 2 + rows*2);
+}
+static void
+mdb_space_dir_set(MdbSpaceDir *dir, guint32 pg, int room)
+{
+	MdbSpacePage *sp;
+	GPtrArray *bucket;
+	guint b;
+
+	sp = g_hash_table_lookup(dir->pages, GUINT_TO_POINTER(pg));
+	if (sp) {
+		bucket = dir->buckets[MIN(sp->room / MDB_SPACE_GRANULE,
+			dir->num_buckets - 1)];
+		g_ptr_array_remove_index_fast(bucket, sp->pos);
+		if (sp->pos < bucket->len)
+			((MdbSpacePage *)g_ptr_array_index(bucket, sp->pos))->pos = sp->pos;
+	}
+	/* two bytes go to the row's offset */
+	if (room <= 2) {
+		if (sp)
+			g_hash_table_remove(dir->pages, GUINT_TO_POINTER(pg));
+		return;
+	}
+	if (!sp) {
+		sp = g_malloc(sizeof(MdbSpacePage));
+		sp->pg = pg;
+		g_hash_table_insert(dir->pages, GUINT_TO_POINTER(pg), sp);
+	}
+	sp->room = room;
+	b = MIN(room / MDB_SPACE_GRANULE, dir->num_buckets - 1);
+	sp->pos = dir->buckets[b]->len;
+	g_ptr_array_add(dir->buckets[b], sp);
+}
+/*
+ * Returns a page with at least need bytes free, or 0 if there is none.
+ * Pages in need's own bucket may fall short: its newest one is tried,
+ * then the smallest bucket that is sure to fit, and only then the rest
+ * of need's bucket.
+ */
+static guint32
+mdb_space_dir_find(MdbSpaceDir *dir, int need)
+{
+	GPtrArray *own, *bucket;
+	MdbSpacePage *sp;
+	guint b, i;
+
+	b = need / MDB_SPACE_GRANULE;
+	if (b >= dir->num_buckets)
+		return 0;
+	own = dir->buckets[b];
+	if (own->len) {
+		sp = g_ptr_array_index(own, own->len - 1);
+		if (sp->room >= need)
+			return sp->pg;
+	}
+	for (b++;b<dir->num_buckets;b++) {
+		bucket = dir->buckets[b];
+		if (bucket->len)
+			return ((MdbSpacePage *)g_ptr_array_index(bucket, bucket->len - 1))->pg;
+	}
+	for (i=0;i+1<own->len;i++) {
+		sp = g_ptr_array_index(own, i);
+		if (sp->room >= need)
+			return sp->pg;
+	}
 	return 0;
 }
-guint32 
-mdb_map_find_next_freepage(MdbTableDef *table, int row_size)
+static MdbSpaceDir *
+mdb_space_dir(MdbTableDef *table)
 {
 	MdbCatalogEntry *entry = table->entry;
 	MdbHandle *mdb = entry->mdb;
-	guint32 pgnum;
-	guint32 cur_pg = 0;
-	int free_space;
-
-	do {
-		pgnum = mdb_map_find_next(mdb, 
-				table->free_usage_map, 
-				table->freemap_sz, cur_pg);
-		//printf("looking at page %d\n", pgnum);
-		if (!pgnum) {
-			/* allocate new page */
-			pgnum = mdb_alloc_page(table);
-			return pgnum;
-		}
-		cur_pg = pgnum;
+	MdbSpaceDir *dir;
+	guint32 pg = 0;
+	guint i;
 
-		mdb_read_pg(mdb, pgnum);
-		free_space = mdb_pg_get_freespace(mdb);
-		
-	} while (free_space < row_size);
+	if (!mdb->space_dirs)
+		mdb->space_dirs = g_hash_table_new_full(g_direct_hash,
+			g_direct_equal, NULL, mdb_space_dir_destroy);
+	dir = g_hash_table_lookup(mdb->space_dirs,
+		GUINT_TO_POINTER(entry->table_pg));
+	if (dir)
+		return dir;
 
-	//printf("page %d has %d bytes left\n", pgnum, free_space);
+	dir = g_malloc0(sizeof(MdbSpaceDir));
+	dir->pages = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+		NULL, g_free);
+	dir->num_buckets = mdb->fmt->pg_size / MDB_SPACE_GRANULE + 1;
+	dir->buckets = g_malloc(dir->num_buckets * sizeof(GPtrArray *));
+	for (i=0;i<dir->num_buckets;i++)
+		dir->buckets[i] = g_ptr_array_new();
+	g_hash_table_insert(mdb->space_dirs,
+		GUINT_TO_POINTER(entry->table_pg), dir);
 
+	/* one pass over the pages the free map offers */
+	while ((pg = mdb_map_find_next(mdb, table->free_usage_map,
+			table->freemap_sz, pg)) && pg != (guint32) -1) {
+		mdb_read_pg(mdb, pg);
+		mdb_space_dir_set(dir, pg, mdb_space_dir_room(table, mdb->pg_buf));
+	}
+	return dir;
+}
+/**
+ * mdb_space_dir_update:
+ * @table: table the page belongs to
+ * @pg: data page that was written
+ * @pg_buf: contents of the page
+ *
+ * Records the free space left on @pg after rows were added to or replaced
+ * on it.  Does nothing until the table's directory has been built.
+ */
+void
+mdb_space_dir_update(MdbTableDef *table, guint32 pg, unsigned char *pg_buf)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbSpaceDir *dir;
+
+	if (!mdb->space_dirs)
+		return;
+	dir = g_hash_table_lookup(mdb->space_dirs,
+		GUINT_TO_POINTER(table->entry->table_pg));
+	if (dir)
+		mdb_space_dir_set(dir, pg, mdb_space_dir_room(table, pg_buf));
+}
+/*
+ * Reads a page with room for a row of row_size bytes into mdb->pg_buf,
+ * adding one to the table if none has.
+ */
+guint32 
+mdb_map_find_next_freepage(MdbTableDef *table, int row_size)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbSpaceDir *dir = mdb_space_dir(table);
+	guint32 pgnum;
+	int room;
+
+	while ((pgnum = mdb_space_dir_find(dir, row_size + 2))) {
+		mdb_read_pg(mdb, pgnum);
+		room = mdb_space_dir_room(table, mdb->pg_buf);
+		if (room >= row_size + 2)
+			return pgnum;
+		/* written through another handle */
+		mdb_space_dir_set(dir, pgnum, room);
+	}
+	pgnum = mdb_alloc_page(table);
+	if (pgnum) {
+		mdb_read_pg(mdb, pgnum);
+		mdb_space_dir_set(dir, pgnum, mdb_space_dir_room(table, mdb->pg_buf));
+	}
 	return pgnum;
 }
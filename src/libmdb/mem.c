@@ -36,6 +36,7 @@
 /* METHOD */ void mdb_init()
 {
 	mdb_init_backends();
+	mdb_init_row_kernels();
 }
 
 /**
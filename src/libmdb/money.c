@@ -24,115 +24,125 @@
 #include "dmalloc.h"
 #endif
 
-#define MAXPRECISION 19
-/* 
-** these routines are copied from the freetds project which does something
-** very similiar
-*/
+/* MONEY is a 64 bit integer scaled by 10^4 */
+#define MDB_MONEY_SCALE 4
 
-static int multiply_byte(unsigned char *product, int num, unsigned char *multiplier);
-static int do_carry(unsigned char *product);
-static char *array_to_string(unsigned char *array, int unsigned scale, int neg);
-
-/**
- * mdb_money_to_string
- * @mdb: Handle to open MDB database file
- * @start: Offset of the field within the current page
- *
- * Returns: the allocated string that has received the value.
+/*
+ * write a string of decimal digits with the point placed scale digits
+ * from the right, padding with zeros so there is always a digit before it
  */
-char *mdb_money_to_string(MdbHandle *mdb, int start)
+static int
+mdb_format_scaled(const char *digits, int ndigits, int neg, int scale, char *buf)
 {
-	const int num_bytes = 8;
-	int i;
-	int neg=0;
-	unsigned char multiplier[MAXPRECISION], temp[MAXPRECISION];
-	unsigned char product[MAXPRECISION];
-	unsigned char money[num_bytes];
-
-	memset(multiplier,0,MAXPRECISION);
-	memset(product,0,MAXPRECISION);
-	multiplier[0]=1;
-	memcpy(money, mdb->pg_buf + start, num_bytes);
+	int i, j = 0;
 
-	/* Perform two's complement for negative numbers */
-	if (money[7] & 0x80) {
-		neg = 1;
-		for (i=0;i<num_bytes;i++) {
-			money[i] = ~money[i];
-		}
-		for (i=0; i<num_bytes; i++) {
-			money[i] ++;
-			if (money[i]!=0) break;
+	if (neg)
+		buf[j++] = '-';
+	if (ndigits <= scale) {
+		buf[j++] = '0';
+		if (scale)
+			buf[j++] = '.';
+		for (i=ndigits; i<scale; i++)
+			buf[j++] = '0';
+		memcpy(buf + j, digits, ndigits);
+		j += ndigits;
+	} else {
+		memcpy(buf + j, digits, ndigits - scale);
+		j += ndigits - scale;
+		if (scale) {
+			buf[j++] = '.';
+			memcpy(buf + j, digits + ndigits - scale, scale);
+			j += scale;
 		}
 	}
+	buf[j] = '\0';
 
-	for (i=0;i<num_bytes;i++) {
-		/* product += multiplier * current byte */
-		multiply_byte(product, money[i], multiplier);
-
-		/* multiplier = multiplier * 256 */
-		memcpy(temp, multiplier, MAXPRECISION);
-		memset(multiplier,0,MAXPRECISION);
-		multiply_byte(multiplier, 256, temp);
-	}
-	return array_to_string(product, 4, neg);
+	return j;
 }
-static int multiply_byte(unsigned char *product, int num, unsigned char *multiplier)
+/**
+ * mdb_money_to_buf
+ * @src: pointer to the 8 byte field value
+ * @buf: buffer of at least MDB_NUMERIC_BUFSZ bytes
+ *
+ * Returns: the length of the string written to @buf.
+ */
+int
+mdb_money_to_buf(const unsigned char *src, char *buf)
 {
-	unsigned char number[3];
-	unsigned int i, j;
-
-	number[0]=num%10;
-	number[1]=(num/10)%10;
-	number[2]=(num/100)%10;
-
-	for (i=0;i<MAXPRECISION;i++) {
-		if (multiplier[i] == 0) continue;
-		for (j=0;j<3;j++) {
-			if (number[j] == 0) continue;
-			product[i+j] += multiplier[i]*number[j];
-		}
-		do_carry(product);
+	char digits[20];
+	gint64 v;
+	guint64 u;
+	int n = sizeof(digits);
+	int neg;
+
+	memcpy(&v, src, 8);
+	v = GINT64_FROM_LE(v);
+	neg = (v < 0);
+	/* negate as unsigned so the most negative value survives */
+	u = neg ? -(guint64)v : (guint64)v;
+	while (u) {
+		digits[--n] = '0' + u % 10;
+		u /= 10;
 	}
-	return 0;
+	return mdb_format_scaled(digits + n, sizeof(digits) - n, neg,
+		MDB_MONEY_SCALE, buf);
 }
-static int do_carry(unsigned char *product)
+/**
+ * mdb_numeric_to_buf
+ * @src: pointer to the 17 byte field value
+ * @scale: number of digits after the decimal point
+ * @buf: buffer of at least MDB_NUMERIC_BUFSZ bytes
+ *
+ * Returns: the length of the string written to @buf.
+ */
+int
+mdb_numeric_to_buf(const unsigned char *src, int scale, char *buf)
 {
-	unsigned int j;
-
-	for (j=0;j<MAXPRECISION-1;j++) {
-		if (product[j]>9) {
-			product[j+1]+=product[j]/10;
-			product[j]=product[j]%10;
+	char digits[40];
+	guint32 word[4], chunk, more;
+	guint64 rem;
+	int n = sizeof(digits);
+	int i, k;
+
+	if (scale < 0) scale = 0;
+	if (scale > 38) scale = 38;
+
+	/* a sign byte, then the 128 bit mantissa stored as four little
+	 * endian 32 bit words with the most significant word first */
+	for (i=0; i<4; i++)
+		word[i] = (guint32) mdb_get_int32((void *)src, 1 + i*4);
+
+	/* peel off nine digits at a time */
+	do {
+		rem = 0;
+		more = 0;
+		for (i=0; i<4; i++) {
+			rem = (rem << 32) | word[i];
+			word[i] = rem / 1000000000;
+			rem %= 1000000000;
+			more |= word[i];
 		}
-	}
-	if (product[j]>9) {
-		product[j]=product[j]%10;
-	}
-	return 0;
+		chunk = rem;
+		for (k=0; k<9 && (more || chunk); k++) {
+			digits[--n] = '0' + chunk % 10;
+			chunk /= 10;
+		}
+	} while (more);
+
+	return mdb_format_scaled(digits + n, sizeof(digits) - n,
+		(src[0] & 0x80) && n < sizeof(digits), scale, buf);
 }
-static char *array_to_string(unsigned char *array, unsigned int scale, int neg)
+/**
+ * mdb_money_to_string
+ * @mdb: Handle to open MDB database file
+ * @start: Offset of the field within the current page
+ *
+ * Returns: the allocated string that has received the value.
+ */
+char *mdb_money_to_string(MdbHandle *mdb, int start)
 {
-	char *s;
-	unsigned int top, i, j=0;
-	
-	for (top=MAXPRECISION;(top>0) && (top-1>scale) && !array[top-1];top--);
-
-	s = (char *) g_malloc(22);
-
-	if (neg)
-		s[j++] = '-';
-
-	if (top == 0) {
-		s[j++] = '0';
-	} else {
-		for (i=top; i>0; i--) {
-			if (i == scale) s[j++]='.';
-			s[j++]=array[i-1]+'0';
-		}
-	}
-	s[j]='\0';
+	char *s = (char *) g_malloc(MDB_NUMERIC_BUFSZ);
 
+	mdb_money_to_buf(mdb->pg_buf + start, s);
 	return s;
 }
@@ -67,6 +67,7 @@ load_options()
         	if (!strcmp(opt, "debug_usage")) opts |= MDB_DEBUG_USAGE;
         	if (!strcmp(opt, "debug_ole")) opts |= MDB_DEBUG_OLE;
         	if (!strcmp(opt, "debug_row")) opts |= MDB_DEBUG_ROW;
+        	if (!strcmp(opt, "no_simd")) opts |= MDB_NO_SIMD;
         	if (!strcmp(opt, "debug_all")) {
 				opts |= MDB_DEBUG_LIKE;
 				opts |= MDB_DEBUG_WRITE;
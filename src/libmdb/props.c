@@ -20,6 +20,13 @@
 
 #include "mdbtools.h"
 
+static gboolean
+mdb_free_prop_value(gpointer key, gpointer value, gpointer user_data)
+{
+	g_free(key);
+	g_free(value);
+	return TRUE;
+}
 GPtrArray *
 mdb_read_props_list(gchar *kkd, int len)
 {
@@ -58,8 +65,22 @@ mdb_free_props(MdbProperties *props)
 	if (!props) return;
 
 	if (props->name) g_free(props->name);
+	if (props->hash) {
+		g_hash_table_foreach_remove(props->hash, mdb_free_prop_value, NULL);
+		g_hash_table_destroy(props->hash);
+	}
 	g_free(props);
 }
+void
+mdb_free_props_list(GPtrArray *props)
+{
+	unsigned int i;
+
+	if (!props) return;
+	for (i=0; i<props->len; i++)
+		mdb_free_props(g_ptr_array_index(props, i));
+	g_ptr_array_free(props, TRUE);
+}
 MdbProperties *
 mdb_alloc_props()
 {
@@ -127,3 +148,125 @@ mdb_read_props(MdbHandle *mdb, GPtrArray *names, gchar *kkd, int len)
 	return props;
 	
 }
+/*
+ * read the LvProp value of the table's MSysObjects row into a list of
+ * MdbProperties, one for the table and one for each column having any.
+ */
+static GPtrArray *
+mdb_load_props(MdbTableDef *table)
+{
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbCatalogEntry msysobj;
+	MdbTableDef *msys;
+	MdbColumn *col = NULL;
+	MdbBlob *blob;
+	GPtrArray *props, *names = NULL;
+	gchar *kkd;
+	size_t len = 0, sz = 4096, n;
+	guint32 record_len;
+	guint16 record_type;
+	size_t pos;
+	unsigned int i;
+
+	props = g_ptr_array_new();
+	if (!entry->row_pg)
+		return props;
+
+	memset(&msysobj, 0, sizeof(MdbCatalogEntry));
+	msysobj.mdb = mdb;
+	msysobj.object_type = MDB_TABLE;
+	msysobj.table_pg = 2;
+	strcpy(msysobj.object_name, "MSysObjects");
+	msys = mdb_read_table(&msysobj);
+	if (!msys)
+		return props;
+	mdb_read_columns(msys);
+	for (i=0; i<msys->num_cols; i++) {
+		col = g_ptr_array_index(msys->columns, i);
+		if (!strcasecmp(col->name, "LvProp"))
+			break;
+		col = NULL;
+	}
+	mdb_read_pg(mdb, entry->row_pg);
+	if (!col || !mdb_read_row(msys, entry->row_num) || !col->cur_value_len) {
+		mdb_free_tabledef(msys);
+		return props;
+	}
+
+	kkd = g_malloc(sz);
+	blob = mdb_blob_open(mdb, col);
+	while ((n = mdb_blob_read(blob, kkd + len, sz - len))) {
+		len += n;
+		if (len == sz)
+			kkd = g_realloc(kkd, sz *= 2);
+	}
+	mdb_blob_close(blob);
+	mdb_free_tabledef(msys);
+
+	if (len < 4 || strncmp("KKD", kkd, 4)) {
+		g_free(kkd);
+		return props;
+	}
+	pos = 4;
+	while (pos + 6 <= len) {
+		record_len = mdb_get_int32(kkd, pos);
+		record_type = mdb_get_int16(kkd, pos + 4);
+		if (record_len < 6 || pos + record_len > len)
+			break;
+		if (record_type == 0x80) {
+			if (names) {
+				for (i=0; i<names->len; i++)
+					g_free(g_ptr_array_index(names, i));
+				g_ptr_array_free(names, TRUE);
+			}
+			names = mdb_read_props_list(kkd+pos+6, record_len - 6);
+		} else if ((record_type == 0x00 || record_type == 0x01) && names) {
+			g_ptr_array_add(props, 
+				mdb_read_props(mdb, names, kkd+pos+6, record_len - 6));
+		}
+		pos += record_len;
+	}
+	if (names) {
+		for (i=0; i<names->len; i++)
+			g_free(g_ptr_array_index(names, i));
+		g_ptr_array_free(names, TRUE);
+	}
+	g_free(kkd);
+
+	return props;
+}
+/**
+ * mdb_get_props:
+ * @table: a table read by mdb_read_table()
+ * @name: a column name, or NULL for the table's own properties
+ *
+ * Properties are read from MSysObjects the first time any of a table's
+ * are asked for and kept with its definition.
+ *
+ * Returns: the properties, owned by the table definition, or NULL.
+ */
+MdbProperties *
+mdb_get_props(MdbTableDef *table, const gchar *name)
+{
+	MdbTdef *tdef = table->tdef;
+	MdbProperties *props;
+	unsigned int i;
+
+	if (!tdef)
+		return NULL;
+	if (!tdef->props_read) {
+		tdef->props = mdb_load_props(table);
+		tdef->props_read = 1;
+	}
+	for (i=0; i<tdef->props->len; i++) {
+		props = g_ptr_array_index(tdef->props, i);
+		if (!name) {
+			/* the table's record comes first */
+			return i ? NULL : props;
+		}
+		if (props->name && !strcasecmp(props->name, name))
+			return props;
+	}
+	return NULL;
+}
@@ -49,6 +49,9 @@ int rc;
 	if (node->op == MDB_LIKE) {
 		return mdb_like_cmp(s,node->value.s);
 	}
+	if (node->op == MDB_IN) {
+		return mdb_sarg_set_find_string(node->set, s);
+	}
 	rc = strncmp(node->value.s, s, 255);
 	switch (node->op) {
 		case MDB_EQUAL:
@@ -75,6 +78,9 @@ int rc;
 int mdb_test_int(MdbSargNode *node, gint32 i)
 {
 	switch (node->op) {
+		case MDB_IN:
+			return mdb_sarg_set_find_int(node->set, i);
+			break;
 		case MDB_EQUAL:
 			//fprintf(stderr, "comparing %ld and %ld\n", i, node->value.i);
 			if (node->value.i == i) return 1;
@@ -123,6 +129,7 @@ mdb_find_indexable_sargs(MdbSargNode *node, gpointer data)
 		//printf("op = %d value = %s\n", node->op, node->value.s);
 		sarg.op = node->op;
 		sarg.value = node->value;
+		sarg.set = node->set;
 		mdb_add_sarg(node->col, &sarg);
 	}
 	return 0;
@@ -250,6 +257,34 @@ MdbSarg *sarg;
 
 	return 1;
 }
+/*
+ * Drop the sargs gathered for index scans, along with their index key
+ * forms, so they can be gathered again from a sarg tree with new values.
+ */
+void mdb_clear_sargs(MdbColumn *col)
+{
+	MdbSarg *sarg;
+	unsigned int i;
+
+	if (col->idx_sarg_cache) {
+		for (i=0;i<col->idx_sarg_cache->len;i++) {
+			sarg = g_ptr_array_index(col->idx_sarg_cache, i);
+			/* IN sets are converted to a set of their own */
+			if (sarg->op == MDB_IN && sarg->set)
+				mdb_free_sarg_set(sarg->set);
+			g_free(sarg);
+		}
+		g_ptr_array_free(col->idx_sarg_cache, TRUE);
+		col->idx_sarg_cache = NULL;
+	}
+	if (col->sargs) {
+		for (i=0;i<col->sargs->len;i++)
+			g_free(g_ptr_array_index(col->sargs, i));
+		g_ptr_array_free(col->sargs, TRUE);
+		col->sargs = NULL;
+	}
+	col->num_sargs = 0;
+}
 int mdb_add_sarg_by_name(MdbTableDef *table, char *colname, MdbSarg *in_sarg)
 {
 	MdbColumn *col;
@@ -264,3 +299,101 @@ int mdb_add_sarg_by_name(MdbTableDef *table, char *colname, MdbSarg *in_sarg)
 	/* else didn't find the column return 0! */
 	return 0;
 }
+/*
+ * Constant sets for the IN operator.  Values are appended while the query is
+ * parsed and then sorted once, so testing a row is a binary search no matter
+ * how many constants are in the list.
+ */
+MdbSargSet *
+mdb_alloc_sarg_set()
+{
+	MdbSargSet *set;
+
+	set = (MdbSargSet *) g_malloc0(sizeof(MdbSargSet));
+	set->ints = g_array_new(FALSE, FALSE, sizeof(gint32));
+	set->strs = g_ptr_array_new();
+
+	return set;
+}
+void
+mdb_free_sarg_set(MdbSargSet *set)
+{
+	unsigned int i;
+
+	if (!set) return;
+	g_array_free(set->ints, TRUE);
+	for (i=0; i<set->strs->len; i++)
+		g_free(g_ptr_array_index(set->strs, i));
+	g_ptr_array_free(set->strs, TRUE);
+	g_free(set);
+}
+void
+mdb_sarg_set_add_int(MdbSargSet *set, gint32 i)
+{
+	g_array_append_val(set->ints, i);
+	set->sorted = FALSE;
+}
+void
+mdb_sarg_set_add_string(MdbSargSet *set, char *s)
+{
+	g_ptr_array_add(set->strs, g_strdup(s));
+	set->sorted = FALSE;
+}
+static gint
+mdb_sarg_int_comparer(gint32 *a, gint32 *b)
+{
+	if (*a > *b)
+		return 1;
+	else if (*a < *b)
+		return -1;
+	else
+		return 0;
+}
+static gint
+mdb_sarg_str_comparer(char **a, char **b)
+{
+	return strcmp(*a, *b);
+}
+void
+mdb_sarg_set_sort(MdbSargSet *set)
+{
+	if (set->sorted) return;
+	g_array_sort(set->ints, (GCompareFunc)mdb_sarg_int_comparer);
+	g_ptr_array_sort(set->strs, (GCompareFunc)mdb_sarg_str_comparer);
+	set->sorted = TRUE;
+}
+int
+mdb_sarg_set_find_int(MdbSargSet *set, gint32 i)
+{
+	int lo = 0, hi, mid;
+	gint32 v;
+
+	if (!set) return 0;
+	mdb_sarg_set_sort(set);
+	hi = set->ints->len - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		v = g_array_index(set->ints, gint32, mid);
+		if (v == i) return 1;
+		if (v < i) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return 0;
+}
+int
+mdb_sarg_set_find_string(MdbSargSet *set, char *s)
+{
+	int lo = 0, hi, mid, rc;
+
+	if (!set) return 0;
+	mdb_sarg_set_sort(set);
+	hi = set->strs->len - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		rc = strcmp(g_ptr_array_index(set->strs, mid), s);
+		if (!rc) return 1;
+		if (rc < 0) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return 0;
+}
@@ -24,25 +24,6 @@
 #endif
 
 
-static char *sanitize_name(char *str, int sanitize)
- {
- 	static char namebuf[256];
- 	char *p = namebuf;
-
- 	if (!sanitize)
- 		return str;
-
- 	while (*str) {
- 		*p = isalnum(*str) ? *str : '_';
- 		p++;
- 		str++;
- 	}
-
- 	*p = 0;
-
- 	return namebuf;
- }
-
 static gint mdb_col_comparer(MdbColumn **a, MdbColumn **b)
 {
 	if ((*a)->col_num > (*b)->col_num)
@@ -81,70 +62,143 @@ void mdb_free_tabledef(MdbTableDef *table)
 		for (i=0; i<table->temp_table_pages->len; i++)
 			g_free(g_ptr_array_index(table->temp_table_pages,i));
 		g_ptr_array_free(table->temp_table_pages, TRUE);
+		if (table->row_source) {
+			if (table->row_source->free)
+				table->row_source->free(table->row_source->data);
+			g_free(table->row_source);
+		}
 		/* Temp tables use dummy entries */
 		g_free(table->entry);
 	}
+	mdb_index_scan_free(table);
+	mdb_free_page_crack(table->page_crack);
+	mdb_tdef_unref(table->tdef);
 	mdb_free_columns(table->columns);
 	mdb_free_indices(table->indices);
 	g_free(table->usage_map);
 	g_free(table->free_usage_map);
 	g_free(table);
 }
-MdbTableDef *mdb_read_table(MdbCatalogEntry *entry)
+/* read the fixed part of a TDEF page and the maps it points at */
+static MdbTdef *mdb_tdef_read(MdbHandle *mdb, guint32 table_pg)
 {
-	MdbTableDef *table;
-	MdbHandle *mdb = entry->mdb;
+	MdbTdef *tdef;
 	MdbFormatConstants *fmt = mdb->fmt;
-	int len, row_start, pg_row;
+	int row_start, pg_row;
 	void *buf, *pg_buf = mdb->pg_buf;
 
-	mdb_read_pg(mdb, entry->table_pg);
+	mdb_read_pg(mdb, table_pg);
 	if (mdb_get_byte(pg_buf, 0) != 0x02)  /* not a valid table def page */
 		return NULL;
-	table = mdb_alloc_tabledef(entry);
+	tdef = (MdbTdef *) g_malloc0(sizeof(MdbTdef));
+	tdef->table_pg = table_pg;
+	tdef->refs = 1;
 
-	len = mdb_get_int16(pg_buf, 8);
-
-	table->num_rows = mdb_get_int32(pg_buf, fmt->tab_num_rows_offset);
-	table->num_var_cols = mdb_get_int16(pg_buf, fmt->tab_num_cols_offset-2);
-	table->num_cols = mdb_get_int16(pg_buf, fmt->tab_num_cols_offset);
-	table->num_idxs = mdb_get_int32(pg_buf, fmt->tab_num_idxs_offset);
-	table->num_real_idxs = mdb_get_int32(pg_buf, fmt->tab_num_ridxs_offset);
+	tdef->num_rows = mdb_get_int32(pg_buf, fmt->tab_num_rows_offset);
+	tdef->num_var_cols = mdb_get_int16(pg_buf, fmt->tab_num_cols_offset-2);
+	tdef->num_cols = mdb_get_int16(pg_buf, fmt->tab_num_cols_offset);
+	tdef->num_idxs = mdb_get_int32(pg_buf, fmt->tab_num_idxs_offset);
+	tdef->num_real_idxs = mdb_get_int32(pg_buf, fmt->tab_num_ridxs_offset);
+	tdef->num_used_idxs = tdef->num_real_idxs;
 
 	/* grab a copy of the usage map */
 	pg_row = mdb_get_int32(pg_buf, fmt->tab_usage_map_offset);
-	mdb_find_pg_row(mdb, pg_row, &buf, &row_start, &(table->map_sz));
-	table->usage_map = g_memdup(buf + row_start, table->map_sz);
+	mdb_find_pg_row(mdb, pg_row, &buf, &row_start, &(tdef->map_sz));
+	tdef->usage_map = g_memdup(buf + row_start, tdef->map_sz);
 	if (mdb_get_option(MDB_DEBUG_USAGE)) 
-		buffer_dump(buf, row_start, table->map_sz);
+		buffer_dump(buf, row_start, tdef->map_sz);
 	mdb_debug(MDB_DEBUG_USAGE,"usage map found on page %ld row %d start %d len %d",
-		pg_row >> 8, pg_row & 0xff, row_start, table->map_sz);
+		pg_row >> 8, pg_row & 0xff, row_start, tdef->map_sz);
 
 	/* grab a copy of the free space page map */
 	pg_row = mdb_get_int32(pg_buf, fmt->tab_free_map_offset);
-	mdb_find_pg_row(mdb, pg_row, &buf, &row_start, &(table->freemap_sz));
-	table->free_usage_map = g_memdup(buf + row_start, table->freemap_sz);
+	mdb_find_pg_row(mdb, pg_row, &buf, &row_start, &(tdef->freemap_sz));
+	tdef->free_usage_map = g_memdup(buf + row_start, tdef->freemap_sz);
 	mdb_debug(MDB_DEBUG_USAGE,"free map found on page %ld row %d start %d len %d\n",
-		pg_row >> 8, pg_row & 0xff, row_start, table->freemap_sz);
+		pg_row >> 8, pg_row & 0xff, row_start, tdef->freemap_sz);
+
+	tdef->first_data_pg = mdb_get_int16(pg_buf, fmt->tab_first_dpg_offset);
+
+	return tdef;
+}
+void mdb_tdef_unref(MdbTdef *tdef)
+{
+	if (!tdef || --tdef->refs > 0) return;
+
+	mdb_free_columns(tdef->columns);
+	mdb_free_indices(tdef->indices);
+	mdb_free_props_list(tdef->props);
+	g_free(tdef->usage_map);
+	g_free(tdef->free_usage_map);
+	g_free(tdef);
+}
+/*
+ * Forget the cached definition of a table that was written to.  Tables
+ * open on it keep their reference; the next open reads the pages again.
+ */
+void mdb_tdef_drop(MdbHandle *mdb, guint32 table_pg)
+{
+	if (mdb->tdefs)
+		g_hash_table_remove(mdb->tdefs, GUINT_TO_POINTER(table_pg));
+}
+void mdb_free_tdefs(MdbHandle *mdb)
+{
+	if (!mdb->tdefs) return;
+	g_hash_table_destroy(mdb->tdefs);
+	mdb->tdefs = NULL;
+}
+/* the handle's definition of the table, read if not cached yet */
+static MdbTdef *mdb_tdef_get(MdbHandle *mdb, guint32 table_pg)
+{
+	MdbTdef *tdef;
+
+	if (!mdb->tdefs)
+		mdb->tdefs = g_hash_table_new_full(g_direct_hash, 
+			g_direct_equal, NULL, (GDestroyNotify)mdb_tdef_unref);
+	tdef = g_hash_table_lookup(mdb->tdefs, GUINT_TO_POINTER(table_pg));
+	if (!tdef) {
+		tdef = mdb_tdef_read(mdb, table_pg);
+		if (!tdef) return NULL;
+		g_hash_table_insert(mdb->tdefs, GUINT_TO_POINTER(table_pg), tdef);
+	}
+	tdef->refs++;
+	return tdef;
+}
+MdbTableDef *mdb_read_table(MdbCatalogEntry *entry)
+{
+	MdbTableDef *table;
+	MdbTdef *tdef;
+
+	tdef = mdb_tdef_get(entry->mdb, entry->table_pg);
+	if (!tdef)
+		return NULL;
+	table = mdb_alloc_tabledef(entry);
+	table->tdef = tdef;
+
+	table->num_rows = tdef->num_rows;
+	table->num_var_cols = tdef->num_var_cols;
+	table->num_cols = tdef->num_cols;
+	table->num_idxs = tdef->num_idxs;
+	table->num_real_idxs = tdef->num_real_idxs;
+	table->first_data_pg = tdef->first_data_pg;
 
-	table->first_data_pg = mdb_get_int16(pg_buf, fmt->tab_first_dpg_offset);
+	/* the maps are the table's own, writers update them */
+	table->map_sz = tdef->map_sz;
+	table->usage_map = g_memdup(tdef->usage_map, tdef->map_sz);
+	table->freemap_sz = tdef->freemap_sz;
+	table->free_usage_map = g_memdup(tdef->free_usage_map, tdef->freemap_sz);
 
 	return table;
 }
 MdbTableDef *mdb_read_table_by_name(MdbHandle *mdb, gchar *table_name, int obj_type)
 {
-	unsigned int i;
 	MdbCatalogEntry *entry;
 
-	mdb_read_catalog(mdb, obj_type);
-
-	for (i=0; i<mdb->num_catalog; i++) {
-		entry = g_ptr_array_index(mdb->catalog, i);
-		if (!strcasecmp(entry->object_name, table_name) || !strcasecmp(sanitize_name(entry->object_name, 1), table_name))
-			return mdb_read_table(entry);
-	}
+	entry = mdb_get_catalogentry_by_name(mdb, table_name, obj_type);
+	if (!entry)
+		return NULL;
 
-	return NULL;
+	return mdb_read_table(entry);
 }
 
 
@@ -218,9 +272,9 @@ void mdb_free_columns(GPtrArray *columns)
 		g_free (g_ptr_array_index(columns, i));
 	g_ptr_array_free(columns, TRUE);
 }
-GPtrArray *mdb_read_columns(MdbTableDef *table)
+/* read the column definitions following the TDEF header */
+static void mdb_tdef_read_columns(MdbHandle *mdb, MdbTdef *tdef)
 {
-	MdbHandle *mdb = table->entry->mdb;
 	MdbFormatConstants *fmt = mdb->fmt;
 	MdbColumn *pcol;
 	unsigned char *col;
@@ -228,19 +282,21 @@ GPtrArray *mdb_read_columns(MdbTableDef *table)
 	int cur_pos;
 	size_t name_sz;
 	
-	table->columns = g_ptr_array_new();
+	tdef->columns = g_ptr_array_new();
+
+	mdb_read_pg(mdb, tdef->table_pg);
 
 	col = (unsigned char *) g_malloc(fmt->tab_col_entry_size);
 
 	cur_pos = fmt->tab_cols_start_offset + 
-		(table->num_real_idxs * fmt->tab_ridx_entry_size);
+		(tdef->num_real_idxs * fmt->tab_ridx_entry_size);
 
 	/* new code based on patch submitted by Tim Nelson 2000.09.27 */
 
 	/* 
 	** column attributes 
 	*/
-	for (i=0;i<table->num_cols;i++) {
+	for (i=0;i<tdef->num_cols;i++) {
 #ifdef MDB_DEBUG
 	/* printf("column %d\n", i);
 	buffer_dump(mdb->pg_buf, cur_pos, fmt->tab_col_entry_size); */
@@ -283,7 +339,7 @@ GPtrArray *mdb_read_columns(MdbTableDef *table)
 			pcol->col_size=0;
 		}
 		
-		g_ptr_array_add(table->columns, pcol);
+		g_ptr_array_add(tdef->columns, pcol);
 	}
 
 	g_free (col);
@@ -291,9 +347,9 @@ GPtrArray *mdb_read_columns(MdbTableDef *table)
 	/* 
 	** column names - ordered the same as the column attributes table
 	*/
-	for (i=0;i<table->num_cols;i++) {
+	for (i=0;i<tdef->num_cols;i++) {
 		char *tmp_buf;
-		pcol = g_ptr_array_index(table->columns, i);
+		pcol = g_ptr_array_index(tdef->columns, i);
 
 		if (IS_JET4(mdb)) {
 			name_sz = read_pg_if_16(mdb, &cur_pos);
@@ -311,9 +367,25 @@ GPtrArray *mdb_read_columns(MdbTableDef *table)
 	}
 
 	/* Sort the columns by col_num */
-	g_ptr_array_sort(table->columns, (GCompareFunc)mdb_col_comparer);
+	g_ptr_array_sort(tdef->columns, (GCompareFunc)mdb_col_comparer);
+
+	tdef->index_pg = mdb->cur_pg;
+	tdef->index_start = cur_pos;
+}
+GPtrArray *mdb_read_columns(MdbTableDef *table)
+{
+	MdbTdef *tdef = table->tdef;
+	unsigned int i;
+
+	if (!tdef->columns)
+		mdb_tdef_read_columns(table->entry->mdb, tdef);
+
+	table->columns = g_ptr_array_sized_new(tdef->columns->len);
+	for (i=0;i<tdef->columns->len;i++)
+		mdb_append_column(table->columns, 
+			g_ptr_array_index(tdef->columns, i));
 
-	table->index_start = cur_pos;
+	table->index_start = tdef->index_start;
 	return table->columns;
 }
 
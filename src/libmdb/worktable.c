@@ -97,3 +97,12 @@ void mdb_temp_columns_end(MdbTableDef *table)
 		}
 	}
 }
+/*
+ * Take the rows of a temp table from source rather than from its pages.
+ * The source is freed along with the table.
+ */
+void
+mdb_temp_table_set_source(MdbTableDef *table, MdbRowSource *source)
+{
+	table->row_source = g_memdup(source, sizeof(MdbRowSource));
+}
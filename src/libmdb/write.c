@@ -17,18 +17,30 @@
  * Boston, MA 02111-1307, USA.
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include "mdbtools.h"
 #include "time.h"
 #include "math.h"
+#include <errno.h>
+#ifdef HAVE_PWRITEV
+#include <sys/uio.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) \
+ && (__GNUC__ >= 5 || defined(__clang__))
+#define MDB_SSE2_KERNELS
+#include <emmintrin.h>
+#define MDB_SSE2 __attribute__((target("sse2")))
+#endif
 
 #ifdef DMALLOC
 #include "dmalloc.h"
 #endif
 
 
-//static int mdb_copy_index_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg);
-static int mdb_add_row_to_leaf_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg, MdbField *idx_fields, guint32 pgnum, guint16 rownum);
-
 void
 _mdb_put_int16(void *buf, guint32 offset, guint32 value)
 {
@@ -47,30 +59,233 @@ _mdb_put_int32_msb(void *buf, guint32 offset, guint32 value)
 	value = GINT32_TO_BE(value);
 	memcpy(buf + offset, &value, 4);
 }
+/* pages held back before mdb_maybe_flush() flushes */
+#define MDB_MAX_DIRTY_PGS 1024
+/* pages per pwritev() call */
+#define MDB_FLUSH_IOV 64
+
+/*
+ * mdb_write_pg() only copies the page into the file's dirty set, so a
+ * page written many times in a row reaches the disk once.  mdb_flush()
+ * writes the set in page order, adjacent pages in one call, and reads
+ * of a dirty page are served from the set.
+ */
 ssize_t
 mdb_write_pg(MdbHandle *mdb, unsigned long pg)
 {
-	ssize_t len;
-	struct stat status;
-	off_t offset = pg * mdb->fmt->pg_size;
+	MdbFile *f = mdb->f;
+	int pg_size = mdb->fmt->pg_size;
+	unsigned char *buf;
 
-	fstat(mdb->f->fd, &status);
-	/* is page beyond current size + 1 ? */
-	if (status.st_size < offset + mdb->fmt->pg_size) {
-		fprintf(stderr,"offset %lu is beyond EOF\n",offset);
+	if (!f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
 		return 0;
 	}
-	lseek(mdb->f->fd, offset, SEEK_SET);
-	len = write(mdb->f->fd,mdb->pg_buf,mdb->fmt->pg_size);
-	if (len==-1) {
-		perror("write");
+	if (!f->dirty_pgs)
+		f->dirty_pgs = g_hash_table_new_full(g_direct_hash,
+			g_direct_equal, NULL, g_free);
+	buf = g_hash_table_lookup(f->dirty_pgs, GUINT_TO_POINTER(pg));
+	if (!buf) {
+		buf = g_malloc(pg_size);
+		g_hash_table_insert(f->dirty_pgs, GUINT_TO_POINTER(pg), buf);
+	}
+	memcpy(buf, mdb->pg_buf, pg_size);
+	f->pg_writes++;
+	mdb->cur_pos = 0;
+	return pg_size;
+}
+static gint
+mdb_pg_num_cmp(gconstpointer a, gconstpointer b)
+{
+	guint32 pa = *(guint32 *)a, pb = *(guint32 *)b;
+
+	return (pa > pb) - (pa < pb);
+}
+static void
+mdb_collect_pg(gpointer key, gpointer value, gpointer data)
+{
+	guint32 pg = GPOINTER_TO_UINT(key);
+
+	g_array_append_val((GArray *)data, pg);
+}
+/* write num pages starting at first_pg, the contents taken from the dirty set */
+static int
+mdb_write_run(MdbHandle *mdb, guint32 first_pg, guint num)
+{
+	MdbFile *f = mdb->f;
+	int pg_size = mdb->fmt->pg_size;
+	off_t offset = (off_t) first_pg * pg_size;
+	ssize_t len;
+	guint i;
+#ifdef HAVE_PWRITEV
+	struct iovec *iov, *v;
+	int ret = 1;
+
+	iov = g_malloc(num * sizeof(struct iovec));
+	for (i=0;i<num;i++) {
+		iov[i].iov_base = g_hash_table_lookup(f->dirty_pgs,
+			GUINT_TO_POINTER(first_pg + i));
+		iov[i].iov_len = pg_size;
+	}
+	v = iov;
+	while (num) {
+		len = pwritev(f->fd, v, MIN(num, MDB_FLUSH_IOV), offset);
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			perror("pwritev");
+			ret = 0;
+			break;
+		}
+		offset += len;
+		/* step over what was written, part of a page included */
+		while (num && len >= (ssize_t) v->iov_len) {
+			len -= v->iov_len;
+			v++;
+			num--;
+		}
+		if (len) {
+			v->iov_base = (char *) v->iov_base + len;
+			v->iov_len -= len;
+		}
+	}
+	g_free(iov);
+	return ret;
+#else
+	lseek(f->fd, offset, SEEK_SET);
+	for (i=0;i<num;i++) {
+		len = write(f->fd, g_hash_table_lookup(f->dirty_pgs,
+			GUINT_TO_POINTER(first_pg + i)), pg_size);
+		if (len != pg_size) {
+			perror("write");
+			return 0;
+		}
+	}
+	return 1;
+#endif
+}
+/**
+ * mdb_flush:
+ * @mdb: Database file handle
+ *
+ * Writes the pages changed since the last flush to the file, and waits for
+ * them to reach the disk if the handle's sync policy asks for it.
+ * mdb_close() flushes too.  Pages that could not be written are kept for
+ * the next flush.
+ *
+ * Returns: 1 on success, 0 if a page could not be written.
+ */
+int
+mdb_flush(MdbHandle *mdb)
+{
+	MdbFile *f = mdb->f;
+	int pg_size = mdb->fmt->pg_size;
+	struct stat status;
+	GArray *pgs;
+	guint32 *pg;
+	guint i, j, n, run;
+	int ret = 1;
+
+	if (!f || !f->dirty_pgs || !g_hash_table_size(f->dirty_pgs))
+		return 1;
+	pgs = g_array_sized_new(FALSE, FALSE, sizeof(guint32),
+		g_hash_table_size(f->dirty_pgs));
+	g_hash_table_foreach(f->dirty_pgs, mdb_collect_pg, pgs);
+	g_array_sort(pgs, mdb_pg_num_cmp);
+	pg = (guint32 *) pgs->data;
+
+	/*
+	 * pages are added to the file before they are written; if one is
+	 * beyond EOF nothing is written and the pages are all kept
+	 */
+	fstat(f->fd, &status);
+	n = pgs->len;
+	if (status.st_size < (off_t) (pg[n-1] + 1) * pg_size) {
+		fprintf(stderr,"offset %lu is beyond EOF\n",
+			(unsigned long) pg[n-1] * pg_size);
+		g_array_free(pgs, TRUE);
 		return 0;
-	} else if (len<mdb->fmt->pg_size) {
-	/* fprintf(stderr,"EOF reached %d bytes returned.\n",len, mdb->pg_size); */
+	}
+	if (f->journal_fd != -1 && !mdb_journal_commit(mdb, pg, n)) {
+		/* nothing was written in place */
+		g_array_free(pgs, TRUE);
 		return 0;
 	}
-	mdb->cur_pos = 0;
-	return len;
+	/* a run that fails stays in the dirty set for the next flush */
+	for (i=0;i<n;i+=run) {
+		for (run=1;i+run<n && pg[i+run]==pg[i]+run;run++)
+			;
+		if (!mdb_write_run(mdb, pg[i], run)) {
+			ret = 0;
+			continue;
+		}
+		for (j=0;j<run;j++)
+			g_hash_table_remove(f->dirty_pgs,
+				GUINT_TO_POINTER(pg[i + j]));
+	}
+	g_array_free(pgs, TRUE);
+	if (!g_hash_table_size(f->dirty_pgs)) {
+		g_hash_table_destroy(f->dirty_pgs);
+		f->dirty_pgs = NULL;
+	}
+
+	if (f->journal_fd != -1) {
+		/* the journal is only emptied once its pages are safe */
+		if (ret && mdb_sync_fd(f->fd))
+			mdb_journal_done(mdb);
+		else
+			ret = 0;
+	} else if (ret && f->sync == MDB_SYNC_FLUSH && !mdb_sync_fd(f->fd)) {
+		ret = 0;
+	}
+	return ret;
+}
+/**
+ * mdb_maybe_flush:
+ * @mdb: Database file handle
+ *
+ * Flushes once enough pages are waiting.  Called at the end of each write
+ * operation, never in the middle of one, so the pages an operation
+ * changes are flushed (and journaled) together.
+ *
+ * Returns: 1 on success, 0 if a page could not be written.
+ */
+int
+mdb_maybe_flush(MdbHandle *mdb)
+{
+	if (mdb->f->dirty_pgs
+	 && g_hash_table_size(mdb->f->dirty_pgs) >= MDB_MAX_DIRTY_PGS)
+		return mdb_flush(mdb);
+	return 1;
+}
+/**
+ * mdb_set_sync:
+ * @mdb: Database file handle
+ * @sync: MDB_SYNC_NONE to leave flushed pages to the operating system,
+ * MDB_SYNC_FLUSH to have every mdb_flush() wait for the disk
+ *
+ * Sets how durable a flush is.  The policy applies to the file, clones of
+ * @mdb included.
+ */
+void
+mdb_set_sync(MdbHandle *mdb, MdbSyncPolicy sync)
+{
+	mdb->f->sync = sync;
+}
+/*
+ * Forgets pending writes to pages start_pg .. start_pg+num_pgs-1, used when
+ * they are cut off the end of the file.
+ */
+void
+mdb_drop_dirty_pgs(MdbHandle *mdb, guint32 start_pg, guint32 num_pgs)
+{
+	guint32 i;
+
+	if (!mdb->f->dirty_pgs)
+		return;
+	for (i=0;i<num_pgs;i++)
+		g_hash_table_remove(mdb->f->dirty_pgs,
+			GUINT_TO_POINTER(start_pg + i));
 }
 
 static int 
@@ -88,16 +303,121 @@ mdb_is_col_indexed(MdbTableDef *table, int colnum)
 	return 0;
 }
 
+/*
+ * Row decoding kernels, picked at run time by mdb_init_row_kernels().  The
+ * SSE2 ones are built for any x86 target and only used if the CPU has it.
+ */
 static void
-mdb_crack_row4(MdbHandle *mdb, int row_start, int row_end, unsigned int bitmask_sz, unsigned int row_var_cols, unsigned int *var_col_offsets)
+mdb_gather_offsets4_c(unsigned char *pg_buf, int pos, unsigned int num, unsigned int *offsets)
 {
 	unsigned int i;
 
-	for (i=0; i<row_var_cols+1; i++) {
-		var_col_offsets[i] = mdb_get_int16(mdb->pg_buf,
-			row_end - bitmask_sz - 3 - (i*2));
+	for (i=0; i<num; i++)
+		offsets[i] = mdb_get_int16(pg_buf, pos - (i*2));
+}
+/*
+ * Spread the null masks of rows first to num_rows - 1, mask_sz bytes each,
+ * into a bitmap per mask bit: bit r of valid[c * stride] is bit c of the
+ * mask of row r.  valid starts out cleared.
+ */
+static void
+mdb_expand_masks_c(const unsigned char *masks, unsigned int mask_sz, unsigned int first, unsigned int num_rows, unsigned char *valid, unsigned int stride)
+{
+	unsigned int r, b, c;
+	unsigned char m;
+
+	for (r=first; r<num_rows; r++) {
+		for (b=0; b<mask_sz; b++) {
+			m = masks[r*mask_sz + b];
+			for (c=b*8; m; c++, m >>= 1)
+				if (m & 1)
+					valid[c*stride + r/8] |= 1 << (r%8);
+		}
 	}
 }
+#ifdef MDB_SSE2_KERNELS
+static MDB_SSE2 void
+mdb_gather_offsets4_sse2(unsigned char *pg_buf, int pos, unsigned int num, unsigned int *offsets)
+{
+	unsigned int i = 0;
+
+	/* eight offsets at a time, the table is stored back to front */
+	for (; i + 8 <= num && pos - (int)(i*2) - 14 >= 0; i += 8) {
+		__m128i v = _mm_loadu_si128(
+			(__m128i *)(pg_buf + pos - i*2 - 14));
+		v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0,1,2,3));
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2,3,0,1));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2,3,0,1));
+		_mm_storeu_si128((__m128i *)(offsets + i),
+			_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+		_mm_storeu_si128((__m128i *)(offsets + i + 4),
+			_mm_unpackhi_epi16(v, _mm_setzero_si128()));
+	}
+	mdb_gather_offsets4_c(pg_buf, pos - i*2, num - i, offsets + i);
+}
+static MDB_SSE2 void
+mdb_expand_masks_sse2(const unsigned char *masks, unsigned int mask_sz, unsigned int first, unsigned int num_rows, unsigned char *valid, unsigned int stride)
+{
+	unsigned char lanes[16];
+	unsigned int r, b, c, j;
+	__m128i v;
+	int bits;
+
+	/*
+	 * sixteen rows at a time: a mask byte of each in one register, whose
+	 * bits are then brought to the top and collected one by one
+	 */
+	for (r=first; r + 16 <= num_rows; r += 16) {
+		for (b=0; b<mask_sz; b++) {
+			for (j=0; j<16; j++)
+				lanes[j] = masks[(r+j)*mask_sz + b];
+			v = _mm_loadu_si128((__m128i *)lanes);
+			for (c=b*8+8; c-- > b*8; ) {
+				bits = _mm_movemask_epi8(v);
+				valid[c*stride + r/8] = bits & 0xff;
+				valid[c*stride + r/8 + 1] = bits >> 8;
+				v = _mm_add_epi8(v, v);
+			}
+		}
+	}
+	mdb_expand_masks_c(masks, mask_sz, r, num_rows, valid, stride);
+}
+#endif
+
+static void (*mdb_gather_offsets4)(unsigned char *pg_buf, int pos,
+	unsigned int num, unsigned int *offsets) = mdb_gather_offsets4_c;
+static void (*mdb_expand_masks)(const unsigned char *masks,
+	unsigned int mask_sz, unsigned int first, unsigned int num_rows,
+	unsigned char *valid, unsigned int stride) = mdb_expand_masks_c;
+
+/**
+ * mdb_init_row_kernels:
+ *
+ * Picks the kernels rows are decoded with: SSE2 ones if the CPU has SSE2,
+ * scalar ones otherwise or if MDBOPTS holds no_simd.  Called by mdb_init().
+ */
+void
+mdb_init_row_kernels(void)
+{
+	mdb_gather_offsets4 = mdb_gather_offsets4_c;
+	mdb_expand_masks = mdb_expand_masks_c;
+#ifdef MDB_SSE2_KERNELS
+	if (mdb_get_option(MDB_NO_SIMD))
+		return;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		mdb_gather_offsets4 = mdb_gather_offsets4_sse2;
+		mdb_expand_masks = mdb_expand_masks_sse2;
+	}
+#endif
+}
+
+static void
+mdb_crack_row4(MdbHandle *mdb, int row_start, int row_end, unsigned int bitmask_sz, unsigned int row_var_cols, unsigned int *var_col_offsets)
+{
+	mdb_gather_offsets4(mdb->pg_buf, row_end - bitmask_sz - 3,
+		row_var_cols + 1, var_col_offsets);
+}
 static void
 mdb_crack_row3(MdbHandle *mdb, int row_start, int row_end, unsigned int bitmask_sz, unsigned int row_var_cols, unsigned int *var_col_offsets)
 {
@@ -121,6 +441,51 @@ mdb_crack_row3(MdbHandle *mdb, int row_start, int row_end, unsigned int bitmask_
 		var_col_offsets[i] = mdb->pg_buf[col_ptr-i]+(jumps_used*256);
 	}
 }
+/*
+ * Point the fields at a row's values.  Their null flags come from the row's
+ * mask and are only set here for columns the row doesn't have.
+ */
+static void
+mdb_crack_fields(MdbTableDef *table, int row_start, unsigned int row_cols, unsigned int row_var_cols, unsigned int *var_col_offsets, MdbField *fields)
+{
+	MdbColumn *col;
+	MdbHandle *mdb = table->entry->mdb;
+	void *pg_buf = mdb->pg_buf;
+	unsigned int fixed_cols_found = 0;
+	unsigned int row_fixed_cols = row_cols - row_var_cols;
+	unsigned int col_count_size = IS_JET4(mdb) ? 2 : 1;
+	unsigned int col_start;
+	unsigned int i;
+
+	for (i=0;i<table->num_cols;i++) {
+		col = g_ptr_array_index(table->columns,i);
+		fields[i].colnum = i;
+		fields[i].is_fixed = col->is_fixed;
+
+		if ((fields[i].is_fixed)
+		 && (fixed_cols_found < row_fixed_cols)) {
+			col_start = col->fixed_offset + col_count_size;
+			fields[i].start = row_start + col_start;
+			fields[i].value = pg_buf + row_start + col_start;
+			fields[i].siz = col->col_size;
+			fixed_cols_found++;
+		/* Use col->var_col_num because a deleted column is still
+		 * present in the variable column offsets table for the row */
+		} else if ((!fields[i].is_fixed)
+		 && (col->var_col_num < row_var_cols)) {
+			col_start = var_col_offsets[col->var_col_num];
+			fields[i].start = row_start + col_start;
+			fields[i].value = pg_buf + row_start + col_start;
+			fields[i].siz = var_col_offsets[(col->var_col_num)+1] -
+		                col_start;
+		} else {
+			fields[i].start = 0;
+			fields[i].value = NULL;
+			fields[i].siz = 0;
+			fields[i].is_null = 1;
+		}
+	}
+}
 /**
  * mdb_crack_row:
  * @table: Table that the row belongs to
@@ -152,21 +517,18 @@ mdb_crack_row(MdbTableDef *table, int row_start, int row_end, MdbField *fields)
 	unsigned int row_var_cols=0, row_cols;
 	unsigned char *nullmask;
 	unsigned int bitmask_sz;
-	unsigned int *var_col_offsets = NULL;
-	unsigned int fixed_cols_found, row_fixed_cols;
-	unsigned int col_count_size;
+	unsigned int var_col_offsets[MDB_MAX_COLS+1];
 	unsigned int i;
+	int debug_row = mdb_get_option(MDB_DEBUG_ROW);
 
-	if (mdb_get_option(MDB_DEBUG_ROW)) {
+	if (debug_row) {
 		buffer_dump(pg_buf, row_start, row_end - row_start + 1);
 	}
 
 	if (IS_JET4(mdb)) {
 		row_cols = mdb_get_int16(pg_buf, row_start);
-		col_count_size = 2;
 	} else {
 		row_cols = mdb_get_byte(pg_buf, row_start);
-		col_count_size = 1;
 	}
 
 	bitmask_sz = (row_cols + 7) / 8;
@@ -176,7 +538,9 @@ mdb_crack_row(MdbTableDef *table, int row_start, int row_end, MdbField *fields)
 	row_var_cols = IS_JET4(mdb) ?
 		mdb_get_int16(pg_buf, row_end - bitmask_sz - 1) :
 		mdb_get_byte(pg_buf, row_end - bitmask_sz);
-	var_col_offsets = (unsigned int *)g_malloc((row_var_cols+1)*sizeof(int));
+	/* don't let a damaged row overrun the offset table */
+	if (row_var_cols > MDB_MAX_COLS)
+		row_var_cols = MDB_MAX_COLS;
 	if (table->num_var_cols > 0) {
 		if (IS_JET4(mdb)) {
 			mdb_crack_row4(mdb, row_start, row_end, bitmask_sz,
@@ -187,52 +551,198 @@ mdb_crack_row(MdbTableDef *table, int row_start, int row_end, MdbField *fields)
 		}
 	}
 
-	fixed_cols_found = 0;
-	row_fixed_cols = row_cols - row_var_cols;
-
-	if (mdb_get_option(MDB_DEBUG_ROW)) {
+	if (debug_row) {
 		fprintf(stdout,"bitmask_sz %d\n", bitmask_sz);
 		fprintf(stdout,"row_var_cols %d\n", row_var_cols);
-		fprintf(stdout,"row_fixed_cols %d\n", row_fixed_cols);
+		fprintf(stdout,"row_fixed_cols %d\n", row_cols - row_var_cols);
 	}
 
 	for (i=0;i<table->num_cols;i++) {
-		unsigned int byte_num, bit_num;
-		unsigned int col_start;
 		col = g_ptr_array_index(table->columns,i);
-		fields[i].colnum = i;
-		fields[i].is_fixed = col->is_fixed;
-		byte_num = col->col_num / 8;
-		bit_num = col->col_num % 8;
 		/* logic on nulls is reverse, 1 is not null, 0 is null */
-		fields[i].is_null = nullmask[byte_num] & (1 << bit_num) ? 0 : 1;
+		fields[i].is_null = nullmask[col->col_num / 8]
+			& (1 << (col->col_num % 8)) ? 0 : 1;
+	}
+	mdb_crack_fields(table, row_start, row_cols, row_var_cols,
+		var_col_offsets, fields);
 
-		if ((fields[i].is_fixed)
-		 && (fixed_cols_found < row_fixed_cols)) {
-			col_start = col->fixed_offset + col_count_size;
-			fields[i].start = row_start + col_start;
-			fields[i].value = pg_buf + row_start + col_start;
-			fields[i].siz = col->col_size;
-			fixed_cols_found++;
-		/* Use col->var_col_num because a deleted column is still
-		 * present in the variable column offsets table for the row */
-		} else if ((!fields[i].is_fixed)
-		 && (col->var_col_num < row_var_cols)) {
-			col_start = var_col_offsets[col->var_col_num];
-			fields[i].start = row_start + col_start;
-			fields[i].value = pg_buf + row_start + col_start;
-			fields[i].siz = var_col_offsets[(col->var_col_num)+1] -
-		                col_start;
-		} else {
-			fields[i].start = 0;
-			fields[i].value = NULL;
-			fields[i].siz = 0;
-			fields[i].is_null = 1;
+	return row_cols;
+}
+/**
+ * mdb_crack_page:
+ * @table: Table that the current page belongs to
+ *
+ * Decodes the null masks and variable column offset tables of all rows on
+ * the current page at once, for mdb_crack_page_row().  The masks are turned
+ * into a validity bitmap per column, covering every row of the page.
+ *
+ * Return value: 1 on success, 0 if the page has to be cracked row by row.
+ */
+int
+mdb_crack_page(MdbTableDef *table)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	unsigned char *pg_buf = mdb->pg_buf;
+	MdbPageCrack *pc;
+	MdbPageRow *pr;
+	MdbColumn *col;
+	unsigned int num_rows, mask_sz = 0, var_len = 0;
+	unsigned int bitmask_sz, cols, var_cols, i, b;
+	int start, end, tab_end, pos;
+	size_t len;
+
+	num_rows = mdb_get_int16(pg_buf, fmt->row_count_offset);
+	if (!num_rows
+	 || num_rows > (fmt->pg_size - fmt->row_count_offset - 2) / 2)
+		return 0;
+	/* the mask bytes that mdb_crack_row() may look at */
+	for (i=0;i<table->num_cols;i++) {
+		col = g_ptr_array_index(table->columns,i);
+		if (col->col_num / 8 + 1 > mask_sz)
+			mask_sz = col->col_num / 8 + 1;
+	}
+	if (!mask_sz)
+		return 0;
+	if (!table->page_crack)
+		table->page_crack = g_malloc0(sizeof(MdbPageCrack));
+	pc = table->page_crack;
+	pc->pg = 0;
+
+	pc->rows = g_realloc(pc->rows, num_rows * sizeof(MdbPageRow));
+	for (i=0; i<num_rows; i++) {
+		pr = &pc->rows[i];
+		pr->start = -1;
+		mdb_find_row(mdb, i, &start, &len);
+		/*
+		 * deleted rows aren't read, and rows whose tables don't fit
+		 * in them are left to mdb_crack_row()
+		 */
+		if ((start & 0x4000) && !table->noskip_del)
+			continue;
+		start &= 0x1fff;
+		if (len < 4 || start + len > fmt->pg_size)
+			continue;
+		cols = IS_JET4(mdb) ? mdb_get_int16(pg_buf, start) :
+			mdb_get_byte(pg_buf, start);
+		bitmask_sz = (cols + 7) / 8;
+		if (bitmask_sz + 3 > len)
+			continue;
+		end = start + len - 1;
+		var_cols = IS_JET4(mdb) ?
+			mdb_get_int16(pg_buf, end - bitmask_sz - 1) :
+			mdb_get_byte(pg_buf, end - bitmask_sz);
+		if (var_cols > MDB_MAX_COLS)
+			var_cols = MDB_MAX_COLS;
+		pr->var_pos = var_len;
+		if (table->num_var_cols > 0) {
+			tab_end = IS_JET4(mdb) ?
+				end - bitmask_sz - 3 - var_cols*2 :
+				end - bitmask_sz - (len - 1) / 256 - 1 - var_cols;
+			if (tab_end < start)
+				continue;
+			var_len += var_cols + 1;
 		}
+		pr->start = start;
+		pr->end = end;
+		pr->cols = cols;
+		pr->var_cols = var_cols;
 	}
 
-	g_free(var_col_offsets);
-	return row_cols;
+	pc->num_rows = num_rows;
+	pc->mask_sz = mask_sz;
+	pc->stride = (num_rows + 7) / 8;
+	pc->masks = g_realloc(pc->masks, num_rows * mask_sz);
+	memset(pc->masks, 0, num_rows * mask_sz);
+	pc->valid = g_realloc(pc->valid, mask_sz * 8 * pc->stride);
+	memset(pc->valid, 0, mask_sz * 8 * pc->stride);
+	pc->var_offsets = g_realloc(pc->var_offsets,
+		MAX(var_len, 1) * sizeof(unsigned int));
+
+	for (i=0; i<num_rows; i++) {
+		pr = &pc->rows[i];
+		if (pr->start < 0)
+			continue;
+		bitmask_sz = (pr->cols + 7) / 8;
+		if (table->num_var_cols > 0) {
+			if (IS_JET4(mdb)) {
+				mdb_crack_row4(mdb, pr->start, pr->end,
+					bitmask_sz, pr->var_cols,
+					pc->var_offsets + pr->var_pos);
+			} else {
+				mdb_crack_row3(mdb, pr->start, pr->end,
+					bitmask_sz, pr->var_cols,
+					pc->var_offsets + pr->var_pos);
+			}
+		}
+		/* the mask, and past it for columns the row doesn't have */
+		pos = pr->end - bitmask_sz + 1;
+		for (b=0; b<mask_sz && pos + b < MDB_PGSIZE; b++)
+			pc->masks[i*mask_sz + b] = pg_buf[pos + b];
+	}
+	mdb_expand_masks(pc->masks, mask_sz, 0, num_rows, pc->valid,
+		pc->stride);
+
+	pc->pg = mdb->cur_pg;
+	pc->pg_writes = mdb->f->pg_writes;
+	return 1;
+}
+/**
+ * mdb_crack_page_row:
+ * @table: Table that the row belongs to
+ * @row: number of the row on the current page
+ * @row_start: offset to start of row on current page
+ * @row_end: offset to end of row on current page
+ * @fields: pointer to MdbField array to be populated
+ *
+ * Does what mdb_crack_row() does, from the decoding of the whole page by
+ * mdb_crack_page().  The page is decoded again if it was changed since.
+ *
+ * Return value: number of fields present.
+ */
+int
+mdb_crack_page_row(MdbTableDef *table, unsigned int row, int row_start, int row_end, MdbField *fields)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbPageCrack *pc = table->page_crack;
+	MdbPageRow *pr;
+	MdbColumn *col;
+	unsigned char *valid;
+	unsigned int i;
+
+	if (mdb_get_option(MDB_DEBUG_ROW))
+		return mdb_crack_row(table, row_start, row_end, fields);
+	if (!pc || !mdb->cur_pg || pc->pg != mdb->cur_pg
+	 || pc->pg_writes != mdb->f->pg_writes) {
+		if (!mdb->cur_pg || !mdb_crack_page(table))
+			return mdb_crack_row(table, row_start, row_end, fields);
+		pc = table->page_crack;
+	}
+	if (row >= pc->num_rows || pc->rows[row].start != row_start
+	 || pc->rows[row].end != row_end)
+		return mdb_crack_row(table, row_start, row_end, fields);
+	pr = &pc->rows[row];
+
+	valid = pc->valid + row / 8;
+	for (i=0;i<table->num_cols;i++) {
+		col = g_ptr_array_index(table->columns,i);
+		fields[i].is_null = valid[col->col_num * pc->stride]
+			& (1 << (row % 8)) ? 0 : 1;
+	}
+	mdb_crack_fields(table, row_start, pr->cols, pr->var_cols,
+		pc->var_offsets + pr->var_pos, fields);
+
+	return pr->cols;
+}
+void
+mdb_free_page_crack(MdbPageCrack *pc)
+{
+	if (!pc) return;
+	g_free(pc->rows);
+	g_free(pc->masks);
+	g_free(pc->valid);
+	g_free(pc->var_offsets);
+	g_free(pc);
 }
 
 static int
@@ -410,6 +920,76 @@ mdb_pack_row(MdbTableDef *table, unsigned char *row_buffer, int unsigned num_fie
 		return mdb_pack_row3(table, row_buffer, num_fields, fields);
 	}
 }
+/**
+ * mdb_packed_row_size:
+ * @table: the table the row is for
+ * @num_fields: number of fields
+ * @fields: the row, as for mdb_pack_row()
+ *
+ * Works out the size of the packed row without packing it, so that a
+ * row too large for a page can be turned away before it is copied
+ * anywhere.  Only the fields' siz, is_fixed and is_null are looked at.
+ *
+ * Returns: the number of bytes mdb_pack_row() would write.
+ */
+int
+mdb_packed_row_size(MdbTableDef *table, unsigned int num_fields, MdbField *fields)
+{
+	unsigned int pos, eod, var_cols = 0, jumps = 0, high = 0, i;
+	unsigned int mask_size = (num_fields + 7) / 8;
+	int jet4 = IS_JET4(table->entry->mdb);
+
+	pos = jet4 ? 2 : 1;
+	for (i=0;i<num_fields;i++) {
+		if (fields[i].is_fixed)
+			pos += fields[i].siz;
+	}
+	if (table->num_var_cols == 0)
+		return pos + mask_size;
+	for (i=0;i<num_fields;i++) {
+		if (fields[i].is_fixed)
+			continue;
+		/* a jump table entry wherever the offsets' high byte goes up */
+		if (var_cols++ && (pos >> 8) > high)
+			jumps++;
+		high = pos >> 8;
+		if (!fields[i].is_null)
+			pos += fields[i].siz;
+	}
+	eod = pos;
+	if (jet4)
+		return eod + 2 + var_cols * 2 + 2 + mask_size;
+
+	if (var_cols && (eod >> 8) > high)
+		jumps++;
+	pos = eod + 1 + var_cols;
+	/* dummy jump table entry */
+	if ((eod >> 8) < (pos + mask_size - 1) / 255)
+		pos++;
+	return pos + jumps + 1 + mask_size;
+}
+/**
+ * mdb_pg_free_end:
+ * @mdb: Database file handle
+ * @pg_buf: a data page
+ *
+ * Returns: where the free space on the page ends, the start of its lowest
+ * row.  That needn't be the last row in the offset table.
+ */
+int
+mdb_pg_free_end(MdbHandle *mdb, unsigned char *pg_buf)
+{
+	int rco = mdb->fmt->row_count_offset;
+	int rows, free_end = mdb->fmt->pg_size, offset, i;
+
+	rows = mdb_get_int16(pg_buf, rco);
+	for (i=0;i<rows;i++) {
+		offset = mdb_get_int16(pg_buf, rco + 2 + i*2) & 0x1fff;
+		if (offset < free_end)
+			free_end = offset;
+	}
+	return free_end;
+}
 int
 mdb_pg_get_freespace(MdbHandle *mdb)
 {
@@ -418,7 +998,7 @@ mdb_pg_get_freespace(MdbHandle *mdb)
 
 	rows = mdb_get_int16(mdb->pg_buf, row_count_offset);
 	free_start = row_count_offset + 2 + (rows * 2);
-	free_end = mdb_get_int16(mdb->pg_buf, row_count_offset + (rows * 2));
+	free_end = mdb_pg_free_end(mdb, mdb->pg_buf);
 	mdb_debug(MDB_DEBUG_WRITE,"free space left on page = %d", free_end - free_start);
 	return (free_end - free_start);
 }
@@ -428,7 +1008,7 @@ mdb_new_leaf_pg(MdbCatalogEntry *entry)
 	MdbHandle *mdb = entry->mdb;
 	void *new_pg = g_malloc0(mdb->fmt->pg_size);
 		
-	_mdb_put_int16(new_pg, 2, 0x0104);
+	_mdb_put_int16(new_pg, 0, 0x0104);
 	_mdb_put_int32(new_pg, 4, entry->table_pg);
 	
 	return new_pg;
@@ -439,27 +1019,48 @@ mdb_new_data_pg(MdbCatalogEntry *entry)
 	MdbFormatConstants *fmt = entry->mdb->fmt;
 	void *new_pg = g_malloc0(fmt->pg_size);
 		
-	_mdb_put_int16(new_pg, 2, 0x0101);
+	_mdb_put_int16(new_pg, 0, 0x0101);
 	_mdb_put_int16(new_pg, 2, fmt->pg_size - fmt->row_count_offset - 2);
 	_mdb_put_int32(new_pg, 4, entry->table_pg);
 	
 	return new_pg;
 }
 
+/*
+ * Returns the index if it has a tree of its own to keep up to date:
+ * foreign keys share the index of the table they refer to, and several
+ * indexes of a table can share one tree.
+ */
+static MdbIndex *
+mdb_index_maintained(MdbTableDef *table, unsigned int i)
+{
+	MdbIndex *idx = g_ptr_array_index(table->indices, i), *prev;
+	unsigned int j;
+
+	if (idx->index_type == 2 || !idx->first_pg)
+		return NULL;
+	for (j=0;j<i;j++) {
+		prev = g_ptr_array_index(table->indices, j);
+		if (prev->index_type != 2 && prev->first_pg == idx->first_pg)
+			return NULL;
+	}
+	return idx;
+}
 int
 mdb_update_indexes(MdbTableDef *table, int num_fields, MdbField *fields, guint32 pgnum, guint16 rownum)
 {
 	unsigned int i;
 	MdbIndex *idx;
+	int ret = 1;
 	
 	for (i=0;i<table->num_idxs;i++) {
-		idx = g_ptr_array_index (table->indices, i);
+		if (!(idx = mdb_index_maintained(table, i)))
+			continue;
 		mdb_debug(MDB_DEBUG_WRITE,"Updating %s (%d).", idx->name, idx->index_type);
-		if (idx->index_type==1) {
-			mdb_update_index(table, idx, num_fields, fields, pgnum, rownum);
-		}
+		if (!mdb_update_index(table, idx, num_fields, fields, pgnum, rownum))
+			ret = 0;
 	}
-	return 1;
+	return ret;
 }
 
 int
@@ -476,47 +1077,35 @@ mdb_init_index_chain(MdbTableDef *table, MdbIndex *idx)
 	return 1;
 }
 
+/**
+ * mdb_update_index:
+ * @table: table the index belongs to
+ * @idx: index
+ * @num_fields: number of fields
+ * @fields: the new row
+ * @pgnum: page the row was added to
+ * @rownum: number of rows on that page, the new one being the last
+ *
+ * Adds the index entry of a new row.
+ *
+ * Returns: 1 on success, 0 if the index is now out of date.
+ */
 int
 mdb_update_index(MdbTableDef *table, MdbIndex *idx, unsigned int num_fields, MdbField *fields, guint32 pgnum, guint16 rownum)
 {
-	MdbCatalogEntry *entry = table->entry;
-	MdbHandle *mdb = entry->mdb;
-	int idx_xref[16];
-	unsigned int i, j;
-	MdbIndexChain *chain;
-	MdbField idx_fields[10];
-
-	for (i = 0; i < idx->num_keys; i++) {
-		for (j = 0; j < num_fields; j++) {
-			// key_col_num is 1 based, can't remember why though
-			if (fields[j].colnum == idx->key_col_num[i]-1) {
-				idx_xref[i] = j;
-				idx_fields[i] = fields[j];
-			}
-		}
+	unsigned char key[MDB_MAX_KEY_LEN];
+	int key_len;
+
+	if (!mdb_index_writable(table, idx)) {
+		fprintf(stderr, "Warning: index %s can't be updated and will be out of date\n", idx->name);
+		return 0;
+	}
+	key_len = mdb_index_make_key(table, idx, num_fields, fields, key);
+	if (!mdb_index_add_entry(table, idx, key, key_len,
+			(pgnum << 8) | ((rownum-1) & 0xff))) {
+		fprintf(stderr, "Warning: couldn't add row to index %s, it will be out of date\n", idx->name);
+		return 0;
 	}
-/*
-	for (i = 0; i < idx->num_keys; i++) {
-		fprintf(stdout, "key col %d (%d) is mapped to field %d (%d %d)\n",
-			i, idx->key_col_num[i], idx_xref[i], fields[idx_xref[i]].colnum, 
-			fields[idx_xref[i]].siz);
-	}
-	for (i = 0; i < num_fields; i++) {
-		fprintf(stdout, "%d (%d %d)\n",
-			i, fields[i].colnum, 
-			fields[i].siz);
-	}
-*/
-
-	chain = g_malloc0(sizeof(MdbIndexChain));
-
-	mdb_index_find_row(mdb, idx, chain, pgnum, rownum);
-	//printf("chain depth = %d\n", chain->cur_depth);
-	//printf("pg = %" G_GUINT32_FORMAT "\n",
-		//chain->pages[chain->cur_depth-1].pg);
-	//mdb_copy_index_pg(table, idx, &chain->pages[chain->cur_depth-1]);
-	mdb_add_row_to_leaf_pg(table, idx, &chain->pages[chain->cur_depth-1], idx_fields, pgnum, rownum);
-	
 	return 1;
 }
 
@@ -557,9 +1146,24 @@ mdb_insert_row(MdbTableDef *table, int num_fields, MdbField *fields)
 		exit(1);
 	}
 
+	mdb_space_dir_update(table, pgnum, mdb->pg_buf);
+
 	mdb_update_indexes(table, num_fields, fields, pgnum, rownum);
+
+	/* COUNT(*) and empty table scans trust the count in the definition */
+	table->num_rows++;
+	mdb_read_pg(mdb, entry->table_pg);
+	_mdb_put_int32(mdb->pg_buf, fmt->tab_num_rows_offset, table->num_rows);
+	if (!mdb_write_pg(mdb, entry->table_pg)) {
+		fprintf(stderr, "write failed! exiting...\n");
+		exit(1);
+	}
+	mdb_tdef_drop(mdb, entry->table_pg);
+	/* MSysObjects changed, the cached catalog must be read again */
+	if (entry->table_pg == 2)
+		mdb->catalog_stale = 1;
  
-	return 1;
+	return mdb_maybe_flush(mdb);
 }
 /*
  * Assumes caller has verfied space is available on page and adds the new 
@@ -569,8 +1173,7 @@ guint16
 mdb_add_row_to_pg(MdbTableDef *table, unsigned char *row_buffer, int new_row_size)
 {
 	void *new_pg;
-	int num_rows, i, pos, row_start;
-	size_t row_size;
+	int num_rows, pos;
 	MdbCatalogEntry *entry = table->entry;
 	MdbHandle *mdb = entry->mdb;
 	MdbFormatConstants *fmt = mdb->fmt;
@@ -592,18 +1195,10 @@ mdb_add_row_to_pg(MdbTableDef *table, unsigned char *row_buffer, int new_row_siz
 		pos = (num_rows == 0) ? fmt->pg_size :
 			mdb_get_int16(new_pg, fmt->row_count_offset + (num_rows*2));
 	} else {  /* is not a temp table */
-		new_pg = mdb_new_data_pg(entry);
-
-		num_rows = mdb_get_int16(mdb->pg_buf, fmt->row_count_offset);
-		pos = fmt->pg_size;
-
-		/* copy existing rows */
-		for (i=0;i<num_rows;i++) {
-			mdb_find_row(mdb, i, &row_start, &row_size);
-			pos -= row_size;
-			memcpy(new_pg + pos, mdb->pg_buf + row_start, row_size);
-			_mdb_put_int16(new_pg, (fmt->row_count_offset + 2) + (i*2), pos);
-		}
+		/* the row goes below the others, nothing else moves */
+		new_pg = mdb->pg_buf;
+		num_rows = mdb_get_int16(new_pg, fmt->row_count_offset);
+		pos = mdb_pg_free_end(mdb, mdb->pg_buf);
 	}
 
 	/* add our new row */
@@ -619,73 +1214,209 @@ mdb_add_row_to_pg(MdbTableDef *table, unsigned char *row_buffer, int new_row_siz
 	/* update the freespace */
 	_mdb_put_int16(new_pg,2,pos - fmt->row_count_offset - 2 - (num_rows*2));
 
-	/* copy new page over old */
-	if (!table->is_temp_table) {
-		memcpy(mdb->pg_buf, new_pg, fmt->pg_size);
-		g_free(new_pg);
-	}
-
 	return num_rows;
 }
+/*
+ * Moves the index entries of a row from its old keys to its new ones, or
+ * back again with undo set.  Stops at the first entry that doesn't fit and
+ * returns the number of indexes done.
+ */
+static unsigned int
+mdb_update_row_keys(MdbTableDef *table, unsigned char *old_keys, unsigned char *new_keys, int *key_lens, guint32 pg_row, unsigned int num, int undo)
+{
+	MdbIndex *idx;
+	unsigned char *from, *to;
+	unsigned int i;
+
+	for (i=0;i<num;i++) {
+		if (!key_lens[i*2] && !key_lens[i*2+1])
+			continue;
+		idx = g_ptr_array_index(table->indices, i);
+		from = (undo ? new_keys : old_keys) + i * MDB_MAX_KEY_LEN;
+		to = (undo ? old_keys : new_keys) + i * MDB_MAX_KEY_LEN;
+		if (!mdb_index_del_entry(table, idx, from, key_lens[i*2 + !!undo], pg_row))
+			fprintf(stderr, "Index %s has no entry for this row\n", idx->name);
+		if (!mdb_index_add_entry(table, idx, to, key_lens[i*2 + !undo], pg_row)) {
+			/* there was room for it a moment ago */
+			mdb_index_add_entry(table, idx, from, key_lens[i*2 + !!undo], pg_row);
+			return i;
+		}
+	}
+	return num;
+}
+/**
+ * mdb_update_row:
+ * @table: table positioned on a row by mdb_fetch_row()
+ *
+ * Writes the values bound to the table's columns into the current row.
+ * A row that no longer fits on its page moves to another one and leaves a
+ * pointer behind, so index entries stay valid; indexes on changed columns
+ * get their entries moved.
+ *
+ * Returns: 1 on success, 0 if the row could not be updated.
+ */
 int 
 mdb_update_row(MdbTableDef *table)
 {
 int row_start, row_end;
-unsigned int i;
+unsigned int i, done;
 MdbColumn *col;
 MdbCatalogEntry *entry = table->entry;
 MdbHandle *mdb = entry->mdb;
-MdbField fields[256];
+MdbIndex *idx;
+MdbField fields[256], old_fields[256];
 unsigned char row_buffer[4096];
+unsigned char *old_keys = NULL, *new_keys = NULL;
+int *key_lens = NULL;
 	size_t old_row_size, new_row_size;
 unsigned int num_fields;
+	guint32 pg = table->cur_phys_pg, new_pg = 0, pg_row;
+	int row = table->cur_row - 1, flags, keys_changed = 0;
+	unsigned char fwd[4];
 
 	if (!mdb->f->writable) {
 		fprintf(stderr, "File is not open for writing\n");
 		return 0;
 	}
-	mdb_find_row(mdb, table->cur_row-1, &row_start, &old_row_size);
+	mdb_read_pg(mdb, pg);
+	mdb_find_row(mdb, row, &row_start, &old_row_size);
+	flags = row_start & 0xe000;
+	row_start &= 0x1fff; /* remove flags */
 	row_end = row_start + old_row_size - 1;
-
-	row_start &= 0x0FFF; /* remove flags */
+	if (flags & 0x4000) {
+		fprintf(stderr, "Row %d of page %lu is not a row\n", row, (unsigned long) pg);
+		return 0;
+	}
 
 	mdb_debug(MDB_DEBUG_WRITE,"page %lu row %d start %d end %d", (unsigned long) table->cur_phys_pg, table->cur_row-1, row_start, row_end);
 	if (mdb_get_option(MDB_DEBUG_LIKE))
 		buffer_dump(mdb->pg_buf, row_start, old_row_size);
 
+	num_fields = mdb_crack_row(table, row_start, row_end, old_fields);
+	memcpy(fields, old_fields, sizeof(MdbField) * num_fields);
 	for (i=0;i<table->num_cols;i++) {
 		col = g_ptr_array_index(table->columns,i);
-		if (col->bind_ptr && mdb_is_col_indexed(table,i)) {
-			fprintf(stderr, "Attempting to update column that is part of an index\n");
-			return 0;
+		if (col->bind_ptr) {
+			fields[i].value = col->bind_ptr;
+			fields[i].siz = *(col->len_ptr);
+			if (col->col_type != MDB_BOOL)
+				fields[i].is_null = 0;
 		}
 	}
-	num_fields = mdb_crack_row(table, row_start, row_end, fields);
 
-	if (mdb_get_option(MDB_DEBUG_WRITE)) {
-		for (i=0;i<num_fields;i++) {
-			//printf("col %d %d start %d siz %d fixed 5d\n", i, fields[i].colnum, fields[i].start, fields[i].siz, fields[i].is_fixed);
-		}
+	/* old keys are taken before the page is read again */
+	if (table->num_idxs) {
+		old_keys = g_malloc(table->num_idxs * MDB_MAX_KEY_LEN);
+		new_keys = g_malloc(table->num_idxs * MDB_MAX_KEY_LEN);
+		key_lens = g_malloc0(table->num_idxs * 2 * sizeof(int));
 	}
-	for (i=0;i<table->num_cols;i++) {
-		col = g_ptr_array_index(table->columns,i);
-		if (col->bind_ptr) {
-			fields[i].value = col->bind_ptr;
-			fields[i].siz = *(col->len_ptr);
+	for (i=0;i<table->num_idxs;i++) {
+		unsigned int j;
+		int bound = 0;
+
+		if (!(idx = mdb_index_maintained(table, i)))
+			continue;
+		for (j=0;j<idx->num_keys;j++) {
+			col = g_ptr_array_index(table->columns, idx->key_col_num[j]-1);
+			if (col->bind_ptr) bound = 1;
 		}
+		if (!bound)
+			continue;
+		if (!mdb_index_writable(table, idx)) {
+			fprintf(stderr, "Index %s can't be updated\n", idx->name);
+			goto fail;
+		}
+		key_lens[i*2] = mdb_index_make_key(table, idx, num_fields,
+			old_fields, old_keys + i * MDB_MAX_KEY_LEN);
+		key_lens[i*2+1] = mdb_index_make_key(table, idx, num_fields,
+			fields, new_keys + i * MDB_MAX_KEY_LEN);
+		if (key_lens[i*2] == key_lens[i*2+1]
+		 && !memcmp(old_keys + i * MDB_MAX_KEY_LEN,
+				new_keys + i * MDB_MAX_KEY_LEN, key_lens[i*2])) {
+			key_lens[i*2] = key_lens[i*2+1] = 0;
+			continue;
+		}
+		keys_changed = 1;
 	}
 
 	new_row_size = mdb_pack_row(table, row_buffer, num_fields, fields);
 	if (mdb_get_option(MDB_DEBUG_WRITE)) 
 		buffer_dump(row_buffer, 0, new_row_size);
-	if (new_row_size > (old_row_size + mdb_pg_get_freespace(mdb))) {
-		fprintf(stderr, "No space left on this page, update will not occur\n");
-		return 0;
+
+	mdb_read_pg(mdb, pg);
+	/* index entries point at the row's first place */
+	pg_row = table->fwd_pg_row ? table->fwd_pg_row : (pg << 8) | row;
+	if (new_row_size > old_row_size + mdb_pg_get_freespace(mdb)) {
+		if (flags & 0x8000) {
+			/* only one pointer may lead to a row */
+			fprintf(stderr, "Row has been moved before and no longer fits on its page\n");
+			goto fail;
+		}
+		if (!(new_pg = mdb_map_find_next_freepage(table, new_row_size))) {
+			fprintf(stderr, "Unable to allocate new page.\n");
+			goto fail;
+		}
+	} else if ((flags & 0x8000) && !table->fwd_pg_row && keys_changed) {
+		fprintf(stderr, "Row has been moved, read it through an index to change its keys\n");
+		goto fail;
+	}
+
+	if (keys_changed) {
+		done = mdb_update_row_keys(table, old_keys, new_keys, key_lens,
+			pg_row, table->num_idxs, 0);
+		if (done < table->num_idxs) {
+			fprintf(stderr, "Couldn't change index %s, update will not occur\n",
+				((MdbIndex *) g_ptr_array_index(table->indices, done))->name);
+			mdb_update_row_keys(table, old_keys, new_keys, key_lens,
+				pg_row, done, 1);
+			goto fail;
+		}
+	}
+	g_free(old_keys);
+	g_free(new_keys);
+	g_free(key_lens);
+
+	if (!new_pg) {
+		mdb_read_pg(mdb, pg);
+		return mdb_replace_row(table, row, row_buffer, new_row_size);
 	}
-	/* do it! */
-	mdb_replace_row(table, table->cur_row-1, row_buffer, new_row_size);
+
+	/* the moved row is marked so scans only find it through the pointer */
+	mdb_read_pg(mdb, new_pg);
+	i = mdb_add_row_to_pg(table, row_buffer, new_row_size) - 1;
+	_mdb_put_int16(mdb->pg_buf, mdb->fmt->row_count_offset + 2 + i*2,
+		mdb_get_int16(mdb->pg_buf, mdb->fmt->row_count_offset + 2 + i*2) | 0x8000);
+	if (!mdb_write_pg(mdb, new_pg)) {
+		fprintf(stderr, "write failed! exiting...\n");
+		exit(1);
+	}
+	mdb_space_dir_update(table, new_pg, mdb->pg_buf);
+
+	mdb_read_pg(mdb, pg);
+	_mdb_put_int16(mdb->pg_buf, mdb->fmt->row_count_offset + 2 + row*2,
+		mdb_get_int16(mdb->pg_buf, mdb->fmt->row_count_offset + 2 + row*2) | 0x4000);
+	_mdb_put_int32(fwd, 0, (new_pg << 8) | i);
+	return mdb_replace_row(table, row, fwd, 4);
+
+fail:
+	g_free(old_keys);
+	g_free(new_keys);
+	g_free(key_lens);
 	return 0;
 }
+/**
+ * mdb_replace_row:
+ * @table: table the row belongs to
+ * @row: row number on the page in mdb->pg_buf, table->cur_phys_pg
+ * @new_row: packed row
+ * @new_row_size: its size
+ *
+ * Puts a new version of a row in the place of the old one.  A row of the
+ * same size is copied over it; otherwise only the rows stored below it
+ * move, by the difference.
+ *
+ * Returns: 1 on success, 0 if the row doesn't fit on the page.
+ */
 int 
 mdb_replace_row(MdbTableDef *table, int row, void *new_row, int new_row_size)
 {
@@ -693,51 +1424,43 @@ MdbCatalogEntry *entry = table->entry;
 MdbHandle *mdb = entry->mdb;
 int pg_size = mdb->fmt->pg_size;
 int rco = mdb->fmt->row_count_offset;
-	void *new_pg;
 guint16 num_rows;
-	int row_start;
+	int row_start, flags, free_end, delta, offset;
 	size_t row_size;
-int i, pos;
+int i;
 
 	if (mdb_get_option(MDB_DEBUG_WRITE)) {
 		buffer_dump(mdb->pg_buf, 0, 40);
 		buffer_dump(mdb->pg_buf, pg_size - 160, 160);
 	}
 	mdb_debug(MDB_DEBUG_WRITE,"updating row %d on page %lu", row, (unsigned long) table->cur_phys_pg);
-	new_pg = mdb_new_data_pg(entry);
 
 	num_rows = mdb_get_int16(mdb->pg_buf, rco);
-	_mdb_put_int16(new_pg, rco, num_rows);
-
-	pos = pg_size;
+	mdb_find_row(mdb, row, &row_start, &row_size);
+	flags = row_start & 0xe000;
+	row_start &= 0x1fff;
+	delta = (int) row_size - new_row_size;
 
-	/* rows before */
-	for (i=0;i<row;i++) {
-		mdb_find_row(mdb, i, &row_start, &row_size);
-		pos -= row_size;
-		memcpy(new_pg + pos, mdb->pg_buf + row_start, row_size);
-		_mdb_put_int16(new_pg, rco + 2 + i*2, pos);
-	}
-	
-	/* our row */
-	pos -= new_row_size;
-	memcpy(new_pg + pos, new_row, new_row_size);
-	_mdb_put_int16(new_pg, rco + 2 + row*2, pos);
-	
-	/* rows after */
-	for (i=row+1;i<num_rows;i++) {
-		mdb_find_row(mdb, i, &row_start, &row_size);
-		pos -= row_size;
-		memcpy(new_pg + pos, mdb->pg_buf + row_start, row_size);
-		_mdb_put_int16(new_pg, rco + 2 + i*2, pos);
+	if (delta) {
+		if (-delta > mdb_pg_get_freespace(mdb))
+			return 0;
+		/* everything stored below the row moves, whatever its slot */
+		free_end = mdb_pg_free_end(mdb, mdb->pg_buf);
+		memmove(mdb->pg_buf + free_end + delta, mdb->pg_buf + free_end,
+			row_start - free_end);
+		for (i=0;i<num_rows;i++) {
+			offset = mdb_get_int16(mdb->pg_buf, rco + 2 + i*2);
+			if (i == row || (offset & 0x1fff) >= row_start)
+				continue;
+			_mdb_put_int16(mdb->pg_buf, rco + 2 + i*2,
+				((offset & 0x1fff) + delta) | (offset & 0xe000));
+		}
+		row_start += delta;
+		_mdb_put_int16(mdb->pg_buf, rco + 2 + row*2, row_start | flags);
+		_mdb_put_int16(mdb->pg_buf, 2, mdb_pg_get_freespace(mdb));
 	}
+	memcpy(mdb->pg_buf + row_start, new_row, new_row_size);
 
-	/* almost done, copy page over current */
-	memcpy(mdb->pg_buf, new_pg, pg_size);
-
-	g_free(new_pg);
-
-	_mdb_put_int16(mdb->pg_buf, 2, mdb_pg_get_freespace(mdb));
 	if (mdb_get_option(MDB_DEBUG_WRITE)) {
 		buffer_dump(mdb->pg_buf, 0, 40);
 		buffer_dump(mdb->pg_buf, pg_size - 160, 160);
@@ -747,100 +1470,8 @@ int i, pos;
 		fprintf(stderr, "write failed! exiting...\n");
 		exit(1);
 	}
-	return 0;
-}
-static int
-mdb_add_row_to_leaf_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg, MdbField *idx_fields, guint32 pgnum, guint16 rownum) 
-/*,  guint32 pgnum, guint16 rownum) 
-static int
-mdb_copy_index_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg)
-*/
-{
-	MdbCatalogEntry *entry = table->entry;
-	MdbHandle *mdb = entry->mdb;
-	MdbColumn *col;
-	guint32 pg, pg_row;
-	guint16 row;
-	void *new_pg;
-	unsigned char key_hash[256];
-	unsigned char iflag;
-	int keycol;
-
-	new_pg = mdb_new_leaf_pg(entry);
-
-	/* reinitial ipg pointers to start of page */
-	mdb_index_page_reset(ipg);
-	mdb_read_pg(mdb, ipg->pg);
-
-	/* do we support this index type yet? */
-	if (idx->num_keys > 1) {
-		fprintf(stderr,"multikey indexes not yet supported, aborting\n");
-		return 0;
-	}
-	keycol = idx->key_col_num[0];
-	col = g_ptr_array_index (table->columns, keycol - 1);
-	if (!col->is_fixed) {
-		fprintf(stderr,"variable length key columns not yet supported, aborting\n");
-		return 0;
-	}
-
-	while (mdb_index_find_next_on_page(mdb, ipg)) {
-
-		/* check for compressed indexes.  */
-		if (ipg->len < col->col_size + 1) {
-			fprintf(stderr,"compressed indexes not yet supported, aborting\n");
-			return 0;
-		}
-
-		pg_row = mdb_get_int32_msb(mdb->pg_buf, ipg->offset + ipg->len - 4);
-		pg = pg_row >> 8;
-		row = pg_row & 0xff;
-		iflag = mdb->pg_buf[ipg->offset];
-
-		/* turn the key hash back into a value */
-		mdb_index_swap_n(&mdb->pg_buf[ipg->offset + 1], col->col_size, key_hash);
-		key_hash[col->col_size - 1] &= 0x7f;
-
-		if (mdb_get_option(MDB_DEBUG_WRITE)) {
-			buffer_dump(mdb->pg_buf, ipg->offset, ipg->len);
-			buffer_dump(mdb->pg_buf, ipg->offset + 1, col->col_size);
-			buffer_dump(key_hash, 0, col->col_size);
-		}
-
-		memcpy(new_pg + ipg->offset, mdb->pg_buf + ipg->offset, ipg->len);
-		ipg->offset += ipg->len;
-		ipg->len = 0;
-
-		row++;
-	}
-	//_mdb_put_int16(new_pg, mdb->fmt->row_count_offset, row);
-	/* free space left */
-	_mdb_put_int16(new_pg, 2, mdb->fmt->pg_size - ipg->offset);
-	//printf("offset = %d\n", ipg->offset);
-
-	mdb_index_swap_n(idx_fields[0].value, col->col_size, key_hash);
-	key_hash[0] |= 0x080;
-	if (mdb_get_option(MDB_DEBUG_WRITE)) {
-		printf("key_hash\n");
-		buffer_dump(idx_fields[0].value, 0, col->col_size);
-		buffer_dump(key_hash, 0, col->col_size);
-		printf("--------\n");
-	}
-	((char *)new_pg)[ipg->offset] = 0x7f;
-	memcpy(new_pg + ipg->offset + 1, key_hash, col->col_size);
-	pg_row = (pgnum << 8) | ((rownum-1) & 0xff);
-	_mdb_put_int32_msb(new_pg, ipg->offset + 5, pg_row);
-	ipg->idx_starts[row++] = ipg->offset + ipg->len;
-	//ipg->idx_starts[row] = ipg->offset + ipg->len;
-	if (mdb_get_option(MDB_DEBUG_WRITE)) {
-		buffer_dump(mdb->pg_buf, 0, mdb->fmt->pg_size);
-	}
-	memcpy(mdb->pg_buf, new_pg, mdb->fmt->pg_size);
-	mdb_index_pack_bitmap(mdb, ipg);
-	if (mdb_get_option(MDB_DEBUG_WRITE)) {
-		buffer_dump(mdb->pg_buf, 0, mdb->fmt->pg_size);
-	}
-	g_free(new_pg);
-
-	return ipg->len;
+	mdb_space_dir_update(table, table->cur_phys_pg, mdb->pg_buf);
+	if (entry->table_pg == 2)
+		mdb->catalog_stale = 1;
+	return mdb_maybe_flush(mdb);
 }
@@ -33,6 +33,9 @@ static void *no_unused_var_warn[] = {software_version,
 
 static SQLSMALLINT _odbc_get_client_type(int srv_type);
 static int _odbc_fix_literals(struct _hstmt *stmt);
+static SQLRETURN _odbc_prepare(struct _hstmt *stmt);
+static int _odbc_bind_params(struct _hstmt *stmt, MdbSQL *sql);
+static void _odbc_free_params(struct _hstmt *stmt);
 static int _odbc_get_server_type(int clt_type);
 static int _odbc_get_string_size(int size, char *str);
 static SQLRETURN SQL_API _SQLAllocConnect(SQLHENV henv, SQLHDBC FAR *phdbc);
@@ -290,7 +293,12 @@ SQLRETURN SQL_API SQLNumParams(
     SQLHSTMT           hstmt,
     SQLSMALLINT FAR   *pcpar)
 {
+struct _hstmt *stmt = (struct _hstmt *) hstmt;
+struct _hdbc *dbc = (struct _hdbc *) stmt->hdbc;
+struct _henv *env = (struct _henv *) dbc->henv;
+
 	TRACE("SQLNumParams");
+	*pcpar = env->plan_stmt == stmt ? env->sql->num_params : 0;
 	return SQL_SUCCESS;
 }
 
@@ -404,9 +412,67 @@ SQLRETURN SQL_API SQLBindParameter(
     SQLINTEGER FAR    *pcbValue)
 {
 struct _hstmt *stmt;
+struct _sql_param_info *cur, *newitem;
 
 	TRACE("SQLBindParameter");
 	stmt = (struct _hstmt *) hstmt;
+	if (fParamType != SQL_PARAM_INPUT) {
+		LogError("Only input parameters are supported");
+		return SQL_ERROR;
+	}
+	if (fCType == SQL_C_DEFAULT) {
+		switch (fSqlType) {
+			case SQL_INTEGER: fCType = SQL_C_SLONG; break;
+			case SQL_SMALLINT: fCType = SQL_C_SSHORT; break;
+			case SQL_TINYINT: fCType = SQL_C_STINYINT; break;
+			case SQL_BIT: fCType = SQL_C_BIT; break;
+			default: fCType = SQL_C_CHAR; break;
+		}
+	}
+	switch (fCType) {
+		case SQL_C_CHAR:
+		case SQL_C_LONG:
+		case SQL_C_SLONG:
+		case SQL_C_ULONG:
+		case SQL_C_SHORT:
+		case SQL_C_SSHORT:
+		case SQL_C_USHORT:
+		case SQL_C_TINYINT:
+		case SQL_C_STINYINT:
+		case SQL_C_UTINYINT:
+		case SQL_C_BIT:
+			break;
+		default:
+			LogError("Parameter type not supported");
+			return SQL_ERROR;
+	}
+
+	/* find available item in list */
+	cur = stmt->param_head;
+	while (cur) {
+		if (cur->param_number==ipar) 
+			break;
+		cur = cur->next;
+	}
+	if (!cur) {
+		newitem = (struct _sql_param_info *) g_malloc0(sizeof(struct _sql_param_info));
+		newitem->param_number = ipar;
+		if (! stmt->param_head) {
+			stmt->param_head = newitem;
+		} else {
+			cur = stmt->param_head;
+			while (cur->next) {
+				cur = cur->next;
+			}
+			cur->next = newitem;
+		}
+		cur = newitem;
+	}
+	cur->param_ctype = fCType;
+	cur->varaddr = (char *) rgbValue;
+	cur->param_buflen = cbValueMax;
+	cur->param_lenbind = pcbValue;
+
 	return SQL_SUCCESS;
 }
 
@@ -610,6 +676,10 @@ SQLRETURN SQL_API SQLDescribeCol(
 	if (icol<1 || icol>sql->num_columns) {
 		return SQL_ERROR;
 	}
+	/* a prepared sort, group or join has no result before SQLExecute */
+	if (!sql->cur_table) {
+		return SQL_ERROR;
+	}
      sqlcol = g_ptr_array_index(sql->columns,icol - 1);
 	table = sql->cur_table;
      for (i=0;i<table->num_cols;i++) {
@@ -672,7 +742,7 @@ SQLRETURN SQL_API SQLColAttributes(
 			break;
 	}
 
-	if (icol<1 || icol>sql->num_columns) {
+	if (icol<1 || icol>sql->num_columns || !sql->cur_table) {
 		return SQL_ERROR;
 	}
 
@@ -751,11 +821,30 @@ static SQLRETURN SQL_API _SQLExecute( SQLHSTMT hstmt)
 	struct _henv *env = (struct _henv *) dbc->henv;
 
 	TRACE("_SQLExecute");
+
+   stmt->rows_affected = 0;
+   if (stmt->prepared) {
+        /* another statement may have used the connection since */
+        if (env->plan_stmt != stmt && _odbc_prepare(stmt) != SQL_SUCCESS)
+             return SQL_ERROR;
+        if (_odbc_bind_params(stmt, env->sql))
+             return SQL_ERROR;
+        mdb_sql_set_maxrow(env->sql, stmt->max_rows);
+        if (mdb_sql_execute(env->sql)) {
+             LogError("Couldn't execute SQL\n");
+             return SQL_ERROR;
+        }
+        return SQL_SUCCESS;
+   }
    
    /* fprintf(stderr,"query = %s\n",stmt->query); */
    _odbc_fix_literals(stmt);
 
+   env->plan_stmt = NULL;
    mdb_sql_reset(env->sql);
+   /* the scan stops reading once this many rows were fetched */
+   if (stmt->max_rows)
+        mdb_sql_set_maxrow(env->sql, stmt->max_rows);
 
    /* calls to yyparse would need to be serialized for thread safety */
 
@@ -781,6 +870,7 @@ SQLRETURN SQL_API SQLExecDirect(
 
 	TRACE("SQLExecDirect");
 	strcpy(stmt->query, szSqlStr);
+	stmt->prepared = 0;
 
 	return _SQLExecute(hstmt);
 }
@@ -901,9 +991,14 @@ static SQLRETURN SQL_API _SQLFreeStmt(
 
 	TRACE("_SQLFreeStmt");
 	if (fOption==SQL_DROP) {
+		if (env->plan_stmt == stmt)
+			env->plan_stmt = NULL;
 		mdb_sql_reset(sql);
+		_odbc_free_params(stmt);
 		g_free(stmt);
 	} else if (fOption==SQL_CLOSE) {
+	} else if (fOption==SQL_RESET_PARAMS) {
+		_odbc_free_params(stmt);
 	} else {
 	}
 	return SQL_SUCCESS;
@@ -923,7 +1018,25 @@ SQLRETURN SQL_API SQLGetStmtAttr (
     SQLINTEGER BufferLength,
     SQLINTEGER * StringLength)
 {
+	struct _hstmt *stmt = (struct _hstmt *) StatementHandle;
+
 	TRACE("SQLGetStmtAttr");
+	if (Attribute == SQL_ATTR_MAX_ROWS)
+		*(SQLUINTEGER *)Value = stmt->max_rows;
+   return SQL_SUCCESS;
+}
+
+SQLRETURN SQL_API SQLSetStmtAttr (
+    SQLHSTMT StatementHandle,
+    SQLINTEGER Attribute,
+    SQLPOINTER Value,
+    SQLINTEGER StringLength)
+{
+	struct _hstmt *stmt = (struct _hstmt *) StatementHandle;
+
+	TRACE("SQLSetStmtAttr");
+	if (Attribute == SQL_ATTR_MAX_ROWS)
+		stmt->max_rows = (SQLUINTEGER)(unsigned long)Value;
    return SQL_SUCCESS;
 }
 
@@ -962,8 +1075,11 @@ SQLRETURN SQL_API SQLPrepare(
 
 	strncpy(stmt->query, szSqlStr, sqllen);
 	stmt->query[sqllen]='\0';
+	_odbc_fix_literals(stmt);
+	stmt->prepared = 1;
 
-	return SQL_SUCCESS;
+	/* parse and plan now, SQLExecute only binds the parameters */
+	return _odbc_prepare(stmt);
 }
 
 SQLRETURN SQL_API SQLRowCount(
@@ -1106,6 +1222,7 @@ SQLRETURN SQL_API SQLColumns(
 		mdb_free_tabledef(table);
 	}
 	sql->cur_table = ttable;
+	env->plan_stmt = NULL;
 
 	return SQL_SUCCESS;
 }
@@ -1356,7 +1473,11 @@ SQLRETURN SQL_API SQLGetStmtOption(
     SQLUSMALLINT       fOption,
     SQLPOINTER         pvParam)
 {
+	struct _hstmt *stmt = (struct _hstmt *) hstmt;
+
 	TRACE("SQLGetStmtOption");
+	if (fOption == SQL_MAX_ROWS)
+		*(SQLUINTEGER *)pvParam = stmt->max_rows;
 	return SQL_SUCCESS;
 }
 
@@ -1440,6 +1561,7 @@ SQLRETURN SQL_API SQLGetTypeInfo(
 		ttable->num_rows++;
 	}
 	sql->cur_table = ttable;
+	env->plan_stmt = NULL;
 	
 	/* return _SQLExecute(hstmt); */
 	return SQL_SUCCESS;
@@ -1476,7 +1598,11 @@ SQLRETURN SQL_API SQLSetStmtOption(
     SQLUSMALLINT       fOption,
     SQLUINTEGER        vParam)
 {
+	struct _hstmt *stmt = (struct _hstmt *) hstmt;
+
 	TRACE("SQLSetStmtOption");
+	if (fOption == SQL_MAX_ROWS)
+		stmt->max_rows = vParam;
 	return SQL_SUCCESS;
 }
 
@@ -1578,6 +1704,7 @@ SQLRETURN SQL_API SQLTables(
 		ttable->num_rows++;
 	}
 	sql->cur_table = ttable;
+	env->plan_stmt = NULL;
 
 	return SQL_SUCCESS;
 }
@@ -1637,6 +1764,93 @@ char quote_char;
 	return 0;
 }
 
+/* parse and plan a prepared statement in the connection's MdbSQL */
+static SQLRETURN _odbc_prepare(struct _hstmt *stmt)
+{
+struct _hdbc *dbc = (struct _hdbc *) stmt->hdbc;
+struct _henv *env = (struct _henv *) dbc->henv;
+
+	env->plan_stmt = NULL;
+	mdb_sql_reset(env->sql);
+	mdb_sql_set_maxrow(env->sql, stmt->max_rows);
+
+	/* calls to yyparse would need to be serialized for thread safety */
+	if (mdb_sql_prepare(env->sql, stmt->query)) {
+		LogError("Couldn't parse SQL\n");
+		mdb_sql_reset(env->sql);
+		return SQL_ERROR;
+	}
+	env->plan_stmt = stmt;
+	return SQL_SUCCESS;
+}
+
+/* hand the values of the bound parameters to the prepared query */
+static int _odbc_bind_params(struct _hstmt *stmt, MdbSQL *sql)
+{
+struct _sql_param_info *cur;
+char buf[256];
+int len;
+
+	for (cur = stmt->param_head; cur; cur = cur->next) {
+		if (cur->param_lenbind && *cur->param_lenbind == SQL_NULL_DATA) {
+			LogError("NULL parameter values are not supported");
+			return 1;
+		}
+		switch (cur->param_ctype) {
+			case SQL_C_CHAR:
+			if (!cur->param_lenbind || *cur->param_lenbind == SQL_NTS)
+				len = strlen(cur->varaddr);
+			else
+				len = *cur->param_lenbind;
+			len = MIN(len, 255);
+			memcpy(buf, cur->varaddr, len);
+			buf[len] = '\0';
+			mdb_sql_bind_param_string(sql, cur->param_number, buf);
+			break;
+			case SQL_C_LONG:
+			case SQL_C_SLONG:
+			mdb_sql_bind_param_int(sql, cur->param_number,
+				*(SQLINTEGER *)cur->varaddr);
+			break;
+			case SQL_C_ULONG:
+			mdb_sql_bind_param_int(sql, cur->param_number,
+				*(SQLUINTEGER *)cur->varaddr);
+			break;
+			case SQL_C_SHORT:
+			case SQL_C_SSHORT:
+			mdb_sql_bind_param_int(sql, cur->param_number,
+				*(SQLSMALLINT *)cur->varaddr);
+			break;
+			case SQL_C_USHORT:
+			mdb_sql_bind_param_int(sql, cur->param_number,
+				*(SQLUSMALLINT *)cur->varaddr);
+			break;
+			case SQL_C_TINYINT:
+			case SQL_C_STINYINT:
+			mdb_sql_bind_param_int(sql, cur->param_number,
+				*(signed char *)cur->varaddr);
+			break;
+			case SQL_C_UTINYINT:
+			case SQL_C_BIT:
+			mdb_sql_bind_param_int(sql, cur->param_number,
+				*(unsigned char *)cur->varaddr);
+			break;
+		}
+	}
+	return 0;
+}
+
+static void _odbc_free_params(struct _hstmt *stmt)
+{
+struct _sql_param_info *cur, *next;
+
+	for (cur = stmt->param_head; cur; cur = next) {
+		next = cur->next;
+		g_free(cur);
+	}
+	stmt->param_head = NULL;
+}
+
 static int _odbc_get_string_size(int size, char *str)
 {
 	if (!str) {
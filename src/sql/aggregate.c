@@ -0,0 +1,972 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Aggregate functions and GROUP BY.  The query is first run as a plain
+ * select (or join) of the columns the groups and aggregates read, then its
+ * rows are folded into an open addressing hash table keyed on the group
+ * values in their native form.  Once the groups outgrow sql->mem_budget,
+ * rows of groups not already in memory are hashed out to temp files, and
+ * each file is aggregated on its own afterwards.  The finished groups are
+ * kept as flat rows and handed out through the row source of a temp table.
+ *
+ * Input rows come from a scan operator in the usual flat format: one value
+ * per input column, each a 2 byte length (MDB_FLAT_NULL for null) followed
+ * by the raw data.  A Boolean is carried as a zero length value when true
+ * and null when false.
+ */
+#include "mdbsql.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#define MDB_AGG_KEY_SIZE 8192
+#define MDB_AGG_TEXT_SIZE 768
+#define MDB_AGG_PARTS 32
+#define MDB_AGG_MAX_DEPTH 3
+#define MDB_AGG_BLOCK_SIZE 65536
+
+/* how an aggregate reads its column */
+enum {
+	MDB_AGG_OTHER,
+	MDB_AGG_INT,
+	MDB_AGG_MONEY,
+	MDB_AGG_REAL,
+	MDB_AGG_DATE,
+	MDB_AGG_NUMERIC,
+	MDB_AGG_TEXT,
+	MDB_AGG_RAW
+};
+
+typedef struct {
+	int func;
+	int in;			/* input value read, -1 for COUNT(*) */
+	MdbColumn *col;
+	int kind;
+	size_t off;		/* offset of the state within a group */
+} MdbAggFunc;
+
+typedef struct {
+	guint32 hash;
+	guint32 key_len;
+	unsigned char data[8];	/* key, then the aggregate states */
+} MdbAggGroup;
+
+/* rows of new groups go to temp files once the budget is used up */
+typedef struct {
+	int depth;
+	int spilling;
+	FILE *parts[MDB_AGG_PARTS];
+} MdbAggLevel;
+
+typedef struct {
+	MdbSQL *sql;
+	MdbHandle *mdb;
+	int num_inputs;
+	MdbColumn **inputs;
+	int num_groups;		/* the first inputs are the group columns */
+	int num_funcs;
+	MdbAggFunc *funcs;
+	size_t state_size;
+	/* hash table */
+	MdbAggGroup **slots;
+	guint32 num_slots;
+	guint32 num_entries;
+	GPtrArray *blocks;
+	size_t block_left;
+	unsigned char *block_ptr;
+	size_t mem_used;
+	unsigned long groups_out;
+	/* scratch */
+	unsigned char *row;
+	size_t row_size;
+	const unsigned char **vals;
+	int *lens;
+	/* output */
+	MdbTableDef *ttable;
+	MdbSQLRows *rows;
+	unsigned char *out;
+	size_t out_size;
+	int *out_group;		/* group an output column shows, or -1 */
+	int *out_func;		/* aggregate it shows, or -1 */
+	int failed;
+} MdbAgg;
+
+static void
+mdb_agg_grow(unsigned char **buf, size_t *size, size_t need)
+{
+	if (need <= *size) return;
+	while (*size < need)
+		*size = *size ? *size * 2 : 4096;
+	*buf = g_realloc(*buf, *size);
+}
+static guint32
+mdb_agg_hash(const unsigned char *key, int len)
+{
+	guint32 h = 2166136261U;
+	int i;
+
+	for (i=0; i<len; i++) {
+		h ^= key[i];
+		h *= 16777619U;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+/* each level of partitioning needs bits the previous ones didn't use */
+static int
+mdb_agg_part(guint32 hash, int depth)
+{
+	hash ^= 0x9e3779b9U * (depth + 1);
+	hash ^= hash >> 15;
+	hash *= 0x2c1b3c6dU;
+	hash ^= hash >> 12;
+	return hash % MDB_AGG_PARTS;
+}
+static int
+mdb_agg_kind(int col_type)
+{
+	switch (col_type) {
+		case MDB_BYTE:
+		case MDB_INT:
+		case MDB_LONGINT:
+			return MDB_AGG_INT;
+		case MDB_MONEY:
+			return MDB_AGG_MONEY;
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+			return MDB_AGG_REAL;
+		case MDB_SDATETIME:
+			return MDB_AGG_DATE;
+		case MDB_NUMERIC:
+			return MDB_AGG_NUMERIC;
+		case MDB_TEXT:
+			return MDB_AGG_TEXT;
+		case MDB_REPID:
+			return MDB_AGG_RAW;
+	}
+	return MDB_AGG_OTHER;
+}
+static gint64
+mdb_agg_get_int(MdbColumn *col, const unsigned char *v)
+{
+	gint64 i;
+
+	switch (col->col_type) {
+		case MDB_BYTE:
+			return v[0];
+		case MDB_INT:
+			return (gint16)mdb_get_int16((void *)v, 0);
+		case MDB_MONEY:
+			memcpy(&i, v, 8);
+			return GINT64_FROM_LE(i);
+	}
+	return (gint32)mdb_get_int32((void *)v, 0);
+}
+static double
+mdb_agg_get_real(MdbColumn *col, const unsigned char *v)
+{
+	char buf[MDB_NUMERIC_BUFSZ];
+
+	switch (col->col_type) {
+		case MDB_FLOAT:
+			return mdb_get_single((void *)v, 0);
+		case MDB_NUMERIC:
+			mdb_numeric_to_buf(v, col->col_scale, buf);
+			return g_ascii_strtod(buf, NULL);
+	}
+	return mdb_get_double((void *)v, 0);
+}
+static void
+mdb_agg_put_int64(unsigned char *buf, gint64 i)
+{
+	i = GINT64_TO_LE(i);
+	memcpy(buf, &i, 8);
+}
+static void
+mdb_agg_put_double(unsigned char *buf, double d)
+{
+	union {guint64 g; double d;} u;
+
+	u.d = d;
+	u.g = GUINT64_TO_LE(u.g);
+	memcpy(buf, &u.g, 8);
+}
+/* compare two non text values of an aggregate's column */
+static int
+mdb_agg_cmp(MdbAggFunc *f, const unsigned char *a, const unsigned char *b, int len)
+{
+	gint64 ia, ib;
+	double da, db;
+
+	switch (f->kind) {
+		case MDB_AGG_INT:
+		case MDB_AGG_MONEY:
+			ia = mdb_agg_get_int(f->col, a);
+			ib = mdb_agg_get_int(f->col, b);
+			return ia < ib ? -1 : ia > ib;
+		case MDB_AGG_REAL:
+		case MDB_AGG_DATE:
+		case MDB_AGG_NUMERIC:
+			da = mdb_agg_get_real(f->col, a);
+			db = mdb_agg_get_real(f->col, b);
+			return da < db ? -1 : da > db;
+	}
+	return memcmp(a, b, len);
+}
+/*
+ * Build the group key from the decoded row: a flag byte per column (0 for
+ * null), then the value.  Text is converted so that equal strings make equal
+ * keys, floats have -0 folded into 0, everything else is kept as stored.
+ */
+static int
+mdb_agg_make_key(MdbAgg *agg, unsigned char *key)
+{
+	MdbColumn *col;
+	const unsigned char *v;
+	int g, n, pos = 0;
+	float fl;
+	double d;
+
+	for (g=0; g<agg->num_groups; g++) {
+		col = agg->inputs[g];
+		v = agg->vals[g];
+		if (pos + MDB_AGG_TEXT_SIZE + 4 > MDB_AGG_KEY_SIZE) {
+			mdb_sql_error("GROUP BY key is too long");
+			agg->failed = 1;
+			return -1;
+		}
+		if (col->col_type == MDB_BOOL) {
+			key[pos++] = v ? 1 : 0;
+			continue;
+		}
+		if (!v) {
+			key[pos++] = 0;
+			continue;
+		}
+		key[pos++] = 1;
+		switch (col->col_type) {
+			case MDB_TEXT:
+				n = mdb_unicode2ascii(agg->mdb, (char *)v, agg->lens[g],
+					(char *)key + pos + 2, MDB_AGG_TEXT_SIZE);
+				key[pos] = n & 0xff;
+				key[pos + 1] = (n >> 8) & 0xff;
+				pos += n + 2;
+				break;
+			case MDB_FLOAT:
+				fl = mdb_get_single((void *)v, 0);
+				if (fl == 0) memset(key + pos, 0, 4);
+				else memcpy(key + pos, v, 4);
+				pos += 4;
+				break;
+			case MDB_DOUBLE:
+				d = mdb_get_double((void *)v, 0);
+				if (d == 0) memset(key + pos, 0, 8);
+				else memcpy(key + pos, v, 8);
+				pos += 8;
+				break;
+			default:
+				key[pos++] = agg->lens[g];
+				memcpy(key + pos, v, agg->lens[g]);
+				pos += agg->lens[g];
+				break;
+		}
+	}
+	return pos;
+}
+static unsigned char *
+mdb_agg_states(MdbAggGroup *grp)
+{
+	return grp->data + ((grp->key_len + 7) & ~7);
+}
+static void
+mdb_agg_update(MdbAgg *agg, unsigned char *states)
+{
+	MdbAggFunc *f;
+	unsigned char *s;
+	gint64 *count;
+	const unsigned char *v;
+	char text[MDB_AGG_TEXT_SIZE + 1];
+	int i, n, len, cmp;
+
+	for (i=0; i<agg->num_funcs; i++) {
+		f = &agg->funcs[i];
+		s = states + f->off;
+		count = (gint64 *)s;
+		if (f->in < 0) {
+			(*count)++;
+			continue;
+		}
+		v = agg->vals[f->in];
+		len = agg->lens[f->in];
+		/* Booleans are never null, false just looks that way */
+		if (f->col->col_type == MDB_BOOL) {
+			(*count)++;
+			continue;
+		}
+		if (!v)
+			continue;
+		switch (f->func) {
+			case MDB_SQL_SUM:
+			case MDB_SQL_AVG:
+				if (f->kind == MDB_AGG_INT || f->kind == MDB_AGG_MONEY)
+					*(gint64 *)(s + 8) += mdb_agg_get_int(f->col, v);
+				else
+					*(double *)(s + 8) += mdb_agg_get_real(f->col, v);
+				break;
+			case MDB_SQL_MIN:
+			case MDB_SQL_MAX:
+				if (f->kind == MDB_AGG_TEXT) {
+					n = mdb_unicode2ascii(agg->mdb, (char *)v, len,
+						text, MDB_AGG_TEXT_SIZE);
+					text[n] = '\0';
+					cmp = *count ? strcmp(text, (char *)s + 10) : 0;
+					if (!*count || (f->func == MDB_SQL_MIN ? cmp < 0 : cmp > 0)) {
+						s[8] = n & 0xff;
+						s[9] = (n >> 8) & 0xff;
+						memcpy(s + 10, text, n + 1);
+					}
+				} else {
+					cmp = *count ? mdb_agg_cmp(f, v, s + 9, len) : 0;
+					if (!*count || (f->func == MDB_SQL_MIN ? cmp < 0 : cmp > 0)) {
+						s[8] = len;
+						memcpy(s + 9, v, len);
+					}
+				}
+				break;
+		}
+		(*count)++;
+	}
+}
+static void
+mdb_agg_free_hash(MdbAgg *agg)
+{
+	unsigned int i;
+
+	if (agg->blocks) {
+		for (i=0; i<agg->blocks->len; i++)
+			g_free(g_ptr_array_index(agg->blocks, i));
+		g_ptr_array_free(agg->blocks, TRUE);
+		agg->blocks = NULL;
+	}
+	g_free(agg->slots);
+	agg->slots = NULL;
+	agg->num_slots = 0;
+	agg->num_entries = 0;
+	agg->block_left = 0;
+	agg->block_ptr = NULL;
+	agg->mem_used = 0;
+}
+static void
+mdb_agg_resize(MdbAgg *agg, guint32 num_slots)
+{
+	MdbAggGroup **slots, *grp;
+	guint32 i, h;
+
+	slots = g_malloc0(num_slots * sizeof(MdbAggGroup *));
+	for (i=0; i<agg->num_slots; i++) {
+		if (!(grp = agg->slots[i])) continue;
+		for (h = grp->hash & (num_slots - 1); slots[h];
+		  h = (h + 1) & (num_slots - 1))
+			;
+		slots[h] = grp;
+	}
+	agg->mem_used += (num_slots - agg->num_slots) * sizeof(MdbAggGroup *);
+	g_free(agg->slots);
+	agg->slots = slots;
+	agg->num_slots = num_slots;
+}
+/* returns the slot holding key, or the empty slot where it belongs */
+static guint32
+mdb_agg_find(MdbAgg *agg, guint32 hash, const unsigned char *key, int key_len)
+{
+	MdbAggGroup *grp;
+	guint32 h;
+
+	for (h = hash & (agg->num_slots - 1); (grp = agg->slots[h]);
+	  h = (h + 1) & (agg->num_slots - 1)) {
+		if (grp->hash == hash && grp->key_len == (guint32)key_len
+		 && !memcmp(grp->data, key, key_len))
+			break;
+	}
+	return h;
+}
+static MdbAggGroup *
+mdb_agg_insert(MdbAgg *agg, guint32 slot, guint32 hash, const unsigned char *key, int key_len)
+{
+	MdbAggGroup *grp;
+	size_t size, block;
+
+	size = sizeof(MdbAggGroup) + ((key_len + 7) & ~7) + agg->state_size;
+	size = (size + 7) & ~7;
+	if (size > agg->block_left) {
+		block = size > MDB_AGG_BLOCK_SIZE ? size : MDB_AGG_BLOCK_SIZE;
+		if (!agg->blocks)
+			agg->blocks = g_ptr_array_new();
+		agg->block_ptr = g_malloc(block);
+		agg->block_left = block;
+		g_ptr_array_add(agg->blocks, agg->block_ptr);
+		agg->mem_used += block;
+	}
+	grp = (MdbAggGroup *)agg->block_ptr;
+	agg->block_ptr += size;
+	agg->block_left -= size;
+
+	grp->hash = hash;
+	grp->key_len = key_len;
+	memcpy(grp->data, key, key_len);
+	memset(mdb_agg_states(grp), 0, agg->state_size);
+	agg->slots[slot] = grp;
+	agg->num_entries++;
+	return grp;
+}
+/* fold one input row into its group, or set it aside for later */
+static void
+mdb_agg_add(MdbAgg *agg, MdbAggLevel *lvl, const unsigned char *row, size_t len)
+{
+	unsigned char key[MDB_AGG_KEY_SIZE];
+	MdbAggGroup *grp;
+	guint32 hash, slot, row_len;
+	int key_len, p;
+
+	mdb_sql_flat_decode(row, agg->num_inputs, agg->vals, agg->lens);
+	if ((key_len = mdb_agg_make_key(agg, key)) < 0)
+		return;
+	hash = mdb_agg_hash(key, key_len);
+
+	/* keep the table at most half full */
+	if ((agg->num_entries + 1) * 2 > agg->num_slots)
+		mdb_agg_resize(agg, agg->num_slots ? agg->num_slots * 2 : 1024);
+	slot = mdb_agg_find(agg, hash, key, key_len);
+	if (!(grp = agg->slots[slot])) {
+		if (lvl->spilling) {
+			p = mdb_agg_part(hash, lvl->depth);
+			row_len = len;
+			if (fwrite(&row_len, sizeof(row_len), 1, lvl->parts[p]) != 1
+			 || fwrite(row, 1, len, lvl->parts[p]) != len) {
+				mdb_sql_error("Error writing aggregate partition file");
+				agg->failed = 1;
+			}
+			return;
+		}
+		grp = mdb_agg_insert(agg, slot, hash, key, key_len);
+	}
+	/* the decoded values still point into row */
+	mdb_agg_update(agg, mdb_agg_states(grp));
+
+	if (!lvl->spilling && agg->mem_used > agg->sql->mem_budget
+	 && lvl->depth < MDB_AGG_MAX_DEPTH && agg->num_groups) {
+		for (p=0; p<MDB_AGG_PARTS; p++) {
+			if (!(lvl->parts[p] = tmpfile())) {
+				mdb_sql_error("Unable to create temp file for aggregate");
+				agg->failed = 1;
+				return;
+			}
+		}
+		lvl->spilling = 1;
+	}
+}
+/* add one group to the result rows */
+static void
+mdb_agg_emit(MdbAgg *agg, MdbAggGroup *grp)
+{
+	MdbTableDef *ttable = agg->ttable;
+	MdbHandle *mdb = agg->mdb;
+	unsigned char vbuf[MDB_PGSIZE * 2];
+	static unsigned char zero[8];
+	const unsigned char *gval[MDB_MAX_COLS];
+	int glen[MDB_MAX_COLS];
+	const unsigned char *key, *val;
+	unsigned char *s;
+	MdbAggFunc *f;
+	MdbColumn *col;
+	size_t pos = 0, row_size = 0;
+	gint64 count;
+	gint32 count32;
+	int g, i, len;
+
+	/* split the key back into group values */
+	key = grp ? grp->data : NULL;
+	for (g=0; g<agg->num_groups; g++) {
+		col = agg->inputs[g];
+		if (pos + MDB_AGG_TEXT_SIZE * 2 > sizeof(vbuf)) {
+			mdb_sql_error("Aggregate row is too large");
+			agg->failed = 1;
+			return;
+		}
+		gval[g] = NULL;
+		glen[g] = 0;
+		if (!*key++) continue;
+		if (col->col_type == MDB_BOOL) {
+			gval[g] = zero;
+		} else if (col->col_type == MDB_TEXT) {
+			len = key[0] | (key[1] << 8);
+			gval[g] = vbuf + pos;
+			glen[g] = mdb_ascii2unicode(mdb, (char *)key + 2, len,
+				(char *)vbuf + pos, MDB_AGG_TEXT_SIZE * 2);
+			pos += glen[g];
+			key += len + 2;
+		} else if (col->col_type == MDB_FLOAT || col->col_type == MDB_DOUBLE) {
+			gval[g] = key;
+			glen[g] = col->col_type == MDB_FLOAT ? 4 : 8;
+			key += glen[g];
+		} else {
+			glen[g] = *key++;
+			gval[g] = key;
+			key += glen[g];
+		}
+	}
+
+	for (i=0; i<(int)ttable->num_cols; i++) {
+		if (pos + MDB_AGG_TEXT_SIZE * 2 > sizeof(vbuf)) {
+			mdb_sql_error("Aggregate row is too large");
+			agg->failed = 1;
+			return;
+		}
+		val = NULL;
+		len = 0;
+		if (agg->out_group[i] >= 0) {
+			val = gval[agg->out_group[i]];
+			len = glen[agg->out_group[i]];
+		} else {
+			f = &agg->funcs[agg->out_func[i]];
+			s = grp ? mdb_agg_states(grp) + f->off : zero;
+			memcpy(&count, s, sizeof(count));
+			switch (f->func) {
+				case MDB_SQL_COUNT:
+					count32 = GINT32_TO_LE((gint32)count);
+					memcpy(vbuf + pos, &count32, 4);
+					val = vbuf + pos;
+					len = 4;
+					break;
+				case MDB_SQL_SUM:
+				case MDB_SQL_AVG:
+					if (!count) break;
+					val = vbuf + pos;
+					len = 8;
+					if (f->kind == MDB_AGG_MONEY && f->func == MDB_SQL_SUM) {
+						mdb_agg_put_int64(vbuf + pos, *(gint64 *)(s + 8));
+					} else if (f->kind == MDB_AGG_INT || f->kind == MDB_AGG_MONEY) {
+						double d = (double)*(gint64 *)(s + 8);
+						if (f->kind == MDB_AGG_MONEY) d /= 10000;
+						if (f->func == MDB_SQL_AVG) d /= count;
+						mdb_agg_put_double(vbuf + pos, d);
+					} else {
+						double d = *(double *)(s + 8);
+						if (f->func == MDB_SQL_AVG) d /= count;
+						mdb_agg_put_double(vbuf + pos, d);
+					}
+					break;
+				case MDB_SQL_MIN:
+				case MDB_SQL_MAX:
+					if (!count) break;
+					if (f->kind == MDB_AGG_TEXT) {
+						val = vbuf + pos;
+						len = mdb_ascii2unicode(mdb, (char *)s + 10,
+							s[8] | (s[9] << 8), (char *)vbuf + pos,
+							MDB_AGG_TEXT_SIZE * 2);
+					} else {
+						val = s + 9;
+						len = s[8];
+					}
+					break;
+			}
+			pos += len;
+		}
+		mdb_agg_grow(&agg->out, &agg->out_size, row_size + 2 + len);
+		row_size += mdb_sql_flat_value(agg->out + row_size, val, len);
+	}
+	if (row_size > mdb->fmt->pg_size) {
+		mdb_sql_error("Aggregate row is too large (%lu bytes)",
+			(unsigned long)row_size);
+		agg->failed = 1;
+		return;
+	}
+	mdb_sql_rows_add(agg->rows, agg->out, row_size);
+	agg->groups_out++;
+}
+/* write out the groups in memory, then aggregate each spilled partition */
+static void
+mdb_agg_finish(MdbAgg *agg, MdbAggLevel *lvl)
+{
+	MdbAggLevel sub;
+	guint32 i, row_len;
+	int p;
+
+	for (i=0; i<agg->num_slots && !agg->failed; i++)
+		if (agg->slots[i])
+			mdb_agg_emit(agg, agg->slots[i]);
+	mdb_agg_free_hash(agg);
+	if (!lvl->spilling)
+		return;
+
+	for (p=0; p<MDB_AGG_PARTS; p++) {
+		memset(&sub, 0, sizeof(sub));
+		sub.depth = lvl->depth + 1;
+		rewind(lvl->parts[p]);
+		while (!agg->failed
+		 && fread(&row_len, sizeof(row_len), 1, lvl->parts[p]) == 1) {
+			mdb_agg_grow(&agg->row, &agg->row_size, row_len);
+			if (fread(agg->row, 1, row_len, lvl->parts[p]) != row_len) {
+				mdb_sql_error("Error reading aggregate partition file");
+				agg->failed = 1;
+				break;
+			}
+			mdb_agg_add(agg, &sub, agg->row, row_len);
+		}
+		fclose(lvl->parts[p]);
+		lvl->parts[p] = NULL;
+		mdb_agg_finish(agg, &sub);
+	}
+	lvl->spilling = 0;
+}
+static void
+mdb_agg_close_level(MdbAggLevel *lvl)
+{
+	int p;
+
+	for (p=0; p<MDB_AGG_PARTS; p++)
+		if (lvl->parts[p])
+			fclose(lvl->parts[p]);
+}
+/* check that func can be applied to col and lay out its state */
+static int
+mdb_agg_add_func(MdbAgg *agg, MdbSQLColumn *sqlcol, int in)
+{
+	static char *names[] = { "", "COUNT", "SUM", "MIN", "MAX", "AVG" };
+	MdbAggFunc *f = &agg->funcs[agg->num_funcs];
+	size_t size = 8;
+
+	f->func = sqlcol->func;
+	f->in = in;
+	f->col = in >= 0 ? agg->inputs[in] : NULL;
+	f->kind = f->col ? mdb_agg_kind(f->col->col_type) : MDB_AGG_OTHER;
+	if (!f->col) {
+		if (f->func != MDB_SQL_COUNT) {
+			mdb_sql_error("%s(*) is not allowed", names[f->func]);
+			return 0;
+		}
+	} else if (f->func == MDB_SQL_SUM || f->func == MDB_SQL_AVG) {
+		if (f->kind != MDB_AGG_INT && f->kind != MDB_AGG_MONEY
+		 && f->kind != MDB_AGG_REAL && f->kind != MDB_AGG_NUMERIC) {
+			mdb_sql_error("Can't use %s on column %s", names[f->func],
+				sqlcol->arg);
+			return 0;
+		}
+		size = 16;
+	} else if (f->func == MDB_SQL_MIN || f->func == MDB_SQL_MAX) {
+		if (f->kind == MDB_AGG_OTHER) {
+			mdb_sql_error("Can't use %s on column %s", names[f->func],
+				sqlcol->arg);
+			return 0;
+		}
+		size = f->kind == MDB_AGG_TEXT ? 10 + MDB_AGG_TEXT_SIZE + 1 : 32;
+	}
+	f->off = agg->state_size;
+	agg->state_size += (size + 7) & ~7;
+	agg->num_funcs++;
+	return 1;
+}
+/* the result column an output shows */
+static int
+mdb_agg_add_output(MdbAgg *agg, MdbSQLColumn *sqlcol, int i)
+{
+	MdbColumn tcol, *col;
+	MdbAggFunc *f;
+
+	if (strlen(sqlcol->name) > MDB_MAX_OBJ_NAME) {
+		mdb_sql_error("Column name %s is too long", sqlcol->name);
+		return 0;
+	}
+	if (agg->out_group[i] >= 0) {
+		col = agg->inputs[agg->out_group[i]];
+		mdb_fill_temp_col(&tcol, sqlcol->name, col->col_size,
+			col->col_type, col->is_fixed);
+		tcol.col_size = col->col_size;
+		tcol.col_prec = col->col_prec;
+		tcol.col_scale = col->col_scale;
+	} else {
+		f = &agg->funcs[agg->out_func[i]];
+		col = f->col;
+		switch (f->func) {
+			case MDB_SQL_COUNT:
+				mdb_fill_temp_col(&tcol, sqlcol->name, 4, MDB_LONGINT, 1);
+				break;
+			case MDB_SQL_SUM:
+				if (f->kind == MDB_AGG_MONEY)
+					mdb_fill_temp_col(&tcol, sqlcol->name, 8, MDB_MONEY, 1);
+				else
+					mdb_fill_temp_col(&tcol, sqlcol->name, 8, MDB_DOUBLE, 1);
+				break;
+			case MDB_SQL_AVG:
+				mdb_fill_temp_col(&tcol, sqlcol->name, 8, MDB_DOUBLE, 1);
+				break;
+			default:
+				mdb_fill_temp_col(&tcol, sqlcol->name, col->col_size,
+					col->col_type, col->is_fixed);
+				tcol.col_size = col->col_size;
+				tcol.col_prec = col->col_prec;
+				tcol.col_scale = col->col_scale;
+				break;
+		}
+	}
+	mdb_temp_table_add_col(agg->ttable, &tcol);
+	sqlcol->disp_size = mdb_col_disp_size(&tcol);
+	if (sqlcol->disp_size < (int)strlen(sqlcol->name))
+		sqlcol->disp_size = strlen(sqlcol->name);
+	return 1;
+}
+int
+mdb_sql_is_aggregate(MdbSQL *sql)
+{
+	MdbSQLColumn *sqlcol;
+	unsigned int i;
+
+	for (i=0; i<sql->num_columns; i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		if (sqlcol->func)
+			return 1;
+	}
+	return sql->group_by->len > 0;
+}
+/* index of a column among the inputs, adding it if new */
+static int
+mdb_agg_need(GPtrArray *names, char *name)
+{
+	unsigned int i;
+
+	for (i=0; i<names->len; i++)
+		if (!strcasecmp(g_ptr_array_index(names, i), name))
+			return i;
+	g_ptr_array_add(names, g_strdup(name));
+	return names->len - 1;
+}
+static void
+mdb_agg_free(MdbAgg *agg)
+{
+	mdb_agg_free_hash(agg);
+	g_free(agg->inputs);
+	g_free(agg->funcs);
+	g_free(agg->row);
+	g_free(agg->out);
+	mdb_sql_rows_free(agg->rows);
+	g_free(agg->vals);
+	g_free(agg->lens);
+	g_free(agg->out_group);
+	g_free(agg->out_func);
+}
+/*
+ * Run a query with aggregates and/or GROUP BY.  The select list is swapped
+ * for the columns the aggregation reads, the query runs as usual, and its
+ * rows are aggregated into a new result table.
+ */
+void
+mdb_sql_aggregate(MdbSQL *sql)
+{
+	MdbAgg agg_s, *agg = &agg_s;
+	MdbAggLevel lvl;
+	MdbTableDef *table;
+	MdbSQLBatch batch;
+	MdbSQLOp *op;
+	MdbSQLColumn *sqlcol;
+	MdbColumn *col;
+	GPtrArray *outs, *names, *group_by;
+	unsigned int num_outs, i, k;
+	int *in_of, count_only, ok = 0;
+
+	memset(agg, 0, sizeof(MdbAgg));
+	memset(&lvl, 0, sizeof(lvl));
+	agg->sql = sql;
+	agg->mdb = sql->mdb;
+
+	if (sql->all_columns) {
+		mdb_sql_error("SELECT * can't be used with aggregates or GROUP BY");
+		mdb_sql_reset(sql);
+		return;
+	}
+
+	/* the group columns come first among the inputs */
+	names = g_ptr_array_new();
+	group_by = sql->group_by;
+	sql->group_by = g_ptr_array_new();
+	for (i=0; i<group_by->len; i++)
+		mdb_agg_need(names, g_ptr_array_index(group_by, i));
+	agg->num_groups = names->len;
+
+	outs = sql->columns;
+	num_outs = sql->num_columns;
+	in_of = g_malloc0((num_outs + 1) * sizeof(int));
+	agg->out_group = g_malloc0((num_outs + 1) * sizeof(int));
+	agg->out_func = g_malloc0((num_outs + 1) * sizeof(int));
+	count_only = !group_by->len && !sql->sarg_tree && sql->num_tables == 1;
+	for (i=0; i<num_outs; i++) {
+		sqlcol = g_ptr_array_index(outs, i);
+		agg->out_group[i] = -1;
+		agg->out_func[i] = -1;
+		in_of[i] = -1;
+		if (!sqlcol->func) {
+			for (k=0; k<group_by->len; k++)
+				if (!strcasecmp(sqlcol->name, g_ptr_array_index(group_by, k)))
+					break;
+			if (k == group_by->len) {
+				mdb_sql_error("Column %s must be in GROUP BY or in an aggregate",
+					sqlcol->name);
+				goto fail;
+			}
+			agg->out_group[i] = mdb_agg_need(names, sqlcol->name);
+		} else if (sqlcol->arg) {
+			in_of[i] = mdb_agg_need(names, sqlcol->arg);
+		}
+		if (sqlcol->func != MDB_SQL_COUNT || sqlcol->arg)
+			count_only = 0;
+	}
+
+	/* run the query for the input columns */
+	sql->columns = g_ptr_array_new();
+	sql->num_columns = 0;
+	for (i=0; i<names->len; i++)
+		mdb_sql_add_column(sql, g_ptr_array_index(names, i));
+	if (!names->len && sql->num_tables > 1) {
+		/* joins need at least one column to carry */
+		if (sql->joins->len)
+			mdb_sql_add_column(sql,
+				((MdbSQLJoin *)g_ptr_array_index(sql->joins, 0))->left);
+		else
+			sql->all_columns = 1;
+	}
+	mdb_sql_select(sql);
+	if (!(table = sql->cur_table)) {
+		/* mdb_sql_select() already reported and reset */
+		mdb_sql_free_columns(outs);
+		goto done;
+	}
+	sql->cur_table = NULL;
+
+	agg->num_inputs = names->len;
+	agg->inputs = g_malloc0((names->len + 1) * sizeof(MdbColumn *));
+	for (i=0; i<names->len; i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		for (k=0; k<table->num_cols; k++) {
+			col = g_ptr_array_index(table->columns, k);
+			if (!strcasecmp(col->name, sqlcol->name)) {
+				agg->inputs[i] = col;
+				break;
+			}
+		}
+		if (!agg->inputs[i]) {
+			mdb_sql_error("Column %s not found", sqlcol->name);
+			goto fail_table;
+		}
+	}
+	for (i=0; i<agg->num_groups; i++) {
+		col = agg->inputs[i];
+		if (col->col_type == MDB_MEMO || col->col_type == MDB_OLE) {
+			mdb_sql_error("Can't GROUP BY column %s", col->name);
+			goto fail_table;
+		}
+	}
+	agg->funcs = g_malloc0((num_outs + 1) * sizeof(MdbAggFunc));
+	for (i=0; i<num_outs; i++) {
+		sqlcol = g_ptr_array_index(outs, i);
+		if (!sqlcol->func) continue;
+		agg->out_func[i] = agg->num_funcs;
+		if (!mdb_agg_add_func(agg, sqlcol, in_of[i]))
+			goto fail_table;
+	}
+
+	agg->ttable = mdb_create_temp_table(sql->mdb, "#aggregate");
+	for (i=0; i<num_outs; i++) {
+		if (!mdb_agg_add_output(agg, g_ptr_array_index(outs, i), i))
+			goto fail_table;
+	}
+	mdb_temp_columns_end(agg->ttable);
+	agg->rows = mdb_sql_rows_new();
+
+	agg->vals = g_malloc0((agg->num_inputs + 1) * sizeof(unsigned char *));
+	agg->lens = g_malloc0((agg->num_inputs + 1) * sizeof(int));
+	if (count_only) {
+		/* nothing to test, the table knows how many rows it has */
+		gint64 rows = table->num_rows;
+		unsigned char states[8 * MDB_MAX_COLS];
+
+		for (i=0; i<(unsigned int)agg->num_funcs; i++)
+			memcpy(states + agg->funcs[i].off, &rows, sizeof(rows));
+		mdb_agg_resize(agg, 2);
+		agg->slots[0] = (MdbAggGroup *)g_malloc0(sizeof(MdbAggGroup)
+			+ agg->state_size);
+		memcpy(mdb_agg_states(agg->slots[0]), states, agg->state_size);
+		mdb_agg_emit(agg, agg->slots[0]);
+		g_free(agg->slots[0]);
+		agg->slots[0] = NULL;
+	} else {
+		op = mdb_sql_scan_op(table, agg->inputs, agg->num_inputs);
+		mdb_sql_batch_init(&batch);
+		while (!agg->failed && mdb_sql_op_next(op, &batch)) {
+			for (i=0; i<batch.num_rows && !agg->failed; i++)
+				mdb_agg_add(agg, &lvl, MDB_SQL_BATCH_ROW(&batch, i),
+					batch.lens[i]);
+		}
+		mdb_sql_batch_free(&batch);
+		mdb_sql_op_close(op);
+		if (!agg->failed)
+			mdb_agg_finish(agg, &lvl);
+		/* without GROUP BY there is always one row */
+		if (!agg->failed && !agg->num_groups && !agg->groups_out)
+			mdb_agg_emit(agg, NULL);
+	}
+	if (agg->failed)
+		goto fail_table;
+	ok = 1;
+
+fail_table:
+	mdb_index_scan_free(table);
+	if (table->sarg_tree)
+		mdb_sql_free_tree(table->sarg_tree);
+	mdb_free_tabledef(table);
+fail:
+	/* put the select list back */
+	if (sql->columns != outs)
+		mdb_sql_free_columns(sql->columns);
+	sql->columns = outs;
+	sql->num_columns = num_outs;
+	if (ok) {
+		mdb_sql_set_op(agg->ttable, mdb_sql_rows_op(agg->rows));
+		agg->rows = NULL;
+		sql->cur_table = agg->ttable;
+	} else {
+		if (agg->ttable)
+			mdb_free_tabledef(agg->ttable);
+		mdb_sql_reset(sql);
+	}
+done:
+	mdb_agg_close_level(&lvl);
+	mdb_agg_free(agg);
+	g_free(in_of);
+	for (i=0; i<names->len; i++)
+		g_free(g_ptr_array_index(names, i));
+	g_ptr_array_free(names, TRUE);
+	for (i=0; i<group_by->len; i++)
+		g_free(g_ptr_array_index(group_by, i));
+	g_ptr_array_free(group_by, TRUE);
+}
@@ -0,0 +1,1386 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Multi-table SELECT.  Equi-joins run as a pipeline of hash joins: the
+ * largest table is streamed through mdb_fetch_row() as the probe side and
+ * every other table is read once into a hash table keyed on its join
+ * columns.  A build side that outgrows its share of sql->mem_budget is
+ * grace partitioned: the rest of the build rows and all probe rows reaching
+ * that join are hashed out to temp files, and the partitions are joined
+ * pairwise once the probe table is exhausted.  The build sides are loaded
+ * up front; the probe table is only read as rows are fetched from the temp
+ * table handed back, whose rows come from the join operator.
+ *
+ * With MDB_USE_INDEX set, a table whose join column leads a usable index is
+ * not hashed when few rows will look into it: each arriving row seeks the
+ * index instead (index nested loop).  When the probe table and the first
+ * table joined to it can both be read in key order, the two are merged.
+ * Only single column ascending indexes on long integers qualify, that is
+ * all the index code can seek on.
+ *
+ * Rows travel through the pipeline in a flat format, one value per column
+ * carried, each a 2 byte length (MDB_FLAT_NULL for null) followed by the raw
+ * column data as it was on the data page.
+ */
+#include "mdbsql.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#define MDB_JOIN_MAX_KEYS 8
+#define MDB_JOIN_KEY_SIZE 1028
+#define MDB_JOIN_MAX_PARTS 256
+#define MDB_JOIN_BLOCK_SIZE 65536
+/* a seek costs a few index pages, prefer it while it reads far fewer rows */
+#define MDB_JOIN_SEEK_RATIO 8
+
+enum {
+	MDB_JOIN_HASH,
+	MDB_JOIN_INDEX,
+	MDB_JOIN_MERGE
+};
+
+typedef struct {
+	MdbSQLTable *sql_tab;
+	MdbTableDef *table;
+	GArray *cols;		/* column numbers carried through the join */
+	MdbSargNode *sarg_tree;
+	unsigned long est;	/* rows expected to pass the WHERE clause */
+	int first_slot;
+	int joined;
+} MdbJoinInput;
+
+typedef struct mdbjoinentry MdbJoinEntry;
+struct mdbjoinentry {
+	MdbJoinEntry *next;
+	guint32 hash;
+	unsigned int key_len;
+	unsigned int row_len;
+	unsigned char data[1];	/* key, then row */
+};
+
+typedef struct {
+	MdbJoinInput *build;
+	int method;
+	int num_slots;		/* values in a row arriving at this join */
+	int num_keys;
+	int seek_key;		/* key read from the index */
+	int probe_slot[MDB_JOIN_MAX_KEYS];
+	int build_slot[MDB_JOIN_MAX_KEYS];
+	MdbColumn *probe_col[MDB_JOIN_MAX_KEYS];
+	MdbColumn *build_col[MDB_JOIN_MAX_KEYS];
+	/* hash table */
+	MdbJoinEntry **buckets;
+	guint32 num_buckets;
+	guint32 num_entries;
+	GPtrArray *blocks;
+	size_t block_left;
+	unsigned char *block_ptr;
+	size_t mem_used;
+	size_t budget;
+	/* grace partitions */
+	int num_parts;
+	FILE **build_parts;
+	FILE **probe_parts;
+	/* scratch for joined rows and partition reads */
+	unsigned char *out;
+	size_t out_size;
+	unsigned char *io;
+	size_t io_size;
+	/* rows read from the index */
+	unsigned char *inner;
+	size_t inner_size;
+	/* merge join state: the inner rows equal to the last key, and the
+	 * next inner row */
+	unsigned char *group;
+	size_t group_len;
+	size_t group_size;
+	gint64 group_key;
+	int have_group;
+	size_t ahead_len;
+	gint64 ahead_key;
+	int have_ahead;
+	int started;
+	gint64 probe_key;
+	int have_probe;
+} MdbJoinStep;
+
+typedef struct {
+	MdbSQL *sql;
+	MdbHandle *mdb;
+	int num_inputs;
+	MdbJoinInput *inputs;	/* in FROM clause order */
+	MdbJoinInput **order;	/* join order, order[0] is the probe side */
+	int num_steps;
+	MdbJoinStep *steps;	/* steps[i] joins in order[i+1] */
+	int num_slots;
+	const unsigned char **vals;
+	int *lens;
+	/* output */
+	MdbTableDef *ttable;
+	int *out_in;
+	int *out_slot;
+	MdbSQLBatch *batch;	/* being filled by mdb_join_next() */
+	unsigned char *scratch;
+	size_t scratch_size;
+	int use_index;
+	int reread;		/* the probe table's page has been replaced */
+	int stop;		/* no more probe rows can match */
+	int probe_started;
+	int probe_done;
+	/* partition being joined once the probe table is done */
+	int fin_step;
+	int fin_part;
+	int fin_loaded;
+	int failed;
+} MdbJoin;
+
+static void
+mdb_join_grow(unsigned char **buf, size_t *size, size_t need)
+{
+	if (need <= *size) return;
+	while (*size < need)
+		*size = *size ? *size * 2 : 4096;
+	*buf = g_realloc(*buf, *size);
+}
+static guint32
+mdb_join_hash(const unsigned char *key, int len)
+{
+	guint32 h = 2166136261U;
+	int i;
+
+	for (i=0; i<len; i++) {
+		h ^= key[i];
+		h *= 16777619U;
+	}
+	/* murmur3 finalizer, so the low bits are usable as a bucket index */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+static int
+mdb_join_part(MdbJoinStep *st, guint32 hash)
+{
+	/* use different bits than the bucket index */
+	return (int)((((guint64)(hash >> 8)) * st->num_parts) >> 24);
+}
+/*
+ * Columns can only be joined to columns of the same class; the key
+ * encoding below makes equal values encode to equal bytes within a class.
+ */
+static int
+mdb_join_key_class(int col_type)
+{
+	switch (col_type) {
+		case MDB_BYTE:
+		case MDB_INT:
+		case MDB_LONGINT:
+			return 1;
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+			return 2;
+		case MDB_SDATETIME:
+			return 3;
+		case MDB_MONEY:
+			return 4;
+		case MDB_NUMERIC:
+			return 5;
+		case MDB_TEXT:
+			return 6;
+		case MDB_REPID:
+			return 7;
+	}
+	return 0;
+}
+static int
+mdb_join_encode_key(MdbHandle *mdb, MdbColumn *col, const unsigned char *val, int len, unsigned char *key)
+{
+	gint64 i;
+	double d;
+	int n;
+
+	switch (col->col_type) {
+		case MDB_BYTE:
+			i = val[0];
+			memcpy(key, &i, sizeof(i));
+			return sizeof(i);
+		case MDB_INT:
+			i = (gint16)mdb_get_int16((void *)val, 0);
+			memcpy(key, &i, sizeof(i));
+			return sizeof(i);
+		case MDB_LONGINT:
+			i = (gint32)mdb_get_int32((void *)val, 0);
+			memcpy(key, &i, sizeof(i));
+			return sizeof(i);
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+			if (col->col_type == MDB_FLOAT)
+				d = mdb_get_single((void *)val, 0);
+			else
+				d = mdb_get_double((void *)val, 0);
+			if (d == 0) d = 0;	/* -0 == 0 */
+			memcpy(key, &d, sizeof(d));
+			return sizeof(d);
+		case MDB_NUMERIC:
+			n = mdb_numeric_to_buf(val, col->col_scale, (char *)key);
+			key[n++] = '\0';
+			return n;
+		case MDB_TEXT:
+			n = mdb_unicode2ascii(mdb, (char *)val, len, (char *)key + 2,
+				MDB_JOIN_KEY_SIZE - 4);
+			key[0] = n & 0xff;
+			key[1] = (n >> 8) & 0xff;
+			return n + 2;
+		default:
+			memcpy(key, val, len);
+			return len;
+	}
+}
+/* returns the key length, or -1 if a key column is null */
+static int
+mdb_join_make_key(MdbJoin *j, const unsigned char *row, int num_slots, int *slots, MdbColumn **cols, int num_keys, unsigned char *key)
+{
+	int k, pos = 0;
+
+	mdb_sql_flat_decode(row, num_slots, j->vals, j->lens);
+	for (k=0; k<num_keys; k++) {
+		if (!j->vals[slots[k]])
+			return -1;
+		pos += mdb_join_encode_key(j->mdb, cols[k], j->vals[slots[k]],
+			j->lens[slots[k]], key + pos);
+	}
+	return pos;
+}
+/* integer value of a key column, 0 if it is null */
+static int
+mdb_join_int_key(MdbJoin *j, const unsigned char *row, int num_slots, int slot, MdbColumn *col, gint64 *val)
+{
+	const unsigned char *v;
+
+	mdb_sql_flat_decode(row, num_slots, j->vals, j->lens);
+	if (!(v = j->vals[slot]))
+		return 0;
+	switch (col->col_type) {
+		case MDB_BYTE:
+			*val = v[0];
+			break;
+		case MDB_INT:
+			*val = (gint16)mdb_get_int16((void *)v, 0);
+			break;
+		default:
+			*val = (gint32)mdb_get_int32((void *)v, 0);
+			break;
+	}
+	return 1;
+}
+/* flatten the current row of an input table into buf */
+static size_t
+mdb_join_pack_input(MdbJoin *j, MdbJoinInput *in, unsigned char **buf, size_t *size)
+{
+	MdbColumn *col;
+	unsigned int i;
+	size_t pos = 0;
+	int len, is_null;
+
+	for (i=0; i<in->cols->len; i++) {
+		col = g_ptr_array_index(in->table->columns,
+			g_array_index(in->cols, int, i));
+		if (col->col_type == MDB_BOOL) {
+			/* the value lives in the null bit */
+			is_null = col->cur_value_len;
+			len = 0;
+		} else {
+			len = col->cur_value_len;
+			is_null = !len;
+			if (col->col_type == MDB_OLE) {
+				if (len < MDB_MEMO_OVERHEAD) is_null = 1;
+				len = MDB_MEMO_OVERHEAD;
+			}
+		}
+		mdb_join_grow(buf, size, pos + 2 + len);
+		if (is_null) {
+			(*buf)[pos++] = MDB_FLAT_NULL & 0xff;
+			(*buf)[pos++] = MDB_FLAT_NULL >> 8;
+			continue;
+		}
+		(*buf)[pos++] = len & 0xff;
+		(*buf)[pos++] = (len >> 8) & 0xff;
+		memcpy(*buf + pos, j->mdb->pg_buf + col->cur_value_start, len);
+		pos += len;
+	}
+	return pos;
+}
+static void
+mdb_join_free_hash(MdbJoinStep *st)
+{
+	unsigned int i;
+
+	if (st->blocks) {
+		for (i=0; i<st->blocks->len; i++)
+			g_free(g_ptr_array_index(st->blocks, i));
+		g_ptr_array_free(st->blocks, TRUE);
+		st->blocks = NULL;
+	}
+	g_free(st->buckets);
+	st->buckets = NULL;
+	st->num_buckets = 0;
+	st->num_entries = 0;
+	st->block_left = 0;
+	st->block_ptr = NULL;
+	st->mem_used = 0;
+}
+static void
+mdb_join_resize(MdbJoinStep *st, guint32 num_buckets)
+{
+	MdbJoinEntry **buckets, *e, *next;
+	guint32 i;
+
+	buckets = g_malloc0(num_buckets * sizeof(MdbJoinEntry *));
+	for (i=0; i<st->num_buckets; i++) {
+		for (e = st->buckets[i]; e; e = next) {
+			next = e->next;
+			e->next = buckets[e->hash & (num_buckets - 1)];
+			buckets[e->hash & (num_buckets - 1)] = e;
+		}
+	}
+	st->mem_used += (num_buckets - st->num_buckets) * sizeof(MdbJoinEntry *);
+	g_free(st->buckets);
+	st->buckets = buckets;
+	st->num_buckets = num_buckets;
+}
+static void
+mdb_join_insert(MdbJoinStep *st, guint32 hash, const unsigned char *key, int key_len, const unsigned char *row, size_t row_len)
+{
+	MdbJoinEntry *e;
+	size_t size, block;
+
+	size = sizeof(MdbJoinEntry) + key_len + row_len;
+	size = (size + 7) & ~7;
+	if (size > st->block_left) {
+		block = size > MDB_JOIN_BLOCK_SIZE ? size : MDB_JOIN_BLOCK_SIZE;
+		if (!st->blocks)
+			st->blocks = g_ptr_array_new();
+		st->block_ptr = g_malloc(block);
+		st->block_left = block;
+		g_ptr_array_add(st->blocks, st->block_ptr);
+		st->mem_used += block;
+	}
+	e = (MdbJoinEntry *)st->block_ptr;
+	st->block_ptr += size;
+	st->block_left -= size;
+
+	e->hash = hash;
+	e->key_len = key_len;
+	e->row_len = row_len;
+	memcpy(e->data, key, key_len);
+	memcpy(e->data + key_len, row, row_len);
+
+	if (st->num_entries >= st->num_buckets)
+		mdb_join_resize(st, st->num_buckets ? st->num_buckets * 2 : 1024);
+	e->next = st->buckets[hash & (st->num_buckets - 1)];
+	st->buckets[hash & (st->num_buckets - 1)] = e;
+	st->num_entries++;
+}
+static int
+mdb_join_write(FILE *f, guint32 hash, const unsigned char *key, int key_len, const unsigned char *row, size_t row_len)
+{
+	guint32 hdr[3];
+
+	hdr[0] = hash;
+	hdr[1] = key_len;
+	hdr[2] = row_len;
+	if (fwrite(hdr, sizeof(hdr), 1, f) != 1
+	 || fwrite(key, 1, key_len, f) != (size_t)key_len
+	 || fwrite(row, 1, row_len, f) != row_len) {
+		mdb_sql_error("Error writing join partition file");
+		return 0;
+	}
+	return 1;
+}
+/* returns 1 and points key/row into st->io, 0 at end of file */
+static int
+mdb_join_read(MdbJoinStep *st, FILE *f, guint32 *hash, unsigned char **key, int *key_len, unsigned char **row, size_t *row_len)
+{
+	guint32 hdr[3];
+
+	if (fread(hdr, sizeof(hdr), 1, f) != 1)
+		return 0;
+	mdb_join_grow(&st->io, &st->io_size, hdr[1] + hdr[2]);
+	if (fread(st->io, 1, hdr[1] + hdr[2], f) != hdr[1] + hdr[2])
+		return 0;
+	*hash = hdr[0];
+	*key = st->io;
+	*key_len = hdr[1];
+	*row = st->io + hdr[1];
+	*row_len = hdr[2];
+	return 1;
+}
+/*
+ * The build side no longer fits in its budget.  Pick a partition count
+ * from the rows seen so far and move the hash table out to temp files.
+ */
+static int
+mdb_join_spill(MdbJoin *j, MdbJoinStep *st, unsigned long rows_seen)
+{
+	MdbJoinEntry *e;
+	double est;
+	guint32 i;
+	int p;
+
+	est = (double)st->mem_used / rows_seen * st->build->table->num_rows;
+	est = est / (st->budget ? st->budget : 1) * 2 + 2;
+	p = est > MDB_JOIN_MAX_PARTS ? MDB_JOIN_MAX_PARTS : (int)est;
+	st->num_parts = p;
+	st->build_parts = g_malloc0(p * sizeof(FILE *));
+	st->probe_parts = g_malloc0(p * sizeof(FILE *));
+	for (i=0; i<(guint32)p; i++) {
+		st->build_parts[i] = tmpfile();
+		st->probe_parts[i] = tmpfile();
+		if (!st->build_parts[i] || !st->probe_parts[i]) {
+			mdb_sql_error("Unable to create temp file for join");
+			return 0;
+		}
+	}
+	for (i=0; i<st->num_buckets; i++) {
+		for (e = st->buckets[i]; e; e = e->next) {
+			if (!mdb_join_write(st->build_parts[mdb_join_part(st, e->hash)],
+			  e->hash, e->data, e->key_len,
+			  e->data + e->key_len, e->row_len))
+				return 0;
+		}
+	}
+	mdb_join_free_hash(st);
+	return 1;
+}
+/* load one input table into the hash table of the join it feeds */
+static int
+mdb_join_build(MdbJoin *j, MdbJoinStep *st)
+{
+	MdbJoinInput *in = st->build;
+	unsigned char key[MDB_JOIN_KEY_SIZE * MDB_JOIN_MAX_KEYS];
+	unsigned long rows = 0;
+	guint32 hash;
+	int key_len;
+	size_t len;
+
+	while (mdb_fetch_row(in->table)) {
+		len = mdb_join_pack_input(j, in, &j->scratch, &j->scratch_size);
+		key_len = mdb_join_make_key(j, j->scratch, in->cols->len,
+			st->build_slot, st->build_col, st->num_keys, key);
+		if (key_len < 0)
+			continue;
+		hash = mdb_join_hash(key, key_len);
+		if (st->num_parts) {
+			if (!mdb_join_write(st->build_parts[mdb_join_part(st, hash)],
+			  hash, key, key_len, j->scratch, len))
+				return 0;
+			continue;
+		}
+		mdb_join_insert(st, hash, key, key_len, j->scratch, len);
+		rows++;
+		/* a cross join has a single key, partitioning can't split it */
+		if (st->mem_used > st->budget && st->num_keys) {
+			if (!mdb_join_spill(j, st, rows))
+				return 0;
+		}
+	}
+	return 1;
+}
+/* add a joined row, cut down to the output columns, to the batch */
+static void
+mdb_join_emit(MdbJoin *j, const unsigned char *row)
+{
+	unsigned int i, num_cols = j->ttable->num_cols;
+	unsigned char *out;
+	size_t pos = 0, row_size = 0;
+
+	mdb_sql_flat_decode(row, j->num_slots, j->vals, j->lens);
+	for (i=0; i<num_cols; i++)
+		row_size += 2 + j->lens[j->out_slot[i]];
+	if (row_size > j->mdb->fmt->pg_size) {
+		mdb_sql_error("Joined row is too large (%lu bytes)",
+			(unsigned long)row_size);
+		j->failed = 1;
+		return;
+	}
+	out = mdb_sql_batch_row(j->batch, row_size);
+	for (i=0; i<num_cols; i++)
+		pos += mdb_sql_flat_value(out + pos, j->vals[j->out_slot[i]],
+			j->lens[j->out_slot[i]]);
+	mdb_sql_batch_end_row(j->batch, pos);
+}
+static void mdb_join_push(MdbJoin *j, int s, const unsigned char *row, size_t len);
+
+/* pass row joined with the inner row of step s on to the next step */
+static void
+mdb_join_pair(MdbJoin *j, int s, const unsigned char *row, size_t len, const unsigned char *inner, size_t inner_len)
+{
+	MdbJoinStep *st = &j->steps[s];
+
+	mdb_join_grow(&st->out, &st->out_size, len + inner_len);
+	memcpy(st->out, row, len);
+	memcpy(st->out + len, inner, inner_len);
+	mdb_join_push(j, s + 1, st->out, len + inner_len);
+}
+static void
+mdb_join_probe(MdbJoin *j, int s, guint32 hash, const unsigned char *key, int key_len, const unsigned char *row, size_t len)
+{
+	MdbJoinStep *st = &j->steps[s];
+	MdbJoinEntry *e;
+
+	if (!st->num_buckets) return;
+	for (e = st->buckets[hash & (st->num_buckets - 1)]; e; e = e->next) {
+		if (e->hash != hash || e->key_len != (unsigned int)key_len
+		 || memcmp(e->data, key, key_len))
+			continue;
+		mdb_join_pair(j, s, row, len, e->data + e->key_len, e->row_len);
+		if (j->failed) return;
+	}
+}
+/* index nested loop: look the row's key up in the build table's index */
+static void
+mdb_join_seek(MdbJoin *j, int s, const unsigned char *row, size_t len)
+{
+	MdbJoinStep *st = &j->steps[s];
+	MdbJoinInput *in = st->build;
+	unsigned char key[MDB_JOIN_KEY_SIZE * MDB_JOIN_MAX_KEYS];
+	unsigned char inner_key[MDB_JOIN_KEY_SIZE * MDB_JOIN_MAX_KEYS];
+	int key_len, inner_key_len;
+	size_t inner_len;
+	gint64 val;
+
+	key_len = mdb_join_make_key(j, row, st->num_slots, st->probe_slot,
+		st->probe_col, st->num_keys, key);
+	if (key_len < 0)
+		return;
+	mdb_join_int_key(j, row, st->num_slots, st->probe_slot[st->seek_key],
+		st->probe_col[st->seek_key], &val);
+	mdb_index_scan_seek(in->table, (gint32)val);
+	j->reread = 1;
+	while (!j->failed && mdb_fetch_row(in->table)) {
+		inner_len = mdb_join_pack_input(j, in, &st->inner, &st->inner_size);
+		inner_key_len = mdb_join_make_key(j, st->inner, in->cols->len,
+			st->build_slot, st->build_col, st->num_keys, inner_key);
+		if (inner_key_len != key_len || memcmp(inner_key, key, key_len))
+			continue;
+		mdb_join_pair(j, s, row, len, st->inner, inner_len);
+	}
+}
+/* read the next build row in index order into st->inner */
+static void
+mdb_join_merge_next(MdbJoin *j, MdbJoinStep *st)
+{
+	MdbJoinInput *in = st->build;
+	gint64 val;
+
+	j->reread = 1;
+	while (mdb_fetch_row(in->table)) {
+		st->ahead_len = mdb_join_pack_input(j, in, &st->inner,
+			&st->inner_size);
+		/* nulls never join */
+		if (!mdb_join_int_key(j, st->inner, in->cols->len,
+		  st->build_slot[st->seek_key], st->build_col[st->seek_key], &val))
+			continue;
+		if (st->have_ahead && val < st->ahead_key) {
+			mdb_sql_error("Index %s is not in key order",
+				in->table->scan_idx->name);
+			j->failed = 1;
+			break;
+		}
+		st->ahead_key = val;
+		st->have_ahead = 1;
+		return;
+	}
+	st->have_ahead = 0;
+}
+/*
+ * merge join: both sides arrive in key order, so keep the build rows that
+ * share the current key and move forward as the probe keys grow.
+ */
+static void
+mdb_join_merge(MdbJoin *j, int s, const unsigned char *row, size_t len)
+{
+	MdbJoinStep *st = &j->steps[s];
+	MdbJoinInput *in = st->build;
+	unsigned char key[MDB_JOIN_KEY_SIZE * MDB_JOIN_MAX_KEYS];
+	unsigned char inner_key[MDB_JOIN_KEY_SIZE * MDB_JOIN_MAX_KEYS];
+	int key_len, inner_key_len;
+	guint32 inner_len;
+	size_t pos;
+	gint64 val;
+
+	key_len = mdb_join_make_key(j, row, st->num_slots, st->probe_slot,
+		st->probe_col, st->num_keys, key);
+	if (key_len < 0)
+		return;
+	mdb_join_int_key(j, row, st->num_slots, st->probe_slot[st->seek_key],
+		st->probe_col[st->seek_key], &val);
+	if (st->have_probe && val < st->probe_key) {
+		mdb_sql_error("Index %s is not in key order",
+			j->order[0]->table->scan_idx->name);
+		j->failed = 1;
+		return;
+	}
+	st->probe_key = val;
+	st->have_probe = 1;
+
+	if (!st->have_group || st->group_key != val) {
+		st->have_group = 0;
+		st->group_len = 0;
+		if (!st->started) {
+			st->started = 1;
+			mdb_join_merge_next(j, st);
+		}
+		while (!j->failed && st->have_ahead && st->ahead_key < val)
+			mdb_join_merge_next(j, st);
+		if (j->failed)
+			return;
+		if (!st->have_ahead) {
+			/* the build side is used up */
+			j->stop = 1;
+			return;
+		}
+		if (st->ahead_key != val)
+			return;
+		st->group_key = val;
+		st->have_group = 1;
+		while (!j->failed && st->have_ahead && st->ahead_key == val) {
+			inner_len = st->ahead_len;
+			mdb_join_grow(&st->group, &st->group_size,
+				st->group_len + sizeof(inner_len) + inner_len);
+			memcpy(st->group + st->group_len, &inner_len,
+				sizeof(inner_len));
+			memcpy(st->group + st->group_len + sizeof(inner_len),
+				st->inner, inner_len);
+			st->group_len += sizeof(inner_len) + inner_len;
+			mdb_join_merge_next(j, st);
+		}
+	}
+	for (pos = 0; pos < st->group_len && !j->failed; pos += inner_len) {
+		memcpy(&inner_len, st->group + pos, sizeof(inner_len));
+		pos += sizeof(inner_len);
+		inner_key_len = mdb_join_make_key(j, st->group + pos,
+			in->cols->len, st->build_slot, st->build_col,
+			st->num_keys, inner_key);
+		if (inner_key_len != key_len || memcmp(inner_key, key, key_len))
+			continue;
+		mdb_join_pair(j, s, row, len, st->group + pos, inner_len);
+	}
+}
+/* hand a row to join step s, or to the output once all tables are in */
+static void
+mdb_join_push(MdbJoin *j, int s, const unsigned char *row, size_t len)
+{
+	MdbJoinStep *st;
+	unsigned char key[MDB_JOIN_KEY_SIZE * MDB_JOIN_MAX_KEYS];
+	int key_len;
+	guint32 hash;
+
+	if (s == j->num_steps) {
+		mdb_join_emit(j, row);
+		return;
+	}
+	st = &j->steps[s];
+	if (st->method == MDB_JOIN_INDEX) {
+		mdb_join_seek(j, s, row, len);
+		return;
+	}
+	if (st->method == MDB_JOIN_MERGE) {
+		mdb_join_merge(j, s, row, len);
+		return;
+	}
+	key_len = mdb_join_make_key(j, row, st->num_slots, st->probe_slot,
+		st->probe_col, st->num_keys, key);
+	if (key_len < 0)
+		return;
+	hash = mdb_join_hash(key, key_len);
+	if (st->num_parts) {
+		if (!mdb_join_write(st->probe_parts[mdb_join_part(st, hash)],
+		  hash, key, key_len, row, len))
+			j->failed = 1;
+		return;
+	}
+	mdb_join_probe(j, s, hash, key, key_len, row, len);
+}
+/*
+ * Join the spilled partitions of each step in turn, one pair at a time.
+ * Each call probes a single partitioned row; returns 0 once all are done.
+ */
+static int
+mdb_join_finish_next(MdbJoin *j)
+{
+	MdbJoinStep *st;
+	unsigned char *key, *row;
+	int key_len, p;
+	size_t len;
+	guint32 hash;
+
+	while (j->fin_step < j->num_steps) {
+		st = &j->steps[j->fin_step];
+		p = j->fin_part;
+		if (p >= st->num_parts) {
+			j->fin_step++;
+			j->fin_part = 0;
+			continue;
+		}
+		if (!j->fin_loaded) {
+			rewind(st->build_parts[p]);
+			while (mdb_join_read(st, st->build_parts[p], &hash, &key,
+			  &key_len, &row, &len))
+				mdb_join_insert(st, hash, key, key_len, row, len);
+			fclose(st->build_parts[p]);
+			st->build_parts[p] = NULL;
+			rewind(st->probe_parts[p]);
+			j->fin_loaded = 1;
+		}
+		if (mdb_join_read(st, st->probe_parts[p], &hash, &key, &key_len,
+		  &row, &len)) {
+			mdb_join_probe(j, j->fin_step, hash, key, key_len, row, len);
+			return 1;
+		}
+		fclose(st->probe_parts[p]);
+		st->probe_parts[p] = NULL;
+		mdb_join_free_hash(st);
+		j->fin_loaded = 0;
+		j->fin_part++;
+	}
+	return 0;
+}
+static void
+mdb_join_free(MdbJoin *j)
+{
+	MdbJoinStep *st;
+	MdbJoinInput *in;
+	int i, p;
+
+	for (i=0; i<j->num_steps; i++) {
+		st = &j->steps[i];
+		mdb_join_free_hash(st);
+		for (p=0; p<st->num_parts; p++) {
+			if (st->build_parts[p]) fclose(st->build_parts[p]);
+			if (st->probe_parts[p]) fclose(st->probe_parts[p]);
+		}
+		g_free(st->build_parts);
+		g_free(st->probe_parts);
+		g_free(st->out);
+		g_free(st->io);
+		g_free(st->inner);
+		g_free(st->group);
+	}
+	for (i=0; i<j->num_inputs; i++) {
+		in = &j->inputs[i];
+		if (in->table) {
+			mdb_index_scan_free(in->table);
+			if (in->table->sarg_tree)
+				mdb_sql_free_tree(in->table->sarg_tree);
+			else if (in->sarg_tree)
+				mdb_sql_free_tree(in->sarg_tree);
+			mdb_free_tabledef(in->table);
+		}
+		if (in->cols) g_array_free(in->cols, TRUE);
+	}
+	g_free(j->steps);
+	g_free(j->inputs);
+	g_free(j->order);
+	g_free(j->vals);
+	g_free(j->lens);
+	g_free(j->out_in);
+	g_free(j->out_slot);
+	g_free(j->scratch);
+}
+/*
+ * Find the table and column a (possibly qualified) column name refers to.
+ * Returns the input index or -1 after reporting an error.
+ */
+static int
+mdb_join_resolve(MdbJoin *j, char *name, int *colnum)
+{
+	MdbJoinInput *in;
+	MdbColumn *col;
+	unsigned int k;
+	int i, found = -1;
+	char *bare;
+
+	for (i=0; i<j->num_inputs; i++) {
+		in = &j->inputs[i];
+		bare = mdb_sql_unqualify(in->sql_tab, name);
+		if (!bare) continue;
+		for (k=0; k<in->table->num_cols; k++) {
+			col = g_ptr_array_index(in->table->columns, k);
+			if (strcasecmp(col->name, bare)) continue;
+			if (found >= 0) {
+				mdb_sql_error("Column %s is ambiguous", name);
+				return -1;
+			}
+			found = i;
+			*colnum = k;
+			break;
+		}
+	}
+	if (found < 0)
+		mdb_sql_error("Column %s not found", name);
+	return found;
+}
+/* index of a column within the values an input carries, adding it if new */
+static int
+mdb_join_need(MdbJoinInput *in, int colnum)
+{
+	unsigned int i;
+
+	for (i=0; i<in->cols->len; i++)
+		if (g_array_index(in->cols, int, i) == colnum)
+			return i;
+	g_array_append_val(in->cols, colnum);
+	return in->cols->len - 1;
+}
+static MdbSQLJoin *
+mdb_join_is_marker(MdbSQL *sql, MdbSargNode *node)
+{
+	MdbSQLJoin *cond;
+	unsigned int i;
+
+	for (i=0; i<sql->joins->len; i++) {
+		cond = g_ptr_array_index(sql->joins, i);
+		if (cond->node == node)
+			return cond;
+	}
+	return NULL;
+}
+/*
+ * Resolve the columns of one WHERE conjunct.  Returns the input it
+ * belongs to, -1 if it refers to no table at all, -2 on error.
+ */
+static int
+mdb_join_route(MdbJoin *j, MdbSargNode *node, int cur)
+{
+	int in, colnum;
+
+	if (!node) return cur;
+	if (mdb_join_is_marker(j->sql, node)) {
+		mdb_sql_error("Join conditions can only be combined with AND");
+		return -2;
+	}
+	if (mdb_is_relational_op(node->op) && node->parent) {
+		in = mdb_join_resolve(j, (char *)node->parent, &colnum);
+		if (in < 0) return -2;
+		if (cur >= 0 && cur != in) {
+			mdb_sql_error("Conditions on more than one table must be joins");
+			return -2;
+		}
+		node->col = g_ptr_array_index(j->inputs[in].table->columns, colnum);
+		mdb_sql_set_param(node, j->sql);
+		return in;
+	}
+	cur = mdb_join_route(j, node->left, cur);
+	if (cur == -2) return cur;
+	return mdb_join_route(j, node->right, cur);
+}
+static MdbSargNode *
+mdb_join_and(MdbSargNode *a, MdbSargNode *b)
+{
+	MdbSargNode *node;
+
+	if (!a) return b;
+	node = mdb_sql_alloc_node();
+	node->op = MDB_AND;
+	node->left = a;
+	node->right = b;
+	return node;
+}
+/* split the WHERE clause at its top level ANDs and hand out the pieces */
+static int
+mdb_join_split_sargs(MdbJoin *j, MdbSargNode *node)
+{
+	MdbSargNode *left, *right;
+	MdbSQLJoin *cond;
+	int in;
+
+	if (node->op == MDB_AND) {
+		left = node->left;
+		right = node->right;
+		g_free(node);
+		if (!mdb_join_split_sargs(j, left)) {
+			mdb_sql_free_tree(right);
+			return 0;
+		}
+		return mdb_join_split_sargs(j, right);
+	}
+	if ((cond = mdb_join_is_marker(j->sql, node))) {
+		cond->node = NULL;
+		mdb_sql_free_tree(node);
+		return 1;
+	}
+	in = mdb_join_route(j, node, -1);
+	if (in == -2) {
+		mdb_sql_free_tree(node);
+		return 0;
+	}
+	/* constant expressions can go anywhere */
+	if (in < 0) in = 0;
+	j->inputs[in].sarg_tree = mdb_join_and(j->inputs[in].sarg_tree, node);
+	return 1;
+}
+static int
+mdb_join_add_output(MdbJoin *j, MdbSQLColumn *sqlcol, int in, int colnum)
+{
+	MdbColumn *col, tcol;
+
+	if (strlen(sqlcol->name) > MDB_MAX_OBJ_NAME) {
+		mdb_sql_error("Column name %s is too long", sqlcol->name);
+		return 0;
+	}
+	if (j->ttable->num_cols >= MDB_MAX_COLS) {
+		mdb_sql_error("Too many columns in join");
+		return 0;
+	}
+	col = g_ptr_array_index(j->inputs[in].table->columns, colnum);
+	mdb_fill_temp_col(&tcol, sqlcol->name, col->col_size, col->col_type,
+		col->is_fixed);
+	tcol.col_size = col->col_type == MDB_OLE ?
+		MDB_MEMO_OVERHEAD : col->col_size;
+	tcol.col_prec = col->col_prec;
+	tcol.col_scale = col->col_scale;
+	/* turned into a row slot once the join order is known */
+	j->out_in[j->ttable->num_cols] = in;
+	j->out_slot[j->ttable->num_cols] = mdb_join_need(&j->inputs[in], colnum);
+	mdb_temp_table_add_col(j->ttable, &tcol);
+	sqlcol->disp_size = mdb_col_disp_size(col);
+	return 1;
+}
+/* SELECT * over several tables qualifies the names that collide */
+static void
+mdb_join_all_columns(MdbJoin *j)
+{
+	MdbJoinInput *in, *other;
+	MdbColumn *col;
+	unsigned int k, m;
+	int i, o, dup;
+	char *name;
+
+	for (i=0; i<j->num_inputs; i++) {
+		in = &j->inputs[i];
+		for (k=0; k<in->table->num_cols; k++) {
+			col = g_ptr_array_index(in->table->columns, k);
+			dup = 0;
+			for (o=0; o<j->num_inputs && !dup; o++) {
+				if (o == i) continue;
+				other = &j->inputs[o];
+				for (m=0; m<other->table->num_cols; m++) {
+					MdbColumn *ocol = g_ptr_array_index(
+						other->table->columns, m);
+					if (!strcasecmp(ocol->name, col->name)) {
+						dup = 1;
+						break;
+					}
+				}
+			}
+			if (dup) {
+				name = g_strconcat(in->sql_tab->alias ?
+					in->sql_tab->alias : in->sql_tab->name,
+					".", col->name, NULL);
+				mdb_sql_add_column(j->sql, name);
+				g_free(name);
+			} else {
+				mdb_sql_add_column(j->sql, col->name);
+			}
+		}
+	}
+}
+/* an index on the column behind an input's slot that can be sought */
+static MdbIndex *
+mdb_join_seek_index(MdbJoin *j, MdbJoinInput *in, int slot)
+{
+	MdbIndex *idx;
+	MdbColumn *col;
+	unsigned int i;
+	int colnum;
+
+	if (!j->use_index)
+		return NULL;
+	colnum = g_array_index(in->cols, int, slot);
+	col = g_ptr_array_index(in->table->columns, colnum);
+	if (col->col_type != MDB_LONGINT)
+		return NULL;
+	for (i=0; i<in->table->num_idxs; i++) {
+		idx = g_ptr_array_index(in->table->indices, i);
+		if (idx->num_keys == 1 && idx->key_col_num[0] == colnum + 1
+		 && idx->key_col_order[0] == MDB_ASC && idx->first_pg)
+			return idx;
+	}
+	return NULL;
+}
+/* guess how many rows survive the WHERE clause from the index costs */
+static unsigned long
+mdb_join_estimate(MdbJoinInput *in)
+{
+	MdbTableDef *table = in->table;
+	int cost = 0;
+
+	if (!in->sarg_tree)
+		return table->num_rows;
+	if (table->strategy == MDB_INDEX_SCAN)
+		cost = mdb_index_compute_cost(table, table->scan_idx);
+	if (cost == 1)
+		return 1;
+	if (cost && cost <= 3)
+		return table->num_rows / 10 + 1;
+	return table->num_rows / 3 + 1;
+}
+/* rough size of the hash table an input would build */
+static double
+mdb_join_hash_size(MdbJoinInput *in)
+{
+	MdbColumn *col;
+	unsigned int i;
+	size_t width = sizeof(MdbJoinEntry) + 16;
+
+	for (i=0; i<in->cols->len; i++) {
+		col = g_ptr_array_index(in->table->columns,
+			g_array_index(in->cols, int, i));
+		width += 2 + (col->col_type == MDB_OLE ?
+			MDB_MEMO_OVERHEAD : col->col_size);
+	}
+	return (double)width * in->est;
+}
+/*
+ * Choose the join order: stream the biggest table, then keep adding the
+ * smallest table that joins to what we have so far.  A small table that
+ * can seek into a much bigger indexed table is streamed instead, so the
+ * big one is never read in full.
+ */
+static void
+mdb_join_order(MdbJoin *j, int *jl, int *jr, int *jlc, int *jrc)
+{
+	MdbJoinInput *in;
+	unsigned int k;
+	int i, s, a, b, bc, best, connected, best_connected;
+
+	best = -1;
+	for (k=0; k<j->sql->joins->len; k++) {
+		for (i=0; i<2; i++) {
+			a = i ? jr[k] : jl[k];
+			b = i ? jl[k] : jr[k];
+			bc = i ? jlc[k] : jrc[k];
+			if (!mdb_join_seek_index(j, &j->inputs[b], bc)
+			 || (double)j->inputs[a].est * MDB_JOIN_SEEK_RATIO
+			 >= j->inputs[b].table->num_rows)
+				continue;
+			if (best < 0 || j->inputs[a].est < j->inputs[best].est)
+				best = a;
+		}
+	}
+	if (best < 0) {
+		best = 0;
+		for (i=1; i<j->num_inputs; i++)
+			if (j->inputs[i].est > j->inputs[best].est)
+				best = i;
+	}
+	j->order[0] = &j->inputs[best];
+	j->inputs[best].joined = 1;
+
+	for (s=1; s<j->num_inputs; s++) {
+		best = -1;
+		best_connected = 0;
+		for (i=0; i<j->num_inputs; i++) {
+			in = &j->inputs[i];
+			if (in->joined) continue;
+			connected = 0;
+			for (k=0; k<j->sql->joins->len; k++) {
+				if ((jl[k] == i && j->inputs[jr[k]].joined)
+				 || (jr[k] == i && j->inputs[jl[k]].joined))
+					connected = 1;
+			}
+			if (best < 0 || connected > best_connected
+			 || (connected == best_connected
+			  && in->est < j->inputs[best].est)) {
+				best = i;
+				best_connected = connected;
+			}
+		}
+		j->order[s] = &j->inputs[best];
+		j->inputs[best].joined = 1;
+	}
+}
+static int
+mdb_join_plan(MdbJoin *j)
+{
+	MdbSQL *sql = j->sql;
+	MdbSQLTable *sql_tab;
+	MdbSQLColumn *sqlcol;
+	MdbSQLJoin *cond;
+	MdbJoinInput *in;
+	MdbJoinStep *st;
+	MdbColumn *lcol, *rcol;
+	MdbIndex *idx, *probe_idx;
+	unsigned long rows;
+	int *jl, *jr, *jlc, *jrc;
+	unsigned int i, k;
+	int s, slot, colnum, ok = 0;
+
+	/* the index code only reads Jet 3 index pages */
+	j->use_index = mdb_get_option(MDB_USE_INDEX) && !IS_JET4(j->mdb);
+	j->num_inputs = sql->num_tables;
+	j->inputs = g_malloc0(j->num_inputs * sizeof(MdbJoinInput));
+	j->order = g_malloc0(j->num_inputs * sizeof(MdbJoinInput *));
+	for (i=0; i<sql->num_tables; i++) {
+		sql_tab = g_ptr_array_index(sql->tables, i);
+		for (k=0; k<i; k++) {
+			MdbSQLTable *prev = j->inputs[k].sql_tab;
+			if (!strcasecmp(prev->alias ? prev->alias : prev->name,
+			  sql_tab->alias ? sql_tab->alias : sql_tab->name)) {
+				mdb_sql_error("Table %s appears twice, give it an alias",
+					sql_tab->name);
+				return 0;
+			}
+		}
+		in = &j->inputs[i];
+		in->sql_tab = sql_tab;
+		in->cols = g_array_new(FALSE, FALSE, sizeof(int));
+		in->table = mdb_read_table_by_name(j->mdb, sql_tab->name, MDB_TABLE);
+		if (!in->table) {
+			mdb_sql_error("%s is not a table in this database",
+				sql_tab->name);
+			return 0;
+		}
+		mdb_read_columns(in->table);
+		mdb_read_indices(in->table);
+		mdb_rewind_table(in->table);
+	}
+
+	/* output columns */
+	if (sql->all_columns)
+		mdb_join_all_columns(j);
+	j->ttable = mdb_create_temp_table(j->mdb, "#hashjoin");
+	j->out_in = g_malloc0((sql->num_columns + 1) * sizeof(int));
+	j->out_slot = g_malloc0((sql->num_columns + 1) * sizeof(int));
+	for (i=0; i<sql->num_columns; i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		s = mdb_join_resolve(j, sqlcol->name, &colnum);
+		if (s < 0 || !mdb_join_add_output(j, sqlcol, s, colnum))
+			return 0;
+	}
+	mdb_temp_columns_end(j->ttable);
+
+	/* join conditions */
+	jl = g_malloc0((sql->joins->len + 1) * sizeof(int) * 4);
+	jr = jl + sql->joins->len + 1;
+	jlc = jr + sql->joins->len + 1;
+	jrc = jlc + sql->joins->len + 1;
+	for (k=0; k<sql->joins->len; k++) {
+		cond = g_ptr_array_index(sql->joins, k);
+		if (cond->op != MDB_EQUAL) {
+			mdb_sql_error("Only equality joins are supported (%s, %s)",
+				cond->left, cond->right);
+			goto done;
+		}
+		if ((jl[k] = mdb_join_resolve(j, cond->left, &jlc[k])) < 0
+		 || (jr[k] = mdb_join_resolve(j, cond->right, &jrc[k])) < 0)
+			goto done;
+		if (jl[k] == jr[k]) {
+			mdb_sql_error("%s = %s compares two columns of the same table",
+				cond->left, cond->right);
+			goto done;
+		}
+		lcol = g_ptr_array_index(j->inputs[jl[k]].table->columns, jlc[k]);
+		rcol = g_ptr_array_index(j->inputs[jr[k]].table->columns, jrc[k]);
+		if (!mdb_join_key_class(lcol->col_type)
+		 || mdb_join_key_class(lcol->col_type)
+		 != mdb_join_key_class(rcol->col_type)) {
+			mdb_sql_error("Can't join %s to %s", cond->left, cond->right);
+			goto done;
+		}
+		/* remember where the key lives in each input's values */
+		jlc[k] = mdb_join_need(&j->inputs[jl[k]], jlc[k]);
+		jrc[k] = mdb_join_need(&j->inputs[jr[k]], jrc[k]);
+	}
+
+	/* hand each WHERE condition to the table it tests */
+	if (sql->sarg_tree) {
+		MdbSargNode *tree = sql->sarg_tree;
+		sql->sarg_tree = NULL;
+		if (!mdb_join_split_sargs(j, tree))
+			goto done;
+	}
+	for (s=0; s<j->num_inputs; s++) {
+		in = &j->inputs[s];
+		if (in->sarg_tree) {
+			in->sarg_tree = mdb_sql_fold_or_chains(in->sarg_tree);
+			mdb_sql_walk_tree(in->sarg_tree, mdb_find_indexable_sargs, NULL);
+		}
+		in->table->sarg_tree = in->sarg_tree;
+		mdb_index_scan_init(j->mdb, in->table);
+		in->est = mdb_join_estimate(in);
+	}
+
+	mdb_join_order(j, jl, jr, jlc, jrc);
+	for (s=0; s<j->num_inputs; s++)
+		j->inputs[s].joined = 0;
+	slot = 0;
+	for (s=0; s<j->num_inputs; s++) {
+		j->order[s]->first_slot = slot;
+		slot += j->order[s]->cols->len;
+	}
+	j->num_slots = slot;
+	j->vals = g_malloc0((slot + 1) * sizeof(unsigned char *));
+	j->lens = g_malloc0((slot + 1) * sizeof(int));
+
+	for (i=0; i<sql->num_columns; i++)
+		j->out_slot[i] += j->inputs[j->out_in[i]].first_slot;
+
+	j->num_steps = j->num_inputs - 1;
+	j->steps = g_malloc0(j->num_steps * sizeof(MdbJoinStep));
+	j->order[0]->joined = 1;
+	rows = j->order[0]->est;
+	for (s=0; s<j->num_steps; s++) {
+		st = &j->steps[s];
+		st->build = j->order[s + 1];
+		st->num_slots = st->build->first_slot;
+		st->budget = sql->mem_budget / j->num_steps;
+		for (k=0; k<sql->joins->len; k++) {
+			MdbJoinInput *l = &j->inputs[jl[k]], *r = &j->inputs[jr[k]];
+			int lc = jlc[k], rc = jrc[k];
+
+			if (r->joined && l == st->build) {
+				/* swap so the build side is on the right */
+				MdbJoinInput *t = l; int tc = lc;
+				l = r; lc = rc;
+				r = t; rc = tc;
+			} else if (!(l->joined && r == st->build)) {
+				continue;
+			}
+			if (st->num_keys == MDB_JOIN_MAX_KEYS) {
+				mdb_sql_error("Too many join conditions on %s",
+					st->build->sql_tab->name);
+				goto done;
+			}
+			st->probe_slot[st->num_keys] = l->first_slot + lc;
+			st->probe_col[st->num_keys] = g_ptr_array_index(
+				l->table->columns, g_array_index(l->cols, int, lc));
+			st->build_slot[st->num_keys] = rc;
+			st->build_col[st->num_keys] = g_ptr_array_index(
+				r->table->columns, g_array_index(r->cols, int, rc));
+			st->num_keys++;
+		}
+		st->build->joined = 1;
+
+		/* seek the build table if few rows will look into it */
+		idx = NULL;
+		for (slot=0; slot<st->num_keys && !idx; slot++) {
+			idx = mdb_join_seek_index(j, st->build, st->build_slot[slot]);
+			st->seek_key = slot;
+		}
+		if (idx && (double)rows * MDB_JOIN_SEEK_RATIO
+		  < st->build->table->num_rows) {
+			st->method = MDB_JOIN_INDEX;
+			mdb_index_scan_use(j->mdb, st->build->table, idx);
+		} else if (idx && s == 0 && !j->order[0]->sarg_tree
+		  && (probe_idx = mdb_join_seek_index(j, j->order[0],
+		   st->probe_slot[st->seek_key]))
+		  && (mdb_join_hash_size(st->build) > st->budget
+		   || (idx->flags & probe_idx->flags & MDB_IDX_UNIQUE))) {
+			/* both sides can be read in key order */
+			st->method = MDB_JOIN_MERGE;
+			mdb_index_scan_use(j->mdb, j->order[0]->table, probe_idx);
+			mdb_index_scan_use(j->mdb, st->build->table, idx);
+		}
+		if (st->method == MDB_JOIN_HASH || !(idx->flags & MDB_IDX_UNIQUE))
+			rows = MAX(rows, st->build->est);
+	}
+	ok = 1;
+done:
+	g_free(jl);
+	return ok;
+}
+static int
+mdb_join_next(MdbSQLOp *op, MdbSQLBatch *batch)
+{
+	MdbJoin *j = op->data;
+	MdbJoinInput *probe = j->order[0];
+	size_t len;
+
+	j->batch = batch;
+	/* the caller has used the page buffer since the last batch */
+	if (j->probe_started && !j->probe_done
+	 && probe->table->strategy != MDB_INDEX_SCAN)
+		mdb_read_pg(j->mdb, probe->table->cur_phys_pg);
+	while (!j->failed && batch->num_rows < MDB_SQL_BATCH_ROWS) {
+		if (j->probe_done) {
+			if (!mdb_join_finish_next(j))
+				break;
+			continue;
+		}
+		if (j->stop || !mdb_fetch_row(probe->table)) {
+			j->probe_done = 1;
+			continue;
+		}
+		j->probe_started = 1;
+		len = mdb_join_pack_input(j, probe, &j->scratch, &j->scratch_size);
+		mdb_join_push(j, 0, j->scratch, len);
+		/* a table scan expects its data page to still be loaded */
+		if (j->reread && probe->table->strategy != MDB_INDEX_SCAN) {
+			mdb_read_pg(j->mdb, probe->table->cur_phys_pg);
+			j->reread = 0;
+		}
+	}
+	return j->failed ? 0 : batch->num_rows;
+}
+static void
+mdb_join_close(MdbSQLOp *op)
+{
+	MdbJoin *j = op->data;
+
+	mdb_join_free(j);
+	g_free(j);
+}
+void
+mdb_sql_join_select(MdbSQL *sql)
+{
+	MdbJoin *j;
+	int s;
+
+	j = (MdbJoin *) g_malloc0(sizeof(MdbJoin));
+	j->sql = sql;
+	j->mdb = sql->mdb;
+
+	if (!mdb_join_plan(j))
+		j->failed = 1;
+
+	for (s=0; s<j->num_steps && !j->failed; s++) {
+		if (j->steps[s].method != MDB_JOIN_HASH)
+			continue;
+		if (!mdb_join_build(j, &j->steps[s]))
+			j->failed = 1;
+	}
+	if (j->failed) {
+		mdb_join_free(j);
+		mdb_free_tabledef(j->ttable);
+		g_free(j);
+		mdb_sql_reset(sql);
+		return;
+	}
+	/* the probe table is read as the caller fetches */
+	mdb_sql_set_op(j->ttable,
+		mdb_sql_op_new(mdb_join_next, mdb_join_close, j));
+	sql->cur_table = j->ttable;
+}
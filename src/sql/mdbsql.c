@@ -19,6 +19,7 @@
 
 #include "mdbsql.h"
 #include <stdarg.h>
+#include <errno.h>
 
 #ifdef DMALLOC
 #include "dmalloc.h"
@@ -67,6 +68,12 @@ MdbSQL *sql;
 	sql->sarg_tree = NULL;
 	sql->sarg_stack = NULL;
 	sql->max_rows = -1;
+	sql->limit = -1;
+	sql->joins = g_ptr_array_new();
+	sql->mem_budget = MDB_SQL_MEM_BUDGET;
+	sql->group_by = g_ptr_array_new();
+	sql->order_by = g_ptr_array_new();
+	sql->param_values = g_array_new(FALSE, TRUE, sizeof(MdbSQLParam));
 
 	return sql;
 }
@@ -111,6 +118,12 @@ mdb_sql_run_query (MdbSQL* sql, const gchar* querystr) {
 		return NULL;
 	}
 
+	if (sql->num_params) {
+		mdb_sql_error (_("'%s' has parameters, use mdb_sql_prepare()"), querystr);
+		mdb_sql_reset (sql);
+		return NULL;
+	}
+
 	mdb_sql_bind_all (sql);
 
 	return sql;
@@ -120,14 +133,214 @@ void mdb_sql_set_maxrow(MdbSQL *sql, int maxrow)
 {
 	sql->max_rows = maxrow;
 }
+static int
+mdb_sql_get_count(char *s, unsigned long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoul(s, &end, 10);
+	if (*s == '-' || *end || errno || *val > G_MAXINT) {
+		mdb_sql_error("%s is not a valid row count", s);
+		return 1;
+	}
+	return 0;
+}
+/* LIMIT or TOP; with both the smaller count wins */
+int
+mdb_sql_set_limit(MdbSQL *sql, char *limit, char *offset)
+{
+	unsigned long n, skip = 0;
+
+	if (mdb_sql_get_count(limit, &n))
+		return 1;
+	if (offset && mdb_sql_get_count(offset, &skip))
+		return 1;
+	if (sql->limit < 0 || (long)n < sql->limit)
+		sql->limit = n;
+	if (offset)
+		sql->offset = skip;
+	return 0;
+}
+/* rows the query may return: LIMIT capped by the client's max_rows */
+static long
+mdb_sql_row_limit(MdbSQL *sql)
+{
+	long limit = sql->limit;
+
+	if (sql->max_rows > 0 && (limit < 0 || sql->max_rows < limit))
+		limit = sql->max_rows;
+	return limit;
+}
+/* parse and plan the prepared query text */
+static int
+mdb_sql_plan(MdbSQL *sql)
+{
+	g_input_ptr = sql->prepared;
+	sql->replan = 0;
+
+	/* calls to yyparse should be serialized for thread safety */
+
+	/* begin unsafe */
+	_mdb_sql (sql);
+	if (yyparse()) {
+		/* end unsafe */
+		mdb_sql_error (_("Could not parse '%s' command"), sql->prepared);
+		mdb_sql_reset (sql);
+		return 1;
+	}
+	/* a query left for mdb_sql_execute() has no table yet */
+	if (sql->cur_table == NULL)
+		return !sql->replan;
+
+	/*
+	 * Joins, groups and sorts hand their rows over once, so those
+	 * queries are planned again on each execute.  A single table scan
+	 * can simply start over with new sarg values.
+	 */
+	sql->replan = sql->cur_table->is_temp_table;
+	return 0;
+}
+
+/**
+ * mdb_sql_prepare:
+ * @sql: MDB SQL object to prepare the query in.
+ * @querystr: SQL query string, which may use ? for values in the WHERE
+ * clause.
+ *
+ * Parses and plans @querystr so that mdb_sql_execute() can run it any
+ * number of times with new parameter values, without reading the catalog
+ * or the table definition again.  Sorts, groups and joins only have their
+ * table and column names checked, nothing is read until they are executed.
+ * Placeholders are numbered from 1 in the order they appear.  The caller
+ * resets @sql beforehand, as with mdb_sql_run_query().
+ *
+ * Returns: 0 on success, 1 on error
+ **/
+int
+mdb_sql_prepare(MdbSQL *sql, const gchar *querystr)
+{
+	int ret;
+
+	g_return_val_if_fail (sql, 1);
+	g_return_val_if_fail (querystr, 1);
+
+	g_free(sql->prepared);
+	sql->prepared = g_strdup(querystr);
+	g_array_set_size(sql->param_values, 0);
+
+	sql->preparing = 1;
+	ret = mdb_sql_plan(sql);
+	sql->preparing = 0;
+	if (ret) {
+		g_free(sql->prepared);
+		sql->prepared = NULL;
+		return 1;
+	}
+	return 0;
+}
+static MdbSQLParam *
+mdb_sql_get_param(MdbSQL *sql, unsigned int num)
+{
+	if (num > sql->param_values->len)
+		g_array_set_size(sql->param_values, num);
+	return &g_array_index(sql->param_values, MdbSQLParam, num - 1);
+}
+/* set the value of placeholder num (1 based) for the next execute */
+void
+mdb_sql_bind_param_int(MdbSQL *sql, unsigned int num, int value)
+{
+	MdbSQLParam *param;
+
+	g_return_if_fail (num > 0);
+	param = mdb_sql_get_param(sql, num);
+	param->type = MDB_SQL_PARAM_INT;
+	param->i = value;
+}
+void
+mdb_sql_bind_param_string(MdbSQL *sql, unsigned int num, char *value)
+{
+	MdbSQLParam *param;
+
+	g_return_if_fail (num > 0);
+	param = mdb_sql_get_param(sql, num);
+	param->type = MDB_SQL_PARAM_STRING;
+	strncpy(param->s, value, 255);
+	param->s[255] = '\0';
+}
+/**
+ * mdb_sql_execute:
+ * @sql: MDB SQL object holding a prepared query.
+ *
+ * Runs the query from mdb_sql_prepare() with the values bound to its
+ * placeholders.  A single table query keeps its plan: the new values go
+ * into the sarg tree and the index sargs, and the scan is rewound on the
+ * index it chose at prepare time.  Other queries are parsed and planned
+ * again, mdb_sql_prepare() only checked their names.
+ * Columns bound to the result stay bound across executes.
+ *
+ * Returns: 0 on success, 1 on error
+ **/
+int
+mdb_sql_execute(MdbSQL *sql)
+{
+	MdbTableDef *table = sql->cur_table;
+	MdbColumn *col;
+	MdbSQLParam *param;
+	unsigned int i;
+	long max_rows;
+
+	if (!sql->prepared) {
+		mdb_sql_error("No query has been prepared");
+		return 1;
+	}
+	for (i=0;i<sql->num_params;i++) {
+		param = i < sql->param_values->len ?
+			&g_array_index(sql->param_values, MdbSQLParam, i) : NULL;
+		if (!param || param->type == MDB_SQL_PARAM_UNBOUND) {
+			mdb_sql_error("No value for parameter %d", i+1);
+			return 1;
+		}
+	}
+
+	if (!table || sql->replan) {
+		max_rows = sql->max_rows;
+		mdb_sql_reset(sql);
+		sql->max_rows = max_rows;
+		return mdb_sql_plan(sql);
+	}
+
+	if (table->sarg_tree) {
+		mdb_sql_walk_tree(table->sarg_tree, mdb_sql_set_param, sql);
+		for (i=0;i<table->num_cols;i++) {
+			col = g_ptr_array_index(table->columns, i);
+			mdb_clear_sargs(col);
+		}
+		table->seek_sarg = NULL;
+		mdb_sql_walk_tree(table->sarg_tree, mdb_find_indexable_sargs, NULL);
+	}
+	mdb_set_fetch_limit(table, sql->offset, mdb_sql_row_limit(sql));
+	mdb_rewind_table(table);
+
+	return 0;
+}
+/*
+ * Set the memory a query may use for hash tables before it starts
+ * spilling to temp files.
+ */
+void mdb_sql_set_mem_budget(MdbSQL *sql, size_t bytes)
+{
+	sql->mem_budget = bytes;
+}
 
-static void mdb_sql_free_columns(GPtrArray *columns)
+void mdb_sql_free_columns(GPtrArray *columns)
 {
 	unsigned int i;
 	if (!columns) return;
 	for (i=0; i<columns->len; i++) {
 		MdbSQLColumn *c = (MdbSQLColumn *)g_ptr_array_index(columns, i);
 		g_free(c->name);
+		g_free(c->arg);
 		g_free(c);
 	}
 	g_ptr_array_free(columns, TRUE);
@@ -139,10 +352,42 @@ static void mdb_sql_free_tables(GPtrArray *tables)
 	for (i=0; i<tables->len; i++) {
 		MdbSQLTable *t = (MdbSQLTable *)g_ptr_array_index(tables, i);
 		g_free(t->name);
+		g_free(t->alias);
 		g_free(t);
 	}
 	g_ptr_array_free(tables, TRUE);
 }
+static void mdb_sql_free_group_by(GPtrArray *group_by)
+{
+	unsigned int i;
+	if (!group_by) return;
+	for (i=0; i<group_by->len; i++)
+		g_free(g_ptr_array_index(group_by, i));
+	g_ptr_array_free(group_by, TRUE);
+}
+void mdb_sql_free_order_by(GPtrArray *order_by)
+{
+	unsigned int i;
+	if (!order_by) return;
+	for (i=0; i<order_by->len; i++) {
+		MdbSQLOrder *o = (MdbSQLOrder *)g_ptr_array_index(order_by, i);
+		g_free(o->name);
+		g_free(o);
+	}
+	g_ptr_array_free(order_by, TRUE);
+}
+static void mdb_sql_free_joins(GPtrArray *joins)
+{
+	unsigned int i;
+	if (!joins) return;
+	for (i=0; i<joins->len; i++) {
+		MdbSQLJoin *j = (MdbSQLJoin *)g_ptr_array_index(joins, i);
+		g_free(j->left);
+		g_free(j->right);
+		g_free(j);
+	}
+	g_ptr_array_free(joins, TRUE);
+}
 
 void
 mdb_sql_close(MdbSQL *sql)
@@ -196,6 +441,7 @@ mdb_sql_free_tree(MdbSargNode *tree)
 
 	if (tree->left) mdb_sql_free_tree(tree->left);
 	if (tree->right) mdb_sql_free_tree(tree->right);
+	if (tree->set) mdb_free_sarg_set(tree->set);
 	g_free(tree);
 }
 void
@@ -311,6 +557,10 @@ mdb_sql_dump_node(MdbSargNode *node, int level)
 		case MDB_EQUAL: 
 			printf(" = %d\n", node->value.i); 
 			break;
+		case MDB_IN: 
+			printf(" in (%d values)\n", 
+				node->set->ints->len + node->set->strs->len); 
+			break;
 	}
 	if (node->left) {
 		printf("left  ");
@@ -401,6 +651,56 @@ mdb_sql_add_sarg(MdbSQL *sql, char *col_name, int op, char *constant)
 
 	return 0;
 }
+/* collect one constant of an IN (...) list */
+void
+mdb_sql_add_in_value(MdbSQL *sql, char *constant)
+{
+	char tmpstr[256];
+	int lastchar;
+
+	if (!sql->in_set)
+		sql->in_set = mdb_alloc_sarg_set();
+
+	if (constant[0]=='\'') {
+		lastchar = strlen(constant) > 256 ? 256 : strlen(constant);
+		strncpy(tmpstr, &constant[1], lastchar - 2);
+		tmpstr[lastchar - 2]='\0';
+		mdb_sarg_set_add_string(sql->in_set, tmpstr);
+	} else {
+		mdb_sarg_set_add_int(sql->in_set, atoi(constant));
+	}
+}
+/* a comparison against a ? placeholder, valued when the query executes */
+int
+mdb_sql_add_param_sarg(MdbSQL *sql, char *col_name, int op)
+{
+	MdbSargNode *node;
+
+	node = mdb_sql_alloc_node();
+	node->op = op;
+	node->parent = (void *) g_strdup(col_name);
+	node->param = ++sql->num_params;
+
+	mdb_sql_push_node(sql, node);
+
+	return 0;
+}
+int 
+mdb_sql_add_in_sarg(MdbSQL *sql, char *col_name)
+{
+	MdbSargNode *node;
+
+	node = mdb_sql_alloc_node();
+	node->op = MDB_IN;
+	node->parent = (void *) g_strdup(col_name);
+	node->set = sql->in_set;
+	sql->in_set = NULL;
+	mdb_sarg_set_sort(node->set);
+
+	mdb_sql_push_node(sql, node);
+
+	return 0;
+}
 void
 mdb_sql_all_columns(MdbSQL *sql)
 {
@@ -416,6 +716,48 @@ int mdb_sql_add_column(MdbSQL *sql, char *column_name)
 	sql->num_columns++;
 	return 0;
 }
+/*
+ * Add an aggregate to the select list, it is named after the call
+ * (e.g. "sum(qty)") unless given an alias.
+ */
+int mdb_sql_add_aggregate(MdbSQL *sql, int func, char *arg)
+{
+	static char *names[] = { "", "count", "sum", "min", "max", "avg" };
+	MdbSQLColumn *c;
+	char *name;
+
+	name = g_strconcat(names[func], "(", arg ? arg : "*", ")", NULL);
+	mdb_sql_add_column(sql, name);
+	g_free(name);
+	c = g_ptr_array_index(sql->columns, sql->num_columns - 1);
+	c->func = func;
+	c->arg = arg ? g_strdup(arg) : NULL;
+	return 0;
+}
+void mdb_sql_set_column_alias(MdbSQL *sql, char *alias)
+{
+	MdbSQLColumn *c;
+
+	if (!sql->num_columns) return;
+	c = g_ptr_array_index(sql->columns, sql->num_columns - 1);
+	g_free(c->name);
+	c->name = g_strdup(alias);
+}
+int mdb_sql_add_group_by(MdbSQL *sql, char *column_name)
+{
+	g_ptr_array_add(sql->group_by, g_strdup(column_name));
+	return 0;
+}
+int mdb_sql_add_order_by(MdbSQL *sql, char *column_name, int desc)
+{
+	MdbSQLOrder *o;
+
+	o = (MdbSQLOrder *) g_malloc0(sizeof(MdbSQLOrder));
+	o->name = g_strdup(column_name);
+	o->desc = desc;
+	g_ptr_array_add(sql->order_by, o);
+	return 0;
+}
 int mdb_sql_add_table(MdbSQL *sql, char *table_name)
 {
 	MdbSQLTable *t;
@@ -427,6 +769,58 @@ int mdb_sql_add_table(MdbSQL *sql, char *table_name)
 	sql->num_tables++;
 	return 0;
 }
+void mdb_sql_set_table_alias(MdbSQL *sql, char *alias)
+{
+	MdbSQLTable *t;
+
+	if (!sql->num_tables) return;
+	t = g_ptr_array_index(sql->tables, sql->num_tables - 1);
+	g_free(t->alias);
+	t->alias = g_strdup(alias);
+}
+/*
+ * Record an equi-join condition.  Conditions from the WHERE clause leave an
+ * always-true node in the sarg tree so the surrounding AND still has two
+ * operands; the join code removes it again.  The operator is checked when
+ * the query is planned.
+ */
+int
+mdb_sql_add_join(MdbSQL *sql, char *left, int op, char *right, int in_where)
+{
+	MdbSQLJoin *j;
+
+	j = (MdbSQLJoin *) g_malloc0(sizeof(MdbSQLJoin));
+	j->left = g_strdup(left);
+	j->right = g_strdup(right);
+	j->op = op;
+	if (in_where) {
+		j->node = mdb_sql_alloc_node();
+		j->node->op = MDB_EQUAL;
+		j->node->value.i = 1;
+		mdb_sql_push_node(sql, j->node);
+	}
+	g_ptr_array_add(sql->joins, j);
+	return 0;
+}
+/*
+ * Strip a "table." or "alias." prefix from a column name.  Returns NULL if
+ * the name is qualified with some other table.
+ */
+char *
+mdb_sql_unqualify(MdbSQLTable *sql_tab, char *name)
+{
+	char *dot = strrchr(name, '.');
+	size_t len;
+
+	if (!dot) return name;
+	len = dot - name;
+	if (sql_tab->alias && strlen(sql_tab->alias) == len
+	 && !strncasecmp(sql_tab->alias, name, len))
+		return dot + 1;
+	if (strlen(sql_tab->name) == len && !strncasecmp(sql_tab->name, name, len))
+		return dot + 1;
+	return NULL;
+}
 void mdb_sql_dump(MdbSQL *sql)
 {
 	unsigned int i;
@@ -446,6 +840,12 @@ void mdb_sql_exit(MdbSQL *sql)
 {
 	mdb_sql_free_columns(sql->columns);
 	mdb_sql_free_tables(sql->tables);
+	mdb_sql_free_joins(sql->joins);
+	sql->joins = NULL;
+	mdb_sql_free_group_by(sql->group_by);
+	sql->group_by = NULL;
+	mdb_sql_free_order_by(sql->order_by);
+	sql->order_by = NULL;
 
 	if (sql->sarg_tree) {
 		mdb_sql_free_tree(sql->sarg_tree);
@@ -453,6 +853,15 @@ void mdb_sql_exit(MdbSQL *sql)
 	}
 	g_list_free(sql->sarg_stack);
 	sql->sarg_stack = NULL;
+	if (sql->in_set) {
+		mdb_free_sarg_set(sql->in_set);
+		sql->in_set = NULL;
+	}
+
+	g_array_free(sql->param_values, TRUE);
+	sql->param_values = NULL;
+	g_free(sql->prepared);
+	sql->prepared = NULL;
 
 	if (sql->mdb) {
 		mdb_close(sql->mdb);
@@ -476,6 +885,18 @@ void mdb_sql_reset(MdbSQL *sql)
 	sql->num_tables = 0;
 	sql->tables = g_ptr_array_new();
 
+	/* Reset join conditions */
+	mdb_sql_free_joins(sql->joins);
+	sql->joins = g_ptr_array_new();
+
+	/* Reset GROUP BY */
+	mdb_sql_free_group_by(sql->group_by);
+	sql->group_by = g_ptr_array_new();
+
+	/* Reset ORDER BY */
+	mdb_sql_free_order_by(sql->order_by);
+	sql->order_by = g_ptr_array_new();
+
 	/* Reset sargs */
 	if (sql->sarg_tree) {
 		mdb_sql_free_tree(sql->sarg_tree);
@@ -483,9 +904,18 @@ void mdb_sql_reset(MdbSQL *sql)
 	}
 	g_list_free(sql->sarg_stack);
 	sql->sarg_stack = NULL;
+	if (sql->in_set) {
+		mdb_free_sarg_set(sql->in_set);
+		sql->in_set = NULL;
+	}
+
+	/* bound parameter values outlive the parse, see mdb_sql_execute() */
+	sql->num_params = 0;
 
 	sql->all_columns = 0;
 	sql->max_rows = -1;
+	sql->limit = -1;
+	sql->offset = 0;
 }
 static void print_break(int sz, int first)
 {
@@ -517,9 +947,8 @@ void mdb_sql_listtables(MdbSQL *sql)
 	unsigned int i;
 	MdbCatalogEntry *entry;
 	MdbHandle *mdb = sql->mdb;
-	MdbField fields[1];
-	unsigned char row_buffer[MDB_PGSIZE];
-	int row_size;
+	MdbSQLRows *rows;
+	unsigned char row[2 + 100];
 	MdbTableDef *ttable;
 	gchar tmpstr[100];
 	int tmpsiz;
@@ -532,6 +961,7 @@ void mdb_sql_listtables(MdbSQL *sql)
 
 	ttable = mdb_create_temp_table(mdb, "#listtables");
 	mdb_sql_add_temp_col(sql, ttable, 0, "Tables", MDB_TEXT, 30, 0);
+	rows = mdb_sql_rows_new();
 
  	/* add all user tables in catalog to list */
  	for (i=0; i < mdb->num_catalog; i++) {
@@ -539,12 +969,11 @@ void mdb_sql_listtables(MdbSQL *sql)
      		if (mdb_is_user_table(entry)) {
           		//col = g_ptr_array_index(table->columns,0);
 			tmpsiz = mdb_ascii2unicode(mdb, entry->object_name, 0, tmpstr, 100);
-			mdb_fill_temp_field(&fields[0],tmpstr, tmpsiz, 0,0,0,0);
-			row_size = mdb_pack_row(ttable, row_buffer, 1, fields);
-			mdb_add_row_to_pg(ttable,row_buffer, row_size);
-			ttable->num_rows++;
+			mdb_sql_rows_add(rows, row,
+				mdb_sql_flat_value(row, tmpstr, tmpsiz));
 		}
 	}
+	mdb_sql_set_op(ttable, mdb_sql_rows_op(rows));
 	sql->cur_table = ttable;
 
 }
@@ -569,10 +998,10 @@ void mdb_sql_describe_table(MdbSQL *sql)
 	MdbHandle *mdb = sql->mdb;
 	MdbColumn *col;
 	unsigned int i;
-	MdbField fields[3];
+	MdbSQLRows *rows;
 	char tmpstr[256];
-	unsigned char row_buffer[MDB_PGSIZE];
-	int row_size;
+	unsigned char row[3 * (2 + 100)];
+	size_t pos;
 	gchar col_name[100], col_type[100], col_size[100];
 	int tmpsiz;
 
@@ -598,28 +1027,28 @@ void mdb_sql_describe_table(MdbSQL *sql)
 	mdb_sql_add_temp_col(sql, ttable, 0, "Column Name", MDB_TEXT, 30, 0);
 	mdb_sql_add_temp_col(sql, ttable, 1, "Type", MDB_TEXT, 20, 0);
 	mdb_sql_add_temp_col(sql, ttable, 2, "Size", MDB_TEXT, 10, 0);
+	rows = mdb_sql_rows_new();
 
      for (i=0;i<table->num_cols;i++) {
 
         col = g_ptr_array_index(table->columns,i);
 		tmpsiz = mdb_ascii2unicode(mdb, col->name, 0, col_name, 100);
-		mdb_fill_temp_field(&fields[0],col_name, tmpsiz, 0,0,0,0);
+		pos = mdb_sql_flat_value(row, col_name, tmpsiz);
 
 		strcpy(tmpstr, mdb_get_coltype_string(mdb->default_backend, col->col_type));
 		tmpsiz = mdb_ascii2unicode(mdb, tmpstr, 0, col_type, 100);
-		mdb_fill_temp_field(&fields[1],col_type, tmpsiz, 0,0,0,1);
+		pos += mdb_sql_flat_value(row + pos, col_type, tmpsiz);
 
 		sprintf(tmpstr,"%d",col->col_size);
 		tmpsiz = mdb_ascii2unicode(mdb, tmpstr, 0, col_size, 100);
-		mdb_fill_temp_field(&fields[2],col_size, tmpsiz, 0,0,0,2);
+		pos += mdb_sql_flat_value(row + pos, col_size, tmpsiz);
 
-		row_size = mdb_pack_row(ttable, row_buffer, 3, fields);
-		mdb_add_row_to_pg(ttable,row_buffer, row_size);
-		ttable->num_rows++;
+		mdb_sql_rows_add(rows, row, pos);
      }
 
 	/* the column and table names are no good now */
 	//mdb_sql_reset(sql);
+	mdb_sql_set_op(ttable, mdb_sql_rows_op(rows));
 	sql->cur_table = ttable;
 }
 
@@ -641,6 +1070,220 @@ int mdb_sql_find_sargcol(MdbSargNode *node, gpointer data)
 	}
 	return 0;
 }
+/*
+ * Give a placeholder node the value bound to it, in the form its column
+ * compares with.  Unbound placeholders compare with 0 or ''.
+ */
+int mdb_sql_set_param(MdbSargNode *node, gpointer data)
+{
+	MdbSQL *sql = data;
+	MdbSQLParam *param = NULL;
+
+	if (!node->param || !node->col) return 0;
+
+	if (node->param <= sql->param_values->len)
+		param = &g_array_index(sql->param_values, MdbSQLParam, 
+			node->param - 1);
+	memset(&node->value, 0, sizeof(MdbAny));
+	if (!param || param->type == MDB_SQL_PARAM_UNBOUND)
+		return 0;
+	if (node->col->col_type == MDB_TEXT) {
+		if (param->type == MDB_SQL_PARAM_STRING)
+			strncpy(node->value.s, param->s, 255);
+		else
+			sprintf(node->value.s, "%d", param->i);
+	} else {
+		if (param->type == MDB_SQL_PARAM_STRING)
+			node->value.i = atoi(param->s);
+		else
+			node->value.i = param->i;
+	}
+	return 0;
+}
+/*
+ * Gather the leaves of an OR subtree.  Returns 0 unless every leaf is an
+ * equality test against the same column.
+ */
+static int
+mdb_sql_collect_or_chain(MdbSargNode *node, MdbColumn **col, GPtrArray *leaves)
+{
+	if (node->op == MDB_OR) {
+		return mdb_sql_collect_or_chain(node->left, col, leaves)
+		 && mdb_sql_collect_or_chain(node->right, col, leaves);
+	}
+	/* placeholders must stay in the tree to take new values */
+	if (node->op != MDB_EQUAL || !node->col || node->param)
+		return 0;
+	if (*col && *col != node->col)
+		return 0;
+	*col = node->col;
+	g_ptr_array_add(leaves, node);
+	return 1;
+}
+/*
+ * Rewrite chains like "a=1 OR a=2 OR ... OR a=500" as a single IN node so
+ * that each row costs one binary search instead of a walk down a deep tree.
+ * Must run after column names have been resolved.
+ */
+MdbSargNode *
+mdb_sql_fold_or_chains(MdbSargNode *node)
+{
+	MdbSargNode *in_node, *leaf;
+	MdbColumn *col = NULL;
+	GPtrArray *leaves;
+	unsigned int i;
+
+	if (!node) return NULL;
+
+	if (node->op == MDB_OR) {
+		leaves = g_ptr_array_new();
+		if (mdb_sql_collect_or_chain(node, &col, leaves)) {
+			in_node = mdb_sql_alloc_node();
+			in_node->op = MDB_IN;
+			in_node->col = col;
+			in_node->set = mdb_alloc_sarg_set();
+			for (i=0; i<leaves->len; i++) {
+				leaf = g_ptr_array_index(leaves, i);
+				if (col->col_type == MDB_TEXT) 
+					mdb_sarg_set_add_string(in_node->set, 
+						leaf->value.s);
+				else
+					mdb_sarg_set_add_int(in_node->set, 
+						leaf->value.i);
+			}
+			mdb_sarg_set_sort(in_node->set);
+			g_ptr_array_free(leaves, TRUE);
+			mdb_sql_free_tree(node);
+			return in_node;
+		}
+		g_ptr_array_free(leaves, TRUE);
+	}
+	node->left = mdb_sql_fold_or_chains(node->left);
+	node->right = mdb_sql_fold_or_chains(node->right);
+	return node;
+}
+/* rewrite qualified column names in the sarg tree to bare names */
+static int
+mdb_sql_unqualify_sarg(MdbSargNode *node, gpointer data)
+{
+	MdbSQLTable *sql_tab = data;
+	char *name;
+
+	if (!mdb_is_relational_op(node->op)) return 0;
+	if (!node->parent) return 0;
+
+	name = mdb_sql_unqualify(sql_tab, (char *)node->parent);
+	if (name && name != node->parent) {
+		name = g_strdup(name);
+		g_free(node->parent);
+		node->parent = name;
+	}
+	return 0;
+}
+/* whether a (possibly qualified) column name is in one of tables */
+static int
+mdb_sql_has_column(MdbSQL *sql, GPtrArray *tables, char *name)
+{
+	MdbSQLTable *sql_tab;
+	MdbTableDef *table;
+	MdbColumn *col;
+	unsigned int i, j;
+	char *bare;
+
+	for (i=0;i<tables->len;i++) {
+		sql_tab = g_ptr_array_index(sql->tables, i);
+		table = g_ptr_array_index(tables, i);
+		if (!(bare = mdb_sql_unqualify(sql_tab, name)))
+			continue;
+		for (j=0;j<table->num_cols;j++) {
+			col = g_ptr_array_index(table->columns, j);
+			if (!strcasecmp(col->name, bare))
+				return 1;
+		}
+	}
+	return 0;
+}
+/* an ORDER BY name may also be a select list column, see sort.c */
+static int
+mdb_sql_has_order_column(MdbSQL *sql, GPtrArray *tables, char *name)
+{
+	MdbSQLColumn *sqlcol;
+	unsigned int i;
+	char *dot = strrchr(name, '.');
+
+	for (i=0;i<sql->num_columns;i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		if (!strcasecmp(sqlcol->name, name)
+		 || (dot && !strcasecmp(sqlcol->name, dot + 1)))
+			return 1;
+	}
+	return mdb_sql_has_column(sql, tables, name);
+}
+/*
+ * Check that the tables of a query exist and hold the columns named in
+ * its select list, GROUP BY, ORDER BY and joins, without reading any
+ * rows.  Returns 0 after reporting the first name that isn't found.
+ */
+static int
+mdb_sql_resolve_names(MdbSQL *sql)
+{
+	GPtrArray *tables = g_ptr_array_new();
+	MdbSQLTable *sql_tab;
+	MdbSQLColumn *sqlcol;
+	MdbSQLOrder *o;
+	MdbSQLJoin *j;
+	MdbTableDef *table;
+	char *name = NULL;
+	unsigned int i;
+	int ok = 0;
+
+	for (i=0;i<sql->num_tables;i++) {
+		sql_tab = g_ptr_array_index(sql->tables, i);
+		table = mdb_read_table_by_name(sql->mdb, sql_tab->name, MDB_TABLE);
+		if (!table) {
+			mdb_sql_error("%s is not a table in this database", sql_tab->name);
+			goto fail;
+		}
+		mdb_read_columns(table);
+		g_ptr_array_add(tables, table);
+	}
+	for (i=0;i<sql->num_columns;i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		name = sqlcol->func ? sqlcol->arg : sqlcol->name;
+		if (name && !mdb_sql_has_column(sql, tables, name))
+			goto not_found;
+	}
+	for (i=0;i<sql->group_by->len;i++) {
+		name = g_ptr_array_index(sql->group_by, i);
+		if (!mdb_sql_has_column(sql, tables, name))
+			goto not_found;
+	}
+	for (i=0;i<sql->order_by->len;i++) {
+		o = g_ptr_array_index(sql->order_by, i);
+		name = o->name;
+		if (!mdb_sql_has_order_column(sql, tables, name))
+			goto not_found;
+	}
+	for (i=0;i<sql->joins->len;i++) {
+		j = g_ptr_array_index(sql->joins, i);
+		name = j->left;
+		if (!mdb_sql_has_column(sql, tables, name))
+			goto not_found;
+		name = j->right;
+		if (!mdb_sql_has_column(sql, tables, name))
+			goto not_found;
+	}
+	name = NULL;
+	ok = 1;
+not_found:
+	if (name)
+		mdb_sql_error("Column %s not found", name);
+fail:
+	for (i=0;i<tables->len;i++)
+		mdb_free_tabledef(g_ptr_array_index(tables, i));
+	g_ptr_array_free(tables, TRUE);
+	return ok;
+}
 void 
 mdb_sql_select(MdbSQL *sql)
 {
@@ -651,12 +1294,70 @@ MdbSQLTable *sql_tab;
 MdbColumn *col;
 MdbSQLColumn *sqlcol;
 int found = 0;
+long limit, query_limit, max_rows;
+unsigned long offset;
 
 	if (!mdb) {
 		mdb_sql_error("You must connect to a database first");
 		return;
 	}
 
+	/*
+	 * Sorts, groups and joins read their input as they are planned, so
+	 * while a query is prepared they only have their names checked.  The
+	 * first mdb_sql_execute() plans and runs them with the values bound.
+	 */
+	if (sql->preparing && (sql->order_by->len || sql->num_tables > 1
+	 || mdb_sql_is_aggregate(sql))) {
+		if (mdb_sql_resolve_names(sql))
+			sql->replan = 1;
+		else
+			mdb_sql_reset(sql);
+		return;
+	}
+
+	limit = mdb_sql_row_limit(sql);
+	if (limit >= 0 || sql->offset) {
+		/* the limit applies to the result, not to what sorts, groups
+		 * and joins read to make it */
+		offset = sql->offset;
+		query_limit = sql->limit;
+		max_rows = sql->max_rows;
+		sql->limit = -1;
+		sql->max_rows = -1;
+		sql->offset = 0;
+		if (sql->order_by->len)
+			mdb_sql_sort(sql, limit > 0 ? offset + limit : 0);
+		else
+			mdb_sql_select(sql);
+		if (sql->cur_table) {
+			mdb_set_fetch_limit(sql->cur_table, offset, limit);
+			mdb_rewind_table(sql->cur_table);
+			/* kept for mdb_sql_execute() */
+			sql->limit = query_limit;
+			sql->max_rows = max_rows;
+			sql->offset = offset;
+		}
+		return;
+	}
+	if (sql->order_by->len) {
+		mdb_sql_sort(sql, 0);
+		return;
+	}
+	if (mdb_sql_is_aggregate(sql)) {
+		mdb_sql_aggregate(sql);
+		return;
+	}
+	if (sql->num_tables > 1) {
+		mdb_sql_join_select(sql);
+		return;
+	}
+	if (sql->joins->len) {
+		mdb_sql_error("Comparing two columns requires a join");
+		mdb_sql_reset(sql);
+		return;
+	}
+
 	sql_tab = g_ptr_array_index(sql->tables,0);
 
 	table = mdb_read_table_by_name(mdb, sql_tab->name, MDB_TABLE);
@@ -678,7 +1379,15 @@ int found = 0;
 	}
 	/* verify all specified columns exist in this table */
 	for (i=0;i<sql->num_columns;i++) {
+		char *name;
+
 		sqlcol = g_ptr_array_index(sql->columns,i);
+		name = mdb_sql_unqualify(sql_tab, sqlcol->name);
+		if (name && name != sqlcol->name) {
+			name = g_strdup(name);
+			g_free(sqlcol->name);
+			sqlcol->name = name;
+		}
 		found=0;
 		for (j=0;j<table->num_cols;j++) {
 			col=g_ptr_array_index(table->columns,j);
@@ -699,12 +1408,14 @@ int found = 0;
 	 * resolve column names to MdbColumn structs
 	 */
 	if (sql->sarg_tree) {
+		mdb_sql_walk_tree(sql->sarg_tree, mdb_sql_unqualify_sarg, sql_tab);
 		mdb_sql_walk_tree(sql->sarg_tree, mdb_sql_find_sargcol, table);
+		mdb_sql_walk_tree(sql->sarg_tree, mdb_sql_set_param, sql);
+		sql->sarg_tree = mdb_sql_fold_or_chains(sql->sarg_tree);
 		mdb_sql_walk_tree(sql->sarg_tree, mdb_find_indexable_sargs, NULL);
 	}
 	/* 
-	 * move the sarg_tree.  
-	 * XXX - this won't work when we implement joins 
+	 * move the sarg_tree.  multi-table queries split it up in join.c
 	 */
 	table->sarg_tree = sql->sarg_tree;
 	sql->sarg_tree = NULL;
@@ -0,0 +1,386 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Query operators.  Joins, aggregates and sorts each produce their rows
+ * through an MdbSQLOp, which hands out batches of flat rows when asked.
+ * An operator reads its input through a scan operator over the table the
+ * previous stage returned, so rows flow from one stage to the next without
+ * being packed into data pages.  The last operator becomes the row source
+ * of the temp table returned in sql->cur_table, and runs as that table is
+ * fetched.  Operators which must see all their input first keep rows in an
+ * MdbSQLRows.
+ */
+#include "mdbsql.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#define MDB_SQL_ROWS_BLOCK 65536
+
+MdbSQLOp *
+mdb_sql_op_new(int (*next)(MdbSQLOp *, MdbSQLBatch *), void (*close)(MdbSQLOp *), void *data)
+{
+	MdbSQLOp *op;
+
+	op = (MdbSQLOp *) g_malloc0(sizeof(MdbSQLOp));
+	op->next = next;
+	op->close = close;
+	op->data = data;
+	return op;
+}
+int
+mdb_sql_op_next(MdbSQLOp *op, MdbSQLBatch *batch)
+{
+	batch->num_rows = 0;
+	batch->used = 0;
+	return op->next(op, batch);
+}
+void
+mdb_sql_op_close(MdbSQLOp *op)
+{
+	if (!op) return;
+	if (op->close)
+		op->close(op);
+	g_free(op);
+}
+
+void
+mdb_sql_batch_init(MdbSQLBatch *batch)
+{
+	memset(batch, 0, sizeof(MdbSQLBatch));
+}
+void
+mdb_sql_batch_free(MdbSQLBatch *batch)
+{
+	g_free(batch->offsets);
+	g_free(batch->lens);
+	g_free(batch->buf);
+	memset(batch, 0, sizeof(MdbSQLBatch));
+}
+/* room for a row of up to max_len bytes, commit it with mdb_sql_batch_end_row() */
+unsigned char *
+mdb_sql_batch_row(MdbSQLBatch *batch, size_t max_len)
+{
+	if (batch->used + max_len > batch->size) {
+		while (batch->used + max_len > batch->size)
+			batch->size = batch->size ? batch->size * 2 : 65536;
+		batch->buf = g_realloc(batch->buf, batch->size);
+	}
+	return batch->buf + batch->used;
+}
+void
+mdb_sql_batch_end_row(MdbSQLBatch *batch, size_t len)
+{
+	if (batch->num_rows == batch->max_rows) {
+		batch->max_rows = batch->max_rows ?
+			batch->max_rows * 2 : MDB_SQL_BATCH_ROWS;
+		batch->offsets = g_realloc(batch->offsets,
+			batch->max_rows * sizeof(size_t));
+		batch->lens = g_realloc(batch->lens,
+			batch->max_rows * sizeof(size_t));
+	}
+	batch->offsets[batch->num_rows] = batch->used;
+	batch->lens[batch->num_rows] = len;
+	batch->num_rows++;
+	batch->used += len;
+}
+void
+mdb_sql_batch_add(MdbSQLBatch *batch, const unsigned char *row, size_t len)
+{
+	memcpy(mdb_sql_batch_row(batch, len), row, len);
+	mdb_sql_batch_end_row(batch, len);
+}
+/* add the current values of cols as a row */
+void
+mdb_sql_batch_pack(MdbSQLBatch *batch, MdbHandle *mdb, MdbColumn **cols, int num_cols)
+{
+	MdbColumn *col;
+	unsigned char *buf;
+	size_t pos = 0, max_len = 0;
+	int i, len;
+
+	for (i=0; i<num_cols; i++)
+		max_len += 2 + MAX(cols[i]->cur_value_len, MDB_MEMO_OVERHEAD);
+	buf = mdb_sql_batch_row(batch, max_len);
+	for (i=0; i<num_cols; i++) {
+		col = cols[i];
+		if (col->col_type == MDB_BOOL) {
+			/* the value lives in the null bit */
+			pos += mdb_sql_flat_value(buf + pos,
+				col->cur_value_len ? NULL : "", 0);
+			continue;
+		}
+		len = col->cur_value_len;
+		if (col->col_type == MDB_OLE) {
+			if (len < MDB_MEMO_OVERHEAD) len = 0;
+			else len = MDB_MEMO_OVERHEAD;
+		}
+		pos += mdb_sql_flat_value(buf + pos,
+			len ? mdb->pg_buf + col->cur_value_start : NULL, len);
+	}
+	mdb_sql_batch_end_row(batch, pos);
+}
+
+/* write one value of a flat row, val is NULL for null */
+size_t
+mdb_sql_flat_value(unsigned char *buf, const void *val, int len)
+{
+	if (!val) {
+		buf[0] = MDB_FLAT_NULL & 0xff;
+		buf[1] = MDB_FLAT_NULL >> 8;
+		return 2;
+	}
+	buf[0] = len & 0xff;
+	buf[1] = (len >> 8) & 0xff;
+	memmove(buf + 2, val, len);
+	return len + 2;
+}
+/* bytes taken by the first num_vals values of row */
+size_t
+mdb_sql_flat_size(const unsigned char *row, int num_vals)
+{
+	size_t pos = 0;
+	int i, len;
+
+	for (i=0; i<num_vals; i++) {
+		len = row[pos] | (row[pos + 1] << 8);
+		pos += 2;
+		if (len != MDB_FLAT_NULL)
+			pos += len;
+	}
+	return pos;
+}
+void
+mdb_sql_flat_decode(const unsigned char *row, int num_vals, const unsigned char **vals, int *lens)
+{
+	int i, len;
+
+	for (i=0; i<num_vals; i++) {
+		len = row[0] | (row[1] << 8);
+		row += 2;
+		if (len == MDB_FLAT_NULL) {
+			vals[i] = NULL;
+			lens[i] = 0;
+		} else {
+			vals[i] = row;
+			lens[i] = len;
+			row += len;
+		}
+	}
+}
+
+/*
+ * Scan operator: the rows of a table, cut down to cols.  The rows of a
+ * temp table fed by another operator are passed on as they are when all
+ * its columns are wanted.
+ */
+typedef struct {
+	MdbTableDef *table;
+	MdbColumn **cols;
+	int num_cols;
+	int whole;
+	int done;
+} MdbSQLScan;
+
+static int
+mdb_sql_scan_next(MdbSQLOp *op, MdbSQLBatch *batch)
+{
+	MdbSQLScan *scan = op->data;
+	MdbRowSource *source = scan->table->row_source;
+	const unsigned char *row;
+	size_t len;
+
+	while (!scan->done && batch->num_rows < MDB_SQL_BATCH_ROWS) {
+		if (scan->whole) {
+			if (!source->next(source->data, &row, &len)) {
+				scan->done = 1;
+				break;
+			}
+			mdb_sql_batch_add(batch, row, len);
+		} else {
+			if (!mdb_fetch_row(scan->table)) {
+				scan->done = 1;
+				break;
+			}
+			mdb_sql_batch_pack(batch, scan->table->entry->mdb,
+				scan->cols, scan->num_cols);
+		}
+	}
+	return batch->num_rows;
+}
+static void
+mdb_sql_scan_close(MdbSQLOp *op)
+{
+	MdbSQLScan *scan = op->data;
+
+	g_free(scan->cols);
+	g_free(scan);
+}
+/* the table stays with the caller */
+MdbSQLOp *
+mdb_sql_scan_op(MdbTableDef *table, MdbColumn **cols, int num_cols)
+{
+	MdbSQLScan *scan;
+	int i;
+
+	scan = (MdbSQLScan *) g_malloc0(sizeof(MdbSQLScan));
+	scan->table = table;
+	scan->num_cols = num_cols;
+	scan->cols = g_memdup(cols, (num_cols + 1) * sizeof(MdbColumn *));
+	if (table->row_source && (unsigned int)num_cols == table->num_cols) {
+		scan->whole = 1;
+		for (i=0; i<num_cols; i++)
+			if (cols[i] != g_ptr_array_index(table->columns, i))
+				scan->whole = 0;
+	}
+	mdb_rewind_table(table);
+	return mdb_sql_op_new(mdb_sql_scan_next, mdb_sql_scan_close, scan);
+}
+
+/* an operator as the row source of a temp table */
+typedef struct {
+	MdbSQLOp *op;
+	MdbSQLBatch batch;
+	unsigned int pos;
+	int done;
+} MdbSQLOpSource;
+
+static int
+mdb_sql_op_source_next(void *data, const unsigned char **row, size_t *len)
+{
+	MdbSQLOpSource *src = data;
+
+	if (src->pos == src->batch.num_rows) {
+		if (src->done || !mdb_sql_op_next(src->op, &src->batch)) {
+			src->done = 1;
+			return 0;
+		}
+		src->pos = 0;
+	}
+	*row = MDB_SQL_BATCH_ROW(&src->batch, src->pos);
+	*len = src->batch.lens[src->pos];
+	src->pos++;
+	return 1;
+}
+static void
+mdb_sql_op_source_free(void *data)
+{
+	MdbSQLOpSource *src = data;
+
+	mdb_sql_op_close(src->op);
+	mdb_sql_batch_free(&src->batch);
+	g_free(src);
+}
+/* ttable takes its rows from op, and closes it when freed */
+void
+mdb_sql_set_op(MdbTableDef *ttable, MdbSQLOp *op)
+{
+	MdbSQLOpSource *src;
+	MdbRowSource source;
+
+	src = (MdbSQLOpSource *) g_malloc0(sizeof(MdbSQLOpSource));
+	src->op = op;
+	source.next = mdb_sql_op_source_next;
+	source.free = mdb_sql_op_source_free;
+	source.data = src;
+	mdb_temp_table_set_source(ttable, &source);
+}
+
+MdbSQLRows *
+mdb_sql_rows_new(void)
+{
+	MdbSQLRows *rows;
+
+	rows = (MdbSQLRows *) g_malloc0(sizeof(MdbSQLRows));
+	rows->blocks = g_ptr_array_new();
+	rows->used = g_array_new(FALSE, FALSE, sizeof(size_t));
+	return rows;
+}
+/* rows are stored as a 4 byte length followed by the row */
+void
+mdb_sql_rows_add(MdbSQLRows *rows, const unsigned char *row, size_t len)
+{
+	unsigned char *block;
+	size_t *used = NULL;
+	guint32 len32 = len;
+
+	if (rows->blocks->len)
+		used = &g_array_index(rows->used, size_t, rows->used->len - 1);
+	if (!used || *used + 4 + len > rows->block_size) {
+		rows->block_size = MAX(MDB_SQL_ROWS_BLOCK, 4 + len);
+		g_ptr_array_add(rows->blocks, g_malloc(rows->block_size));
+		g_array_set_size(rows->used, rows->used->len + 1);
+		used = &g_array_index(rows->used, size_t, rows->used->len - 1);
+		*used = 0;
+	}
+	block = g_ptr_array_index(rows->blocks, rows->blocks->len - 1);
+	memcpy(block + *used, &len32, 4);
+	memcpy(block + *used + 4, row, len);
+	*used += 4 + len;
+	rows->num_rows++;
+}
+void
+mdb_sql_rows_free(MdbSQLRows *rows)
+{
+	unsigned int i;
+
+	if (!rows) return;
+	for (i=0; i<rows->blocks->len; i++)
+		g_free(g_ptr_array_index(rows->blocks, i));
+	g_ptr_array_free(rows->blocks, TRUE);
+	g_array_free(rows->used, TRUE);
+	g_free(rows);
+}
+static int
+mdb_sql_rows_next(MdbSQLOp *op, MdbSQLBatch *batch)
+{
+	MdbSQLRows *rows = op->data;
+	unsigned char *block;
+	guint32 len;
+
+	while (batch->num_rows < MDB_SQL_BATCH_ROWS
+	 && rows->read_block < rows->blocks->len) {
+		if (rows->read_pos >= g_array_index(rows->used, size_t,
+		  rows->read_block)) {
+			rows->read_block++;
+			rows->read_pos = 0;
+			continue;
+		}
+		block = g_ptr_array_index(rows->blocks, rows->read_block);
+		memcpy(&len, block + rows->read_pos, 4);
+		mdb_sql_batch_add(batch, block + rows->read_pos + 4, len);
+		rows->read_pos += 4 + len;
+	}
+	return batch->num_rows;
+}
+static void
+mdb_sql_rows_close(MdbSQLOp *op)
+{
+	mdb_sql_rows_free(op->data);
+}
+/* hand out the rows kept, the operator owns them from now on */
+MdbSQLOp *
+mdb_sql_rows_op(MdbSQLRows *rows)
+{
+	rows->read_block = 0;
+	rows->read_pos = 0;
+	return mdb_sql_op_new(mdb_sql_rows_next, mdb_sql_rows_close, rows);
+}
@@ -43,13 +43,25 @@ static MdbSQL *g_sql;
 %token <name> IDENT NAME PATH STRING NUMBER 
 %token SELECT FROM WHERE CONNECT DISCONNECT TO LIST TABLES WHERE AND OR NOT
 %token DESCRIBE TABLE
+%token <name> JOIN INNER ON AS
+%token <name> COUNT SUM MINIMUM MAXIMUM AVG GROUP BY
+%token <name> ORDER ASC DESC
+%token <name> TOP LIMIT OFFSET
 %token LTEQ GTEQ LIKE IS NUL
+%token <name> IN
 
 %type <name> database
 %type <name> constant
 %type <ival> operator
 %type <ival> nulloperator
+%type <ival> agg_func
+%type <ival> order_dir
 %type <name> identifier
+%type <name> column_name
+%type <name> sarg_column
+%type <name> keyword
+%type <name> order_name
+%type <name> order_keyword
 
 %%
 
@@ -59,7 +71,7 @@ stmt:
 	;
 
 query:
-	SELECT column_list FROM table where_clause {
+	SELECT top_clause column_list FROM table_list where_clause group_clause order_clause limit_clause {
 			mdb_sql_select(_mdb_sql(NULL));	
 		}
 	|	CONNECT TO database { 
@@ -81,6 +93,66 @@ where_clause:
 	| WHERE sarg_list
 	;
 
+group_clause:
+	/* empty */
+	| GROUP BY group_list
+	;
+
+group_list:
+	group_column
+	| group_list ',' group_column
+	;
+
+group_column:
+	column_name { mdb_sql_add_group_by(_mdb_sql(NULL), $1); free($1); }
+	;
+
+order_clause:
+	/* empty */
+	| ORDER BY order_list
+	;
+
+order_list:
+	order_column
+	| order_list ',' order_column
+	;
+
+order_column:
+	order_name order_dir { 
+			mdb_sql_add_order_by(_mdb_sql(NULL), $1, $2); free($1); 
+		}
+	;
+
+order_dir:
+	/* empty */	{ $$ = 0; }
+	| ASC	{ $$ = 0; }
+	| DESC	{ $$ = 1; }
+	;
+
+top_clause:
+	/* empty */
+	| TOP NUMBER {
+			int rc = mdb_sql_set_limit(_mdb_sql(NULL), $2, NULL);
+			free($2);
+			if (rc) YYABORT;
+		}
+	;
+
+limit_clause:
+	/* empty */
+	| LIMIT NUMBER {
+			int rc = mdb_sql_set_limit(_mdb_sql(NULL), $2, NULL);
+			free($2);
+			if (rc) YYABORT;
+		}
+	| LIMIT NUMBER OFFSET NUMBER {
+			int rc = mdb_sql_set_limit(_mdb_sql(NULL), $2, $4);
+			free($2);
+			free($4);
+			if (rc) YYABORT;
+		}
+	;
+
 sarg_list:
 	sarg 
 	| '(' sarg_list ')'
@@ -90,25 +162,54 @@ sarg_list:
 	;
 
 sarg:
-	identifier operator constant	{ 
+	sarg_column operator constant	{ 
 				mdb_sql_add_sarg(_mdb_sql(NULL), $1, $2, $3);
 				free($1);
 				free($3);
 				}
-	| constant operator identifier {
+	| sarg_column operator '?'	{
+				mdb_sql_add_param_sarg(_mdb_sql(NULL), $1, $2);
+				free($1);
+				}
+	| constant operator sarg_column {
 				mdb_sql_add_sarg(_mdb_sql(NULL), $3, $2, $1);
 				free($1);
 				free($3);
 				}
+	| sarg_column operator sarg_column {
+				mdb_sql_add_join(_mdb_sql(NULL), $1, $2, $3, 1);
+				free($1);
+				free($3);
+				}
 	| constant operator constant {
 				mdb_sql_eval_expr(_mdb_sql(NULL), $1, $2, $3);
 				free($1);
 				free($3);
 	}
-	| identifier nulloperator	{ 
+	| sarg_column nulloperator	{ 
 				mdb_sql_add_sarg(_mdb_sql(NULL), $1, $2, NULL);
 				free($1);
 				}
+	| sarg_column IN '(' constant_list ')' {
+				mdb_sql_add_in_sarg(_mdb_sql(NULL), $1);
+				free($1);
+				}
+	| sarg_column NOT IN '(' constant_list ')' {
+				mdb_sql_add_in_sarg(_mdb_sql(NULL), $1);
+				mdb_sql_add_not(_mdb_sql(NULL));
+				free($1);
+				}
+	;
+
+constant_list:
+	constant {
+				mdb_sql_add_in_value(_mdb_sql(NULL), $1);
+				free($1);
+				}
+	| constant_list ',' constant {
+				mdb_sql_add_in_value(_mdb_sql(NULL), $3);
+				free($3);
+				}
 	;
 
 identifier:
@@ -116,6 +217,38 @@ identifier:
 	| IDENT
 	;
 
+/*
+ * Keywords are taken for column names where nothing else can be meant: in
+ * the select list and in the WHERE clause (TOP only there).
+ */
+column_name:
+	identifier
+	| keyword	{ $$ = strdup($1); }
+	;
+
+sarg_column:
+	column_name
+	| TOP	{ $$ = strdup($1); }
+	;
+
+keyword:
+	order_keyword
+	| ASC | DESC
+	| LIMIT | OFFSET
+	;
+
+/* a column after ORDER BY can't be named after its direction or a LIMIT */
+order_name:
+	identifier
+	| order_keyword	{ $$ = strdup($1); }
+	;
+
+order_keyword:
+	IN | JOIN | INNER | ON | AS
+	| COUNT | SUM | MINIMUM | MAXIMUM | AVG
+	| GROUP | BY | ORDER
+	;
+
 operator:
 	'='	{ $$ = MDB_EQUAL; }
 	| '>'	{ $$ = MDB_GT; }
@@ -144,6 +277,41 @@ table:
 	identifier { mdb_sql_add_table(_mdb_sql(NULL), $1); free($1); }
 	;
 
+table_list:
+	from_table
+	| table_list ',' from_table
+	| table_list join_op from_table ON join_cond
+	;
+
+from_table:
+	table
+	| table identifier { 
+			mdb_sql_set_table_alias(_mdb_sql(NULL), $2); free($2); 
+		}
+	| table AS identifier { 
+			mdb_sql_set_table_alias(_mdb_sql(NULL), $3); free($3); 
+		}
+	;
+
+join_op:
+	JOIN
+	| INNER JOIN
+	;
+
+join_cond:
+	join_term
+	| join_cond AND join_term
+	| '(' join_cond ')'
+	;
+
+join_term:
+	column_name operator column_name {
+				mdb_sql_add_join(_mdb_sql(NULL), $1, $2, $3, 0);
+				free($1);
+				free($3);
+				}
+	;
+
 column_list:
 	'*'	{ mdb_sql_all_columns(_mdb_sql(NULL)); }
 	|	column  
@@ -151,7 +319,28 @@ column_list:
 	;
 	 
 column:
-	identifier { mdb_sql_add_column(_mdb_sql(NULL), $1); free($1); }
+	column_name { mdb_sql_add_column(_mdb_sql(NULL), $1); free($1); }
+	| aggregate
+	| aggregate AS identifier { 
+			mdb_sql_set_column_alias(_mdb_sql(NULL), $3); free($3); 
+		}
+	;
+
+aggregate:
+	agg_func '(' '*' ')' {
+			mdb_sql_add_aggregate(_mdb_sql(NULL), $1, NULL);
+		}
+	| agg_func '(' column_name ')' {
+			mdb_sql_add_aggregate(_mdb_sql(NULL), $1, $3); free($3);
+		}
+	;
+
+agg_func:
+	COUNT	{ $$ = MDB_SQL_COUNT; }
+	| SUM	{ $$ = MDB_SQL_SUM; }
+	| MINIMUM	{ $$ = MDB_SQL_MIN; }
+	| MAXIMUM	{ $$ = MDB_SQL_MAX; }
+	| AVG	{ $$ = MDB_SQL_AVG; }
 	;
 
 %%
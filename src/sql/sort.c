@@ -0,0 +1,884 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * ORDER BY.  Each result row is stored with a sort key built from its
+ * ORDER BY values so that plain byte comparison gives the requested order,
+ * which lets the rows be radix sorted.  Rows that don't fit sql->mem_budget
+ * are sorted in runs written to temp files and merged at the end.  When only
+ * the first rows are wanted (LIMIT, TOP or the client's max_rows), those
+ * are kept in a heap while the rows are read and nothing else is sorted.
+ *
+ * With MDB_USE_INDEX set, a single table query whose ORDER BY columns lead
+ * an index in the same direction is read through that index instead.
+ *
+ * The sorted rows are handed out by an operator behind the temp table
+ * returned, so the final merge of the runs happens as the rows are fetched.
+ * Records hold the flat result row behind their key.
+ */
+#include "mdbsql.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#define MDB_SORT_MAX_KEYS 16
+#define MDB_SORT_TEXT_SIZE 1024
+#define MDB_SORT_FAN_IN 64
+#define MDB_SORT_BLOCK_SIZE 65536
+/* buckets smaller than this are insertion sorted */
+#define MDB_SORT_SMALL 32
+/* past this many nested buckets the radix sort hands over to qsort */
+#define MDB_SORT_MAX_LEVEL 64
+
+typedef struct {
+	guint32 key_len;
+	guint32 row_len;
+	unsigned char data[8];	/* key, then row */
+} MdbSortRec;
+
+#define MDB_SORT_REC_SIZE(key_len, row_len) \
+	((8 + (key_len) + (row_len) + 7) & ~7)
+
+typedef struct {
+	MdbColumn *col;
+	int in;			/* input value holding it */
+	int desc;
+} MdbSortKey;
+
+/* a run being merged and its current record */
+typedef struct {
+	FILE *f;
+	MdbSortRec *rec;
+	size_t size;
+} MdbSortRun;
+
+typedef struct {
+	MdbSortRun *runs;
+	int *heap;
+	int n;
+	int num;		/* runs with records left */
+	int popped;		/* the top record has been handed out */
+	long rows;
+} MdbSortMerge;
+
+typedef struct {
+	MdbSQL *sql;
+	MdbHandle *mdb;
+	int num_keys;
+	MdbSortKey keys[MDB_SORT_MAX_KEYS];
+	int num_outs;		/* result columns, the first input values */
+	int num_cols;
+	MdbColumn **cols;	/* source of each input value */
+	long limit;		/* rows the client wants, 0 for all */
+	int use_heap;		/* keeping the best limit rows in a heap */
+	int loose;		/* records were allocated one by one */
+	/* records of the current run */
+	MdbSortRec **recs;
+	guint32 num_recs;
+	guint32 max_recs;
+	GPtrArray *blocks;
+	size_t block_left;
+	unsigned char *block_ptr;
+	size_t mem_used;
+	GPtrArray *runs;	/* sorted runs on disk */
+	/* scratch */
+	unsigned char *key;
+	const unsigned char **vals;
+	int *lens;
+	/* output, from recs or from the final merge */
+	MdbTableDef *ttable;
+	guint32 next_rec;
+	guint32 end_rec;
+	MdbSortMerge merge;
+	int merging;
+	int failed;
+} MdbSort;
+
+static void
+mdb_sort_grow(unsigned char **buf, size_t *size, size_t need)
+{
+	if (need <= *size) return;
+	while (*size < need)
+		*size = *size ? *size * 2 : 4096;
+	*buf = g_realloc(*buf, *size);
+}
+static int
+mdb_sort_cmp_key(const unsigned char *key, guint32 key_len, const MdbSortRec *b)
+{
+	int c = memcmp(key, b->data, MIN(key_len, b->key_len));
+
+	if (c) return c;
+	return key_len < b->key_len ? -1 : key_len > b->key_len;
+}
+static int
+mdb_sort_cmp(const MdbSortRec *a, const MdbSortRec *b)
+{
+	return mdb_sort_cmp_key(a->data, a->key_len, b);
+}
+static int
+mdb_sort_qcmp(const void *a, const void *b)
+{
+	return mdb_sort_cmp(*(MdbSortRec **)a, *(MdbSortRec **)b);
+}
+static void
+mdb_sort_insertion(MdbSortRec **recs, guint32 n)
+{
+	MdbSortRec *r;
+	guint32 i, j;
+
+	for (i=1; i<n; i++) {
+		r = recs[i];
+		for (j=i; j && mdb_sort_cmp(recs[j-1], r) > 0; j--)
+			recs[j] = recs[j-1];
+		recs[j] = r;
+	}
+}
+/* bucket of a key at depth, keys which have ended come first */
+#define MDB_SORT_BYTE(r, depth) \
+	((depth) < (r)->key_len ? (r)->data[depth] + 1 : 0)
+
+/* MSD radix sort on the key bytes from depth on, tmp holds n pointers */
+static void
+mdb_sort_radix(MdbSortRec **recs, MdbSortRec **tmp, guint32 n, guint32 depth, int level)
+{
+	guint32 count[257], start[257], i, b, pos;
+
+	if (level > MDB_SORT_MAX_LEVEL) {
+		qsort(recs, n, sizeof(MdbSortRec *), mdb_sort_qcmp);
+		return;
+	}
+	while (n >= MDB_SORT_SMALL) {
+		memset(count, 0, sizeof(count));
+		for (i=0; i<n; i++)
+			count[MDB_SORT_BYTE(recs[i], depth)]++;
+		/* all keys equal so far: look at the next byte */
+		for (b=0; b<257 && count[b] != n; b++)
+			;
+		if (b == 0)
+			return;
+		if (b < 257) {
+			depth++;
+			continue;
+		}
+		start[0] = 0;
+		for (b=1; b<257; b++)
+			start[b] = start[b-1] + count[b-1];
+		for (i=0; i<n; i++)
+			tmp[start[MDB_SORT_BYTE(recs[i], depth)]++] = recs[i];
+		memcpy(recs, tmp, n * sizeof(MdbSortRec *));
+		for (pos=count[0], b=1; b<257; pos+=count[b], b++)
+			if (count[b] > 1)
+				mdb_sort_radix(recs + pos, tmp, count[b], depth + 1,
+					level + 1);
+		return;
+	}
+	mdb_sort_insertion(recs, n);
+}
+static void
+mdb_sort_recs(MdbSortRec **recs, guint32 n)
+{
+	MdbSortRec **tmp;
+
+	if (n < 2) return;
+	tmp = g_malloc(n * sizeof(MdbSortRec *));
+	mdb_sort_radix(recs, tmp, n, 0, 0);
+	g_free(tmp);
+}
+/* the top-N heap keeps the worst row it holds on top */
+static void
+mdb_sort_heap_up(MdbSortRec **heap, guint32 i)
+{
+	MdbSortRec *r = heap[i];
+
+	while (i && mdb_sort_cmp(heap[(i-1)/2], r) < 0) {
+		heap[i] = heap[(i-1)/2];
+		i = (i-1)/2;
+	}
+	heap[i] = r;
+}
+static void
+mdb_sort_heap_down(MdbSortRec **heap, guint32 n, guint32 i)
+{
+	MdbSortRec *r = heap[i];
+	guint32 c;
+
+	while ((c = 2*i + 1) < n) {
+		if (c + 1 < n && mdb_sort_cmp(heap[c+1], heap[c]) > 0)
+			c++;
+		if (mdb_sort_cmp(heap[c], r) <= 0)
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = r;
+}
+static int
+mdb_sort_put_be(unsigned char *key, int pos, guint64 u, int size)
+{
+	int i;
+
+	for (i=size-1; i>=0; i--) {
+		key[pos + i] = u & 0xff;
+		u >>= 8;
+	}
+	return pos + size;
+}
+static double
+mdb_sort_get_real(MdbColumn *col, const unsigned char *v)
+{
+	char buf[MDB_NUMERIC_BUFSZ];
+
+	switch (col->col_type) {
+		case MDB_FLOAT:
+			return mdb_get_single((void *)v, 0);
+		case MDB_NUMERIC:
+			mdb_numeric_to_buf(v, col->col_scale, buf);
+			return g_ascii_strtod(buf, NULL);
+	}
+	return mdb_get_double((void *)v, 0);
+}
+/*
+ * Encode the ORDER BY values of the decoded row into s->key.  Each value
+ * gets a flag byte (nulls first), numbers are stored big endian with their
+ * sign flipped, text is folded to lower case and NUL terminated.  A
+ * descending key has all its bytes inverted.
+ */
+static int
+mdb_sort_make_key(MdbSort *s)
+{
+	unsigned char *key = s->key;
+	char text[MDB_SORT_TEXT_SIZE + 1];
+	const unsigned char *v;
+	MdbColumn *col;
+	guint64 u;
+	gint64 i64;
+	double d;
+	int k, i, n, start, pos = 0;
+
+	for (k=0; k<s->num_keys; k++) {
+		col = s->keys[k].col;
+		v = s->vals[s->keys[k].in];
+		start = pos;
+		if (col->col_type == MDB_BOOL) {
+			/* false before true */
+			key[pos++] = v ? 1 : 0;
+		} else if (!v) {
+			key[pos++] = 0;
+		} else {
+			key[pos++] = 1;
+			switch (col->col_type) {
+				case MDB_BYTE:
+					key[pos++] = v[0];
+					break;
+				case MDB_INT:
+					u = (guint16)mdb_get_int16((void *)v, 0) ^ 0x8000;
+					pos = mdb_sort_put_be(key, pos, u, 2);
+					break;
+				case MDB_LONGINT:
+					u = (guint32)mdb_get_int32((void *)v, 0) ^ 0x80000000U;
+					pos = mdb_sort_put_be(key, pos, u, 4);
+					break;
+				case MDB_MONEY:
+					memcpy(&i64, v, 8);
+					u = (guint64)GINT64_FROM_LE(i64)
+						^ (G_GUINT64_CONSTANT(1) << 63);
+					pos = mdb_sort_put_be(key, pos, u, 8);
+					break;
+				case MDB_TEXT:
+					n = mdb_unicode2ascii(s->mdb, (char *)v,
+						s->lens[s->keys[k].in], text, MDB_SORT_TEXT_SIZE);
+					for (i=0; i<n; i++)
+						key[pos++] = text[i] ?
+							g_ascii_tolower(text[i]) : 1;
+					key[pos++] = 0;
+					break;
+				case MDB_REPID:
+					memcpy(key + pos, v, 16);
+					pos += 16;
+					break;
+				default:
+					d = mdb_sort_get_real(col, v);
+					if (d == 0) d = 0;
+					memcpy(&u, &d, 8);
+					if (u >> 63)
+						u = ~u;
+					else
+						u |= G_GUINT64_CONSTANT(1) << 63;
+					pos = mdb_sort_put_be(key, pos, u, 8);
+					break;
+			}
+		}
+		if (s->keys[k].desc)
+			for (i=start; i<pos; i++)
+				key[i] = ~key[i];
+	}
+	return pos;
+}
+static void
+mdb_sort_free_recs(MdbSort *s)
+{
+	guint32 i;
+
+	if (s->loose)
+		for (i=0; i<s->num_recs; i++)
+			g_free(s->recs[i]);
+	if (s->blocks) {
+		for (i=0; i<s->blocks->len; i++)
+			g_free(g_ptr_array_index(s->blocks, i));
+		g_ptr_array_free(s->blocks, TRUE);
+		s->blocks = NULL;
+	}
+	s->num_recs = 0;
+	s->block_left = 0;
+	s->block_ptr = NULL;
+	s->mem_used = s->max_recs * sizeof(MdbSortRec *);
+	s->loose = 0;
+}
+static MdbSortRec *
+mdb_sort_new_rec(MdbSort *s, size_t key_len, const unsigned char *row, size_t row_len)
+{
+	MdbSortRec *rec;
+	size_t size = MDB_SORT_REC_SIZE(key_len, row_len);
+	size_t block;
+
+	if (s->num_recs == s->max_recs) {
+		s->max_recs = s->max_recs ? s->max_recs * 2 : 1024;
+		s->recs = g_realloc(s->recs, s->max_recs * sizeof(MdbSortRec *));
+		s->mem_used += s->max_recs / 2 * sizeof(MdbSortRec *);
+	}
+	if (s->use_heap) {
+		rec = g_malloc(size);
+		s->loose = 1;
+	} else {
+		if (size > s->block_left) {
+			block = size > MDB_SORT_BLOCK_SIZE ? size : MDB_SORT_BLOCK_SIZE;
+			if (!s->blocks)
+				s->blocks = g_ptr_array_new();
+			s->block_ptr = g_malloc(block);
+			s->block_left = block;
+			g_ptr_array_add(s->blocks, s->block_ptr);
+		}
+		rec = (MdbSortRec *)s->block_ptr;
+		s->block_ptr += size;
+		s->block_left -= size;
+	}
+	s->mem_used += size;
+	rec->key_len = key_len;
+	rec->row_len = row_len;
+	memcpy(rec->data, s->key, key_len);
+	memcpy(rec->data + key_len, row, row_len);
+	return rec;
+}
+static int
+mdb_sort_write(FILE *f, MdbSortRec *rec)
+{
+	if (fwrite(rec, 8 + rec->key_len + rec->row_len, 1, f) != 1) {
+		mdb_sql_error("Error writing sort file");
+		return 0;
+	}
+	return 1;
+}
+/* read the next record of a run, 0 at its end */
+static int
+mdb_sort_read(MdbSort *s, MdbSortRun *run)
+{
+	guint32 hdr[2];
+	unsigned char *buf = (unsigned char *)run->rec;
+
+	if (fread(hdr, sizeof(hdr), 1, run->f) != 1)
+		return 0;
+	mdb_sort_grow(&buf, &run->size, MDB_SORT_REC_SIZE(hdr[0], hdr[1]));
+	run->rec = (MdbSortRec *)buf;
+	run->rec->key_len = hdr[0];
+	run->rec->row_len = hdr[1];
+	if (fread(run->rec->data, hdr[0] + hdr[1], 1, run->f) != 1) {
+		mdb_sql_error("Error reading sort file");
+		s->failed = 1;
+		return 0;
+	}
+	return 1;
+}
+/* sort the records in memory and write them out as a run */
+static int
+mdb_sort_spill(MdbSort *s)
+{
+	FILE *f;
+	guint32 i, n;
+
+	mdb_sort_recs(s->recs, s->num_recs);
+	if (!(f = tmpfile())) {
+		mdb_sql_error("Unable to create temp file for sort");
+		s->failed = 1;
+		return 0;
+	}
+	g_ptr_array_add(s->runs, f);
+	/* a run never needs more rows than the query returns */
+	n = s->num_recs;
+	if (s->limit && n > s->limit)
+		n = s->limit;
+	for (i=0; i<n; i++) {
+		if (!mdb_sort_write(f, s->recs[i])) {
+			s->failed = 1;
+			return 0;
+		}
+	}
+	mdb_sort_free_recs(s);
+	return 1;
+}
+/* add an input row, only the result columns are kept */
+static void
+mdb_sort_add(MdbSort *s, const unsigned char *row)
+{
+	MdbSortRec *rec, **heap;
+	size_t key_len, row_len;
+
+	mdb_sql_flat_decode(row, s->num_cols, s->vals, s->lens);
+	key_len = mdb_sort_make_key(s);
+	row_len = mdb_sql_flat_size(row, s->num_outs);
+
+	if (s->use_heap) {
+		heap = s->recs;
+		if (s->num_recs == s->limit) {
+			/* only a row better than the worst one kept matters */
+			if (mdb_sort_cmp_key(s->key, key_len, heap[0]) >= 0)
+				return;
+			s->mem_used -= MDB_SORT_REC_SIZE(heap[0]->key_len,
+				heap[0]->row_len);
+			g_free(heap[0]);
+			heap[0] = heap[--s->num_recs];
+			mdb_sort_heap_down(heap, s->num_recs, 0);
+		}
+		rec = mdb_sort_new_rec(s, key_len, row, row_len);
+		s->recs[s->num_recs] = rec;
+		mdb_sort_heap_up(s->recs, s->num_recs++);
+		/* too many rows wanted to keep them all in memory */
+		if (s->mem_used > s->sql->mem_budget) {
+			s->use_heap = 0;
+			mdb_sort_spill(s);
+		}
+		return;
+	}
+	if (s->num_recs && s->mem_used + MDB_SORT_REC_SIZE(key_len, row_len)
+	  > s->sql->mem_budget) {
+		if (!mdb_sort_spill(s))
+			return;
+	}
+	rec = mdb_sort_new_rec(s, key_len, row, row_len);
+	s->recs[s->num_recs++] = rec;
+}
+static void
+mdb_sort_merge_down(MdbSortRun *runs, int *heap, int n, int i)
+{
+	int r = heap[i], c;
+
+	while ((c = 2*i + 1) < n) {
+		if (c + 1 < n
+		 && mdb_sort_cmp(runs[heap[c+1]].rec, runs[heap[c]].rec) < 0)
+			c++;
+		if (mdb_sort_cmp(runs[heap[c]].rec, runs[r].rec) >= 0)
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = r;
+}
+/* start merging n runs, which are closed by mdb_sort_merge_close() */
+static void
+mdb_sort_merge_open(MdbSort *s, MdbSortMerge *m, FILE **files, int n)
+{
+	int i;
+
+	memset(m, 0, sizeof(MdbSortMerge));
+	m->n = n;
+	m->runs = g_malloc0(n * sizeof(MdbSortRun));
+	m->heap = g_malloc0(n * sizeof(int));
+	for (i=0; i<n; i++) {
+		m->runs[i].f = files[i];
+		rewind(m->runs[i].f);
+		if (mdb_sort_read(s, &m->runs[i]))
+			m->heap[m->num++] = i;
+	}
+	for (i=m->num/2-1; i>=0; i--)
+		mdb_sort_merge_down(m->runs, m->heap, m->num, i);
+}
+/* the next record in order, valid until the next call; NULL at the end */
+static MdbSortRec *
+mdb_sort_merge_next(MdbSort *s, MdbSortMerge *m)
+{
+	int i;
+
+	if (m->popped) {
+		i = m->heap[0];
+		if (!mdb_sort_read(s, &m->runs[i]))
+			m->heap[0] = m->heap[--m->num];
+		if (m->num)
+			mdb_sort_merge_down(m->runs, m->heap, m->num, 0);
+		m->popped = 0;
+	}
+	if (!m->num || s->failed || (s->limit && m->rows >= s->limit))
+		return NULL;
+	m->popped = 1;
+	m->rows++;
+	return m->runs[m->heap[0]].rec;
+}
+static void
+mdb_sort_merge_close(MdbSortMerge *m)
+{
+	int i;
+
+	for (i=0; i<m->n; i++) {
+		fclose(m->runs[i].f);
+		g_free(m->runs[i].rec);
+	}
+	g_free(m->runs);
+	g_free(m->heap);
+	memset(m, 0, sizeof(MdbSortMerge));
+}
+/*
+ * Once all rows are in, sort what is in memory, or merge the runs down to
+ * a last merge which is read as the rows are fetched.
+ */
+static void
+mdb_sort_finish(MdbSort *s)
+{
+	MdbSortMerge m;
+	MdbSortRec *rec;
+	FILE *f;
+	guint32 i;
+
+	if (!s->runs->len) {
+		/* it all fit in memory */
+		mdb_sort_recs(s->recs, s->num_recs);
+		s->end_rec = s->num_recs;
+		if (s->limit && s->end_rec > s->limit)
+			s->end_rec = s->limit;
+		return;
+	}
+	if (s->num_recs && !mdb_sort_spill(s))
+		return;
+	while (s->runs->len > MDB_SORT_FAN_IN) {
+		if (!(f = tmpfile())) {
+			mdb_sql_error("Unable to create temp file for sort");
+			s->failed = 1;
+			return;
+		}
+		mdb_sort_merge_open(s, &m, (FILE **)s->runs->pdata, MDB_SORT_FAN_IN);
+		while ((rec = mdb_sort_merge_next(s, &m))) {
+			if (!mdb_sort_write(f, rec)) {
+				s->failed = 1;
+				break;
+			}
+		}
+		mdb_sort_merge_close(&m);
+		for (i=0; i<MDB_SORT_FAN_IN; i++)
+			g_ptr_array_remove_index(s->runs, 0);
+		g_ptr_array_add(s->runs, f);
+		if (s->failed)
+			return;
+	}
+	mdb_sort_merge_open(s, &s->merge, (FILE **)s->runs->pdata, s->runs->len);
+	g_ptr_array_set_size(s->runs, 0);
+	s->merging = 1;
+}
+static void
+mdb_sort_free(MdbSort *s)
+{
+	unsigned int i;
+
+	mdb_sort_free_recs(s);
+	if (s->runs) {
+		for (i=0; i<s->runs->len; i++)
+			fclose(g_ptr_array_index(s->runs, i));
+		g_ptr_array_free(s->runs, TRUE);
+	}
+	mdb_sort_merge_close(&s->merge);
+	g_free(s->recs);
+	g_free(s->cols);
+	g_free(s->key);
+	g_free(s->vals);
+	g_free(s->lens);
+}
+/* index of a select list column, the unqualified name is tried too */
+static int
+mdb_sort_find_column(MdbSQL *sql, char *name)
+{
+	MdbSQLColumn *sqlcol;
+	unsigned int i;
+	char *dot;
+
+	for (i=0; i<sql->num_columns; i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		if (!strcasecmp(sqlcol->name, name))
+			return i;
+	}
+	if ((dot = strrchr(name, '.')))
+		return mdb_sort_find_column(sql, dot + 1);
+	return -1;
+}
+static MdbColumn *
+mdb_sort_table_column(MdbTableDef *table, char *name)
+{
+	MdbColumn *col;
+	unsigned int i;
+
+	for (i=0; i<table->num_cols; i++) {
+		col = g_ptr_array_index(table->columns, i);
+		if (!strcasecmp(col->name, name))
+			return col;
+	}
+	mdb_sql_error("Column %s not found", name);
+	return NULL;
+}
+/*
+ * Read the table through an index whose leading columns are the ORDER BY
+ * columns in the same direction.  Text is left out, the index collation is
+ * not the order mdb_sort_make_key() gives.
+ */
+static int
+mdb_sort_use_index(MdbSort *s, MdbTableDef *table)
+{
+	MdbIndex *idx;
+	MdbColumn *col;
+	unsigned int i;
+	int k;
+
+	if (!mdb_get_option(MDB_USE_INDEX) || IS_JET4(s->mdb))
+		return 0;
+	for (i=0; i<table->num_idxs; i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		if (idx->num_keys < (unsigned int)s->num_keys
+		 || (idx->flags & MDB_IDX_IGNORENULLS))
+			continue;
+		/* a scan picked for the WHERE clause keeps its own index */
+		if (table->strategy == MDB_INDEX_SCAN && table->scan_idx != idx)
+			continue;
+		for (k=0; k<s->num_keys; k++) {
+			col = g_ptr_array_index(table->columns,
+				idx->key_col_num[k]-1);
+			if (col != s->keys[k].col
+			 || idx->key_col_order[k] != (s->keys[k].desc ? MDB_DESC : MDB_ASC))
+				break;
+			if (col->col_type == MDB_TEXT || col->col_type == MDB_BOOL
+			 || col->col_type == MDB_REPID)
+				break;
+		}
+		if (k < s->num_keys)
+			continue;
+		if (table->strategy != MDB_INDEX_SCAN)
+			mdb_index_scan_use(s->mdb, table, idx);
+		return 1;
+	}
+	return 0;
+}
+/* read and sort the rows of table, which give the result in s->ttable */
+static int
+mdb_sort_table(MdbSort *s, MdbTableDef *table, unsigned int num_outs)
+{
+	MdbSQL *sql = s->sql;
+	MdbSQLColumn *sqlcol;
+	MdbColumn tcol, *col;
+	MdbSQLBatch batch;
+	MdbSQLOp *op;
+	unsigned int i;
+
+	s->use_heap = s->limit > 0;
+	s->num_outs = num_outs;
+	s->num_cols = sql->num_columns;
+	s->cols = g_malloc0((s->num_cols + 1) * sizeof(MdbColumn *));
+	for (i=0; i<(unsigned int)s->num_cols; i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		if (!(s->cols[i] = mdb_sort_table_column(table, sqlcol->name)))
+			return 0;
+	}
+	s->ttable = mdb_create_temp_table(s->mdb, "#sort");
+	for (i=0; i<num_outs; i++) {
+		sqlcol = g_ptr_array_index(sql->columns, i);
+		col = s->cols[i];
+		mdb_fill_temp_col(&tcol, sqlcol->name, col->col_size,
+			col->col_type, col->is_fixed);
+		tcol.col_size = col->col_type == MDB_OLE ?
+			MDB_MEMO_OVERHEAD : col->col_size;
+		tcol.col_prec = col->col_prec;
+		tcol.col_scale = col->col_scale;
+		mdb_temp_table_add_col(s->ttable, &tcol);
+	}
+	mdb_temp_columns_end(s->ttable);
+
+	s->key = g_malloc(s->num_keys * (MDB_SORT_TEXT_SIZE + 2));
+	s->vals = g_malloc0((s->num_cols + 1) * sizeof(unsigned char *));
+	s->lens = g_malloc0((s->num_cols + 1) * sizeof(int));
+	s->runs = g_ptr_array_new();
+
+	op = mdb_sql_scan_op(table, s->cols, s->num_cols);
+	mdb_sql_batch_init(&batch);
+	while (!s->failed && mdb_sql_op_next(op, &batch)) {
+		for (i=0; i<batch.num_rows && !s->failed; i++)
+			mdb_sort_add(s, MDB_SQL_BATCH_ROW(&batch, i));
+	}
+	mdb_sql_batch_free(&batch);
+	mdb_sql_op_close(op);
+	if (!s->failed)
+		mdb_sort_finish(s);
+	return !s->failed;
+}
+static int
+mdb_sort_next(MdbSQLOp *op, MdbSQLBatch *batch)
+{
+	MdbSort *s = op->data;
+	MdbSortRec *rec;
+
+	while (batch->num_rows < MDB_SQL_BATCH_ROWS) {
+		if (s->merging)
+			rec = mdb_sort_merge_next(s, &s->merge);
+		else if (s->next_rec < s->end_rec)
+			rec = s->recs[s->next_rec++];
+		else
+			rec = NULL;
+		if (!rec)
+			break;
+		mdb_sql_batch_add(batch, rec->data + rec->key_len, rec->row_len);
+	}
+	return batch->num_rows;
+}
+static void
+mdb_sort_close(MdbSQLOp *op)
+{
+	MdbSort *s = op->data;
+
+	mdb_sort_free(s);
+	g_free(s);
+}
+static void
+mdb_sort_free_table(MdbTableDef *table)
+{
+	mdb_index_scan_free(table);
+	if (table->sarg_tree)
+		mdb_sql_free_tree(table->sarg_tree);
+	table->sarg_tree = NULL;
+	mdb_free_tabledef(table);
+}
+/* drop the columns only carried for sorting */
+static void
+mdb_sort_drop_columns(MdbSQL *sql, unsigned int num_outs)
+{
+	MdbSQLColumn *c;
+
+	while (sql->num_columns > num_outs) {
+		sql->num_columns--;
+		c = g_ptr_array_remove_index(sql->columns, sql->num_columns);
+		g_free(c->name);
+		g_free(c->arg);
+		g_free(c);
+	}
+}
+/*
+ * Run a query with ORDER BY, of which only the first limit rows are wanted
+ * if limit is not 0.  Sort columns missing from the select list are added
+ * to it for the query and removed again afterwards.
+ */
+void
+mdb_sql_sort(MdbSQL *sql, unsigned long limit)
+{
+	MdbSort *s;
+	MdbTableDef *table;
+	MdbSQLOrder *o;
+	MdbSQLColumn *sqlcol;
+	GPtrArray *order_by;
+	int in[MDB_SORT_MAX_KEYS];
+	unsigned int num_outs, k;
+	int aggregate, ok = 0;
+
+	s = (MdbSort *) g_malloc0(sizeof(MdbSort));
+	s->sql = sql;
+	s->mdb = sql->mdb;
+	s->limit = limit;
+	order_by = sql->order_by;
+	sql->order_by = g_ptr_array_new();
+	if (order_by->len > MDB_SORT_MAX_KEYS) {
+		mdb_sql_error("Too many ORDER BY columns");
+		mdb_sql_reset(sql);
+		goto done;
+	}
+	s->num_keys = order_by->len;
+
+	num_outs = sql->num_columns;
+	for (k=0; k<order_by->len; k++) {
+		o = g_ptr_array_index(order_by, k);
+		s->keys[k].desc = o->desc;
+		in[k] = mdb_sort_find_column(sql, o->name);
+		if (in[k] < 0 && !sql->all_columns) {
+			mdb_sql_add_column(sql, o->name);
+			in[k] = sql->num_columns - 1;
+		}
+	}
+	aggregate = mdb_sql_is_aggregate(sql);
+	mdb_sql_select(sql);
+	if (!(table = sql->cur_table)) {
+		/* mdb_sql_select() already reported and reset */
+		goto done;
+	}
+	if (sql->all_columns)
+		num_outs = sql->num_columns;
+
+	for (k=0; k<order_by->len; k++) {
+		o = g_ptr_array_index(order_by, k);
+		if (in[k] < 0 && (in[k] = mdb_sort_find_column(sql, o->name)) < 0) {
+			mdb_sql_error("Column %s not found", o->name);
+			goto fail;
+		}
+		sqlcol = g_ptr_array_index(sql->columns, in[k]);
+		if (!(s->keys[k].col = mdb_sort_table_column(table, sqlcol->name)))
+			goto fail;
+		s->keys[k].in = in[k];
+		if (s->keys[k].col->col_type == MDB_MEMO
+		 || s->keys[k].col->col_type == MDB_OLE) {
+			mdb_sql_error("Can't ORDER BY column %s", o->name);
+			goto fail;
+		}
+	}
+
+	if (!aggregate && !table->is_temp_table && mdb_sort_use_index(s, table)) {
+		/* the rows already come in order */
+		ok = 1;
+	} else if (mdb_sort_table(s, table, num_outs)) {
+		mdb_sort_free_table(table);
+		mdb_sql_set_op(s->ttable,
+			mdb_sql_op_new(mdb_sort_next, mdb_sort_close, s));
+		sql->cur_table = s->ttable;
+		s = NULL;
+		ok = 1;
+	}
+fail:
+	if (ok) {
+		mdb_sort_drop_columns(sql, num_outs);
+	} else {
+		sql->cur_table = NULL;
+		mdb_sort_free_table(table);
+		if (s->ttable)
+			mdb_free_tabledef(s->ttable);
+		mdb_sql_reset(sql);
+	}
+done:
+	if (s) {
+		mdb_sort_free(s);
+		g_free(s);
+	}
+	mdb_sql_free_order_by(order_by);
+}
@@ -31,29 +31,55 @@
 static char *sanitize_name(char *str, int sanitize);
 static char *escapes(char *s);
 
+static void
+print_quoted(gchar *s, size_t len, char *quote_char, char *escape_char)
+{
+	for (;len;s++,len--) {
+		if (strlen(quote_char)==1 && *s==quote_char[0]) {
+	/* double the char if no escape char passed */
+			if (!escape_char) {
+				fprintf(stdout,"%s%s",quote_char,quote_char);
+			} else {
+				fprintf(stdout,"%s%s",escape_char,quote_char);
+			}
+		}
+		else fprintf(stdout,"%c",*s);
+	}
+}
 void
 print_col(gchar *col_val, int quote_text, int col_type, char *quote_char, char *escape_char)
 {
-	gchar *s;
-
 	if (quote_text && is_text_type(col_type)) {
 		fprintf(stdout,quote_char);
-		for (s=col_val;*s;s++) {
-			if (strlen(quote_char)==1 && *s==quote_char[0]) {
-		/* double the char if no escape char passed */
-				if (!escape_char) {
-					fprintf(stdout,"%s%s",quote_char,quote_char);
-				} else {
-					fprintf(stdout,"%s%s",escape_char,quote_char);
-				}
-			}
-			else fprintf(stdout,"%c",*s);
-		}
+		print_quoted(col_val, strlen(col_val), quote_char, escape_char);
 		fprintf(stdout,quote_char);
 	} else {
 		fprintf(stdout,"%s",col_val);
 	}
 }
+/*
+ * memo fields are streamed rather than taken from the bound buffer so
+ * that long values are not truncated.
+ */
+static void
+print_memo(MdbHandle *mdb, MdbColumn *col, int quote_text, char *quote_char, char *escape_char)
+{
+	MdbBlob *blob;
+	gchar buf[MDB_PGSIZE];
+	size_t len;
+
+	if (quote_text) fprintf(stdout,quote_char);
+	blob = mdb_blob_open(mdb, col);
+	while ((len = mdb_blob_read(blob, buf, sizeof(buf)))) {
+		if (quote_text) {
+			print_quoted(buf, len, quote_char, escape_char);
+		} else {
+			fwrite(buf, 1, len, stdout);
+		}
+	}
+	mdb_blob_close(blob);
+	if (quote_text) fprintf(stdout,quote_char);
+}
 int
 main(int argc, char **argv)
 {
@@ -67,6 +93,7 @@ main(int argc, char **argv)
 	char *row_delimiter = NULL;
 	char *quote_char = NULL;
 	char *escape_char = NULL;
+	char *date_fmt = NULL;
 	char header_row = 1;
 	char quote_text = 1;
 	char insert_statements = 0;
@@ -98,7 +125,7 @@ main(int argc, char **argv)
 			sanitize = 1;
 		break;
 		case 'D':
-			mdb_set_date_fmt(optarg);
+			date_fmt = optarg;
 		break;
 		case 'X':
 			escape_char = (char *) g_strdup(optarg);
@@ -150,6 +177,8 @@ main(int argc, char **argv)
 		mdb_exit();
 		exit(1);
 	}
+	if (date_fmt)
+		mdb_set_date_fmt(mdb, date_fmt);
 
 	table = mdb_read_table_by_name(mdb, argv[argc-1], MDB_TABLE);
 	if (!table) {
@@ -171,6 +200,10 @@ main(int argc, char **argv)
 	for (j=0;j<table->num_cols;j++) {
 		bound_values[j] = (char *) g_malloc0(MDB_BIND_SIZE);
 		mdb_bind_column(table, j+1, bound_values[j], &bound_lens[j]);
+		/* memo text is streamed by print_memo() */
+		col=g_ptr_array_index(table->columns,j);
+		if (col->col_type == MDB_MEMO)
+			mdb_set_lazy_memo(table, j+1, 1);
 	}
 	if (header_row) {
 		col=g_ptr_array_index(table->columns,0);
@@ -207,6 +240,8 @@ main(int argc, char **argv)
 			}
 			if (insert_statements && !bound_lens[j]) {
 				print_col("NULL",0,col->col_type, quote_char, escape_char);
+			} else if (col->col_type == MDB_MEMO) {
+				print_memo(mdb, col, quote_text, quote_char, escape_char);
 			} else {
 				print_col(bound_values[j], quote_text, col->col_type, quote_char, escape_char);
 			}
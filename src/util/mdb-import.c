@@ -2,7 +2,7 @@
  * Copyright (C) 2000 Brian Bruns
  *
  *
- * This library is free software; you can redistribute it and/or 
+ * This library is free software; you can redistribute it and/or
  * modify it under the terms of the GNU Library General Public
  * License as published by the Free Software Foundation; either
  * version 2 of the License, or (at your option) any later version.
@@ -19,180 +19,806 @@
  */
 
 #include "mdbtools.h"
+#include <errno.h>
 
-#define MAX_ROW_SIZE 4096
+/*
+ * The import runs as a pipeline.  A reader thread cuts the input into
+ * batches of whole records (RFC 4180: fields may be quoted, quotes inside
+ * them doubled, and quoted fields may hold delimiters and newlines).
+ * Worker threads split the records of a batch into fields and convert
+ * them to the column types.  The main thread takes the converted batches
+ * back in input order and appends their rows with the bulk loader.
+ * Tables with indexes the bulk loader can't rebuild are not imported.
+ *
+ * An empty field is null.  A quoted empty field ("") is an empty string
+ * in text columns.
+ */
+
+/* bytes of input handed to a worker at a time */
+#define BATCH_SIZE (256 * 1024)
+#define MAX_WORKERS 16
 
-void
-free_values(MdbField *fields, int num_fields)
+#if !GLIB_CHECK_VERSION(2,32,0)
+#define g_thread_new(name, func, data) g_thread_create(func, data, TRUE, NULL)
+#endif
+
+typedef struct {
+	unsigned int seq;
+	unsigned long first_line;	/* line the first record starts on */
+	char *text;		/* whole records, NULL at the end of input */
+	size_t len;
+	/* filled in by a worker */
+	unsigned int num_rows;
+	MdbField *fields;	/* num_cols per row */
+	unsigned long *row_lines;
+	unsigned char *vals;	/* the fields' values */
+	size_t vals_len, vals_sz;
+	char *error;		/* why the row after the last one failed */
+} ImportBatch;
+
+typedef struct {
+	MdbHandle *mdb;
+	MdbTableDef *table;
+	FILE *in;
+	char delim;
+	unsigned long skip;	/* header records */
+	GAsyncQueue *work_q;	/* batches to convert */
+	GAsyncQueue *done_q;	/* converted batches, in any order */
+	GAsyncQueue *free_q;	/* one token per batch that may be in flight */
+	ImportBatch quit;	/* tells a worker to stop */
+	volatile gint abort;
+} ImportJob;
+
+static void
+free_batch(ImportBatch *batch)
 {
-	int i;
+	g_free(batch->text);
+	g_free(batch->fields);
+	g_free(batch->row_lines);
+	g_free(batch->vals);
+	g_free(batch->error);
+	g_free(batch);
+}
+static void
+push_batch(ImportJob *job, char *text, size_t len, unsigned long line, unsigned int seq)
+{
+	ImportBatch *batch = g_new0(ImportBatch, 1);
 
-	for (i=0;i<num_fields;i++) {
-		if (!fields[i].is_null)
-			g_free(fields[i].value);
+	batch->seq = seq;
+	batch->first_line = line;
+	if (text) {
+		batch->text = g_malloc(len);
+		memcpy(batch->text, text, len);
+		batch->len = len;
 	}
+	g_async_queue_push(job->work_q, batch);
 }
-int
-convert_field(MdbColumn *col, char *s, MdbField *field)
+/*
+ * Reader thread.  Only tracks where records end, which needs the quoting
+ * state; everything else is left to the workers.
+ */
+enum {
+	CSV_FIELD_START,
+	CSV_UNQUOTED,
+	CSV_QUOTED,
+	CSV_QUOTE_SEEN		/* a quote inside a quoted field */
+};
+static gpointer
+read_batches(gpointer data)
+{
+	ImportJob *job = data;
+	size_t cap = BATCH_SIZE * 2, len = 0, scan = 0, start = 0, cut = 0, n;
+	unsigned long line = 1, lines = 0, start_lines = 0, cut_lines = 0;
+	unsigned long skip = job->skip;
+	unsigned int seq = 0;
+	int state = CSV_FIELD_START, eof = 0, rec_end;
+	char *buf = g_malloc(cap), c;
+
+	while (!eof) {
+		/* a record larger than a batch */
+		if (len == cap) {
+			cap *= 2;
+			buf = g_realloc(buf, cap);
+		}
+		n = fread(buf + len, 1, cap - len, job->in);
+		if (!n) {
+			if (ferror(job->in))
+				perror("read");
+			eof = 1;
+		}
+		len += n;
+		for (;scan<len;scan++) {
+			c = buf[scan];
+			rec_end = 0;
+			if (c == '\n')
+				lines++;
+			switch (state) {
+				case CSV_QUOTED:
+					if (c == '"') state = CSV_QUOTE_SEEN;
+					continue;
+				case CSV_FIELD_START:
+					if (c == '"') {
+						state = CSV_QUOTED;
+						continue;
+					}
+					/* fall through */
+				default:
+					if (c == '\n') {
+						rec_end = 1;
+						state = CSV_FIELD_START;
+					} else if (c == job->delim) {
+						state = CSV_FIELD_START;
+					} else if (state == CSV_QUOTE_SEEN && c == '"') {
+						state = CSV_QUOTED;
+					} else {
+						state = CSV_UNQUOTED;
+					}
+			}
+			if (!rec_end)
+				continue;
+			if (skip) {
+				skip--;
+				start = scan + 1;
+				start_lines = lines;
+			}
+			cut = scan + 1;
+			cut_lines = lines;
+		}
+		/* the last record may lack its newline */
+		if (eof && len > cut) {
+			cut = len;
+			cut_lines = lines;
+			if (skip) start = cut;
+		}
+		if (cut - start >= BATCH_SIZE || (eof && cut > start)) {
+			g_async_queue_pop(job->free_q);
+			if (g_atomic_int_get(&job->abort))
+				break;
+			push_batch(job, buf + start, cut - start,
+				line + start_lines, seq++);
+			start = cut;
+			start_lines = cut_lines;
+		}
+		if (start) {
+			memmove(buf, buf + start, len - start);
+			len -= start;
+			scan -= start;
+			cut -= start;
+			line += start_lines;
+			lines -= start_lines;
+			cut_lines -= start_lines;
+			start = 0;
+			start_lines = 0;
+		}
+	}
+	push_batch(job, NULL, 0, line, seq);
+	g_free(buf);
+	return NULL;
+}
+/*
+ * Split the record at *pos into fields, unquoted and null terminated in
+ * scratch.  Returns the number of fields, which may be more than fit in
+ * vals, 0 at the end of the batch, or -1 if the record is malformed.
+ */
+static int
+split_record(ImportJob *job, ImportBatch *batch, size_t *pos, unsigned long *line, char *scratch, char **vals, int *quoted, int max_vals)
+{
+	char *p = batch->text + *pos, *end = batch->text + batch->len;
+	char *out = scratch;
+	int num = 0, ret = 0;
+
+	if (p == end)
+		return 0;
+	for (;;) {
+		if (num < max_vals) {
+			vals[num] = out;
+			quoted[num] = p < end && *p == '"';
+		}
+		num++;
+		if (p < end && *p == '"') {
+			for (p++;;p++) {
+				if (p == end) {
+					ret = -1;
+					break;
+				}
+				if (*p == '"') {
+					if (p + 1 < end && p[1] == '"') {
+						*out++ = *p++;
+						continue;
+					}
+					p++;
+					break;
+				}
+				if (*p == '\n') (*line)++;
+				*out++ = *p;
+			}
+			if (p < end && *p == '\r' && (p + 1 == end || p[1] == '\n'))
+				p++;
+			if (ret || (p < end && *p != job->delim && *p != '\n')) {
+				ret = -1;
+				break;
+			}
+		} else {
+			for (;p<end && *p!=job->delim && *p!='\n';p++) {
+				if (*p == '\r' && (p + 1 == end || p[1] == '\n'))
+					continue;
+				*out++ = *p;
+			}
+		}
+		*out++ = '\0';
+		if (p == end)
+			break;
+		if (*p++ == '\n') {
+			(*line)++;
+			break;
+		}
+	}
+	/* skip to the next record */
+	if (ret) {
+		for (;p<end && *p!='\n';p++);
+		if (p < end) {
+			p++;
+			(*line)++;
+		}
+	}
+	*pos = p - batch->text;
+	return ret ? ret : num;
+}
+/* room for n bytes of a value, returns its offset */
+static size_t
+reserve(ImportBatch *batch, size_t n)
+{
+	size_t off = batch->vals_len;
+
+	if (off + n > batch->vals_sz) {
+		batch->vals_sz = MAX(batch->vals_sz * 2, off + n);
+		batch->vals = g_realloc(batch->vals, batch->vals_sz);
+	}
+	memset(batch->vals + off, 0, n);
+	batch->vals_len += n;
+	return off;
+}
+static int
+parse_int(const char *s, gint64 min, gint64 max, gint64 *v)
+{
+	char *end;
+
+	errno = 0;
+	*v = g_ascii_strtoll(s, &end, 10);
+	while (*end == ' ') end++;
+	return !errno && end != s && !*end && *v >= min && *v <= max;
+}
+static int
+parse_double(const char *s, double *v)
+{
+	char *end;
+
+	errno = 0;
+	*v = g_ascii_strtod(s, &end);
+	while (*end == ' ') end++;
+	return !errno && end != s && !*end;
+}
+/*
+ * Parse a decimal number into its digits scaled by 10^scale, rounding
+ * half away from zero.  Returns the number of digits, or -1.
+ */
+static int
+parse_scaled(const char *s, int scale, int *neg, char *digits, int max)
+{
+	int n = 0, frac = -1, seen = 0, round = -1, i;
+
+	*neg = 0;
+	while (*s == ' ') s++;
+	if (*s == '-' || *s == '+')
+		*neg = *s++ == '-';
+	for (;*s && *s != ' ';s++) {
+		if (*s == '.' && frac < 0) {
+			frac = 0;
+			continue;
+		}
+		if (!isdigit((unsigned char) *s))
+			return -1;
+		seen = 1;
+		if (frac == scale) {
+			if (round < 0) round = *s >= '5';
+			continue;
+		}
+		if (n || *s != '0') {
+			if (n == max) return -1;
+			digits[n++] = *s;
+		}
+		if (frac >= 0) frac++;
+	}
+	while (*s == ' ') s++;
+	if (!seen || *s)
+		return -1;
+	for (frac=MAX(frac, 0);frac<scale && n;frac++) {
+		if (n == max) return -1;
+		digits[n++] = '0';
+	}
+	if (round > 0) {
+		for (i=n-1;i>=0 && digits[i]=='9';i--)
+			digits[i] = '0';
+		if (i >= 0) {
+			digits[i]++;
+		} else {
+			if (n == max) return -1;
+			memmove(digits + 1, digits, n++);
+			digits[0] = '1';
+		}
+	}
+	if (!n) *neg = 0;
+	return n;
+}
+/* days since 12/30/1899 */
+static long
+days_from_civil(long y, int m, int d)
+{
+	long era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe/4 - yoe/100 + doy;
+	return era * 146097 + doe - 693899;
+}
+/* YYYY-MM-DD or MM/DD/YYYY, optionally followed by HH:MM[:SS] */
+static int
+parse_date(const char *s, double *td)
+{
+	static const int mdays[] = {31,29,31,30,31,30,31,31,30,31,30,31};
+	int y, m, d, hr = 0, mi = 0, se = 0, n = 0;
+	long days;
+	double frac;
+
+	if (sscanf(s, "%4d-%2d-%2d%n", &y, &m, &d, &n) != 3 || !n) {
+		n = 0;
+		if (sscanf(s, "%2d/%2d/%4d%n", &m, &d, &y, &n) != 3 || !n)
+			return 0;
+		if (y < 100) y += y < 30 ? 2000 : 1900;
+	}
+	s += n;
+	if (*s == ' ' || *s == 'T') {
+		n = 0;
+		if (sscanf(s + 1, "%2d:%2d%n", &hr, &mi, &n) != 2 || !n)
+			return 0;
+		s += 1 + n;
+		if (*s == ':') {
+			n = 0;
+			if (sscanf(s + 1, "%2d%n", &se, &n) != 1 || !n)
+				return 0;
+			s += 1 + n;
+		}
+	}
+	while (*s == ' ') s++;
+	if (*s || y < 100 || m < 1 || m > 12 || d < 1 || d > mdays[m-1]
+	 || (m == 2 && d == 29 && (y % 4 || (y % 100 == 0 && y % 400)))
+	 || hr > 23 || mi > 59 || se > 59)
+		return 0;
+	days = days_from_civil(y, m, d);
+	frac = (hr * 3600 + mi * 60 + se) / 86400.0;
+	/* the time of day counts away from 12/30/1899 */
+	*td = days >= 0 ? days + frac : days - frac;
+	return 1;
+}
+static int
+hex_val(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	c = tolower((unsigned char) c);
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+/* {xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}, the first three groups little endian */
+static int
+parse_guid(const char *s, unsigned char *buf)
+{
+	static const int order[] = {3,2,1,0,5,4,7,6,8,9,10,11,12,13,14,15};
+	int i, hi, lo, braced = *s == '{';
+
+	s += braced;
+	for (i=0;i<16;i++) {
+		if (i == 4 || i == 6 || i == 8 || i == 10) {
+			if (*s++ != '-') return 0;
+		}
+		if ((hi = hex_val(s[0])) < 0 || (lo = hex_val(s[1])) < 0)
+			return 0;
+		buf[order[i]] = hi << 4 | lo;
+		s += 2;
+	}
+	if (braced && *s++ != '}')
+		return 0;
+	return !*s;
+}
+/* text in the file's encoding, length checked against the column */
+static int
+put_text(MdbHandle *conv, ImportBatch *batch, MdbField *field, const char *s, int max)
+{
+	size_t len = strlen(s), off;
+	int n;
+
+	off = reserve(batch, len * 2 + 2);
+	n = mdb_ascii2unicode(conv, (char *) s, len,
+		(char *) batch->vals + off, len * 2 + 2);
+	batch->vals_len = off + n;
+	field->value = GSIZE_TO_POINTER(off);
+	field->siz = n;
+	return !max || n <= max;
+}
+/* memo and OLE values are kept in the row, after their 12 byte header */
+static void
+put_inline(ImportBatch *batch, MdbField *field, size_t data_off, int data_len)
+{
+	unsigned char *hdr = batch->vals + data_off - MDB_MEMO_OVERHEAD;
+
+	_mdb_put_int32(hdr, 0, data_len | 0x80000000);
+	field->value = GSIZE_TO_POINTER(data_off - MDB_MEMO_OVERHEAD);
+	field->siz = data_len + MDB_MEMO_OVERHEAD;
+}
+/*
+ * Convert one field.  Values are appended to the batch and field->value
+ * holds their offset until the batch is done.  Returns an error message,
+ * or NULL.
+ */
+static const char *
+convert_field(MdbHandle *conv, ImportBatch *batch, MdbColumn *col, const char *s, int quoted, MdbField *field)
 {
-	char *c;
-	MdbAny any;
+	unsigned char *p = NULL;
+	size_t off;
+	gint64 i;
+	guint64 u;
+	double d;
+	float f;
+	guint32 word[4], w;
+	char digits[40];
+	int neg, n, k, hi, lo, prec;
+	/* memo and OLE values aren't written to LVAL pages */
+	int inline_max = conv->fmt->pg_size - conv->fmt->row_count_offset - 4
+		- MDB_MEMO_OVERHEAD;
 
 	field->colnum = col->col_num;
 	field->is_fixed = col->is_fixed;
+	field->siz = col->is_fixed ? col->col_size : 0;
+	field->value = NULL;
+	field->is_null = 1;
+	if (!*s && !(quoted && (col->col_type == MDB_TEXT
+			|| col->col_type == MDB_MEMO)))
+		return NULL;
+
+	field->is_null = 0;
+	if (col->is_fixed) {
+		off = reserve(batch, MAX(col->col_size, 17));
+		batch->vals_len = off + col->col_size;
+		field->value = GSIZE_TO_POINTER(off);
+		p = batch->vals + off;
+	}
 	switch (col->col_type) {
-		case MDB_TEXT:
-			field->value = g_strdup(s);
-			field->siz = strlen(s);
+		case MDB_BOOL:
+			/* the value is the column's bit in the null mask */
+			if (!g_ascii_strcasecmp(s, "1") || !g_ascii_strcasecmp(s, "-1")
+			 || !g_ascii_strcasecmp(s, "true") || !g_ascii_strcasecmp(s, "yes")) {
+				field->is_null = 0;
+			} else if (!g_ascii_strcasecmp(s, "0")
+			 || !g_ascii_strcasecmp(s, "false") || !g_ascii_strcasecmp(s, "no")) {
+				field->is_null = 1;
+			} else {
+				return "not a boolean";
+			}
 			break;
 		case MDB_BYTE:
-			any.i = strtol(s, &c, 16);
-			if (*c) return 1;
-			field->siz = mdb_col_fixed_size(col);
-			field->value = g_malloc(field->siz);
-			((unsigned char *)field->value)[0] = any.i;
+			if (!parse_int(s, 0, 255, &i))
+				return "not a byte (0 to 255)";
+			p[0] = i;
 			break;
 		case MDB_INT:
-			any.i = strtol(s, &c, 16);
-			if (*c) return 1;
-			field->siz = mdb_col_fixed_size(col);
-			field->value = g_malloc(field->siz);
-			_mdb_put_int16(field->value, 0, any.i);
+			if (!parse_int(s, G_MININT16, G_MAXINT16, &i))
+				return "not an integer";
+			_mdb_put_int16(p, 0, (guint32) i);
 			break;
 		case MDB_LONGINT:
-			any.i = strtol(s, &c, 16);
-			if (*c) return 1;
-			field->siz = mdb_col_fixed_size(col);
-			field->value = g_malloc(field->siz);
-			_mdb_put_int32(field->value, 0, any.i);
+			if (!parse_int(s, G_MININT32, G_MAXINT32, &i))
+				return "not a long integer";
+			_mdb_put_int32(p, 0, (guint32) i);
 			break;
-		case MDB_BOOL:
-			if (*s == '1') {
-				field->is_null = 1;
-			} else if (*s == '0') {
-				field->is_null = 0;
-			} else {
-				fprintf(stderr, "%c is not a valid value for type BOOLEAN\n", *s);
-				return 1;
-			}
-			/*
 		case MDB_FLOAT:
-			any.d = strtod(s, &c);
-			if (*c) return 1;
-			field.value = g_malloc(mdb_col_fixed_size(col));
-			_mdb_put_single(field.value, 0, any.i);
+			if (!parse_double(s, &d))
+				return "not a number";
+			f = d;
+			memcpy(&w, &f, 4);
+			_mdb_put_int32(p, 0, w);
 			break;
 		case MDB_DOUBLE:
-			any.d = strtod(s, &c);
-			if (*c) return 1;
-			field.value = g_malloc(mdb_col_fixed_size(col));
-			_mdb_put_double(field.value, 0, any.i);
+			if (!parse_double(s, &d))
+				return "not a number";
+			memcpy(&u, &d, 8);
+			_mdb_put_int32(p, 0, (guint32) u);
+			_mdb_put_int32(p, 4, (guint32) (u >> 32));
 			break;
-		*/
-			/*
-		case MDB_MONEY:
 		case MDB_SDATETIME:
-		case MDB_OLE:
-		case MDB_MEMO:
-		case MDB_REPID:
+			if (!parse_date(s, &d))
+				return "not a date (YYYY-MM-DD or MM/DD/YYYY, then HH:MM:SS)";
+			memcpy(&u, &d, 8);
+			_mdb_put_int32(p, 0, (guint32) u);
+			_mdb_put_int32(p, 4, (guint32) (u >> 32));
+			break;
+		case MDB_MONEY:
+			/* ten thousandths of a unit */
+			if ((n = parse_scaled(s, 4, &neg, digits, 19)) < 0)
+				return "not an amount";
+			for (u=0,k=0;k<n;k++) {
+				if (u > (G_MAXINT64 - (digits[k] - '0')) / 10)
+					return "amount out of range";
+				u = u * 10 + digits[k] - '0';
+			}
+			if (neg) u = -u;
+			_mdb_put_int32(p, 0, (guint32) u);
+			_mdb_put_int32(p, 4, (guint32) (u >> 32));
+			break;
 		case MDB_NUMERIC:
-			*/
-		default:
-			fprintf(stderr,"Conversion of type %02x not supported yet.\n", col->col_type);
-			return 1;
+			prec = col->col_prec > 0 ? MIN(col->col_prec, 38) : 38;
+			if ((n = parse_scaled(s, col->col_scale, &neg, digits,
+					sizeof(digits))) < 0)
+				return "not a number";
+			if (n > prec)
+				return "number out of range for the column";
+			memset(word, 0, sizeof(word));
+			for (k=0;k<n;k++) {
+				u = digits[k] - '0';
+				for (hi=3;hi>=0;hi--) {
+					u += (guint64) word[hi] * 10;
+					word[hi] = (guint32) u;
+					u >>= 32;
+				}
+			}
+			/* a sign byte, then the most significant word first */
+			p[0] = neg ? 0x80 : 0;
+			for (k=0;k<4;k++)
+				_mdb_put_int32(p, 1 + k*4, word[k]);
 			break;
+		case MDB_REPID:
+			if (!parse_guid(s, p))
+				return "not a GUID";
+			break;
+		case MDB_TEXT:
+			if (!put_text(conv, batch, field, s, col->col_size))
+				return "text too long for the column";
+			break;
+		case MDB_MEMO:
+			off = reserve(batch, MDB_MEMO_OVERHEAD) + MDB_MEMO_OVERHEAD;
+			if (!put_text(conv, batch, field, s, inline_max))
+				return "memo too long to keep in the row";
+			put_inline(batch, field, off, field->siz);
+			break;
+		case MDB_OLE:
+			/* hexadecimal */
+			if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+				s += 2;
+			if ((n = strlen(s)) % 2)
+				return "odd number of hex digits";
+			if (n/2 > inline_max)
+				return "OLE value too long to keep in the row";
+			off = reserve(batch, MDB_MEMO_OVERHEAD + n/2) + MDB_MEMO_OVERHEAD;
+			for (k=0;k<n/2;k++) {
+				if ((hi = hex_val(s[k*2])) < 0 || (lo = hex_val(s[k*2+1])) < 0)
+					return "not hexadecimal";
+				batch->vals[off + k] = hi << 4 | lo;
+			}
+			put_inline(batch, field, off, n/2);
+			break;
+		default:
+			return "column type not supported";
 	}
-	return 0;
+	return NULL;
 }
-int
-prep_row(MdbTableDef *table, char *line, MdbField *fields, char *delim)
+static void
+convert_batch(ImportJob *job, MdbHandle *conv, ImportBatch *batch)
 {
+	MdbTableDef *table = job->table;
+	unsigned int num_cols = table->num_cols;
+	char *vals[MDB_MAX_COLS], *scratch;
+	int quoted[MDB_MAX_COLS];
+	unsigned long line = batch->first_line, row_line;
+	size_t pos = 0;
+	unsigned int i, r, max_rows;
+	int num, size;
+	int row_max = conv->fmt->pg_size - conv->fmt->row_count_offset - 4;
+	const char *err;
+	MdbField *fields;
 	MdbColumn *col;
-	char **sarray, *s;
-	unsigned int i;
 
-	/*
-	 * pull apart the row and turn it into something respectable
-	 */
-	g_strdelimit(line, delim, '\n');
-	sarray = g_strsplit (line, "\n", 0);
-	for (i=0; (s = sarray[i]); i++) {
-		if (!strlen(s)) continue;
-		if (i >= table->num_cols) {
-			fprintf(stderr, "Number of columns in file exceeds number in table.\n");
-			g_strfreev(sarray);
-			return 0;
+	/* every record ends with a newline but the last */
+	max_rows = 1;
+	for (pos=0;pos<batch->len;pos++)
+		if (batch->text[pos] == '\n') max_rows++;
+	batch->fields = g_new0(MdbField, (size_t) max_rows * num_cols);
+	batch->row_lines = g_new(unsigned long, max_rows);
+	batch->vals_sz = batch->len + 64;
+	batch->vals = g_malloc(batch->vals_sz);
+	/* a terminator for every field, and there may be one per byte */
+	scratch = g_malloc(batch->len * 2 + 2);
+
+	pos = 0;
+	for (;;) {
+		row_line = line;
+		num = split_record(job, batch, &pos, &line, scratch, vals, quoted,
+			MDB_MAX_COLS);
+		if (!num)
+			break;
+		if (num == 1 && !*vals[0] && !quoted[0])
+			continue;	/* blank line */
+		if (num < 0) {
+			batch->error = g_strdup_printf("line %lu: malformed quoted field", row_line);
+			break;
 		}
-		if (s[0]=='"' && s[strlen(s)-1]=='"') {
-			s[strlen(s)-1] = '\0';
-			memmove(s+1, s, strlen(s));
+		if ((unsigned int) num != num_cols) {
+			batch->error = g_strdup_printf("line %lu: row has %d columns, but table has %d",
+				row_line, num, num_cols);
+			break;
 		}
-		printf("field = %s\n", s);
-		col = g_ptr_array_index (table->columns, i);
-		if (convert_field(col, s, &fields[i])) {
-			fprintf(stderr, "Format error in column %d\n", i+1);
-			g_strfreev(sarray);
-			return 0;
+		fields = &batch->fields[(size_t) batch->num_rows * num_cols];
+		for (i=0;i<num_cols;i++) {
+			col = g_ptr_array_index(table->columns, i);
+			if ((err = convert_field(conv, batch, col, vals[i], quoted[i],
+					&fields[i])))
+				break;
 		}
+		if (i < num_cols) {
+			/* memo values can be long, only show how they start */
+			batch->error = g_strdup_printf("line %lu, column %s: %s: \"%.40s%s\"",
+				row_line, col->name, err, vals[i],
+				strlen(vals[i]) > 40 ? "..." : "");
+			break;
+		}
+		if ((size = mdb_packed_row_size(table, num_cols, fields)) > row_max) {
+			batch->error = g_strdup_printf("line %lu: row of %d bytes does not fit on a page",
+				row_line, size);
+			break;
+		}
+		batch->row_lines[batch->num_rows++] = row_line;
 	}
-	g_strfreev(sarray);
+	g_free(scratch);
 
-	/*
-	 * verify number of columns in table against number in row
-	 */
-	if (i < table->num_cols) {
-		fprintf(stderr, "Row has %d columns, but table has %d\n", i, table->num_cols);
-		free_values(fields, i);
-		return 0;
+	/* the values don't move any more */
+	for (r=0;r<batch->num_rows;r++) {
+		fields = &batch->fields[(size_t) r * num_cols];
+		for (i=0;i<num_cols;i++)
+			fields[i].value = fields[i].is_null ? NULL
+				: batch->vals + GPOINTER_TO_SIZE(fields[i].value);
+	}
+}
+static gpointer
+convert_batches(gpointer data)
+{
+	ImportJob *job = data;
+	ImportBatch *batch;
+	MdbHandle conv;
+
+	/* iconv descriptors can't be shared between threads */
+	memcpy(&conv, job->mdb, sizeof(MdbHandle));
+	mdb_iconv_init(&conv);
+	while ((batch = g_async_queue_pop(job->work_q)) != &job->quit) {
+		if (batch->text && !g_atomic_int_get(&job->abort))
+			convert_batch(job, &conv, batch);
+		g_async_queue_push(job->done_q, batch);
 	}
-	return i-1;
+	mdb_iconv_close(&conv);
+	return NULL;
+}
+/*
+ * Append the rows of the converted batches in input order.  Returns the
+ * number of rows added, or -1 after an error.
+ */
+static long
+write_batches(ImportJob *job, MdbBulkInsert *bulk)
+{
+	GHashTable *pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+	ImportBatch *batch;
+	unsigned int next = 0, r, num_cols = job->table->num_cols;
+	long rows = 0;
+
+	for (;;) {
+		batch = g_hash_table_lookup(pending, GUINT_TO_POINTER(next));
+		if (!batch) {
+			batch = g_async_queue_pop(job->done_q);
+			g_hash_table_insert(pending, GUINT_TO_POINTER(batch->seq), batch);
+			continue;
+		}
+		g_hash_table_remove(pending, GUINT_TO_POINTER(next));
+		next++;
+		if (!batch->text) {
+			free_batch(batch);
+			break;
+		}
+		for (r=0;r<batch->num_rows;r++) {
+			if (!mdb_bulk_insert_add(bulk, num_cols,
+					&batch->fields[(size_t) r * num_cols])) {
+				g_free(batch->error);
+				batch->error = g_strdup_printf("line %lu: row can't be added",
+					batch->row_lines[r]);
+				break;
+			}
+			rows++;
+		}
+		if (batch->error) {
+			fprintf(stderr, "Error at %s\n", batch->error);
+			rows = -1;
+		}
+		free_batch(batch);
+		g_async_queue_push(job->free_q, job);
+		if (rows < 0)
+			break;
+	}
+	/* a stopped import leaves batches behind */
+	g_hash_table_destroy(pending);
+	return rows;
 }
 int
 main(int argc, char **argv)
 {
-	int i, row;
+	int i;
 	MdbHandle *mdb;
 	MdbTableDef *table;
-	MdbField fields[256];
-	char line[MAX_ROW_SIZE];
-	int num_fields;
-	/* doesn't handle tables > 256 columns.  Can that happen? */
+	MdbBulkInsert *bulk;
+	ImportJob job;
+	GThread *reader, *workers[MAX_WORKERS];
+	int num_workers = 0;
+	long rows;
 	int  opt;
-	FILE *in;
-	char delimiter[2] = ",";
-	char header_rows = 0;
 
-	while ((opt=getopt(argc, argv, "H:d:"))!=-1) {
+	memset(&job, 0, sizeof(job));
+	job.delim = ',';
+	while ((opt=getopt(argc, argv, "H:d:j:"))!=-1) {
 		switch (opt) {
 		case 'H':
-			header_rows = atol(optarg);
+			job.skip = atol(optarg);
 		break;
 		case 'd':
-			delimiter[0] = optarg[0];
+			job.delim = optarg[0];
+		break;
+		case 'j':
+			num_workers = atoi(optarg);
 		break;
 		default:
 		break;
 		}
 	}
-	
-	/* 
-	** optind is now the position of the first non-option arg, 
-	** see getopt(3) 
+
+	/*
+	** optind is now the position of the first non-option arg,
+	** see getopt(3)
 	*/
 	if (argc-optind < 3) {
 		fprintf(stderr,"Usage: %s [options] <database> <table> <csv file>\n",argv[0]);
 		fprintf(stderr,"where options are:\n");
 		fprintf(stderr,"  -H <rows>      skip <rows> header rows\n");
 		fprintf(stderr,"  -d <delimiter> specify a column delimiter\n");
+		fprintf(stderr,"  -j <threads>   convert fields with <threads> threads\n");
+		fprintf(stderr,"<csv file> may be - for standard input.\n");
 		exit(1);
 	}
+	if (job.delim == '"' || job.delim == '\n' || job.delim == '\r' || !job.delim) {
+		fprintf(stderr, "Invalid delimiter\n");
+		exit(1);
+	}
+	if (num_workers <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		/* the reader and the writer have a thread each */
+		num_workers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+#endif
+		if (num_workers <= 0) num_workers = 1;
+	}
+	if (num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
 
+#if !GLIB_CHECK_VERSION(2,32,0)
+	if (!g_thread_supported()) g_thread_init(NULL);
+#endif
 	mdb_init();
 
 	if (!(mdb = mdb_open(argv[optind], MDB_WRITABLE))) {
 		exit(1);
 	}
-	
+
 	table = mdb_read_table_by_name(mdb, argv[argc-2], MDB_TABLE);
 	if (!table) {
 		fprintf(stderr,"Table %s not found in database\n", argv[argc-2]);
@@ -202,35 +828,62 @@ main(int argc, char **argv)
 	mdb_read_indices(table);
 	mdb_rewind_table(table);
 
-	/*
-	 * open the CSV file and read any header rows
-	 */
-	in = fopen(argv[argc-1], "r");
-	if (!in) {
+	if (!strcmp(argv[argc-1], "-")) {
+		job.in = stdin;
+	} else if (!(job.in = fopen(argv[argc-1], "r"))) {
 		fprintf(stderr, "Can not open file %s\n", argv[argc-1]);
 		exit(1);
 	}
-	for (i=0;i<header_rows;i++)
-		fgets(line, MAX_ROW_SIZE, in);
+	if (!(bulk = mdb_bulk_insert_begin(table))) {
+		fprintf(stderr, "Can't start loading table %s\n", argv[argc-2]);
+		exit(1);
+	}
+	/* rather than leave indexes that no longer match the table */
+	if (bulk->stale_idxs) {
+		fprintf(stderr, "Table %s has indexes that can't be updated, not importing\n", argv[argc-2]);
+		mdb_bulk_insert_end(bulk);
+		exit(1);
+	}
 
-	row = 1;
-	while (fgets(line, MAX_ROW_SIZE, in)) {
-		num_fields = prep_row(table, line, fields, delimiter);
-		if (!num_fields) {
-			fprintf(stderr, "Aborting import at row %d\n", row);
-			exit(1);
-		}
-		/*
-	 	* all the prep work is done, let's add the row
-	 	*/
-		mdb_insert_row(table, num_fields, fields);
+	job.mdb = mdb;
+	job.table = table;
+	job.work_q = g_async_queue_new();
+	job.done_q = g_async_queue_new();
+	job.free_q = g_async_queue_new();
+	/* bounds the input held in memory */
+	for (i=0;i<num_workers*2+2;i++)
+		g_async_queue_push(job.free_q, &job);
+	for (i=0;i<num_workers;i++)
+		workers[i] = g_thread_new("mdb-import", convert_batches, &job);
+	reader = g_thread_new("mdb-import-reader", read_batches, &job);
+
+	rows = write_batches(&job, bulk);
+	if (rows < 0) {
+		/* the reader may be waiting for input, only stop the workers */
+		g_atomic_int_set(&job.abort, 1);
+		g_async_queue_push(job.free_q, &job);
+	} else {
+		g_thread_join(reader);
+	}
+	for (i=0;i<num_workers;i++)
+		g_async_queue_push(job.work_q, &job.quit);
+	for (i=0;i<num_workers;i++)
+		g_thread_join(workers[i]);
+
+	/* rows before an error are kept */
+	if (!mdb_bulk_insert_end(bulk)) {
+		fprintf(stderr, "Couldn't finish loading table %s\n", argv[argc-2]);
+		rows = -1;
 	}
+	if (rows < 0)
+		fprintf(stderr, "Import stopped\n");
 
 	mdb_free_tabledef(table);
-	fclose(in);
+	if (job.in != stdin && rows >= 0)
+		fclose(job.in);
 	mdb_close(mdb);
 	mdb_exit();
 
-	exit(0);
+	exit(rows < 0 ? 1 : 0);
 }
 